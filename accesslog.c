@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "proxyServer.h"
+#include "accesslog.h"
+#include "metrics.h"
+
+#define ACCESSLOG_LINE_MAX 2048     //longest formatted line, every field escaped included
+
+/**
+ * the fixed-size record a serving thread copies into its ring
+ */
+struct AccessRecord{
+    long long time;     //CLOCK_REALTIME nanoseconds when the response was done
+    long long total;    //nanoseconds
+    long long resolve;
+    long long origin;
+    long long bytes;
+    struct in_addr client;
+    int status;
+    int source;
+    char method[ACCESSLOG_METHOD];
+    char host[ACCESSLOG_HOST];
+    char path[ACCESSLOG_PATH];
+};
+
+/**
+ * the ring of one thread. the owner only moves tail and the writer only moves head,
+ * each on its own cache line
+ */
+struct AccessRing{
+    struct AccessRecord records[ACCESSLOG_RING];
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));   //next record written
+    long dropped;       //by the owner, read by the stats
+    unsigned long head __attribute__((aligned(CACHE_LINE)));   //next record formatted
+    struct AccessRing *next;
+};
+
+/**
+ * the writer thread and the file it owns
+ */
+struct Writer{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    int running;
+    int fd;             //-1 once the file could not be reopened
+    char *path;         //NULL for stdout
+    size_t rotateSize;
+    size_t size;        //of the current file
+    char batch[ACCESSLOG_BATCH + ACCESSLOG_LINE_MAX];
+    size_t batchLen;
+    long batchLines;
+    time_t stampSecond;     //the second formatted in stamp
+    char stamp[32];
+};
+
+static const char *sourceNames[] = {NULL, "memory", "disk", "followed", "origin", "revalidated", "stats"};
+
+static __thread struct AccessRing *mine;
+static __thread int lastStatus;     //left by the response writers of the thread
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static struct AccessRing *rings;    //of every thread that logged something
+static struct Writer writer = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER, .fd = -1};
+static struct AccessLogStats stats;     //dropped only counts the rings already freed
+static long lostRings;      //records of threads that could not get a ring
+static int enabled;
+
+/**
+ * @return the ring of the calling thread, NULL if memory ran out
+ */
+static struct AccessRing *ring(){
+    if(mine == NULL && posix_memalign((void**)&mine, CACHE_LINE, sizeof(struct AccessRing)) == 0){
+        memset(mine, 0, sizeof(struct AccessRing));
+        pthread_mutex_lock(&ringsLock);
+        mine->next = rings;
+        rings = mine;
+        pthread_mutex_unlock(&ringsLock);
+    }
+    return mine;
+}
+
+void accessLogBegin(struct AccessEntry *e, int client_fd){
+    memset(e, 0, sizeof(struct AccessEntry));
+    e->start = metricsNow();
+    struct sockaddr_in peer;
+    socklen_t peerLen = sizeof(peer);
+    if(enabled == TRUE && getpeername(client_fd, (struct sockaddr*) &peer, &peerLen) == 0 && peer.sin_family == AF_INET){
+        e->client = peer.sin_addr;   //while the client is surely connected
+    }
+    lastStatus = 0;     //of a response this thread wrote before, never taken
+}
+
+void accessLogStatus(int status){
+    lastStatus = status;
+}
+
+int accessLogTakeStatus(){
+    int status = lastStatus;
+    lastStatus = 0;
+    return status;
+}
+
+int accessLogHeadStatus(const char *head, size_t len){
+    const char *space = memchr(head, ' ', len);
+    if(space == NULL || len < strlen("HTTP/") || strncmp(head, "HTTP/", strlen("HTTP/")) != 0
+            || (size_t)(space - head) + 4 > len){
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; i <= 3; i++) {
+        if(space[i] < '0' || space[i] > '9'){
+            return 0;
+        }
+        status = status * 10 + space[i] - '0';
+    }
+    return status;
+}
+
+void accessLogAnswer(struct AccessEntry *e, int source, int status, long long bytes){
+    if(e->source == ACCESS_NONE){
+        e->source = source;
+    }
+    if(status == 0){
+        status = accessLogTakeStatus();
+    }
+    if(status != 0){
+        e->status = status;
+    }
+    if(bytes > 0){
+        e->bytes += bytes;
+    }
+}
+
+void accessLogKeepStatus(struct AccessEntry *e){
+    int status = accessLogTakeStatus();
+    if(e->status == 0){
+        e->status = status;
+    }
+}
+
+/**
+ * copy src into dst, cut to size - 1 characters
+ */
+static void copyField(char *dst, size_t size, const char *src){
+    size_t len = src != NULL ? strnlen(src, size - 1) : 0;
+    if(len > 0){
+        memcpy(dst, src, len);
+    }
+    dst[len] = '\0';
+}
+
+void accessLogWrite(struct AccessEntry *e, const char *method, const char *host, const char *path){
+    if(e->start == 0){
+        return;
+    }
+    long long total = metricsNow() - e->start;
+    e->start = 0;
+    if(enabled == FALSE){
+        return;
+    }
+    struct AccessRing *r = ring();
+    if(r == NULL){
+        __atomic_add_fetch(&lostRings, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    unsigned long tail = r->tail;
+    if(tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == ACCESSLOG_RING){    //the writer is behind, never wait for it
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    struct AccessRecord *rec = &r->records[tail & (ACCESSLOG_RING - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec->time = (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+    rec->total = total;
+    rec->resolve = e->resolve;
+    rec->origin = e->origin;
+    rec->bytes = e->bytes;
+    rec->status = e->status;
+    rec->source = e->source;
+    rec->client = e->client;
+    copyField(rec->method, sizeof(rec->method), method);
+    copyField(rec->host, sizeof(rec->host), host);
+    copyField(rec->path, sizeof(rec->path), path);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * append s as the contents of a JSON string
+ * @return the end of the escaped text
+ */
+static char *escape(char *out, const char *s){
+    for (; *s != '\0'; s++) {
+        unsigned char ch = (unsigned char)*s;
+        if(ch == '"' || ch == '\\'){
+            *out++ = '\\';
+            *out++ = (char)ch;
+        } else if(ch < 0x20 || ch >= 0x7f){
+            out += sprintf(out, "\\u%04x", ch);
+        } else{
+            *out++ = (char)ch;
+        }
+    }
+    return out;
+}
+
+/**
+ * format a record as a line at the end of the batch
+ */
+static void formatRecord(const struct AccessRecord *rec){
+    time_t second = (time_t)(rec->time / 1000000000LL);
+    if(second != writer.stampSecond){
+        struct tm tm;
+        gmtime_r(&second, &tm);
+        strftime(writer.stamp, sizeof(writer.stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        writer.stampSecond = second;
+    }
+    char client[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &rec->client, client, sizeof(client));
+    char *out = writer.batch + writer.batchLen;
+    out += sprintf(out, "{\"time\":\"%s.%03dZ\",\"client\":\"%s\",\"method\":\"", writer.stamp,
+                   (int)(rec->time / 1000000 % 1000), client);
+    out = escape(out, rec->method);
+    out += sprintf(out, "\",\"host\":\"");
+    out = escape(out, rec->host);
+    out += sprintf(out, "\",\"path\":\"");
+    out = escape(out, rec->path);
+    out += sprintf(out, rec->status != 0 ? "\",\"status\":%d" : "\",\"status\":null", rec->status);
+    const char *source = rec->source != ACCESS_NONE ? sourceNames[rec->source] : rec->status != 0 ? "error" : "aborted";
+    int hit = rec->source == ACCESS_MEMORY || rec->source == ACCESS_DISK || rec->source == ACCESS_FOLLOWED
+              || rec->source == ACCESS_REVALIDATED;
+    out += sprintf(out, ",\"bytes\":%lld,\"source\":\"%s\",\"hit\":%s,\"total_us\":%.1f,\"resolve_us\":%.1f,"
+                        "\"origin_us\":%.1f}\n", rec->bytes, source, hit == TRUE ? "true" : "false",
+                   (double)rec->total / 1000, (double)rec->resolve / 1000, (double)rec->origin / 1000);
+    writer.batchLen = (size_t)(out - writer.batch);
+    writer.batchLines++;
+}
+
+/**
+ * rename the file to <file>.1, shifting the older ones up to ACCESSLOG_KEEP, and open a new one
+ */
+static void rotate(){
+    char from[PATH_MAX + 16];
+    char to[PATH_MAX + 16];
+    close(writer.fd);
+    for (int k = ACCESSLOG_KEEP - 1; k >= 1; k--) {
+        snprintf(from, sizeof(from), "%s.%d", writer.path, k);
+        snprintf(to, sizeof(to), "%s.%d", writer.path, k + 1);
+        if(rename(from, to) < 0 && errno != ENOENT){
+            perror("error: <sys_call>\n");
+        }
+    }
+    snprintf(to, sizeof(to), "%s.1", writer.path);
+    if(rename(writer.path, to) < 0){
+        perror("error: <sys_call>\n");
+    }
+    if((writer.fd = open(writer.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0){
+        perror("error: <sys_call>\n");
+    }
+    writer.size = 0;
+    stats.rotations++;
+}
+
+/**
+ * write the batch to the file, rotating it once it is large enough
+ */
+static void flushBatch(){
+    size_t off = 0;
+    while(writer.fd >= 0 && off < writer.batchLen){
+        ssize_t n = write(writer.fd, writer.batch + off, writer.batchLen - off);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            perror("error: <sys_call>\n");
+            break;
+        }
+        off += (size_t)n;
+    }
+    if(off == writer.batchLen){
+        stats.written += writer.batchLines;
+    } else{
+        stats.failed += writer.batchLines;
+    }
+    writer.size += off;
+    writer.batchLen = 0;
+    writer.batchLines = 0;
+    if(writer.path != NULL && writer.rotateSize > 0 && writer.size >= writer.rotateSize){
+        rotate();
+    }
+}
+
+/**
+ * format and write what the rings hold
+ */
+static void drain(){
+    pthread_mutex_lock(&ringsLock);
+    struct AccessRing *r = rings;   //rings are only added at the head, the rest of the list does not change
+    pthread_mutex_unlock(&ringsLock);
+    for (; r != NULL; r = r->next) {
+        unsigned long head = r->head;
+        unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            formatRecord(&r->records[head & (ACCESSLOG_RING - 1)]);
+            if(writer.batchLen >= ACCESSLOG_BATCH){
+                __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+                flushBatch();
+            }
+        }
+        __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+    }
+    if(writer.batchLen > 0){
+        flushBatch();
+    }
+}
+
+static void *writeLoop(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&writer.lock);
+    while(writer.stop == FALSE){
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += ACCESSLOG_FLUSH_MS * 1000000L;
+        if(until.tv_nsec >= 1000000000L){
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&writer.wake, &writer.lock, &until);
+        pthread_mutex_unlock(&writer.lock);
+        drain();
+        pthread_mutex_lock(&writer.lock);
+    }
+    pthread_mutex_unlock(&writer.lock);
+    drain();    //what was logged before the stop
+    return NULL;
+}
+
+int accessLogInit(const char *path, size_t rotateSize){
+    if(path == NULL){
+        return 0;
+    }
+    writer.rotateSize = rotateSize;
+    writer.stop = FALSE;
+    if(strcmp(path, "-") == 0){
+        fflush(stdout);     //what printf holds comes before the first lines
+        writer.fd = STDOUT_FILENO;
+    } else{
+        struct stat st;
+        if((writer.path = strdup(path)) == NULL
+                || (writer.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0){
+            perror("error: <sys_call>\n");
+            free(writer.path);
+            writer.path = NULL;
+            return -1;
+        }
+        writer.size = fstat(writer.fd, &st) == 0 ? (size_t)st.st_size : 0;
+    }
+    if(pthread_create(&writer.thread, NULL, &writeLoop, NULL) != 0){
+        perror("error: <sys_call>\n");
+        accessLogDestroy();
+        return -1;
+    }
+    writer.running = TRUE;
+    enabled = TRUE;
+    return 0;
+}
+
+void accessLogGetStats(struct AccessLogStats *out){
+    *out = stats;
+    out->dropped += __atomic_load_n(&lostRings, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&ringsLock);
+    for (struct AccessRing *r = rings; r != NULL; r = r->next) {
+        out->dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&ringsLock);
+}
+
+void accessLogDestroy(){
+    enabled = FALSE;
+    if(writer.running == TRUE){
+        pthread_mutex_lock(&writer.lock);
+        writer.stop = TRUE;
+        pthread_cond_signal(&writer.wake);
+        pthread_mutex_unlock(&writer.lock);
+        pthread_join(writer.thread, NULL);
+        writer.running = FALSE;
+    }
+    if(writer.path != NULL && writer.fd >= 0){
+        close(writer.fd);
+    }
+    writer.fd = -1;
+    free(writer.path);
+    writer.path = NULL;
+    pthread_mutex_lock(&ringsLock);
+    while(rings != NULL){   //their drops stay counted
+        stats.dropped += rings->dropped;
+        struct AccessRing *next = rings->next;
+        free(rings);
+        rings = next;
+    }
+    mine = NULL;
+    pthread_mutex_unlock(&ringsLock);
+}
@@ -0,0 +1,127 @@
+#ifndef PROXY_SERVER_ACCESSLOG_H
+#define PROXY_SERVER_ACCESSLOG_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+#include "threadpool.h"
+
+/**
+ * accesslog.h
+ *
+ * The access log: one JSON line per answered request. A serving thread never
+ * formats or writes a line, it copies a fixed-size record into a ring of its
+ * own, single producer single consumer, so logging costs a few stores and no
+ * lock. A writer thread drains the rings of all threads every
+ * ACCESSLOG_FLUSH_MS, formats the records and writes them in large batches,
+ * renaming the file to <file>.1 (and the older ones up to ACCESSLOG_KEEP)
+ * once it grows past the size limit. A thread whose ring is full drops the
+ * record and counts the drop instead of waiting for the writer.
+ *
+ * The status of a response is left by the function that wrote it with
+ * accessLogStatus, in the thread that wrote it, and taken by whoever logs
+ * the request, so the response writers need no extra parameter.
+ */
+
+#define ACCESSLOG_RING 1024     //records per thread, must be a power of two
+#define ACCESSLOG_METHOD 8
+#define ACCESSLOG_HOST 64       //longer hosts and paths are cut
+#define ACCESSLOG_PATH 192
+#define ACCESSLOG_KEEP 4        //rotated files kept
+#define ACCESSLOG_FLUSH_MS 20
+#define ACCESSLOG_BATCH (64 * 1024)     //formatted bytes written at once
+#define ACCESSLOG_DEFAULT_SIZE (64 * 1024 * 1024)   //bytes a file grows to before it is rotated
+
+// where the response of a request came from
+#define ACCESS_NONE 0       //not answered, or answered with an error
+#define ACCESS_MEMORY 1
+#define ACCESS_DISK 2
+#define ACCESS_FOLLOWED 3   //the body of a fetch in flight
+#define ACCESS_ORIGIN 4
+#define ACCESS_REVALIDATED 5    //the cached copy, after the origin confirmed it with 304
+#define ACCESS_STATS 6      //the stats of the proxy
+
+/**
+ * what is known of a request while it is served, kept in its Headers
+ */
+struct AccessEntry{
+    long long start;    //metricsNow when the request head was parsed, 0 if no request is being served
+    long long resolve;  //nanoseconds spent resolving the host
+    long long origin;   //nanoseconds of the origin exchange
+    long long bytes;    //written to the client
+    struct in_addr client;
+    int status;         //HTTP status sent, 0 if none was
+    int source;         //ACCESS_*
+};
+
+struct AccessLogStats{
+    long written;       //lines written
+    long dropped;       //records dropped on a full ring
+    long rotations;
+    long failed;        //lines lost to write errors
+};
+
+/**
+ * start the writer thread
+ * @param path - the log file, "-" for stdout, NULL to log nothing
+ * @param rotateSize - bytes the file grows to before it is rotated, 0 never rotates
+ * @return 0 - on success, -1 if the file could not be opened or the thread started
+ */
+int accessLogInit(const char *path, size_t rotateSize);
+
+/**
+ * start the entry of a request whose head was just parsed
+ * @param e
+ * @param client_fd - the address of its peer is logged
+ */
+void accessLogBegin(struct AccessEntry *e, int client_fd);
+
+/**
+ * leave the status of the response the calling thread just wrote
+ * @param status
+ */
+void accessLogStatus(int status);
+
+/**
+ * @return the status left by the calling thread and clears it, 0 if none was
+ */
+int accessLogTakeStatus();
+
+/**
+ * @param head - a response head, "HTTP/1.x NNN ..."
+ * @param len - bytes of head that may be read
+ * @return its status, 0 if it has none
+ */
+int accessLogHeadStatus(const char *head, size_t len);
+
+/**
+ * record how a request was answered
+ * @param e
+ * @param source - ACCESS_*, kept if one was recorded already
+ * @param status - 0 takes the status left by the calling thread
+ * @param bytes - added to the bytes of e
+ */
+void accessLogAnswer(struct AccessEntry *e, int source, int status, long long bytes);
+
+/**
+ * take the status left by the calling thread into e, unless e has one
+ * @param e
+ */
+void accessLogKeepStatus(struct AccessEntry *e);
+
+/**
+ * put the record of a finished request in the ring of the calling thread, or count it dropped
+ * @param e - begun, its start is cleared
+ * @param method - NULL if the request head could not be parsed
+ * @param host
+ * @param path
+ */
+void accessLogWrite(struct AccessEntry *e, const char *method, const char *host, const char *path);
+
+void accessLogGetStats(struct AccessLogStats *stats);
+
+/**
+ * stop the writer after it drained the rings, and close the file
+ */
+void accessLogDestroy();
+
+#endif //PROXY_SERVER_ACCESSLOG_H
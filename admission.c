@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "proxyServer.h"
+#include "admission.h"
+
+static struct AdmissionShard shards[ADMISSION_SHARDS];
+static struct AdmissionStats stats;
+static in_addr_t *clientOf;     //by socket descriptor, 0 if the socket is not tracked
+static int fdLimit;
+static int queueLimit;
+static int rate;        //requests per second, thousandths of a request per millisecond
+static int burst;       //thousandths of a request
+static int conns;
+static int limited;     //TRUE if clients are tracked
+
+static uint32_t clockMs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint32_t)((unsigned long long)now.tv_sec * 1000 + (unsigned long long)now.tv_nsec / 1000000);
+}
+
+static unsigned hashClient(in_addr_t address){
+    return (unsigned)address * 2654435761u;
+}
+
+/**
+ * add the tokens earned since the last refill, up to burst
+ */
+static void refill(struct ClientSlot *s, uint32_t now){
+    if(rate == 0){
+        return;
+    }
+    long long tokens = s->tokens + (long long)(uint32_t)(now - s->stamp) * rate;
+    s->tokens = tokens > burst ? burst : (int32_t)tokens;
+    s->stamp = now;
+}
+
+/**
+ * @return TRUE if nothing would be lost by giving s to another client
+ */
+static int idle(struct ClientSlot *s, uint32_t now){
+    if(s->active > 0){
+        return FALSE;
+    }
+    refill(s, now);
+    return rate == 0 || s->tokens >= burst;
+}
+
+/**
+ * find the slot of address, the shard lock must be held
+ * @param create - TRUE to take an empty or idle slot if address has none
+ * @return NULL if address has no slot
+ */
+static struct ClientSlot *findSlot(struct AdmissionShard *shard, unsigned hash, in_addr_t address, uint32_t now, int create){
+    struct ClientSlot *taken = NULL;
+    unsigned start = hash / ADMISSION_SHARDS;
+    for (unsigned i = 0; i < ADMISSION_PROBES; i++) {
+        struct ClientSlot *s = &shard->slots[(start + i) & (ADMISSION_SLOTS - 1)];
+        if(s->address == address){
+            return s;
+        }
+        if(s->address == 0){    //slots are never emptied again, address is not further on
+            if(taken == NULL){
+                taken = s;
+            }
+            break;
+        }
+        if(taken == NULL && create == TRUE && idle(s, now) == TRUE){
+            taken = s;
+        }
+    }
+    if(create == FALSE || taken == NULL){
+        return NULL;
+    }
+    if(taken->address == 0){
+        __atomic_add_fetch(&stats.clients, 1, __ATOMIC_RELAXED);
+    }
+    taken->address = address;
+    taken->stamp = now;
+    taken->tokens = burst;
+    taken->active = 0;
+    return taken;
+}
+
+int admissionInit(int limit, int perSecond, int atOnce, int perClient){
+    memset(&stats, 0, sizeof(stats));
+    queueLimit = limit;
+    rate = perSecond;
+    burst = (atOnce > 0 ? atOnce : perSecond > 0 ? perSecond : 1) * 1000;
+    conns = perClient;
+    limited = perSecond > 0 || perClient > 0;
+    if(limited == FALSE){
+        return 0;
+    }
+    struct rlimit files;
+    fdLimit = getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < ADMISSION_MAX_FDS ? (int)files.rlim_cur : ADMISSION_MAX_FDS;
+    if((clientOf = (in_addr_t*) calloc(fdLimit, sizeof(in_addr_t))) == NULL){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    for (int i = 0; i < ADMISSION_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        if((shards[i].slots = (struct ClientSlot*) calloc(ADMISSION_SLOTS, sizeof(struct ClientSlot))) == NULL){
+            perror("error: <sys_call>\n");
+            admissionDestroy();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int admissionShed(threadpool *tp){
+    if(queueLimit == 0 || queued_jobs(tp) < queueLimit){
+        return FALSE;
+    }
+    __atomic_add_fetch(&stats.shed, 1, __ATOMIC_RELAXED);
+    return TRUE;
+}
+
+int admissionEnter(int fd, struct in_addr client){
+    if(limited == FALSE || fd < 0 || fd >= fdLimit || client.s_addr == 0){
+        return TRUE;
+    }
+    unsigned hash = hashClient(client.s_addr);
+    struct AdmissionShard *shard = &shards[hash % ADMISSION_SHARDS];
+    int admitted = TRUE;
+    pthread_mutex_lock(&shard->lock);
+    struct ClientSlot *s = findSlot(shard, hash, client.s_addr, clockMs(), TRUE);
+    if(s == NULL){
+        __atomic_add_fetch(&stats.untracked, 1, __ATOMIC_RELAXED);
+    } else if(conns > 0 && s->active >= conns){
+        __atomic_add_fetch(&stats.overConns, 1, __ATOMIC_RELAXED);
+        admitted = FALSE;
+    } else{
+        s->active++;
+        __atomic_store_n(&clientOf[fd], client.s_addr, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return admitted;
+}
+
+int admissionRequest(int fd){
+    if(limited == FALSE || rate == 0 || fd < 0 || fd >= fdLimit){
+        return TRUE;
+    }
+    in_addr_t address = __atomic_load_n(&clientOf[fd], __ATOMIC_RELAXED);
+    if(address == 0){
+        return TRUE;
+    }
+    unsigned hash = hashClient(address);
+    struct AdmissionShard *shard = &shards[hash % ADMISSION_SHARDS];
+    int admitted = TRUE;
+    pthread_mutex_lock(&shard->lock);
+    uint32_t now = clockMs();
+    struct ClientSlot *s = findSlot(shard, hash, address, now, FALSE);
+    if(s != NULL){
+        refill(s, now);
+        if(s->tokens >= 1000){
+            s->tokens -= 1000;
+        } else{
+            admitted = FALSE;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if(admitted == FALSE){
+        __atomic_add_fetch(&stats.overRate, 1, __ATOMIC_RELAXED);
+    }
+    return admitted;
+}
+
+void admissionLeave(int fd){
+    if(limited == FALSE || fd < 0 || fd >= fdLimit){
+        return;
+    }
+    in_addr_t address = __atomic_exchange_n(&clientOf[fd], 0, __ATOMIC_RELAXED);
+    if(address == 0){
+        return;
+    }
+    unsigned hash = hashClient(address);
+    struct AdmissionShard *shard = &shards[hash % ADMISSION_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    struct ClientSlot *s = findSlot(shard, hash, address, clockMs(), FALSE);
+    if(s != NULL && s->active > 0){
+        s->active--;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void admissionGetStats(struct AdmissionStats *out){
+    out->shed = __atomic_load_n(&stats.shed, __ATOMIC_RELAXED);
+    out->overConns = __atomic_load_n(&stats.overConns, __ATOMIC_RELAXED);
+    out->overRate = __atomic_load_n(&stats.overRate, __ATOMIC_RELAXED);
+    out->untracked = __atomic_load_n(&stats.untracked, __ATOMIC_RELAXED);
+    out->clients = __atomic_load_n(&stats.clients, __ATOMIC_RELAXED);
+}
+
+void admissionDestroy(){
+    if(limited == FALSE){
+        return;
+    }
+    for (int i = 0; i < ADMISSION_SHARDS; i++) {
+        free(shards[i].slots);
+        shards[i].slots = NULL;
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+    free(clientOf);
+    clientOf = NULL;
+    limited = FALSE;
+}
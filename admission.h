@@ -0,0 +1,99 @@
+#ifndef PROXY_SERVER_ADMISSION_H
+#define PROXY_SERVER_ADMISSION_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "threadpool.h"
+
+/**
+ * admission.h
+ *
+ * Admission control. A connection accepted while the worker queues hold
+ * config.queueLimit jobs is answered with a canned 503 and closed instead of
+ * being queued behind them. Each client address gets a token bucket of
+ * requests and a cap on its open connections, kept in a sharded open
+ * addressing table of 16-byte slots. A lookup probes at most
+ * ADMISSION_PROBES slots from the home slot of the address. It takes a slot
+ * of a client that is idle again (no open connection, full bucket) when its
+ * own address is not in the table, so slots are never freed. A client that
+ * finds no slot is let in untracked rather than refused.
+ *
+ * The connection cap and the token bucket are found by socket descriptor.
+ * admissionEnter records the client of a socket in a table indexed by
+ * descriptor, so the thread that serves the socket does not need its
+ * address. The descriptor must be left before it is closed.
+ */
+
+#define ADMISSION_SHARDS 16
+#define ADMISSION_SLOTS 1024        //slots per shard, must be a power of two
+#define ADMISSION_PROBES 32
+#define ADMISSION_MAX_FDS (1 << 20)     //sockets above it are not limited
+#define ADMISSION_DEFAULT_BACKLOG 1024
+#define ADMISSION_DEFAULT_QUEUE 1024    //default jobs queued before connections are shed
+#define ADMISSION_DEFAULT_RETRY 1       //default seconds of Retry-After
+
+/**
+ * what is kept of one client address
+ */
+struct ClientSlot{
+    in_addr_t address;  //0 for a slot never used
+    uint32_t stamp;     //milliseconds of the last refill
+    int32_t tokens;     //thousandths of a request
+    int32_t active;     //open connections
+};
+
+struct AdmissionShard{
+    pthread_mutex_t lock;
+    struct ClientSlot *slots;   //ADMISSION_SLOTS
+};
+
+struct AdmissionStats{
+    long shed;          //connections answered 503 at the queue limit
+    long overConns;     //connections refused over the per client cap
+    long overRate;      //requests refused by an empty bucket
+    long untracked;     //clients let in without a slot
+    long clients;       //slots in use
+};
+
+/**
+ * @param queueLimit - jobs queued in the worker pool before connections are shed, 0 never sheds
+ * @param rate - requests per second a client may make, 0 for no limit
+ * @param burst - requests a client may make at once, 0 for one second of rate
+ * @param conns - connections a client may hold open, 0 for no limit
+ * @return 0 - on success, -1 if memory ran out
+ */
+int admissionInit(int queueLimit, int rate, int burst, int conns);
+
+/**
+ * @param tp - the worker pool
+ * @return TRUE if a new connection has to be shed, counted
+ */
+int admissionShed(threadpool *tp);
+
+/**
+ * count a new connection of client
+ * @param fd - its socket
+ * @param client
+ * @return TRUE if it may be served, FALSE over the connection cap of client, it is not counted then
+ */
+int admissionEnter(int fd, struct in_addr client);
+
+/**
+ * take a token from the bucket of the client of fd
+ * @param fd - a socket admissionEnter let in
+ * @return TRUE if the request may be served
+ */
+int admissionRequest(int fd);
+
+/**
+ * the connection of fd ends, before fd is closed
+ * @param fd - a socket admissionEnter let in
+ */
+void admissionLeave(int fd);
+
+void admissionGetStats(struct AdmissionStats *stats);
+
+void admissionDestroy();
+
+#endif //PROXY_SERVER_ADMISSION_H
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "proxyServer.h"
+#include "arena.h"
+
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+static struct ArenaStats stats;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t idleKey;       //frees the thread's free-list when it exits
+static __thread struct Arena *idleHead;
+static __thread int idleCount;
+
+static struct ArenaBlock *newBlock(size_t size){
+    struct ArenaBlock *b = (struct ArenaBlock*) malloc(sizeof(struct ArenaBlock) + size);
+    if(b != NULL){
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+    }
+    return b;
+}
+
+static void freeBlocks(struct ArenaBlock *b){
+    while(b != NULL){
+        struct ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+static void dropIdle(void *unused){
+    (void)unused;
+    while(idleHead != NULL){
+        struct Arena *a = idleHead;
+        idleHead = a->nextIdle;
+        freeBlocks(a->first);
+    }
+    idleCount = 0;
+}
+
+static void makeKey(){
+    pthread_key_create(&idleKey, dropIdle);
+}
+
+/**
+ * add the allocations a made since the last rewind to the totals
+ */
+static void account(struct Arena *a, int request){
+    if(request == TRUE){
+        __atomic_add_fetch(&stats.requests, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&stats.allocs, a->allocs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.heapAllocs, a->heapAllocs, __ATOMIC_RELAXED);
+    a->allocs = 0;
+    a->heapAllocs = 0;
+}
+
+struct Arena *arenaTake(){
+    struct Arena *a = idleHead;
+    if(a != NULL){
+        idleHead = a->nextIdle;
+        idleCount--;
+        a->nextIdle = NULL;
+        __atomic_add_fetch(&stats.reused, 1, __ATOMIC_RELAXED);
+        return a;
+    }
+    struct ArenaBlock *b = newBlock(ARENA_BLOCK);
+    if(b == NULL){
+        return NULL;
+    }
+    a = (struct Arena*) b->data;
+    b->used = ARENA_ALIGN(sizeof(struct Arena));
+    a->first = b;
+    a->current = b;
+    a->allocs = 0;
+    a->heapAllocs = 1;
+    a->blockBytes = b->size;
+    a->nextIdle = NULL;
+    __atomic_add_fetch(&stats.created, 1, __ATOMIC_RELAXED);
+    return a;
+}
+
+void *arenaAlloc(struct Arena *a, size_t size){
+    size = ARENA_ALIGN(size);
+    struct ArenaBlock *b = a->current;
+    if(b->size - b->used < size){
+        struct ArenaBlock *next = b->next;     //blocks after the current one are free
+        if(next != NULL && next->size >= size){
+            next->used = 0;
+            b = next;
+        } else{
+            struct ArenaBlock *grown = newBlock(size > ARENA_BLOCK ? size : ARENA_BLOCK);
+            if(grown == NULL){
+                return NULL;
+            }
+            grown->next = next;     //a smaller next block stays for later allocations
+            b->next = grown;
+            b = grown;
+            a->heapAllocs++;
+            a->blockBytes += grown->size;
+        }
+        a->current = b;
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    a->allocs++;
+    return p;
+}
+
+void *arenaCalloc(struct Arena *a, size_t size){
+    void *p = arenaAlloc(a, size);
+    if(p != NULL){
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+struct ArenaMark arenaMark(struct Arena *a){
+    struct ArenaMark mark = {a->current, a->current->used};
+    return mark;
+}
+
+static void rewindTo(struct Arena *a, struct ArenaMark mark){
+    a->current = mark.block;
+    mark.block->used = mark.used;
+    if(a->blockBytes > ARENA_KEEP){    //a few large requests should not pin their blocks
+        for (struct ArenaBlock *b = mark.block->next; b != NULL; b = b->next) {
+            a->blockBytes -= b->size;
+        }
+        freeBlocks(mark.block->next);
+        mark.block->next = NULL;
+    }
+}
+
+void arenaRewind(struct Arena *a, struct ArenaMark mark){
+    account(a, TRUE);
+    rewindTo(a, mark);
+}
+
+void arenaCount(struct Arena *a){
+    account(a, TRUE);
+}
+
+void arenaGive(struct Arena *a){
+    struct ArenaMark start = {a->first, ARENA_ALIGN(sizeof(struct Arena))};
+    account(a, FALSE);
+    rewindTo(a, start);
+    if(idleCount >= ARENA_IDLE){
+        freeBlocks(a->first);
+        return;
+    }
+    pthread_once(&keyOnce, makeKey);
+    a->nextIdle = idleHead;
+    idleHead = a;
+    idleCount++;
+    pthread_setspecific(idleKey, (void*)a);    //any non-NULL value makes dropIdle run at thread exit
+}
+
+void arenaCountHeap(unsigned long n){
+    __atomic_add_fetch(&stats.heapAllocs, n, __ATOMIC_RELAXED);
+}
+
+void arenaGetStats(struct ArenaStats *out){
+    out->created = __atomic_load_n(&stats.created, __ATOMIC_RELAXED);
+    out->reused = __atomic_load_n(&stats.reused, __ATOMIC_RELAXED);
+    out->requests = __atomic_load_n(&stats.requests, __ATOMIC_RELAXED);
+    out->allocs = __atomic_load_n(&stats.allocs, __ATOMIC_RELAXED);
+    out->heapAllocs = __atomic_load_n(&stats.heapAllocs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,105 @@
+#ifndef PROXY_SERVER_ARENA_H
+#define PROXY_SERVER_ARENA_H
+
+#include <stddef.h>
+
+/**
+ * arena.h
+ *
+ * Bump-pointer arenas for connection and request scoped memory. A client
+ * connection takes one arena, allocates what lives as long as the connection
+ * (its headers and read buffer), marks the arena, and rewinds to the mark
+ * after each request, which drops everything the request allocated at once.
+ *
+ * Blocks an arena grew into stay with it, so a connection that keeps serving
+ * similar requests stops calling malloc after its first one. Closed
+ * connections give their arena to a free-list of the thread they ran on,
+ * the next connection of that thread takes it from there.
+ *
+ * What a request allocates that outlives it (a fetch its followers share,
+ * cache entries, an idle origin connection, a background refresh) comes
+ * from the heap, and is counted with the blocks arenas malloc.
+ */
+
+#define ARENA_BLOCK (16 * 1024)     //size of a regular block, larger allocations get a block of their own
+#define ARENA_IDLE 64               //arenas a thread keeps for reuse
+#define ARENA_KEEP (1024 * 1024)    //block bytes an idle arena keeps, the rest is freed
+
+struct ArenaBlock{
+    struct ArenaBlock *next;
+    size_t size;        //of data
+    size_t used;
+    char data[] __attribute__((aligned(16)));
+};
+
+struct Arena{
+    struct ArenaBlock *first;   //the arena itself lives at its start
+    struct ArenaBlock *current;
+    unsigned long allocs;       //since the last rewind
+    unsigned long heapAllocs;   //blocks malloc'd since the last rewind
+    size_t blockBytes;          //of all its blocks
+    struct Arena *nextIdle;
+};
+
+/**
+ * a position in an arena to rewind to
+ */
+struct ArenaMark{
+    struct ArenaBlock *block;
+    size_t used;
+};
+
+struct ArenaStats{
+    unsigned long created;      //arenas malloc'd
+    unsigned long reused;       //arenas taken from a free-list
+    unsigned long requests;     //rewinds
+    unsigned long allocs;
+    unsigned long heapAllocs;   //blocks malloc'd, and what requests allocated outside their arenas
+};
+
+/**
+ * @return an empty arena, from this thread's free-list when it has one. NULL if memory ran out
+ */
+struct Arena *arenaTake();
+
+/**
+ * @return size bytes aligned to 16, valid until the arena is rewound before them or given back.
+ *         NULL if memory ran out
+ */
+void *arenaAlloc(struct Arena *a, size_t size);
+
+/**
+ * arenaAlloc, zeroed
+ */
+void *arenaCalloc(struct Arena *a, size_t size);
+
+/**
+ * @return the current position of a
+ */
+struct ArenaMark arenaMark(struct Arena *a);
+
+/**
+ * free everything allocated after mark, and count the allocations since the last rewind as one request.
+ * an arena grown past ARENA_KEEP frees the blocks after the mark
+ */
+void arenaRewind(struct Arena *a, struct ArenaMark mark);
+
+/**
+ * count the allocations since the last rewind as one request, without freeing them, for the last request
+ * of a connection whose arena is given back later
+ */
+void arenaCount(struct Arena *a);
+
+/**
+ * give a back, everything allocated from it is freed
+ */
+void arenaGive(struct Arena *a);
+
+/**
+ * count n allocations a request made on the heap, for memory that outlives it and so can not come from its arena
+ */
+void arenaCountHeap(unsigned long n);
+
+void arenaGetStats(struct ArenaStats *out);
+
+#endif //PROXY_SERVER_ARENA_H
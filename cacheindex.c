@@ -0,0 +1,694 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "proxyServer.h"
+#include "cacheindex.h"
+#include "arena.h"
+#include "fdcache.h"
+#include "memcache.h"
+#include "variants.h"
+#include "freshness.h"
+
+struct Evictor{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int running;
+    int stop;
+    int policy;
+    uint64_t random;    //xorshift state, used by the thread only
+};
+
+static struct IndexShard shards[CACHEINDEX_SHARDS];
+static struct CacheIndexStats stats;
+static struct Evictor evictor = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+static uint64_t tick;           //recency clock, advanced by every store and hit
+static double inflation;        //GDSF value of the last victim
+static struct timespec filled;  //when the index was filled
+static char *snapshotMap;       //the loaded snapshot, mapped keys point into it
+static size_t snapshotLen;
+static int walkFailed;
+static const char *cacheRoot;   //the cache directory, every key starts with it and a slash
+static size_t cacheRootLen;
+
+static uint64_t hashKey(const char *key){
+    uint64_t h = 14695981039346656037ull;  //FNV-1a
+    for (; *key != '\0'; key++) {
+        h = (h ^ (unsigned char)*key) * 1099511628211ull;
+    }
+    return h != 0 ? h : 1;
+}
+
+uint64_t cacheIndexDigest(const char *data, size_t len){
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return h != 0 ? h : 1;
+}
+
+static struct IndexShard *shardOf(uint64_t hash){
+    return &shards[hash % CACHEINDEX_SHARDS];
+}
+
+static size_t homeOf(struct IndexShard *shard, uint64_t hash){
+    return (size_t)(hash / CACHEINDEX_SHARDS) & (shard->capacity - 1);
+}
+
+/**
+ * @return slots for a table holding count entries without growing
+ */
+static size_t slotsFor(size_t count){
+    size_t capacity = CACHEINDEX_MIN_SLOTS;
+    while(capacity * 3 < count * 4 + 4){
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+static struct CacheEntry *findLocked(struct IndexShard *shard, const char *key, uint64_t hash){
+    size_t mask = shard->capacity - 1;
+    for (size_t i = homeOf(shard, hash); shard->slots[i].hash != 0; i = (i + 1) & mask) {
+        if(shard->slots[i].hash == hash && strcmp(shard->slots[i].key, key) == 0){
+            return &shard->slots[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * move the entries of shard into a table of capacity slots
+ * @return 0, -1 if memory ran out
+ */
+static int growLocked(struct IndexShard *shard, size_t capacity){
+    if(capacity <= shard->capacity){
+        return 0;
+    }
+    struct CacheEntry *slots = (struct CacheEntry*) calloc(capacity, sizeof(struct CacheEntry));
+    if(slots == NULL){
+        return -1;
+    }
+    struct CacheEntry *old = shard->slots;
+    size_t oldCapacity = shard->capacity;
+    shard->slots = slots;
+    shard->capacity = capacity;
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if(old[i].hash != 0){
+            size_t j = homeOf(shard, old[i].hash);
+            while(slots[j].hash != 0){
+                j = (j + 1) & (capacity - 1);
+            }
+            slots[j] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * @param key - copied unless mapped is TRUE
+ * @return the entry of key, a new one with no size if it was missing. NULL if memory ran out
+ */
+static struct CacheEntry *insertLocked(struct IndexShard *shard, const char *key, uint64_t hash, int mapped){
+    struct CacheEntry *entry = findLocked(shard, key, hash);
+    if(entry != NULL){
+        return entry;
+    }
+    if((shard->count + 1) * 4 > shard->capacity * 3 && growLocked(shard, shard->capacity * 2) == -1){
+        return NULL;
+    }
+    char *copy = mapped == TRUE ? (char*)key : strdup(key);
+    if(copy == NULL){
+        return NULL;
+    }
+    size_t i = homeOf(shard, hash);
+    while(shard->slots[i].hash != 0){
+        i = (i + 1) & (shard->capacity - 1);
+    }
+    entry = &shard->slots[i];
+    memset(entry, 0, sizeof(struct CacheEntry));
+    entry->hash = hash;
+    entry->key = copy;
+    entry->mapped = mapped;
+    shard->count++;
+    __atomic_add_fetch(&stats.objects, 1, __ATOMIC_RELAXED);
+    return entry;
+}
+
+/**
+ * set the size of entry, keeping the byte count of the index
+ */
+static void resizeLocked(struct CacheEntry *entry, off_t size){
+    __atomic_add_fetch(&stats.bytes, (long long)size - (long long)entry->size, __ATOMIC_RELAXED);
+    entry->size = size;
+}
+
+/**
+ * count a store or hit of entry for the eviction policies, after its size is set
+ */
+static void touchLocked(struct CacheEntry *entry){
+    double base;
+    __atomic_load(&inflation, &base, __ATOMIC_RELAXED);
+    entry->hits++;
+    entry->lastUsed = __atomic_add_fetch(&tick, 1, __ATOMIC_RELAXED);
+    entry->priority = base + (double)entry->hits / (double)(entry->size > 0 ? entry->size : 1);
+}
+
+/**
+ * remove entry, moving back the entries of its probe run that may no longer be found past the hole
+ */
+static void deleteLocked(struct IndexShard *shard, struct CacheEntry *entry){
+    resizeLocked(entry, 0);
+    if(entry->mapped == FALSE){
+        free(entry->key);
+    }
+    size_t mask = shard->capacity - 1;
+    size_t hole = (size_t)(entry - shard->slots);
+    for (size_t i = (hole + 1) & mask; shard->slots[i].hash != 0; i = (i + 1) & mask) {
+        size_t home = homeOf(shard, shard->slots[i].hash);
+        //the entry stays if its home lies cyclically in (hole, i]
+        int stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if(stays == FALSE){
+            shard->slots[hole] = shard->slots[i];
+            hole = i;
+        }
+    }
+    memset(&shard->slots[hole], 0, sizeof(struct CacheEntry));
+    shard->count--;
+    __atomic_sub_fetch(&stats.objects, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return 1 if the index was filled from the snapshot, 0 if there is no usable one, -1 if memory ran out
+ */
+static int loadSnapshot(const char *snapshot){
+    int fd = open(snapshot, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return 0;
+    }
+    struct stat sb;
+    if(fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(struct SnapshotHeader)){
+        close(fd);
+        return 0;
+    }
+    size_t len = (size_t)sb.st_size;
+    char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        return 0;
+    }
+    madvise(map, len, MADV_WILLNEED);
+    const struct SnapshotHeader *header = (const struct SnapshotHeader*)map;
+    size_t area = len - sizeof(struct SnapshotHeader);
+    if(memcmp(header->magic, CACHEINDEX_MAGIC, sizeof(header->magic)) != 0
+            || header->recordSize != sizeof(struct SnapshotRecord)
+            || header->count > area / sizeof(struct SnapshotRecord)
+            || header->keyBytes != area - header->count * sizeof(struct SnapshotRecord)
+            || (header->keyBytes > 0 && map[len - 1] != '\0')){
+        munmap(map, len);
+        return 0;
+    }
+    const struct SnapshotRecord *records = (const struct SnapshotRecord*)(map + sizeof(struct SnapshotHeader));
+    char *keys = map + sizeof(struct SnapshotHeader) + header->count * sizeof(struct SnapshotRecord);
+    for (uint64_t i = 0; i < header->count; i++) {     //checked before any is used, every key ends inside the file
+        if(records[i].hash == 0 || records[i].keyOffset >= header->keyBytes){
+            munmap(map, len);
+            return 0;
+        }
+    }
+    size_t perShard = slotsFor((size_t)(header->count / CACHEINDEX_SHARDS) + 1);
+    for (int i = 0; i < CACHEINDEX_SHARDS; i++) {
+        if(growLocked(&shards[i], perShard) == -1){
+            munmap(map, len);
+            return -1;
+        }
+    }
+    snapshotMap = map;
+    snapshotLen = len;
+    for (uint64_t i = 0; i < header->count; i++) {
+        const struct SnapshotRecord *record = &records[i];
+        const char *key = keys + record->keyOffset;
+        if(strncmp(key, cacheRoot, cacheRootLen) != 0 || key[cacheRootLen] != '/'){
+            continue;   //saved for another cache directory, its file is not one of ours
+        }
+        struct IndexShard *shard = shardOf(record->hash);
+        struct CacheEntry *entry = insertLocked(shard, key, record->hash, TRUE);
+        if(entry == NULL){
+            return -1;
+        }
+        resizeLocked(entry, (off_t)record->size);
+        entry->stored = (time_t)record->stored;
+        entry->digest = record->digest;
+        entry->lastUsed = record->lastUsed;
+        entry->hits = (unsigned long)record->hits;
+        entry->priority = record->priority;
+    }
+    tick = header->tick;
+    inflation = header->inflation;
+    return 1;
+}
+
+/**
+ * @return TRUE for ".name.<pid>-<n>.tmp", the name of the temporary file of a fetch
+ */
+static int isFetchTemporary(const char *name){
+    size_t len = strlen(name);
+    if(len < strlen(".x.0-0.tmp") || name[0] != '.' || strcmp(name + len - 4, ".tmp") != 0){
+        return FALSE;
+    }
+    const char *end = name + len - 4;
+    const char *p = end;
+    while(p > name && p[-1] >= '0' && p[-1] <= '9'){    //<n>
+        p--;
+    }
+    if(p == end || p[-1] != '-'){
+        return FALSE;
+    }
+    end = --p;
+    while(p > name && p[-1] >= '0' && p[-1] <= '9'){    //<pid>
+        p--;
+    }
+    return p != end && p[-1] == '.' && p - 1 > name + 1;
+}
+
+/**
+ * @return TRUE if the regular file at path starts with a stored head, so the proxy wrote it
+ */
+static int isCacheFile(const char *path){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        return FALSE;
+    }
+    int stored = freshnessIsStored(fd);
+    close(fd);
+    return stored;
+}
+
+/**
+ * nftw callback: index every cache file below a host directory, skip other files, dot files and
+ * directories, and remove the temporary files of unfinished fetches
+ */
+static int visit(const char *path, const struct stat *sb, int type, struct FTW *ftw){
+    const char *name = path + ftw->base;
+    if(ftw->level > 0 && name[0] == '.'){
+        if(type == FTW_F && ftw->level > 1 && S_ISREG(sb->st_mode) != 0 && isFetchTemporary(name) == TRUE){
+            unlink(path);   //left by a fetch that died with the process
+        }
+        return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+    }
+    if(type != FTW_F || ftw->level < 2 || S_ISREG(sb->st_mode) == 0){
+        return FTW_CONTINUE;    //files directly in the cache directory are not cached objects
+    }
+    if(isCacheFile(path) == FALSE){
+        return FTW_CONTINUE;    //not written by the proxy, it is neither counted nor evicted
+    }
+    uint64_t hash = hashKey(path);
+    struct CacheEntry *entry = insertLocked(shardOf(hash), path, hash, FALSE);
+    if(entry == NULL){
+        walkFailed = TRUE;
+        return FTW_STOP;
+    }
+    resizeLocked(entry, sb->st_size);
+    entry->stored = sb->st_mtime;
+    entry->hits = 1;    //older than anything used after the start
+    entry->priority = 1.0 / (double)(sb->st_size > 0 ? sb->st_size : 1);
+    return FTW_CONTINUE;
+}
+
+/**
+ * @return TRUE if the cache holds more than percent of a quota
+ */
+static int overQuota(int percent){
+    long long bytes = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+    long objects = __atomic_load_n(&stats.objects, __ATOMIC_RELAXED);
+    return (stats.maxBytes > 0 && bytes > stats.maxBytes * percent / 100)
+           || (stats.maxObjects > 0 && objects > stats.maxObjects * percent / 100);
+}
+
+static uint64_t nextRandom(){
+    evictor.random ^= evictor.random << 13;
+    evictor.random ^= evictor.random >> 7;
+    evictor.random ^= evictor.random << 17;
+    return evictor.random;
+}
+
+/**
+ * remove the victim of the policy among CACHEINDEX_SAMPLES entries of shard, and its file
+ * @return FALSE if the shard is empty
+ */
+static int evictFrom(struct IndexShard *shard){
+    pthread_mutex_lock(&shard->lock);
+    if(shard->count == 0){
+        pthread_mutex_unlock(&shard->lock);
+        return FALSE;
+    }
+    size_t mask = shard->capacity - 1;
+    struct CacheEntry *victim = NULL;
+    for (int k = 0; k < CACHEINDEX_SAMPLES; k++) {
+        size_t i = (size_t)nextRandom() & mask;
+        while(shard->slots[i].hash == 0){
+            i = (i + 1) & mask;
+        }
+        struct CacheEntry *entry = &shard->slots[i];
+        if(victim == NULL || (evictor.policy == CACHE_POLICY_LRU ? entry->lastUsed < victim->lastUsed
+                                                                 : entry->priority < victim->priority)){
+            victim = entry;
+        }
+    }
+    char *key = strdup(victim->key);
+    if(key == NULL){
+        pthread_mutex_unlock(&shard->lock);
+        return FALSE;
+    }
+    off_t size = victim->size;
+    double base;
+    __atomic_load(&inflation, &base, __ATOMIC_RELAXED);
+    if(evictor.policy == CACHE_POLICY_GDSF && victim->priority > base){
+        __atomic_store(&inflation, &victim->priority, __ATOMIC_RELAXED);
+    }
+    deleteLocked(shard, victim);
+    pthread_mutex_unlock(&shard->lock);
+    unlink(key);    //a reader that already opened the file keeps it
+    fdCacheForget(key);
+    memCacheRemove(key);
+    variantsForget(key);
+    free(key);
+    __atomic_add_fetch(&stats.evictions, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.evictedBytes, (long long)size, __ATOMIC_RELAXED);
+    return TRUE;
+}
+
+/**
+ * wait until a store takes the cache over a quota, then evict down to the low watermark
+ */
+static void *evictLoop(void *arg){
+    (void)arg;
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);     //only runs when no request wants the cpu
+    int next = 0;
+    pthread_mutex_lock(&evictor.lock);
+    while(evictor.stop == FALSE){
+        if(overQuota(100) == FALSE){
+            pthread_cond_wait(&evictor.wake, &evictor.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&evictor.lock);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long evicted = 0;
+        long long bytes = __atomic_load_n(&stats.evictedBytes, __ATOMIC_RELAXED);
+        int empty = 0;
+        while(__atomic_load_n(&evictor.stop, __ATOMIC_RELAXED) == FALSE && overQuota(CACHEINDEX_LOW_PERCENT) == TRUE
+                && empty < CACHEINDEX_SHARDS){
+            if(evictFrom(&shards[next]) == TRUE){
+                evicted++;
+                empty = 0;
+            } else{
+                empty++;
+            }
+            next = (next + 1) % CACHEINDEX_SHARDS;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        __atomic_add_fetch(&stats.evictionRuns, 1, __ATOMIC_RELAXED);
+        printf("Disk cache: evicted %ld objects, %lld bytes in %.1f ms\n", evicted,
+               __atomic_load_n(&stats.evictedBytes, __ATOMIC_RELAXED) - bytes,
+               (double)(end.tv_sec - start.tv_sec) * 1000.0 + (double)(end.tv_nsec - start.tv_nsec) / 1e6);
+        fflush(stdout);
+        pthread_mutex_lock(&evictor.lock);
+        if(evicted == 0 && evictor.stop == FALSE){     //nothing left to take, wait for the next store
+            pthread_cond_wait(&evictor.wake, &evictor.lock);
+        }
+    }
+    pthread_mutex_unlock(&evictor.lock);
+    return NULL;
+}
+
+int cacheIndexStartEvictor(size_t maxBytes, long maxObjects, int policy){
+    stats.maxBytes = (long long)maxBytes;
+    stats.maxObjects = maxObjects;
+    evictor.policy = policy;
+    evictor.stop = FALSE;
+    evictor.random = (uint64_t)filled.tv_nsec | 1;
+    if(maxBytes == 0 && maxObjects == 0){
+        return 0;
+    }
+    if(pthread_create(&evictor.thread, NULL, &evictLoop, NULL) != 0){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    __atomic_store_n(&evictor.running, TRUE, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void cacheIndexStopEvictor(){
+    if(evictor.running == FALSE){
+        return;
+    }
+    pthread_mutex_lock(&evictor.lock);
+    __atomic_store_n(&evictor.stop, TRUE, __ATOMIC_RELAXED);
+    pthread_cond_signal(&evictor.wake);
+    pthread_mutex_unlock(&evictor.lock);
+    pthread_join(evictor.thread, NULL);
+    __atomic_store_n(&evictor.running, FALSE, __ATOMIC_RELAXED);
+}
+
+/**
+ * create the cache directory if it is missing
+ * @return 0 if root is a directory the proxy may write to, -1 otherwise
+ */
+static int checkRoot(const char *root){
+    struct stat sb;
+    if(mkdir(root, S_IRWXU) < 0 && errno != EEXIST){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    if(stat(root, &sb) < 0 || access(root, W_OK | X_OK) < 0){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    if(S_ISDIR(sb.st_mode) == 0){
+        errno = ENOTDIR;
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    return 0;
+}
+
+int cacheIndexInit(const char *root, const char *snapshot){
+    if(checkRoot(root) == -1){
+        return -1;
+    }
+    cacheRoot = root;
+    cacheRootLen = strlen(root);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&stats, 0, sizeof(stats));
+    tick = 0;
+    inflation = 0;
+    for (int i = 0; i < CACHEINDEX_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].slots = NULL;
+        shards[i].capacity = 0;
+        shards[i].count = 0;
+        if(growLocked(&shards[i], CACHEINDEX_MIN_SLOTS) == -1){
+            return -1;
+        }
+    }
+    int loaded = snapshot != NULL ? loadSnapshot(snapshot) : 0;
+    if(loaded == -1){
+        return -1;
+    }
+    if(loaded == 1){
+        unlink(snapshot);   //it is written again on a clean shutdown only
+        stats.fromSnapshot = TRUE;
+    } else{
+        walkFailed = FALSE;
+        nftw(root, &visit, 64, FTW_PHYS | FTW_ACTIONRETVAL);
+        if(walkFailed == TRUE){
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    filled = end;
+    stats.loaded = stats.objects;
+    stats.loadMs = (double)(end.tv_sec - start.tv_sec) * 1000.0 + (double)(end.tv_nsec - start.tv_nsec) / 1e6;
+    return 0;
+}
+
+int cacheIndexLookup(const char *key, struct CacheEntry *out){
+    uint64_t hash = hashKey(key);
+    struct IndexShard *shard = shardOf(hash);
+    __atomic_add_fetch(&stats.lookups, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&shard->lock);
+    struct CacheEntry *entry = findLocked(shard, key, hash);
+    if(entry != NULL){
+        touchLocked(entry);
+    }
+    if(entry != NULL && out != NULL){
+        *out = *entry;
+        out->key = NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if(entry == NULL){
+        return FALSE;
+    }
+    __atomic_add_fetch(&stats.hits, 1, __ATOMIC_RELAXED);
+    return TRUE;
+}
+
+void cacheIndexStore(const char *key, off_t size, uint64_t digest){
+    uint64_t hash = hashKey(key);
+    struct IndexShard *shard = shardOf(hash);
+    pthread_mutex_lock(&shard->lock);
+    size_t count = shard->count;
+    struct CacheEntry *entry = insertLocked(shard, key, hash, FALSE);
+    if(shard->count > count){
+        arenaCountHeap(1);     //the copy of the key
+    }
+    if(entry != NULL){      //out of memory the file stays unindexed, a miss fetches it again
+        resizeLocked(entry, size);
+        entry->stored = time(NULL);
+        entry->digest = digest;
+        touchLocked(entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_add_fetch(&stats.stores, 1, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&evictor.running, __ATOMIC_RELAXED) == TRUE && overQuota(100) == TRUE){
+        pthread_mutex_lock(&evictor.lock);
+        pthread_cond_signal(&evictor.wake);
+        pthread_mutex_unlock(&evictor.lock);
+    }
+}
+
+void cacheIndexGrow(const char *key, off_t bytes){
+    uint64_t hash = hashKey(key);
+    struct IndexShard *shard = shardOf(hash);
+    pthread_mutex_lock(&shard->lock);
+    struct CacheEntry *entry = findLocked(shard, key, hash);
+    if(entry != NULL){
+        resizeLocked(entry, entry->size + bytes);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if(entry != NULL && __atomic_load_n(&evictor.running, __ATOMIC_RELAXED) == TRUE && overQuota(100) == TRUE){
+        pthread_mutex_lock(&evictor.lock);
+        pthread_cond_signal(&evictor.wake);
+        pthread_mutex_unlock(&evictor.lock);
+    }
+}
+
+void cacheIndexRemove(const char *key){
+    uint64_t hash = hashKey(key);
+    struct IndexShard *shard = shardOf(hash);
+    pthread_mutex_lock(&shard->lock);
+    struct CacheEntry *entry = findLocked(shard, key, hash);
+    if(entry != NULL){
+        deleteLocked(shard, entry);
+        __atomic_add_fetch(&stats.removals, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+int cacheIndexSave(const char *snapshot){
+    char tmp[PATH_MAX];
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", snapshot) >= (int)sizeof(tmp)){
+        return -1;
+    }
+    FILE *fp = fopen(tmp, "wb");
+    if(fp == NULL){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    struct SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHEINDEX_MAGIC, sizeof(header.magic));
+    header.recordSize = sizeof(struct SnapshotRecord);
+    header.tick = tick;
+    header.inflation = inflation;
+    for (int i = 0; i < CACHEINDEX_SHARDS; i++) {
+        for (size_t j = 0; j < shards[i].capacity; j++) {
+            if(shards[i].slots[j].hash != 0){
+                header.count++;
+                header.keyBytes += strlen(shards[i].slots[j].key) + 1;
+            }
+        }
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+    uint64_t keyOffset = 0;
+    for (int i = 0; i < CACHEINDEX_SHARDS; i++) {   //the records, then the keys in the same order
+        for (size_t j = 0; j < shards[i].capacity; j++) {
+            struct CacheEntry *entry = &shards[i].slots[j];
+            if(entry->hash != 0){
+                struct SnapshotRecord record = {entry->hash, keyOffset, (uint64_t)entry->size,
+                                                (int64_t)entry->stored, entry->digest, entry->lastUsed,
+                                                entry->hits, entry->priority};
+                fwrite(&record, sizeof(record), 1, fp);
+                keyOffset += strlen(entry->key) + 1;
+            }
+        }
+    }
+    for (int i = 0; i < CACHEINDEX_SHARDS; i++) {
+        for (size_t j = 0; j < shards[i].capacity; j++) {
+            if(shards[i].slots[j].hash != 0){
+                fwrite(shards[i].slots[j].key, 1, strlen(shards[i].slots[j].key) + 1, fp);
+            }
+        }
+    }
+    int failed = ferror(fp);
+    if(fclose(fp) != 0 || failed != 0 || rename(tmp, snapshot) < 0){
+        perror("error: <sys_call>\n");
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void cacheIndexGetStats(struct CacheIndexStats *out){
+    out->lookups = __atomic_load_n(&stats.lookups, __ATOMIC_RELAXED);
+    out->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+    out->stores = __atomic_load_n(&stats.stores, __ATOMIC_RELAXED);
+    out->removals = __atomic_load_n(&stats.removals, __ATOMIC_RELAXED);
+    out->objects = __atomic_load_n(&stats.objects, __ATOMIC_RELAXED);
+    out->bytes = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+    out->loaded = stats.loaded;
+    out->fromSnapshot = stats.fromSnapshot;
+    out->loadMs = stats.loadMs;
+    out->maxBytes = stats.maxBytes;
+    out->maxObjects = stats.maxObjects;
+    out->evictions = __atomic_load_n(&stats.evictions, __ATOMIC_RELAXED);
+    out->evictedBytes = __atomic_load_n(&stats.evictedBytes, __ATOMIC_RELAXED);
+    out->evictionRuns = __atomic_load_n(&stats.evictionRuns, __ATOMIC_RELAXED);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (double)(now.tv_sec - filled.tv_sec) + (double)(now.tv_nsec - filled.tv_nsec) / 1e9;
+    out->evictionRate = seconds > 0 ? (double)out->evictions / seconds : 0;
+}
+
+void cacheIndexDestroy(){
+    for (int i = 0; i < CACHEINDEX_SHARDS; i++) {
+        for (size_t j = 0; j < shards[i].capacity; j++) {
+            if(shards[i].slots[j].hash != 0 && shards[i].slots[j].mapped == FALSE){
+                free(shards[i].slots[j].key);
+            }
+        }
+        free(shards[i].slots);
+        shards[i].slots = NULL;
+        shards[i].capacity = 0;
+        shards[i].count = 0;
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+    if(snapshotMap != NULL){
+        munmap(snapshotMap, snapshotLen);
+        snapshotMap = NULL;
+    }
+}
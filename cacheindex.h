@@ -0,0 +1,185 @@
+#ifndef PROXY_SERVER_CACHEINDEX_H
+#define PROXY_SERVER_CACHEINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * cacheindex.h
+ *
+ * In-memory index of the on-disk cache, keyed by the cache path (the cache
+ * directory, the host and the request path). Only files below the cache
+ * directory that start with a stored head are indexed, so eviction never
+ * removes a file the proxy did not write. It records for every complete cache file
+ * its size, when it was stored and a digest of the origin response head, so
+ * deciding between a hit and a miss costs one hash probe and no syscall.
+ * An entry is added once its file was written completely and dropped when
+ * the file is rewritten or found missing.
+ *
+ * The table is split into shards with their own lock, each an open
+ * addressing table with linear probing. On a clean shutdown the index is
+ * written to a snapshot file: a header, fixed size records and the keys,
+ * laid out so the next start maps the file and fills the table from it
+ * without reading a single cache directory. The snapshot is removed once
+ * loaded, so a process that dies without saving leaves none behind and the
+ * next start falls back to walking the cache tree.
+ *
+ * The cache is bounded by a byte and an object quota. Every hit updates the
+ * entry's recency and its GDSF value (inflation + hits / size), so no
+ * directory is ever scanned to pick what goes. Once a store takes the cache
+ * over a quota, a background thread at idle priority evicts down to the low
+ * watermark: it samples CACHEINDEX_SAMPLES entries of a shard and removes
+ * the least recently used one, or the one with the lowest GDSF value, which
+ * then becomes the inflation that later hits build on.
+ */
+
+#define CACHEINDEX_SHARDS 64
+#define CACHEINDEX_MIN_SLOTS 64         //initial slots per shard
+#define CACHEINDEX_DEFAULT_ROOT "cache"       //directory the cache files are kept in
+#define CACHEINDEX_DEFAULT_SNAPSHOT ".cache-index"
+#define CACHEINDEX_MAGIC "PXCIDX02"     //8 bytes, changes with the snapshot layout or the key hash
+#define CACHEINDEX_DEFAULT_QUOTA (1024L * 1024 * 1024)
+#define CACHEINDEX_LOW_PERCENT 90       //eviction stops at this share of the quotas
+#define CACHEINDEX_SAMPLES 16           //entries compared to pick one victim
+
+// eviction policies
+#define CACHE_POLICY_LRU 0
+#define CACHE_POLICY_GDSF 1
+
+struct CacheEntry{
+    uint64_t hash;      //of the key, 0 marks an empty slot
+    char *key;
+    off_t size;         //bytes of the cache file
+    time_t stored;
+    uint64_t digest;    //of the origin response head, 0 if not known
+    uint64_t lastUsed;  //tick of the last store or hit
+    unsigned long hits; //stores and hits
+    double priority;    //GDSF value
+    int mapped;         //TRUE if key points into the loaded snapshot
+};
+
+struct IndexShard{
+    pthread_mutex_t lock;
+    struct CacheEntry *slots;
+    size_t capacity;    //power of two
+    size_t count;
+};
+
+/**
+ * start of a snapshot file, in host byte order
+ */
+struct SnapshotHeader{
+    char magic[8];
+    uint32_t recordSize;
+    uint32_t reserved;
+    uint64_t count;     //records that follow the header
+    uint64_t keyBytes;  //NUL terminated keys that follow the records
+    uint64_t tick;      //recency clock when saved
+    double inflation;   //GDSF inflation when saved
+};
+
+struct SnapshotRecord{
+    uint64_t hash;
+    uint64_t keyOffset;     //into the keys
+    uint64_t size;
+    int64_t stored;
+    uint64_t digest;
+    uint64_t lastUsed;
+    uint64_t hits;
+    double priority;
+};
+
+struct CacheIndexStats{
+    long lookups;
+    long hits;
+    long stores;
+    long removals;
+    long objects;
+    long long bytes;
+    long loaded;        //entries found at start
+    int fromSnapshot;   //TRUE if they came from a snapshot, FALSE if from walking the cache tree
+    double loadMs;
+    long long maxBytes;     //quotas, 0 when unbounded
+    long maxObjects;
+    long evictions;
+    long long evictedBytes;
+    long evictionRuns;
+    double evictionRate;    //evictions per second since the index was filled
+};
+
+/**
+ * fill the index from the snapshot, or by walking the cache tree when there is no usable snapshot
+ * @param root - the cache directory, created if missing. every key starts with it, entries of the
+ *               snapshot that do not are dropped
+ * @param snapshot - snapshot file, NULL to always walk
+ * @return 0, -1 if root is not a writable directory or memory ran out
+ */
+int cacheIndexInit(const char *root, const char *snapshot);
+
+/**
+ * start the thread that keeps the cache within its quotas
+ * @param maxBytes - 0 for no byte quota
+ * @param maxObjects - 0 for no object quota
+ * @param policy - CACHE_POLICY_LRU or CACHE_POLICY_GDSF
+ * @return 0, -1 if the thread could not be started
+ */
+int cacheIndexStartEvictor(size_t maxBytes, long maxObjects, int policy);
+
+/**
+ * stop the eviction thread, the cache may be left above its low watermark
+ */
+void cacheIndexStopEvictor();
+
+/**
+ * counts as a hit of the entry for the eviction policy
+ * @param key
+ * @param out - set to the entry with its key left NULL, may be NULL
+ * @return TRUE if the cache holds a complete file for key
+ */
+int cacheIndexLookup(const char *key, struct CacheEntry *out);
+
+/**
+ * record a complete cache file, stored now. wakes the eviction thread when the cache goes over a quota
+ * @param key
+ * @param size
+ * @param digest - of the origin response head, see cacheIndexDigest
+ */
+void cacheIndexStore(const char *key, off_t size, uint64_t digest);
+
+/**
+ * charge the bytes of a file made from the cache file of key, a compressed variant, to its entry,
+ * so they count against the quotas and are evicted with it
+ * @param key
+ * @param bytes
+ */
+void cacheIndexGrow(const char *key, off_t bytes);
+
+/**
+ * drop the entry of key, called when its file is rewritten or removed
+ */
+void cacheIndexRemove(const char *key);
+
+/**
+ * @return the digest of len bytes of data, never 0
+ */
+uint64_t cacheIndexDigest(const char *data, size_t len);
+
+/**
+ * write the index to a snapshot file, through a temporary file renamed over it.
+ * no other thread may use the index meanwhile
+ * @param snapshot
+ * @return 0, -1 if the file could not be written
+ */
+int cacheIndexSave(const char *snapshot);
+
+void cacheIndexGetStats(struct CacheIndexStats *stats);
+
+/**
+ * free the index and unmap the snapshot it was loaded from
+ */
+void cacheIndexDestroy();
+
+#endif //PROXY_SERVER_CACHEINDEX_H
@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "proxyServer.h"
+#include "deadline.h"
+
+struct DeadlineShard{
+    pthread_mutex_t lock;
+    struct TimerWheel wheel;
+};
+
+/**
+ * the deadlines of one thread, its fields are changed under the lock of its shard
+ */
+struct Deadline{
+    struct Timer phase;
+    struct Timer total;
+    int armed;          //phase of the phase timer, PHASE_NONE if none
+    int expired;        //PHASE_NONE until a deadline expires, read by the owner without the lock
+    int client;         //sockets shut down by an expired deadline, -1 for none
+    int server;
+    long long rearmed;  //milliseconds when the relay deadline was last pushed back
+    struct DeadlineShard *shard;
+    struct Deadline *next;
+};
+
+static const char *phaseNames[PHASES] = {"header", "dns", "connect", "first_byte", "relay", "total"};
+
+static __thread struct Deadline *mine;
+static pthread_mutex_t deadlinesLock = PTHREAD_MUTEX_INITIALIZER;
+static struct Deadline *deadlines;     //of every thread that armed one
+static int assigned;        //deadlines given a shard so far
+static struct DeadlineShard shards[DEADLINE_SHARDS];
+static long limits[PHASES];     //milliseconds
+static long timeouts[PHASES];
+static pthread_t watchdog;
+static int watchdogStop;
+static int watchdogRunning;
+
+static long long clockMs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * on the watchdog, with the shard locked: end the blocked calls of the owner on the sockets of the phase
+ */
+static void onExpire(struct Timer *t){
+    struct Deadline *d = (struct Deadline*)t->arg;
+    int phase = t == &d->total ? PHASE_TOTAL : d->armed;
+    if(d->expired == PHASE_NONE){
+        __atomic_store_n(&d->expired, phase, __ATOMIC_RELEASE);
+    }
+    deadlineCount(phase);
+    if(phase == PHASE_HEADER && d->client >= 0){
+        shutdown(d->client, SHUT_RD);   //the 408 can still be written
+        return;
+    }
+    if(phase != PHASE_DNS && d->server >= 0){     //a lookup can not be cut short, it ends within the resolver timeouts
+        shutdown(d->server, SHUT_RDWR);
+    }
+    int answering = phase == PHASE_RELAY || (phase == PHASE_TOTAL && d->armed != PHASE_DNS
+            && d->armed != PHASE_CONNECT && d->armed != PHASE_FIRST_BYTE);
+    if(answering == TRUE && d->client >= 0){    //the client may be the one that stopped reading
+        shutdown(d->client, SHUT_RDWR);
+    }
+}
+
+/**
+ * @return the deadlines of the calling thread, NULL if memory ran out
+ */
+static struct Deadline *deadline(){
+    if(mine == NULL && (mine = (struct Deadline*) calloc(1, sizeof(struct Deadline))) != NULL){
+        timerInit(&mine->phase, &onExpire, mine);
+        timerInit(&mine->total, &onExpire, mine);
+        mine->armed = PHASE_NONE;
+        mine->expired = PHASE_NONE;
+        mine->client = -1;
+        mine->server = -1;
+        pthread_mutex_lock(&deadlinesLock);
+        mine->shard = &shards[assigned++ % DEADLINE_SHARDS];
+        mine->next = deadlines;
+        deadlines = mine;
+        pthread_mutex_unlock(&deadlinesLock);
+    }
+    return mine;
+}
+
+static void *watchLoop(void *arg){
+    (void)arg;
+    struct timespec tick = {0, TIMER_TICK_MS * 1000000L};
+    while(__atomic_load_n(&watchdogStop, __ATOMIC_RELAXED) == FALSE){
+        nanosleep(&tick, NULL);
+        for (int i = 0; i < DEADLINE_SHARDS; i++) {
+            pthread_mutex_lock(&shards[i].lock);
+            timerWheelAdvance(&shards[i].wheel);
+            pthread_mutex_unlock(&shards[i].lock);
+        }
+    }
+    return NULL;
+}
+
+int deadlineInit(const int *seconds){
+    for (int phase = 0; phase < PHASES; phase++) {
+        limits[phase] = (long)seconds[phase] * 1000;
+    }
+    for (int i = 0; i < DEADLINE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        timerWheelInit(&shards[i].wheel);
+    }
+    watchdogStop = FALSE;
+    if(pthread_create(&watchdog, NULL, &watchLoop, NULL) != 0){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    watchdogRunning = TRUE;
+    return 0;
+}
+
+long deadlineMs(int phase){
+    return limits[phase];
+}
+
+void deadlineCount(int phase){
+    __atomic_add_fetch(&timeouts[phase], 1, __ATOMIC_RELAXED);
+}
+
+void deadlineGetStats(long *out){
+    for (int phase = 0; phase < PHASES; phase++) {
+        out[phase] = __atomic_load_n(&timeouts[phase], __ATOMIC_RELAXED);
+    }
+}
+
+const char *deadlinePhaseName(int phase){
+    return phaseNames[phase];
+}
+
+void deadlineClient(int fd){
+    struct Deadline *d = deadline();
+    if(d != NULL){
+        pthread_mutex_lock(&d->shard->lock);
+        d->client = fd;
+        pthread_mutex_unlock(&d->shard->lock);
+    }
+}
+
+void deadlineServer(int fd){
+    struct Deadline *d = deadline();
+    if(d != NULL){
+        pthread_mutex_lock(&d->shard->lock);
+        d->server = fd;
+        pthread_mutex_unlock(&d->shard->lock);
+    }
+}
+
+void deadlineStart(int phase){
+    struct Deadline *d = deadline();
+    if(d == NULL){
+        return;
+    }
+    struct TimerWheel *wheel = &d->shard->wheel;
+    pthread_mutex_lock(&d->shard->lock);
+    if(phase == PHASE_TOTAL){
+        if(limits[phase] > 0){
+            timerArm(wheel, &d->total, limits[phase]);
+        }
+    } else{
+        d->armed = phase;
+        if(limits[phase] > 0){
+            timerArm(wheel, &d->phase, limits[phase]);
+        } else{
+            timerCancel(wheel, &d->phase);
+        }
+        d->rearmed = clockMs();
+    }
+    pthread_mutex_unlock(&d->shard->lock);
+}
+
+void deadlineProgress(){
+    struct Deadline *d = mine;
+    if(d == NULL || d->armed != PHASE_RELAY || limits[PHASE_RELAY] == 0){
+        return;
+    }
+    long long now = clockMs();
+    if(now - d->rearmed < DEADLINE_REARM_MS){   //most chunks skip the lock
+        return;
+    }
+    pthread_mutex_lock(&d->shard->lock);
+    if(timerArmed(&d->phase) == TRUE){
+        timerArm(&d->shard->wheel, &d->phase, limits[PHASE_RELAY]);
+    }
+    d->rearmed = now;
+    pthread_mutex_unlock(&d->shard->lock);
+}
+
+int deadlineStop(){
+    struct Deadline *d = mine;
+    if(d == NULL){
+        return PHASE_NONE;
+    }
+    pthread_mutex_lock(&d->shard->lock);
+    timerCancel(&d->shard->wheel, &d->phase);
+    d->armed = PHASE_NONE;
+    pthread_mutex_unlock(&d->shard->lock);
+    return __atomic_load_n(&d->expired, __ATOMIC_ACQUIRE);
+}
+
+int deadlineExpired(){
+    return mine != NULL ? __atomic_load_n(&mine->expired, __ATOMIC_ACQUIRE) : PHASE_NONE;
+}
+
+void deadlineFinish(){
+    struct Deadline *d = mine;
+    if(d == NULL){
+        return;
+    }
+    pthread_mutex_lock(&d->shard->lock);
+    timerCancel(&d->shard->wheel, &d->phase);
+    timerCancel(&d->shard->wheel, &d->total);
+    d->armed = PHASE_NONE;
+    d->expired = PHASE_NONE;
+    pthread_mutex_unlock(&d->shard->lock);
+}
+
+void deadlineDestroy(){
+    if(watchdogRunning == TRUE){
+        __atomic_store_n(&watchdogStop, TRUE, __ATOMIC_RELAXED);
+        pthread_join(watchdog, NULL);
+        watchdogRunning = FALSE;
+    }
+    pthread_mutex_lock(&deadlinesLock);
+    while(deadlines != NULL){
+        struct Deadline *next = deadlines->next;
+        free(deadlines);
+        deadlines = next;
+    }
+    mine = NULL;
+    pthread_mutex_unlock(&deadlinesLock);
+}
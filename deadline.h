@@ -0,0 +1,110 @@
+#ifndef PROXY_SERVER_DEADLINE_H
+#define PROXY_SERVER_DEADLINE_H
+
+#include "timerwheel.h"
+
+/**
+ * deadline.h
+ *
+ * Deadlines of the phases of a request, so a client that never finishes its
+ * head, an origin that accepts and never answers or a client that stops
+ * reading cannot hold a thread or a connection forever.
+ *
+ * The event loops keep the deadlines of their connections on a timer wheel
+ * of their own (see eventloop.h). Code that blocks on sockets, the workers
+ * of the threads mode and the origin requests run on the background pool,
+ * arms the deadline of the calling thread instead: it is a timer on one of
+ * DEADLINE_SHARDS locked wheels, advanced by a watchdog thread every tick.
+ * When it expires the watchdog shuts down the sockets the thread declared,
+ * which ends the blocked read, write or connect with an error, and the
+ * thread learns which phase expired from deadlineExpired.
+ */
+
+#define DEADLINE_SHARDS 8
+#define DEADLINE_REARM_MS 100       //a relay deadline is pushed back at most this often
+#define DEADLINE_DNS 5              //default seconds of each phase
+#define DEADLINE_CONNECT 5
+#define DEADLINE_FIRST_BYTE 30
+#define DEADLINE_RELAY 30
+#define DEADLINE_TOTAL 300
+
+// phases of a request with a deadline, the header one is config.clientIdle
+#define PHASE_HEADER 0      //waiting for a whole request head, idle keep-alive connections included
+#define PHASE_DNS 1
+#define PHASE_CONNECT 2
+#define PHASE_FIRST_BYTE 3  //from sending the origin request to the first bytes of its response
+#define PHASE_RELAY 4       //without progress while a response is moved
+#define PHASE_TOTAL 5       //from the request head parsed to the response written
+#define PHASES 6
+#define PHASE_NONE (-1)
+
+/**
+ * start the watchdog
+ * @param seconds - deadline of every phase, 0 for none
+ * @return 0 - on success, -1 if the watchdog could not be started
+ */
+int deadlineInit(const int *seconds);
+
+/**
+ * @return milliseconds of phase, 0 if it has no deadline
+ */
+long deadlineMs(int phase);
+
+/**
+ * count an expired deadline
+ */
+void deadlineCount(int phase);
+
+/**
+ * @param timeouts - set to the expired deadlines of every phase, PHASES entries
+ */
+void deadlineGetStats(long *timeouts);
+
+/**
+ * @return the name of phase in the stats, "first_byte" for PHASE_FIRST_BYTE
+ */
+const char *deadlinePhaseName(int phase);
+
+/**
+ * declare the client socket the calling thread serves, shut down when its deadlines expire
+ * @param fd - -1 before the thread closes or gives away the socket
+ */
+void deadlineClient(int fd);
+
+/**
+ * declare the origin socket the calling thread uses
+ * @param fd - -1 before the thread closes the socket or gives it back to the pool
+ */
+void deadlineServer(int fd);
+
+/**
+ * arm the deadline of a phase for the calling thread. PHASE_TOTAL runs beside the others,
+ * every other phase replaces the one armed before
+ * @param phase
+ */
+void deadlineStart(int phase);
+
+/**
+ * push back an armed PHASE_RELAY deadline, the response moved on
+ */
+void deadlineProgress();
+
+/**
+ * cancel the phase armed by the calling thread, PHASE_TOTAL stays armed
+ * @return the phase that expired, PHASE_NONE if none did
+ */
+int deadlineStop();
+
+/**
+ * @return the phase whose deadline expired on the calling thread, PHASE_NONE if none did
+ */
+int deadlineExpired();
+
+/**
+ * cancel every deadline of the calling thread and forget the expired one, the request is done
+ */
+void deadlineFinish();
+
+void deadlineDestroy();
+
+#endif //PROXY_SERVER_DEADLINE_H
@@ -0,0 +1,1119 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "eventloop.h"
+#include "resolver.h"
+#include "upstream.h"
+#include "fdcache.h"
+#include "variants.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "deadline.h"
+#include "admission.h"
+
+#define WATCH_LISTEN 0
+#define WATCH_WAKE 1
+#define WATCH_CLIENT 2
+#define WATCH_SERVER 3
+
+static struct Watch listenWatch = {WATCH_LISTEN, NULL};
+static struct Watch wakeWatch = {WATCH_WAKE, NULL};
+
+static struct EventLoop *loops;
+static int loopsNum;
+static int acceptedCount;
+static int maxAccepted;
+
+static int setNonBlocking(int fd, int on){
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0){
+        return -1;
+    }
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+static void wakeLoop(struct EventLoop *loop){
+    uint64_t one = 1;
+    if(write(loop->wakefd, &one, sizeof(one)) < 0){
+        perror("error: <sys_call>\n");
+    }
+}
+
+/**
+ * arm the deadline of the phase c enters, it replaces the one of the phase before
+ * @param c
+ * @param phase - PHASE_*, not PHASE_TOTAL
+ */
+static void phaseStart(struct Conn *c, int phase){
+    c->phase = phase;
+    if(deadlineMs(phase) > 0){
+        timerArm(&c->loop->wheel, &c->phaseTimer, deadlineMs(phase));
+    } else{
+        timerCancel(&c->loop->wheel, &c->phaseTimer);
+    }
+}
+
+static void phaseStop(struct Conn *c){
+    timerCancel(&c->loop->wheel, &c->phaseTimer);
+}
+
+/**
+ * cancel the deadlines of the current request of c
+ * @param c
+ */
+static void deadlinesStop(struct Conn *c){
+    timerCancel(&c->loop->wheel, &c->phaseTimer);
+    timerCancel(&c->loop->wheel, &c->totalTimer);
+    c->expired = PHASE_NONE;
+}
+
+/**
+ * release what the current request owns. a cache file that was not completed is removed.
+ * @param c
+ */
+static void resetRequest(struct Conn *c){
+    if(c->cacheFile != NULL){
+        closeCacheFile(c->cacheFile, c->fetch, NULL);
+        c->cacheFile = NULL;
+    }
+    if(c->fetch != NULL){
+        if(c->fetchLeader == TRUE){
+            fetchFinish(c->fetch, FALSE, 0);    //its followers end here unless the file was published
+        }
+        fetchRelease(c->fetch);
+        c->fetch = NULL;
+    }
+    if(c->server_fd >= 0){
+        close(c->server_fd);
+        c->server_fd = -1;
+    }
+    if(c->file != NULL){
+        fdCacheRelease(c->file);
+        c->file = NULL;
+    }
+    if(c->stale != NULL){
+        fdCacheRelease(c->stale);
+        c->stale = NULL;
+    }
+    if(c->pipe != NULL){
+        relayPipeGive(c->pipe);
+        c->pipe = NULL;
+    }
+    c->triedSplice = FALSE;
+    if(c->memObj != NULL){
+        memCacheRelease(c->memObj);
+        c->memObj = NULL;
+    }
+    c->fullPath = NULL;     //the arena is rewound by the caller
+    c->constructedRequest = NULL;
+    c->framer = NULL;
+    c->relayBuf = NULL;
+    c->clientHead = NULL;
+    c->requestSent = 0;
+    c->resolved = FALSE;
+    c->reused = FALSE;
+    c->extraBytes = FALSE;
+    c->clientLive = TRUE;
+    c->clientHeadLen = 0;
+    c->clientHeadOff = 0;
+    c->relayLen = 0;
+    c->relayOff = 0;
+    c->totalBytes = 0;
+    c->memSent = 0;
+    c->originStart = 0;
+    c->stageStart = 0;
+}
+
+/**
+ * log the current request of c, if one was begun and not logged yet
+ * @param c
+ */
+static void logRequest(struct Conn *c){
+    struct Headers *h = c->h;
+    accessLogWrite(&h->entry, h->method, h->host, h->path);
+}
+
+/**
+ * release everything the connection owns
+ * @param c
+ */
+static void closeConn(struct Conn *c){
+    logRequest(c);  //cut short, or answered on a connection that does not stay open
+    resetRequest(c);
+    deadlinesStop(c);
+    if(c->client_fd >= 0){
+        admissionLeave(c->client_fd);
+        close(c->client_fd);
+    }
+    c->loop->live--;
+    c->state = CS_CLOSED;   //events of this round may still point at c, its arena is given back after the round
+    c->nextDone = c->loop->deadHead;
+    c->loop->deadHead = c;
+}
+
+/**
+ * the answer to the current request was written: close the connection, or keep it for the
+ * next request of the client, which may already wait in the read buffer
+ * @param c
+ * @param keepAlive - TRUE if the answer left the connection open
+ */
+static void nextRequest(struct Conn *c, int keepAlive){
+    c->served++;
+    if(c->started != 0){
+        metricsSince(STAGE_TOTAL, c->started);
+        c->started = 0;
+    }
+    logRequest(c);
+    if(keepAlive == FALSE){
+        arenaCount(c->arena);
+        closeConn(c);
+        return;
+    }
+    resetRequest(c);
+    deadlinesStop(c);
+    consumeRequest(c->h, &c->requestLen);
+    c->h->method = NULL;    //the next head is not parsed yet, nothing of the last one is logged with it
+    c->h->path = NULL;
+    c->h->host = NULL;
+    arenaRewind(c->arena, c->mark);
+    c->state = CS_READ_HEADERS;
+    phaseStart(c, PHASE_HEADER);
+    if(c->ready == FALSE){  //read it after the round instead of recursing into the next request
+        c->ready = TRUE;
+        c->nextReady = c->loop->readyHead;
+        c->loop->readyHead = c;
+    }
+}
+
+static void failConn(struct Conn *c, int code){
+    int keepAlive = responseErr(code, c->client_fd, c->h->keepAlive);
+    accessLogKeepStatus(&c->h->entry);
+    nextRequest(c, keepAlive);
+}
+
+/**
+ * called on a pool thread when its job on c is done, gives c back to its loop
+ * @param c
+ */
+static void handBack(struct Conn *c){
+    struct EventLoop *loop = c->loop;
+    accessLogKeepStatus(&c->h->entry);  //of an error the job answered
+    pthread_mutex_lock(&loop->doneLock);
+    c->nextDone = loop->doneHead;
+    loop->doneHead = c;
+    pthread_mutex_unlock(&loop->doneLock);
+    wakeLoop(loop);
+}
+
+/**
+ * give c to a pool job, only the deadline of the whole request runs while the job owns it
+ * @param c
+ * @param job - hands c back when it is done
+ */
+static void offload(struct Conn *c, int (*job)(void *)){
+    phaseStop(c);
+    c->state = CS_OFFLOADED;
+    dispatch_to_group(c->loop->tp, c->loop->group, job, (void*)c);
+}
+
+/**
+ * resolver callback of a pending lookup, runs on a pool thread
+ */
+static void onResolveDone(void *arg, int result, struct in_addr address){
+    struct Conn *c = (struct Conn*)arg;
+    c->resolved = result == RESOLVE_FOUND ? TRUE : FALSE;
+    c->address = address;
+    handBack(c);
+}
+
+static int serveLocalJob(void *arg){
+    struct Conn *c = (struct Conn*)arg;
+    long long start = metricsNow();
+    setNonBlocking(c->client_fd, FALSE);
+    long sent = giveFromLocal(c->file, &c->h->parser, c->client_fd, &c->h->keepAlive);
+    metricsSince(STAGE_HIT, start);
+    metricsAnswer(COUNT_DISK_HITS, sent);
+    accessLogAnswer(&c->h->entry, ACCESS_DISK, 0, sent);    //unless it was revalidated
+    handBack(c);
+    return 0;
+}
+
+/**
+ * answer a request for the stats, on a pool thread
+ */
+static int serveStatsJob(void *arg){
+    struct Conn *c = (struct Conn*)arg;
+    setNonBlocking(c->client_fd, FALSE);
+    c->h->keepAlive = metricsServe(c->statsFormat, c->client_fd, c->h->keepAlive);
+    accessLogAnswer(&c->h->entry, ACCESS_STATS, 0, 0);
+    handBack(c);
+    return 0;
+}
+
+/**
+ * answer a range request from the memory cache, on a pool thread
+ */
+static int serveMemoryJob(void *arg){
+    struct Conn *c = (struct Conn*)arg;
+    long long start = metricsNow();
+    setNonBlocking(c->client_fd, FALSE);
+    size_t sent = 0;
+    if(giveFromMemory(c->memObj, &c->h->parser, c->client_fd, c->h->keepAlive, &sent) != 0){
+        c->h->keepAlive = FALSE;
+    }
+    metricsSince(STAGE_HIT, start);
+    metricsAnswer(COUNT_MEMORY_HITS, (long long)sent);
+    accessLogAnswer(&c->h->entry, ACCESS_MEMORY, 0, (long long)sent);
+    handBack(c);
+    return 0;
+}
+
+/**
+ * answer a request whose object another connection is fetching, on a pool thread
+ */
+static int followJob(void *arg){
+    struct Conn *c = (struct Conn*)arg;
+    setNonBlocking(c->client_fd, FALSE);
+    long sent = followFetch(c->fetch, &c->h->parser, c->client_fd, &c->h->keepAlive);
+    if(sent < 0){
+        c->h->keepAlive = responseErr(ERR_SERVER, c->client_fd, FALSE);
+    } else{
+        metricsAnswer(COUNT_FOLLOWED, sent);
+        accessLogAnswer(&c->h->entry, ACCESS_FOLLOWED, 0, sent);
+    }
+    handBack(c);
+    return 0;
+}
+
+static void dropCacheFile(struct Conn *c);
+
+/**
+ * write the stored head of the origin response to the cache file once the framer parsed it
+ * @param c
+ */
+static void storeHead(struct Conn *c){
+    if(c->cacheFile != NULL && storeResponseHead(c->cacheFile, c->fetch, c->framer, c->stale) < 0){
+        dropCacheFile(c);
+    }
+}
+
+static void writeBody(void *arg, const char *data, size_t len){
+    struct Conn *c = (struct Conn*)arg;
+    storeHead(c);
+    if(c->cacheFile != NULL && fwrite(data, 1, len, c->cacheFile) != len){
+        dropCacheFile(c);
+    }
+}
+
+static void connectOrigin(struct Conn *c, int allowPooled);
+
+/**
+ * a pooled origin connection failed before anything was answered on it, send the request again on a new one
+ * @param c
+ * @return TRUE if the request is retried, FALSE if c->server_fd was not a pooled connection
+ */
+static int retryFresh(struct Conn *c){
+    if(c->reused == FALSE || c->totalBytes > 0){
+        return FALSE;
+    }
+    close(c->server_fd);    //also removes it from the epoll set
+    c->server_fd = -1;
+    if(c->cacheFile != NULL){
+        closeCacheFile(c->cacheFile, c->fetch, NULL);
+        c->cacheFile = NULL;
+    }
+    c->requestSent = 0;
+    upstreamCountRetry();
+    connectOrigin(c, FALSE);
+    return TRUE;
+}
+
+/**
+ * the origin response is complete: keep the cache file, give the origin connection back to the pool
+ * and go on with the next request of the client if the response framing allows it. a 304 to a
+ * revalidation is answered from the revalidated copy on the pool
+ * @param c
+ * @param reusable - TRUE if nothing followed the response on the origin connection
+ */
+static void finishRelay(struct Conn *c, int reusable){
+    if(c->cacheFile != NULL){
+        closeCacheFile(c->cacheFile, c->fetch, c->framer);
+        c->cacheFile = NULL;
+    }
+    epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->server_fd, NULL);
+    setNonBlocking(c->server_fd, FALSE);
+    upstreamRelease(c->server_fd, c->address, 80, reusable && c->framer->keepAlive);
+    c->server_fd = -1;
+    c->h->entry.origin = metricsSince(STAGE_ORIGIN, c->originStart) - c->originStart;
+    if(c->stale != NULL && c->framer->status == 304){
+        if((c->file = openFromCache(c->fullPath)) == NULL){     //the merged head could not be stored
+            c->file = c->stale;
+            c->stale = NULL;
+        }
+        c->h->entry.source = ACCESS_REVALIDATED;
+        offload(c, &serveLocalJob);
+        return;
+    }
+    metricsAnswer(COUNT_FETCHED, c->totalBytes);
+    accessLogAnswer(&c->h->entry, ACCESS_ORIGIN, c->framer->status, c->totalBytes);
+    nextRequest(c, c->clientLive && c->framer->keepAlive && c->h->keepAlive);
+}
+
+/**
+ * the cache file can not be completed, stop filling it and end the followers of the fetch
+ * @param c
+ */
+static void dropCacheFile(struct Conn *c){
+    if(c->cacheFile != NULL){
+        closeCacheFile(c->cacheFile, c->fetch, NULL);
+        c->cacheFile = NULL;
+        fetchFinish(c->fetch, FALSE, 0);
+    }
+}
+
+/**
+ * let the followers of the fetch read what reached the cache file
+ * @param c
+ */
+static void reportProgress(struct Conn *c){
+    if(c->cacheFile == NULL){
+        return;
+    }
+    fetchProgress(c->fetch, c->cacheFile);
+}
+
+/**
+ * take the next bytes of the origin response: spliced into the pipes once the body passes through
+ * unchanged, otherwise read into relayBuf and fed to the framer
+ * @param c
+ * @return bytes taken, 0 on EOF, -1 on error or when the origin would block (errno tells),
+ *         -2 on a malformed response
+ */
+static ssize_t relayRead(struct Conn *c){
+    if(c->triedSplice == FALSE && framerPassThrough(c->framer) == TRUE){
+        c->triedSplice = TRUE;
+        storeHead(c);
+        if(c->cacheFile == NULL || fflush(c->cacheFile) == 0){
+            c->pipe = relayPipeTake();
+        }
+    }
+    if(c->pipe != NULL && (c->clientLive == TRUE || c->cacheFile != NULL)){
+        long long remaining = framerRemaining(c->framer);
+        size_t len = remaining >= 0 && (size_t)remaining < c->pipe->size ? (size_t)remaining : c->pipe->size;
+        int fileLive = c->cacheFile != NULL;
+        ssize_t nbytes = relaySpliceIn(c->pipe, c->server_fd, len, c->clientLive, &fileLive);
+        if(fileLive == FALSE){
+            dropCacheFile(c);
+        }
+        if(nbytes > 0){
+            framerSkip(c->framer, (size_t)nbytes);
+            c->totalBytes += nbytes;
+            return nbytes;
+        }
+        if(nbytes < 0 && (errno == EINVAL || errno == ENOSYS) && c->pipe->clientPending == 0 && c->pipe->filePending == 0){
+            relayPipeGive(c->pipe);     //not for these descriptors, copy instead
+            c->pipe = NULL;
+        } else{
+            return nbytes;
+        }
+    }
+    if(c->relayBuf == NULL && ((c->relayBuf = (char*) arenaAlloc(c->arena, config.relayBuffer)) == NULL
+            || (c->clientHead = (char*) arenaAlloc(c->arena, FRAMER_CLIENT_HEAD_MAX)) == NULL)){
+        errno = ENOMEM;
+        return -1;
+    }
+    ssize_t nbytes = read(c->server_fd, c->relayBuf, config.relayBuffer);
+    if(nbytes <= 0){
+        return nbytes;
+    }
+    if(c->stageStart != 0){     //the first bytes of the response
+        metricsSince(STAGE_FIRST_BYTE, c->stageStart);
+        c->stageStart = 0;
+        phaseStart(c, PHASE_RELAY);
+    }
+    long used = framerFeed(c->framer, c->relayBuf, (size_t)nbytes, &writeBody, (void*)c);
+    if(used < 0){
+        return -2;
+    }
+    if(framerHaveHeaders(c->framer) == TRUE){   //a head without body bytes yet
+        storeHead(c);
+    }
+    c->extraBytes = used < nbytes ? TRUE : FALSE;
+    c->relayLen = c->stale != NULL && c->framer->status == 304 ? 0 : (size_t)used;     //the client gets the revalidated copy
+    c->relayOff = 0;
+    if(c->relayLen > 0){
+        c->relayOff = c->framer->headTaken;     //head bytes go out rewritten from clientHead
+        if(c->framer->headTaken > 0 && framerHaveHeaders(c->framer) == TRUE){
+            c->clientHeadLen = framerClientHead(c->framer, c->h->keepAlive && c->framer->keepAlive, c->clientHead);
+            c->clientHeadOff = 0;
+        }
+    }
+    c->totalBytes += used;
+    return nbytes;
+}
+
+/**
+ * move the origin response to the client and the cache file until one of the sockets would block
+ * @param c
+ */
+static void relay(struct Conn *c){
+    ssize_t nbytes;
+    if(c->phase == PHASE_RELAY){    //one of the sockets moved on
+        phaseStart(c, PHASE_RELAY);
+    }
+    while(1){
+        while(c->clientHeadOff < c->clientHeadLen){
+            if(c->clientLive == FALSE){
+                c->clientHeadOff = c->clientHeadLen;
+                break;
+            }
+            nbytes = write(c->client_fd, c->clientHead + c->clientHeadOff, c->clientHeadLen - c->clientHeadOff);
+            if(nbytes < 0){
+                if(errno == EAGAIN || errno == EWOULDBLOCK){
+                    return;     //wait for EPOLLOUT on the client
+                }
+                c->clientLive = FALSE;
+            } else{
+                c->clientHeadOff += nbytes;
+            }
+        }
+        if(c->pipe != NULL){
+            int fileLive = c->cacheFile != NULL;
+            int result = relaySpliceOut(c->pipe, c->client_fd, c->cacheFile != NULL ? fileno(c->cacheFile) : -1,
+                                        &c->clientLive, &fileLive);
+            if(fileLive == FALSE){
+                dropCacheFile(c);
+            }
+            reportProgress(c);
+            if(result == 1){
+                return;     //wait for EPOLLOUT on the client
+            }
+        }
+        while(c->relayOff < c->relayLen){
+            if(c->clientLive == FALSE){
+                c->relayOff = c->relayLen;
+                break;
+            }
+            nbytes = write(c->client_fd, c->relayBuf + c->relayOff, c->relayLen - c->relayOff);
+            if(nbytes < 0){
+                if(errno == EAGAIN || errno == EWOULDBLOCK){
+                    return;     //wait for EPOLLOUT on the client
+                }
+                c->clientLive = FALSE;
+            } else{
+                c->relayOff += nbytes;
+            }
+        }
+        if(framerDone(c->framer) == TRUE){
+            finishRelay(c, c->extraBytes == FALSE);
+            return;
+        }
+        nbytes = relayRead(c);
+        if(nbytes > 0){
+            reportProgress(c);
+            continue;
+        }
+        if(nbytes == -2){
+            closeConn(c);   //malformed response, the partial cache file is removed
+            return;
+        }
+        if(nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;     //wait for EPOLLIN on the origin
+        }
+        if(retryFresh(c) == TRUE){
+            return;
+        }
+        if(nbytes == 0 && framerEof(c->framer) == TRUE){
+            c->extraBytes = TRUE;   //the origin closed it, nothing to give back
+            continue;
+        }
+        closeConn(c);
+        return;
+    }
+}
+
+static void sendRequest(struct Conn *c){
+    size_t len = strlen(c->constructedRequest);
+    while(c->requestSent < len){
+        ssize_t nbytes = send(c->server_fd, c->constructedRequest + c->requestSent, len - c->requestSent, MSG_NOSIGNAL);
+        if(nbytes < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return;
+            }
+            if(retryFresh(c) == FALSE){
+                failConn(c, ERR_SERVER);
+            }
+            return;
+        }
+        c->requestSent += nbytes;
+    }
+    c->stageStart = metricsNow();   //waiting for the first byte
+    createFile(c->fetch, &c->cacheFile);
+    if(c->cacheFile == NULL){
+        failConn(c, ERR_SERVER);
+        return;
+    }
+    if(c->framer == NULL && (c->framer = (struct Framer*) arenaAlloc(c->arena, sizeof(struct Framer))) == NULL){
+        failConn(c, ERR_SERVER);
+        return;
+    }
+    framerInit(c->framer);
+    c->clientHeadLen = 0;
+    c->clientHeadOff = 0;
+    c->relayLen = 0;
+    c->relayOff = 0;
+    c->state = CS_RELAY;
+    relay(c);
+}
+
+static void onConnected(struct Conn *c){
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(c->server_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0){
+        failConn(c, ERR_SERVER);
+        return;
+    }
+    metricsSince(STAGE_CONNECT, c->stageStart);
+    c->state = CS_SEND_REQUEST;
+    phaseStart(c, PHASE_FIRST_BYTE);
+    sendRequest(c);
+}
+
+/**
+ * write the memory cache hit until the client would block
+ * @param c
+ */
+static void sendMemory(struct Conn *c){
+    phaseStart(c, PHASE_RELAY);     //a client that stops reading does not hold the object forever
+    int result = memCacheWrite(c->memObj, c->client_fd, c->memAge, c->h->keepAlive, &c->memSent);
+    if(result == 1){
+        return;     //wait for EPOLLOUT on the client
+    }
+    metricsSince(STAGE_HIT, c->stageStart);
+    metricsAnswer(COUNT_MEMORY_HITS, (long long)c->memSent);
+    accessLogAnswer(&c->h->entry, ACCESS_MEMORY, accessLogHeadStatus(c->memObj->head, c->memObj->headLen),
+                    (long long)c->memSent);
+    nextRequest(c, result == 0 && c->h->keepAlive);
+}
+
+/**
+ * continue a request after its host was resolved: address filter, cache lookup, then connect to the origin
+ * @param c
+ */
+static void onResolved(struct Conn *c){
+    phaseStop(c);
+    c->h->entry.resolve = metricsSince(STAGE_RESOLVE, c->stageStart) - c->stageStart;
+    if(c->resolved == FALSE){
+        failConn(c, ERR_NOT_FOUND);
+        return;
+    }
+    if(searchIpInFilter(c->address) == TRUE){
+        failConn(c, ERR_FORBIDDEN);
+        return;
+    }
+    c->fullPath = buildFullPath(c->h);
+    c->constructedRequest = buildOriginRequest(c->h, NULL, NULL);
+    if(c->fullPath == NULL || c->constructedRequest == NULL){
+        failConn(c, ERR_SERVER);
+        return;
+    }
+    struct CachedFile *file;
+    long long start = metricsNow();
+    int verdict = findInCache(c->fullPath, &c->memObj, &file);
+    if(verdict == FRESHNESS_STALE_SERVE){   //served as it is while a refresh runs in the background
+        char *request = c->memObj != NULL ? buildOriginRequest(c->h, c->memObj->head, &c->memObj->fresh)
+                                          : buildOriginRequest(c->h, file->head, &file->fresh);
+        if(request != NULL){
+            refreshStale(c->fullPath, request, c->address);
+        }
+    }
+    if(c->memObj != NULL || (file != NULL && verdict != FRESHNESS_STALE)){
+        variantPick(c->fullPath, &c->h->parser, &c->memObj, &file);
+    }
+    c->stageStart = metricsSince(STAGE_CACHE, start);    //a hit is timed from here
+    if(c->memObj != NULL){   //from memory
+        c->memAge = freshnessAge(&c->memObj->fresh, time(NULL));
+        if(freshnessNotModified(&c->memObj->fresh, c->memObj->head, &c->h->parser) == TRUE){
+            long sent = giveNotModified(c->memObj->head, c->memObj->headLen, c->memAge, c->client_fd, c->h->keepAlive);
+            metricsSince(STAGE_HIT, c->stageStart);
+            metricsAnswer(COUNT_MEMORY_HITS, sent);
+            accessLogAnswer(&c->h->entry, ACCESS_MEMORY, 0, sent);
+            nextRequest(c, sent >= 0 && c->h->keepAlive);
+            return;
+        }
+        if(httpField(&c->h->parser, "Range") != NULL){     //its slices are sent on the pool
+            offload(c, &serveMemoryJob);
+            return;
+        }
+        c->state = CS_SEND_MEMORY;
+        sendMemory(c);
+        return;
+    }
+    if(file != NULL && verdict != FRESHNESS_STALE){ //from local
+        c->file = file;
+        offload(c, &serveLocalJob);
+        return;
+    }
+    c->stale = file;    //revalidated by the origin request, if this connection leads it
+    if((c->fetch = fetchJoin(c->fullPath, &c->fetchLeader)) == NULL){
+        failConn(c, ERR_SERVER);
+        return;
+    }
+    if(c->stale != NULL && c->fetchLeader == TRUE
+            && (c->constructedRequest = buildOriginRequest(c->h, c->stale->head, &c->stale->fresh)) == NULL){
+        failConn(c, ERR_SERVER);
+        return;
+    }
+    if(c->fetchLeader == TRUE && httpField(&c->h->parser, "Range") != NULL
+            && fillForRange(c->fetch, c->constructedRequest, c->address) == 0){
+        c->fetchLeader = FALSE;     //the whole object is fetched in the background, the ranges follow it
+    }
+    if(c->fetchLeader == FALSE){    //another request fetches it already, its body is followed on the pool
+        if(c->stale != NULL){
+            fdCacheRelease(c->stale);
+            c->stale = NULL;
+        }
+        offload(c, &followJob);
+        return;
+    }
+    connectOrigin(c, TRUE);
+}
+
+/**
+ * get a connection to the origin: a pooled one if allowed and available, otherwise start a non-blocking connect
+ * @param c
+ * @param allowPooled
+ */
+static void connectOrigin(struct Conn *c, int allowPooled){
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = &c->serverWatch;
+    c->reused = FALSE;
+    if(c->originStart == 0){    //not a retry
+        c->originStart = metricsNow();
+    }
+    if(allowPooled == TRUE && (c->server_fd = upstreamTake(c->address, 80)) >= 0){
+        c->reused = TRUE;
+        if(setNonBlocking(c->server_fd, TRUE) < 0 || epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, c->server_fd, &ev) < 0){
+            failConn(c, ERR_SERVER);
+            return;
+        }
+        c->state = CS_SEND_REQUEST;
+        phaseStart(c, PHASE_FIRST_BYTE);
+        sendRequest(c);
+        return;
+    }
+    struct sockaddr_in peeraddr;
+    c->stageStart = metricsNow();
+    if((c->server_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0){
+        failConn(c, ERR_SERVER);
+        return;
+    }
+    if(epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, c->server_fd, &ev) < 0){
+        failConn(c, ERR_SERVER);
+        return;
+    }
+    upstreamCountOpened();
+    peeraddr.sin_family = AF_INET;
+    peeraddr.sin_port = htons(80);
+    peeraddr.sin_addr.s_addr = c->address.s_addr;
+    if(connect(c->server_fd, (struct sockaddr*) &peeraddr, sizeof(peeraddr)) == 0){
+        metricsSince(STAGE_CONNECT, c->stageStart);
+        c->state = CS_SEND_REQUEST;
+        phaseStart(c, PHASE_FIRST_BYTE);
+        sendRequest(c);
+    } else if(errno == EINPROGRESS){
+        c->state = CS_CONNECTING;
+        phaseStart(c, PHASE_CONNECT);
+    } else{
+        failConn(c, ERR_SERVER);
+    }
+}
+
+static void onReadHeaders(struct Conn *c){
+    struct Headers *h = c->h;
+    ssize_t nbytes;
+    int result;
+    while((result = scanRequestHead(h, c->requestLen, FALSE)) == HP_INCOMPLETE){
+        nbytes = read(c->client_fd, h->request + c->requestLen, config.headerLimit - c->requestLen);
+        if(nbytes < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return;
+            }
+            closeConn(c);
+            return;
+        }
+        if(nbytes == 0){   //EOF, parse what was sent like the blocking mode does
+            if(c->requestLen == 0 || c->served > 0){
+                closeConn(c);
+                return;
+            }
+            result = scanRequestHead(h, c->requestLen, TRUE);
+            break;
+        }
+        c->requestLen += nbytes;
+    }
+    phaseStop(c);
+    accessLogBegin(&h->entry, c->client_fd);
+    if(result != HP_DONE){
+        failConn(c, result == HP_TOO_LARGE ? ERR_TOO_LARGE : ERR_BAD_REQUEST);
+        return;
+    }
+    if(admissionRequest(c->client_fd) == FALSE){
+        failConn(c, ERR_TOO_MANY);
+        return;
+    }
+    int err = parseRequest(h);
+    if(err != 0){
+        failConn(c, err);
+        return;
+    }
+    if(c->served + 1 >= config.clientMaxRequests){
+        h->keepAlive = FALSE;
+    }
+    if(metricsWanted(h->path, &c->statsFormat) == TRUE){
+        offload(c, &serveStatsJob);
+        return;
+    }
+    c->started = metricsNow();
+    if(deadlineMs(PHASE_TOTAL) > 0){
+        timerArm(&c->loop->wheel, &c->totalTimer, deadlineMs(PHASE_TOTAL));
+    }
+    if(searchHostInFilter(h->host) == TRUE){
+        failConn(c, ERR_FORBIDDEN);
+        return;
+    }
+    c->state = CS_RESOLVING;
+    c->stageStart = metricsNow();
+    phaseStart(c, PHASE_DNS);
+    result = resolverLookup(h->host, &c->address, &onResolveDone, (void*)c);
+    if(result != RESOLVE_PENDING){  //answered from the cache
+        c->resolved = result == RESOLVE_FOUND ? TRUE : FALSE;
+        onResolved(c);
+    }
+}
+
+/**
+ * a deadline of c expired, on its loop thread: answer 408 or 504 if the client got nothing yet, otherwise close c.
+ * a connection a pool job owns is only shut down, it is closed once it is handed back
+ */
+static void onDeadline(struct Timer *t){
+    struct Conn *c = (struct Conn*)t->arg;
+    int phase = t == &c->totalTimer ? PHASE_TOTAL : c->phase;
+    if(c->expired != PHASE_NONE){
+        return;     //answered already, waiting for the pool
+    }
+    deadlineCount(phase);
+    switch (c->state) {
+        case CS_READ_HEADERS:
+            if(c->requestLen > 0){  //a partial head, a client that went quiet between requests is just closed
+                accessLogBegin(&c->h->entry, c->client_fd);
+                responseErr(ERR_REQUEST_TIMEOUT, c->client_fd, FALSE);
+                accessLogKeepStatus(&c->h->entry);
+            }
+            closeConn(c);
+            break;
+        case CS_RESOLVING:
+            responseErr(ERR_GATEWAY_TIMEOUT, c->client_fd, FALSE);
+            accessLogTakeStatus();  //the entry gets it in onWake, the lookup still owns c
+            c->expired = phase;
+            break;
+        case CS_OFFLOADED:
+            shutdown(c->client_fd, SHUT_RDWR);  //ends the writes of the job
+            c->expired = phase;
+            break;
+        case CS_CONNECTING:
+        case CS_SEND_REQUEST:
+        case CS_RELAY:
+            if(c->totalBytes == 0){
+                failConn(c, ERR_GATEWAY_TIMEOUT);
+                break;
+            }
+            closeConn(c);
+            break;
+        default:
+            closeConn(c);
+            break;
+    }
+}
+
+static void onAccept(struct EventLoop *loop){
+    while(loop->accepting == TRUE){
+        struct sockaddr_in peer;
+        socklen_t peerLen = sizeof(peer);
+        int fd = accept4(loop->listen_fd, (struct sockaddr*) &peer, &peerLen, SOCK_NONBLOCK);
+        if(fd < 0){
+            return;     //EAGAIN or an aborted connection, both wait for the next edge
+        }
+        int n = __atomic_add_fetch(&acceptedCount, 1, __ATOMIC_SEQ_CST);
+        if(n > maxAccepted){
+            close(fd);
+            return;
+        }
+        if(n == maxAccepted){
+            for (int i = 0; i < loopsNum; i++) {
+                wakeLoop(&loops[i]);
+            }
+        }
+        if(admissionShed(loop->tp) == TRUE){    //the pool is behind, its jobs would wait too long
+            refuseConnection(fd, ERR_OVERLOADED);
+            continue;
+        }
+        if(admissionEnter(fd, peer.sin_addr) == FALSE){
+            refuseConnection(fd, ERR_TOO_MANY);
+            continue;
+        }
+        struct Arena *arena = arenaTake();
+        struct Conn *c = arena != NULL ? (struct Conn*) arenaCalloc(arena, sizeof(struct Conn)) : NULL;
+        struct Headers *h = c != NULL ? (struct Headers*) arenaCalloc(arena, sizeof(struct Headers)) : NULL;
+        char *request = h != NULL ? (char*) arenaAlloc(arena, sizeof(char) * (config.headerLimit + 1)) : NULL;
+        if(request == NULL){
+            if(arena != NULL){
+                arenaGive(arena);
+            }
+            responseErr(ERR_SERVER, fd, FALSE);
+            admissionLeave(fd);
+            close(fd);
+            continue;
+        }
+        h->client_fd = -1;  //closed by closeConn
+        h->arena = arena;
+        h->request = request;
+        httpParserInit(&h->parser, FALSE, config.headerLimit);
+        c->loop = loop;
+        c->h = h;
+        c->arena = arena;
+        c->mark = arenaMark(arena);
+        c->state = CS_READ_HEADERS;
+        c->client_fd = fd;
+        c->server_fd = -1;
+        c->clientLive = TRUE;
+        c->clientWatch.kind = WATCH_CLIENT;
+        c->clientWatch.conn = c;
+        c->serverWatch.kind = WATCH_SERVER;
+        c->serverWatch.conn = c;
+        timerInit(&c->phaseTimer, &onDeadline, c);
+        timerInit(&c->totalTimer, &onDeadline, c);
+        c->expired = PHASE_NONE;
+        loop->live++;
+        phaseStart(c, PHASE_HEADER);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = &c->clientWatch;
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+            closeConn(c);
+        }
+    }
+}
+
+static void onWake(struct EventLoop *loop){
+    uint64_t count;
+    if(read(loop->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN){
+        perror("error: <sys_call>\n");
+    }
+    pthread_mutex_lock(&loop->doneLock);
+    struct Conn *c = loop->doneHead;
+    loop->doneHead = NULL;
+    pthread_mutex_unlock(&loop->doneLock);
+    while(c != NULL){
+        struct Conn *next = c->nextDone;
+        if(c->expired != PHASE_NONE){   //answered or shut down when its deadline expired
+            if(c->state == CS_RESOLVING){
+                c->h->entry.status = 504;   //written by onDeadline, the entry was the resolver's then
+            }
+            closeConn(c);
+        } else if(c->state == CS_RESOLVING){
+            onResolved(c);
+        } else{     //the cached file or the followed fetch was delivered
+            setNonBlocking(c->client_fd, TRUE);
+            nextRequest(c, c->h->keepAlive);
+        }
+        c = next;
+    }
+}
+
+static void onClientEvent(struct Conn *c, uint32_t events){
+    if(c->state == CS_RESOLVING || c->state == CS_OFFLOADED || c->state == CS_CLOSED){
+        return;     //owned by a pool job, or already closed in this round
+    }
+    if(events & (EPOLLERR | EPOLLHUP)){
+        closeConn(c);
+        return;
+    }
+    if(c->state == CS_READ_HEADERS && (events & EPOLLIN)){
+        onReadHeaders(c);
+    } else if(c->state == CS_RELAY && (events & EPOLLOUT)){
+        relay(c);
+    } else if(c->state == CS_SEND_MEMORY && (events & EPOLLOUT)){
+        sendMemory(c);
+    }
+}
+
+static void onServerEvent(struct Conn *c, uint32_t events){
+    switch (c->state) {
+        case CS_CONNECTING:
+            if(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)){
+                onConnected(c);
+            }
+            break;
+        case CS_SEND_REQUEST:
+            if(events & (EPOLLERR | EPOLLHUP)){
+                failConn(c, ERR_SERVER);
+            } else{
+                sendRequest(c);
+            }
+            break;
+        case CS_RELAY:
+            relay(c);
+            break;
+        default:
+            break;
+    }
+}
+
+
+static void *loopThread(void *arg){
+    struct EventLoop *loop = (struct EventLoop*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    if(loopsNum > 1){
+        pin_to_group_cpu(loop->group);
+    }
+    while(loop->accepting == TRUE || loop->live > 0){
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, timerWheelWait(&loop->wheel));
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("error: <sys_call>\n");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct Watch *w = (struct Watch*)events[i].data.ptr;
+            switch (w->kind) {
+                case WATCH_LISTEN:
+                    onAccept(loop);
+                    break;
+                case WATCH_WAKE:
+                    onWake(loop);
+                    break;
+                case WATCH_CLIENT:
+                    onClientEvent(w->conn, events[i].events);
+                    break;
+                case WATCH_SERVER:
+                    onServerEvent(w->conn, events[i].events);
+                    break;
+                default:
+                    break;
+            }
+        }
+        while(loop->readyHead != NULL){
+            struct Conn *c = loop->readyHead;
+            loop->readyHead = c->nextReady;
+            c->ready = FALSE;
+            if(c->state == CS_READ_HEADERS){
+                onReadHeaders(c);
+            }
+        }
+        timerWheelAdvance(&loop->wheel);    //before the closed connections are freed, an expiry may close one
+        while(loop->deadHead != NULL){
+            struct Conn *dead = loop->deadHead;
+            loop->deadHead = dead->nextDone;
+            arenaGive(dead->arena);     //dead lives in it
+        }
+        if(loop->accepting == TRUE && __atomic_load_n(&acceptedCount, __ATOMIC_SEQ_CST) >= maxAccepted){
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listen_fd, NULL);
+            close(loop->listen_fd);
+            loop->listen_fd = -1;
+            loop->accepting = FALSE;
+        }
+    }
+    return NULL;
+}
+
+int runEventLoops(threadpool *tp, int maxRequests, int port, int numLoops){
+    loops = (struct EventLoop*) calloc(numLoops, sizeof(struct EventLoop));
+    if(loops == NULL){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    loopsNum = numLoops;
+    acceptedCount = 0;
+    maxAccepted = maxRequests;
+    for (int i = 0; i < numLoops; i++) {
+        pthread_mutex_init(&loops[i].doneLock, NULL);
+        loops[i].epfd = -1;
+        loops[i].wakefd = -1;
+        loops[i].listen_fd = -1;
+    }
+    int started = 0;
+    for (; started < numLoops; started++) {
+        struct EventLoop *loop = &loops[started];
+        loop->tp = tp;
+        loop->group = started;
+        loop->accepting = TRUE;
+        timerWheelInit(&loop->wheel);
+        loop->listen_fd = openListenSocket(port, numLoops > 1);
+        if(loop->listen_fd < 0){
+            break;
+        }
+        loop->epfd = epoll_create1(0);
+        loop->wakefd = eventfd(0, EFD_NONBLOCK);
+        if(loop->epfd < 0 || loop->wakefd < 0 || setNonBlocking(loop->listen_fd, TRUE) < 0){
+            perror("error: <sys_call>\n");
+            break;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &listenWatch;
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listen_fd, &ev) < 0){
+            perror("error: <sys_call>\n");
+            break;
+        }
+        ev.data.ptr = &wakeWatch;
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) < 0){
+            perror("error: <sys_call>\n");
+            break;
+        }
+        if(pthread_create(&loop->thread, NULL, loopThread, (void*)loop) != 0){
+            perror("error: <sys_call>\n");
+            break;
+        }
+    }
+    if(started < numLoops){     //stop the loops that did start
+        __atomic_store_n(&acceptedCount, maxAccepted, __ATOMIC_SEQ_CST);
+        loopsNum = started;
+        for (int i = 0; i < started; i++) {
+            wakeLoop(&loops[i]);
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread, NULL);
+    }
+    for (int i = 0; i < numLoops; i++) {
+        if(loops[i].epfd >= 0){
+            close(loops[i].epfd);
+        }
+        if(loops[i].wakefd >= 0){
+            close(loops[i].wakefd);
+        }
+        if(loops[i].listen_fd >= 0){
+            close(loops[i].listen_fd);
+        }
+        pthread_mutex_destroy(&loops[i].doneLock);
+    }
+    free(loops);
+    loops = NULL;
+    return started == numLoops ? 0 : -1;
+}
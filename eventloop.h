@@ -0,0 +1,146 @@
+#ifndef PROXY_SERVER_EVENTLOOP_H
+#define PROXY_SERVER_EVENTLOOP_H
+
+#include <time.h>
+#include <pthread.h>
+#include "proxyServer.h"
+#include "framer.h"
+#include "memcache.h"
+#include "relay.h"
+#include "timerwheel.h"
+
+/**
+ * eventloop.h
+ *
+ * Non-blocking serving mode. Every loop thread owns an edge-triggered epoll
+ * instance and drives each client connection through a small state machine:
+ *
+ *   read headers -> host filter -> resolve -> address filter -> cache lookup -> connect -> relay
+ *        ^                                                            |                      |
+ *        |                                                            +-> send memory        |
+ *        |                                                                          |        |
+ *        +------------------------------ keep-alive --------------------------------+--------+
+ *
+ * A kept-alive connection goes back to reading headers, and a request the
+ * client pipelined behind the previous one is taken from the read buffer.
+ * Every loop keeps the deadlines of its connections on a timer wheel of its
+ * own (see timerwheel.h, deadline.h): one for the phase a connection is in,
+ * reading a request head, resolving, connecting, waiting for the first byte
+ * of the origin response or relaying without progress, and one for the whole
+ * request. An expired deadline answers 408 or 504 when nothing was sent yet
+ * and closes the connection otherwise.
+ *
+ * Origin bodies that pass through unchanged are spliced from the origin to
+ * the client and the cache file through a pipe pair (see relay.h).
+ *
+ * Memory cache hits are written straight from the loop. Only the pieces that
+ * cannot be done without blocking are handed to the threadpool (name
+ * resolution misses, delivering cached files from disk and following a fetch
+ * another connection leads, see inflight.h); the pool thread gives the
+ * connection back to its loop through the loop's wakeup eventfd.
+ */
+
+// maximum events taken from epoll_wait in one round
+#define MAX_EVENTS 256
+
+enum ConnState{
+    CS_READ_HEADERS,    //reading the client request until "\r\n\r\n", or waiting for the next one
+    CS_RESOLVING,       //waiting for the resolver callback
+    CS_CONNECTING,      //non-blocking connect to the origin in progress
+    CS_SEND_REQUEST,    //writing the constructed request to the origin
+    CS_RELAY,           //origin -> client (and cache file)
+    CS_SEND_MEMORY,     //writing a memory cache hit to the client
+    CS_OFFLOADED,       //owned by a threadpool job until it is handed back
+    CS_CLOSED           //closed, freed at the end of the epoll round
+};
+
+struct EventLoop;
+
+/**
+ * epoll_event.data.ptr of every registered fd, tells which fd of which connection became ready
+ */
+struct Watch{
+    int kind;
+    struct Conn *conn;
+};
+
+struct Conn{
+    struct EventLoop *loop;
+    enum ConnState state;
+    int client_fd;
+    int server_fd;
+    struct Watch clientWatch;
+    struct Watch serverWatch;
+    struct Headers *h;
+    struct Arena *arena;    //c, h and its read buffer live in it, per request memory after mark
+    struct ArenaMark mark;
+    size_t requestLen;  //bytes read from the client, pipelined requests included
+    int served;         //requests answered on this connection
+    struct in_addr address;
+    int resolved;       //TRUE if the resolver found the host
+    char *fullPath;     //request scoped, from the arena
+    char *constructedRequest;
+    size_t requestSent;
+    FILE *cacheFile;    //temporary file of the fetch this connection leads
+    struct Fetch *fetch;    //of a cache miss, led or followed
+    int fetchLeader;    //TRUE if this connection fetches the object for the followers
+    struct Framer *framer;  //finds the end of the origin response, request scoped
+    int reused;         //TRUE if server_fd came from the upstream pool
+    int extraBytes;     //TRUE if the origin sent more than the response, or closed the connection
+    int clientLive;     //FALSE once writing to the client failed, the cache file is still filled
+    struct CachedFile *file;    //disk cache hit given to the pool
+    struct CachedFile *stale;   //stale copy the origin request revalidates
+    struct MemObject *memObj;   //memory cache hit being written
+    long memAge;        //of memObj, sent with every part of its response
+    size_t memSent;
+    char *relayBuf;     //config.relayBuffer bytes, request scoped, allocated on the first buffered relay
+    struct RelayPipe *pipe;     //pipes of a spliced relay
+    char *clientHead;   //FRAMER_CLIENT_HEAD_MAX bytes allocated with relayBuf, the origin's head as the client gets it
+    size_t clientHeadLen;   //of clientHead, set when the head ends in relayBuf
+    size_t clientHeadOff;   //bytes of clientHead written
+    int triedSplice;    //TRUE once this response chose between splice and the buffered relay
+    size_t relayLen;
+    size_t relayOff;
+    long totalBytes;
+    long long started;  //metricsNow when the request head was parsed, 0 once its total time was recorded
+    long long originStart;  //when the origin exchange began
+    long long stageStart;   //when the stage being timed began: the lookup, the connect or the wait for the first byte
+    int statsFormat;    //of a request for the stats
+    struct Timer phaseTimer;    //deadline of the phase the connection is in, on the loop's wheel
+    struct Timer totalTimer;    //deadline of the whole request
+    int phase;          //PHASE_* of phaseTimer
+    int expired;        //PHASE_* of a deadline that expired while a pool job owned the connection, PHASE_NONE if none did
+    int ready;          //TRUE while on the loop's ready list
+    struct Conn *nextReady;
+    struct Conn *nextDone;
+};
+
+struct EventLoop{
+    int epfd;
+    int wakefd;
+    int listen_fd;      //SO_REUSEPORT socket of this loop
+    int group;          //pool group of the offloaded jobs, also picks the cpu the loop is pinned to
+    int accepting;
+    int live;           //connections owned by this loop
+    threadpool *tp;
+    pthread_t thread;
+    pthread_mutex_t doneLock;
+    struct Conn *doneHead;  //connections handed back by pool jobs
+    struct Conn *deadHead;  //connections closed in the current round
+    struct Conn *readyHead; //kept-alive connections to read the next request of after the round
+    struct TimerWheel wheel;    //deadlines of its connections
+};
+
+/**
+ * runEventLoops starts numLoops loop threads, each pinned to its own cpu with its own
+ * SO_REUSEPORT listening socket on port, and returns after maxRequests connections were accepted and all of them finished.
+ * @param tp - pool used for the blocking pieces of a request
+ * @param maxRequests
+ * @param port
+ * @param numLoops
+ * @return 0 - on success
+ *         -1 - on error before the loops started
+ */
+int runEventLoops(threadpool *tp, int maxRequests, int port, int numLoops);
+
+#endif //PROXY_SERVER_EVENTLOOP_H
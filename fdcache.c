@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "proxyServer.h"
+#include "fdcache.h"
+#include "arena.h"
+
+static struct FdShard shards[FDCACHE_SHARDS];
+static struct FdCacheStats stats;
+static int shardCapacity;
+
+static unsigned hashPath(const char *path){
+    unsigned h = 2166136261u;   //FNV-1a
+    for (; *path != '\0'; path++) {
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    }
+    return h;
+}
+
+static struct CachedFile **bucketOf(struct FdShard *shard, unsigned hash){
+    return &shard->buckets[(hash / FDCACHE_SHARDS) % FDCACHE_BUCKETS];
+}
+
+static struct CachedFile *findLocked(struct FdShard *shard, const char *path, unsigned hash){
+    struct CachedFile *file = *bucketOf(shard, hash);
+    while(file != NULL && (file->hash != hash || strcmp(file->path, path) != 0)){
+        file = file->hashNext;
+    }
+    return file;
+}
+
+static void listRemove(struct FdShard *shard, struct CachedFile *file){
+    if(file->prev != NULL){
+        file->prev->next = file->next;
+    } else{
+        shard->head = file->next;
+    }
+    if(file->next != NULL){
+        file->next->prev = file->prev;
+    } else{
+        shard->tail = file->prev;
+    }
+    file->prev = NULL;
+    file->next = NULL;
+}
+
+static void listPush(struct FdShard *shard, struct CachedFile *file){
+    file->prev = NULL;
+    file->next = shard->head;
+    if(shard->head != NULL){
+        shard->head->prev = file;
+    } else{
+        shard->tail = file;
+    }
+    shard->head = file;
+}
+
+/**
+ * remove file from the table and drop the table's reference, the shard lock must be held
+ */
+static void unlinkLocked(struct FdShard *shard, struct CachedFile *file){
+    struct CachedFile **pp = bucketOf(shard, file->hash);
+    while(*pp != file){
+        pp = &(*pp)->hashNext;
+    }
+    *pp = file->hashNext;
+    listRemove(shard, file);
+    file->linked = FALSE;
+    shard->count--;
+    __atomic_sub_fetch(&stats.open, 1, __ATOMIC_RELAXED);
+    fdCacheRelease(file);
+}
+
+void fdCacheInit(int capacity){
+    memset(&stats, 0, sizeof(stats));
+    shardCapacity = capacity > 0 ? (capacity + FDCACHE_SHARDS - 1) / FDCACHE_SHARDS : 0;
+    for (int i = 0; i < FDCACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+        shards[i].head = NULL;
+        shards[i].tail = NULL;
+        shards[i].count = 0;
+    }
+}
+
+struct CachedFile *fdCacheOpen(const char *path){
+    unsigned hash = hashPath(path);
+    struct FdShard *shard = &shards[hash % FDCACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    struct CachedFile *file = findLocked(shard, path, hash);
+    if(file != NULL){
+        listRemove(shard, file);
+        listPush(shard, file);
+        __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&shard->lock);
+        __atomic_add_fetch(&stats.hits, 1, __ATOMIC_RELAXED);
+        return file;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    struct stat sb;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return NULL;
+    }
+    if(fstat(fd, &sb) < 0 || S_ISREG(sb.st_mode) == 0){
+        close(fd);
+        return NULL;
+    }
+    size_t headLen = 0;
+    char *head = freshnessRead(fd, &headLen);
+    file = head != NULL ? (struct CachedFile*) calloc(1, sizeof(struct CachedFile)) : NULL;
+    if(file == NULL || (file->path = strdup(path)) == NULL
+            || freshnessLoad(head, headLen, sb.st_mtime, &file->fresh, &file->served) == -1){
+        if(file != NULL){
+            free(file->path);
+        }
+        free(file);
+        free(head);
+        close(fd);
+        return NULL;
+    }
+    arenaCountHeap(3);     //the entry, its path and its head outlive the request
+    file->hash = hash;
+    file->fd = fd;
+    file->size = sb.st_size;
+    file->head = head;
+    file->body = (off_t)headLen;
+    file->refs = 1;
+    __atomic_add_fetch(&stats.opens, 1, __ATOMIC_RELAXED);
+    if(shardCapacity == 0){
+        return file;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    struct CachedFile *raced = findLocked(shard, path, hash);
+    if(raced != NULL){      //another thread opened it meanwhile, use the table's descriptor
+        listRemove(shard, raced);
+        listPush(shard, raced);
+        __atomic_add_fetch(&raced->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&shard->lock);
+        fdCacheRelease(file);
+        return raced;
+    }
+    while(shard->count >= shardCapacity){
+        unlinkLocked(shard, shard->tail);
+        __atomic_add_fetch(&stats.evictions, 1, __ATOMIC_RELAXED);
+    }
+    struct CachedFile **bucket = bucketOf(shard, hash);
+    file->hashNext = *bucket;
+    *bucket = file;
+    listPush(shard, file);
+    file->linked = TRUE;
+    file->refs++;
+    shard->count++;
+    __atomic_add_fetch(&stats.open, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+    return file;
+}
+
+void fdCacheRelease(struct CachedFile *file){
+    if(__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        close(file->fd);
+        free(file->head);
+        free(file->path);
+        free(file);
+    }
+}
+
+void fdCacheForget(const char *path){
+    if(shardCapacity == 0){
+        return;
+    }
+    unsigned hash = hashPath(path);
+    struct FdShard *shard = &shards[hash % FDCACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    struct CachedFile *file = findLocked(shard, path, hash);
+    if(file != NULL){
+        unlinkLocked(shard, file);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void fdCacheGetStats(struct FdCacheStats *out){
+    out->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+    out->opens = __atomic_load_n(&stats.opens, __ATOMIC_RELAXED);
+    out->evictions = __atomic_load_n(&stats.evictions, __ATOMIC_RELAXED);
+    out->open = __atomic_load_n(&stats.open, __ATOMIC_RELAXED);
+}
+
+void fdCacheDestroy(){
+    for (int i = 0; i < FDCACHE_SHARDS; i++) {
+        while(shards[i].tail != NULL){
+            unlinkLocked(&shards[i], shards[i].tail);
+        }
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef PROXY_SERVER_FDCACHE_H
+#define PROXY_SERVER_FDCACHE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "freshness.h"
+
+/**
+ * fdcache.h
+ *
+ * Table of open cache file descriptors and their sizes, keyed by the cache
+ * path, so a hit on a hot file skips open and stat. The table is split
+ * into shards with their own lock and least recently used order; a shard
+ * that is full closes its least recently used descriptor.
+ *
+ * Descriptors are shared between the requests that serve the same file,
+ * so they are only read with explicit offsets (pread, sendfile with an
+ * offset pointer) and never moved. A path whose file is rewritten is
+ * dropped with fdCacheForget.
+ *
+ * The stored head a cache file starts with is read and parsed when the file
+ * is opened, so a hit on an open file neither reads nor parses it again.
+ */
+
+#define FDCACHE_SHARDS 16
+#define FDCACHE_BUCKETS 256         //buckets per shard
+#define FDCACHE_DEFAULT_CAPACITY 512
+
+struct CachedFile{
+    char *path;
+    unsigned hash;
+    int fd;
+    off_t size;
+    char *head;     //stored head the file starts with, see freshness.h
+    size_t served;  //bytes of head sent with the body, up to its Age field
+    off_t body;     //where the body starts, the length of head
+    struct Freshness fresh;
+    int refs;       //the table holds one while the entry is linked
+    int linked;
+    struct CachedFile *hashNext;
+    struct CachedFile *prev;    //towards the most recently used
+    struct CachedFile *next;
+};
+
+struct FdShard{
+    pthread_mutex_t lock;
+    struct CachedFile *buckets[FDCACHE_BUCKETS];
+    struct CachedFile *head;    //most recently used
+    struct CachedFile *tail;
+    int count;
+};
+
+struct FdCacheStats{
+    long hits;
+    long opens;
+    long evictions;
+    long open;      //descriptors held by the table
+};
+
+/**
+ * @param capacity - descriptors kept open, 0 opens the file for every hit
+ */
+void fdCacheInit(int capacity);
+
+/**
+ * get the open descriptor of the regular file at path, opening it on a table miss
+ * @param path
+ * @return the entry, to be given to fdCacheRelease, NULL if there is no such regular file
+ *         or it does not start with a stored head
+ */
+struct CachedFile *fdCacheOpen(const char *path);
+
+/**
+ * drop a reference taken by fdCacheOpen, the descriptor is closed once nothing uses it
+ */
+void fdCacheRelease(struct CachedFile *file);
+
+/**
+ * drop the entry of path, called when its file is created, rewritten or removed
+ * @param path
+ */
+void fdCacheForget(const char *path);
+
+void fdCacheGetStats(struct FdCacheStats *stats);
+
+/**
+ * close every descriptor, no references may be left
+ */
+void fdCacheDestroy();
+
+#endif //PROXY_SERVER_FDCACHE_H
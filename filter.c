@@ -0,0 +1,596 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+#include "proxyServer.h"
+#include "filter.h"
+
+static filters *current;
+static unsigned long epoch = 1;
+static struct FilterReader *readers;    //every thread that ever read, records are never freed
+static __thread struct FilterReader *self;
+static unsigned long sharedReaders;     //readers without a record of their own
+static pthread_mutex_t publishLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t watcher;
+static int watching;
+static int stopfd = -1;
+static char *watchedPath;
+
+static unsigned hashFolded(const char *s, size_t len){
+    unsigned h = 2166136261u;   //FNV-1a over the lower case bytes
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)tolower((unsigned char)s[i])) * 16777619u;
+    }
+    return h;
+}
+
+static char *lowerCopy(const char *s, size_t len){
+    char *copy = (char*) malloc(len + 1);
+    if(copy == NULL){
+        return NULL;
+    }
+    for (size_t i = 0; i < len; i++) {
+        copy[i] = (char)tolower((unsigned char)s[i]);
+    }
+    copy[len] = '\0';
+    return copy;
+}
+
+/* ---------- exact hosts ---------- */
+
+static int hostSetGrow(struct HostSet *set){
+    size_t capacity = set->capacity == 0 ? 64 : set->capacity * 2;
+    char **slots = (char**) calloc(capacity, sizeof(char*));
+    if(slots == NULL){
+        return -1;
+    }
+    for (size_t i = 0; i < set->capacity; i++) {
+        char *host = set->slots[i];
+        if(host == NULL){
+            continue;
+        }
+        size_t at = hashFolded(host, strlen(host)) & (capacity - 1);
+        while(slots[at] != NULL){
+            at = (at + 1) & (capacity - 1);
+        }
+        slots[at] = host;
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+    return 0;
+}
+
+/**
+ * @return 1 if added, 0 if host was already there, -1 if memory ran out
+ */
+static int hostSetAdd(struct HostSet *set, const char *host, size_t len){
+    if((set->count + 1) * 2 > set->capacity && hostSetGrow(set) == -1){     //keep the load under a half
+        return -1;
+    }
+    size_t at = hashFolded(host, len) & (set->capacity - 1);
+    while(set->slots[at] != NULL){
+        if(strncasecmp(set->slots[at], host, len) == 0 && set->slots[at][len] == '\0'){
+            return 0;
+        }
+        at = (at + 1) & (set->capacity - 1);
+    }
+    if((set->slots[at] = lowerCopy(host, len)) == NULL){
+        return -1;
+    }
+    set->count++;
+    return 1;
+}
+
+static int hostSetHas(struct HostSet *set, const char *host, size_t len){
+    if(set->count == 0){
+        return FALSE;
+    }
+    size_t at = hashFolded(host, len) & (set->capacity - 1);
+    while(set->slots[at] != NULL){
+        if(strncasecmp(set->slots[at], host, len) == 0 && set->slots[at][len] == '\0'){
+            return TRUE;
+        }
+        at = (at + 1) & (set->capacity - 1);
+    }
+    return FALSE;
+}
+
+/* ---------- wildcard domains ---------- */
+
+static struct LabelNode **childSlot(struct LabelNode *node, const char *label, size_t len){
+    size_t at = hashFolded(label, len) & (node->childCapacity - 1);
+    while(node->children[at] != NULL){
+        struct LabelNode *child = node->children[at];
+        if(child->labelLen == len && strncasecmp(child->label, label, len) == 0){
+            break;
+        }
+        at = (at + 1) & (node->childCapacity - 1);
+    }
+    return &node->children[at];
+}
+
+static struct LabelNode *findChild(struct LabelNode *node, const char *label, size_t len){
+    if(node->childCount == 0){
+        return NULL;
+    }
+    return *childSlot(node, label, len);
+}
+
+static int growChildren(struct LabelNode *node){
+    size_t capacity = node->childCapacity == 0 ? 4 : node->childCapacity * 2;
+    struct LabelNode **old = node->children;
+    size_t oldCapacity = node->childCapacity;
+    node->children = (struct LabelNode**) calloc(capacity, sizeof(struct LabelNode*));
+    if(node->children == NULL){
+        node->children = old;
+        return -1;
+    }
+    node->childCapacity = capacity;
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if(old[i] != NULL){
+            *childSlot(node, old[i]->label, old[i]->labelLen) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static struct LabelNode *addChild(struct LabelNode *node, const char *label, size_t len){
+    struct LabelNode *child = findChild(node, label, len);
+    if(child != NULL){
+        return child;
+    }
+    if((node->childCount + 1) * 2 > node->childCapacity && growChildren(node) == -1){
+        return NULL;
+    }
+    child = (struct LabelNode*) calloc(1, sizeof(struct LabelNode));
+    if(child == NULL || (child->label = lowerCopy(label, len)) == NULL){
+        free(child);
+        return NULL;
+    }
+    child->labelLen = len;
+    *childSlot(node, label, len) = child;
+    node->childCount++;
+    return child;
+}
+
+/**
+ * add the rule "*.domain", labels are inserted from the right
+ * @return 1 if added, 0 if it was already there, -1 if memory ran out
+ */
+static int addWildcard(struct LabelNode *root, const char *domain, size_t len){
+    struct LabelNode *node = root;
+    size_t end = len;
+    while(end > 0){
+        const char *dot = memrchr(domain, '.', end);
+        size_t start = dot == NULL ? 0 : (size_t)(dot - domain) + 1;
+        if((node = addChild(node, domain + start, end - start)) == NULL){
+            return -1;
+        }
+        end = dot == NULL ? 0 : start - 1;
+    }
+    if(node->wildcard == TRUE){
+        return 0;
+    }
+    node->wildcard = TRUE;
+    return 1;
+}
+
+/**
+ * @return TRUE if a suffix of host, with at least one label left of it, is a wildcard rule
+ */
+static int matchWildcard(struct LabelNode *root, const char *host, size_t len){
+    struct LabelNode *node = root;
+    size_t end = len;
+    while(node->childCount > 0){
+        const char *dot = memrchr(host, '.', end);
+        size_t start = dot == NULL ? 0 : (size_t)(dot - host) + 1;
+        if((node = findChild(node, host + start, end - start)) == NULL || dot == NULL){
+            return FALSE;
+        }
+        if(node->wildcard == TRUE){
+            return TRUE;
+        }
+        end = start - 1;
+    }
+    return FALSE;
+}
+
+static void freeLabels(struct LabelNode *node){
+    for (size_t i = 0; i < node->childCapacity; i++) {
+        if(node->children[i] != NULL){
+            freeLabels(node->children[i]);
+            free(node->children[i]);
+        }
+    }
+    free(node->children);
+    free(node->label);
+}
+
+/* ---------- address ranges ---------- */
+
+static uint32_t prefixMask(int length){
+    return length == 0 ? 0 : 0xFFFFFFFFu << (32 - length);
+}
+
+static int prefixBit(uint32_t prefix, int index){
+    return (int)((prefix >> (31 - index)) & 1u);
+}
+
+static struct PrefixNode *newPrefix(uint32_t prefix, int length, int terminal){
+    struct PrefixNode *node = (struct PrefixNode*) calloc(1, sizeof(struct PrefixNode));
+    if(node != NULL){
+        node->prefix = prefix & prefixMask(length);
+        node->length = length;
+        node->terminal = terminal;
+    }
+    return node;
+}
+
+/**
+ * add the range prefix/length, a node whose prefix only partly matches is split at the common bits
+ * @return 1 if added, 0 if it was already there, -1 if memory ran out
+ */
+static int addRange(struct PrefixNode **root, uint32_t prefix, int length){
+    prefix &= prefixMask(length);
+    struct PrefixNode **pp = root;
+    while(*pp != NULL){
+        struct PrefixNode *node = *pp;
+        int shorter = node->length < length ? node->length : length;
+        uint32_t diff = (node->prefix ^ prefix) & prefixMask(shorter);
+        int common = diff == 0 ? shorter : __builtin_clz(diff);
+        if(common == node->length){     //node covers the new range, go down
+            if(length == node->length){
+                if(node->terminal == TRUE){
+                    return 0;
+                }
+                node->terminal = TRUE;
+                return 1;
+            }
+            pp = &node->child[prefixBit(prefix, node->length)];
+            continue;
+        }
+        struct PrefixNode *split = newPrefix(prefix, common, common == length);
+        if(split == NULL){
+            return -1;
+        }
+        split->child[prefixBit(node->prefix, common)] = node;
+        if(common < length && (split->child[prefixBit(prefix, common)] = newPrefix(prefix, length, TRUE)) == NULL){
+            free(split);
+            return -1;
+        }
+        *pp = split;
+        return 1;
+    }
+    return (*pp = newPrefix(prefix, length, TRUE)) == NULL ? -1 : 1;
+}
+
+static int matchRange(struct PrefixNode *node, uint32_t address){
+    while(node != NULL){
+        if(((address ^ node->prefix) & prefixMask(node->length)) != 0){
+            return FALSE;
+        }
+        if(node->terminal == TRUE){     //the shortest covering range is enough
+            return TRUE;
+        }
+        if(node->length == 32){
+            return FALSE;
+        }
+        node = node->child[prefixBit(address, node->length)];
+    }
+    return FALSE;
+}
+
+static void freeRanges(struct PrefixNode *node){
+    if(node != NULL){
+        freeRanges(node->child[0]);
+        freeRanges(node->child[1]);
+        free(node);
+    }
+}
+
+/**
+ * parse "a.b.c.d" or "a.b.c.d/n"
+ * @return 0, -1 if the rule is malformed
+ */
+static int parseRange(const char *rule, uint32_t *prefix, int *length){
+    unsigned c[4];
+    int bits = 32, used = 0;
+    int scanned = sscanf(rule, "%3u.%3u.%3u.%3u%n/%d%n", &c[0], &c[1], &c[2], &c[3], &used, &bits, &used);
+    if(scanned < 4 || rule[used] != '\0' || bits < 0 || bits > 32
+       || c[0] > 255 || c[1] > 255 || c[2] > 255 || c[3] > 255){
+        return -1;
+    }
+    *prefix = (c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
+    *length = bits;
+    return 0;
+}
+
+/* ---------- compile and match ---------- */
+
+/**
+ * add one trimmed line of the filter file
+ * @return 0, -1 if memory ran out
+ */
+static int addRule(filters *flt, const char *rule, size_t len){
+    int added;
+    uint32_t prefix;
+    int length;
+    if(*rule >= '0' && *rule <= '9' && parseRange(rule, &prefix, &length) == 0){   //else a host like 1password.com
+        added = addRange(&flt->ranges, prefix, length);
+        flt->rangeRules += added > 0;
+    } else if(len > 2 && rule[0] == '*' && rule[1] == '.'){
+        added = addWildcard(&flt->wildcards, rule + 2, len - 2);
+        flt->wildcardRules += added > 0;
+    } else{
+        added = hostSetAdd(&flt->hosts, rule, len);
+        flt->hostRules += added > 0;
+    }
+    return added < 0 ? -1 : 0;
+}
+
+filters *filterCompile(const char *path){
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL){
+        perror("error: <sys_call>\n");
+        return NULL;
+    }
+    filters *flt = (filters*) calloc(1, sizeof(filters));
+    if(flt == NULL){
+        perror("error: <sys_call>\n");
+        fclose(fp);
+        return NULL;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t read;
+    while((read = getline(&line, &cap, fp)) != -1){
+        char *rule = line;
+        size_t len = (size_t)read;
+        while(len > 0 && isspace((unsigned char)rule[len - 1])){
+            len--;
+        }
+        while(len > 0 && isspace((unsigned char)*rule)){
+            rule++;
+            len--;
+        }
+        if(len == 0 || *rule == '#'){
+            continue;
+        }
+        rule[len] = '\0';
+        if(addRule(flt, rule, len) == -1){
+            perror("error: <sys_call>\n");
+            free(line);
+            fclose(fp);
+            filterFree(flt);
+            return NULL;
+        }
+    }
+    free(line);
+    fclose(fp);
+    return flt;
+}
+
+int filterHost(filters *flt, const char *host){
+    size_t len = strlen(host);
+    return hostSetHas(&flt->hosts, host, len) || matchWildcard(&flt->wildcards, host, len);
+}
+
+int filterAddress(filters *flt, struct in_addr address){
+    return matchRange(flt->ranges, ntohl(address.s_addr));
+}
+
+void filterFree(filters *flt){
+    if(flt == NULL){
+        return;
+    }
+    for (size_t i = 0; i < flt->hosts.capacity; i++) {
+        free(flt->hosts.slots[i]);
+    }
+    free(flt->hosts.slots);
+    freeLabels(&flt->wildcards);
+    freeRanges(flt->ranges);
+    free(flt);
+}
+
+/* ---------- publication ---------- */
+
+static struct FilterReader *registerReader(){
+    struct FilterReader *r = (struct FilterReader*) calloc(1, sizeof(struct FilterReader));
+    if(r == NULL){
+        return NULL;
+    }
+    r->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&readers, &r->next, r, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return r;
+}
+
+filters *filterReadBegin(){
+    if(self == NULL){
+        self = registerReader();
+    }
+    if(self == NULL){   //out of memory, announce the lookup through the shared count
+        __atomic_add_fetch(&sharedReaders, 1, __ATOMIC_SEQ_CST);
+    } else{
+        __atomic_store_n(&self->epoch, __atomic_load_n(&epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    }
+    return __atomic_load_n(&current, __ATOMIC_SEQ_CST);    //ordered after the announcement, see filterPublish
+}
+
+void filterReadEnd(){
+    if(self == NULL){
+        __atomic_sub_fetch(&sharedReaders, 1, __ATOMIC_RELEASE);
+    } else{
+        __atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void filterPublish(filters *next){
+    pthread_mutex_lock(&publishLock);
+    filters *old = __atomic_exchange_n(&current, next, __ATOMIC_SEQ_CST);
+    unsigned long now = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+    //a reader that announced itself before the swap may hold old, one that did not will load next
+    struct FilterReader *r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE);
+    for (; r != NULL; r = r->next) {
+        unsigned long seen;
+        while((seen = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST)) != 0 && seen < now){
+            sched_yield();
+        }
+    }
+    while(__atomic_load_n(&sharedReaders, __ATOMIC_SEQ_CST) != 0){
+        sched_yield();
+    }
+    pthread_mutex_unlock(&publishLock);
+    filterFree(old);
+}
+
+/* ---------- reload ---------- */
+
+static void reload(const char *reason){
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    filters *next = filterCompile(watchedPath);
+    if(next == NULL){
+        printf("Filter reload on %s failed, the previous rules stay\n", reason);
+        return;
+    }
+    filterPublish(next);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (double)(end.tv_sec - start.tv_sec) * 1000.0 + (double)(end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("Filter reloaded on %s in %.3f ms: %ld hosts, %ld wildcard domains, %ld address ranges\n",
+           reason, ms, next->hostRules, next->wildcardRules, next->rangeRules);
+    fflush(stdout);
+}
+
+/**
+ * @return TRUE if the inotify events read from fd name the watched file
+ */
+static int fileChanged(int fd, const char *name){
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = FALSE;
+    ssize_t n;
+    while((n = read(fd, buf, sizeof(buf))) > 0){
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event *ev = (struct inotify_event*)p;
+            if(ev->len > 0 && strcmp(ev->name, name) == 0){
+                changed = TRUE;
+            }
+        }
+    }
+    return changed;
+}
+
+static void *watchLoop(void *arg){
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    int sigfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    //watch the directory, a deploy or an editor may replace the file by a rename
+    char *dir = strdup(watchedPath);
+    char *name = dir == NULL ? NULL : strrchr(dir, '/');
+    int inofd = -1;
+    if(dir != NULL){
+        if(name == NULL){
+            name = dir;
+        } else{
+            *name++ = '\0';
+        }
+        inofd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if(inofd >= 0 && inotify_add_watch(inofd, name == dir ? "." : (*dir == '\0' ? "/" : dir),
+                                           IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+            perror("error: <sys_call>\n");
+            close(inofd);
+            inofd = -1;
+        }
+    }
+
+    struct pollfd fds[3] = {{stopfd, POLLIN, 0}, {sigfd, POLLIN, 0}, {inofd, POLLIN, 0}};
+    while(TRUE){
+        if(poll(fds, 3, -1) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("error: <sys_call>\n");
+            break;
+        }
+        if(fds[0].revents != 0){
+            break;
+        }
+        int hup = FALSE;
+        if(fds[1].revents != 0){
+            struct signalfd_siginfo info;
+            while(read(sigfd, &info, sizeof(info)) == sizeof(info)){
+                hup = TRUE;
+            }
+        }
+        int changed = fds[2].revents != 0 && fileChanged(inofd, name);
+        if(hup == TRUE || changed == TRUE){     //one reload covers everything seen in this round
+            reload(hup == TRUE ? "SIGHUP" : "file change");
+        }
+    }
+    if(sigfd >= 0){
+        close(sigfd);
+    }
+    if(inofd >= 0){
+        close(inofd);
+    }
+    free(dir);
+    return NULL;
+}
+
+int filterWatch(const char *path){
+    if((watchedPath = strdup(path)) == NULL){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    if((stopfd = eventfd(0, EFD_CLOEXEC)) < 0){
+        perror("error: <sys_call>\n");
+        free(watchedPath);
+        watchedPath = NULL;
+        return -1;
+    }
+    if(pthread_create(&watcher, NULL, watchLoop, NULL) != 0){
+        perror("error: <sys_call>\n");
+        close(stopfd);
+        stopfd = -1;
+        free(watchedPath);
+        watchedPath = NULL;
+        return -1;
+    }
+    watching = TRUE;
+    return 0;
+}
+
+void filterUnwatch(){
+    if(watching == FALSE){
+        return;
+    }
+    uint64_t one = 1;
+    if(write(stopfd, &one, sizeof(one)) != sizeof(one)){
+        perror("error: <sys_call>\n");
+    }
+    pthread_join(watcher, NULL);
+    close(stopfd);
+    stopfd = -1;
+    free(watchedPath);
+    watchedPath = NULL;
+    watching = FALSE;
+}
@@ -0,0 +1,126 @@
+#ifndef PROXY_SERVER_FILTER_H
+#define PROXY_SERVER_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/**
+ * filter.h
+ *
+ * The filter file compiled once into lookup structures, one rule per line:
+ *
+ *   example.com        the host itself, case insensitive (hash set)
+ *   *.example.com      every subdomain of example.com (reversed-label trie)
+ *   10.0.0.0/8         an address range, a bare address is a /32 (Patricia trie)
+ *
+ * Empty lines and lines starting with '#' are skipped. Host lookups cost one
+ * hash of the host, wildcard lookups one trie step per label and address
+ * lookups at most one step per prefix bit, whatever the number of rules.
+ *
+ * The current filter is replaced while the proxy runs: SIGHUP, or a change of
+ * the file seen through inotify, makes a watcher thread compile the file again
+ * and publish the result with a pointer swap. Readers take no lock, they only
+ * announce the epoch they entered in; the previous filter is freed once every
+ * reader that may still hold it has left.
+ */
+
+/**
+ * open addressing set of lower case host names
+ */
+struct HostSet{
+    char **slots;
+    size_t capacity;    //power of two
+    size_t count;
+};
+
+/**
+ * node of the reversed-label trie: the root holds the top level labels, a node's
+ * children hold the labels to the left of it
+ */
+struct LabelNode{
+    char *label;        //lower case
+    size_t labelLen;
+    int wildcard;       //TRUE if "*." followed by the labels from here up to the root is a rule
+    struct LabelNode **children;    //open addressing table
+    size_t childCapacity;   //power of two, 0 when there are no children
+    size_t childCount;
+};
+
+/**
+ * node of the path compressed binary trie of address ranges, prefixes in host byte order
+ */
+struct PrefixNode{
+    uint32_t prefix;
+    int length;         //prefix bits, 0 - 32
+    int terminal;       //TRUE if prefix/length is a rule
+    struct PrefixNode *child[2];
+};
+
+/**
+ * a thread that reads the filter, epoch is 0 outside of a lookup
+ */
+struct FilterReader{
+    unsigned long epoch;
+    struct FilterReader *next;
+};
+
+typedef struct Filters{
+    struct HostSet hosts;
+    struct LabelNode wildcards;     //root, has no label
+    struct PrefixNode *ranges;
+    long hostRules;
+    long wildcardRules;
+    long rangeRules;
+}filters;
+
+/**
+ * compile the filter file at path
+ * @param path
+ * @return the compiled filter, NULL if the file can not be read or memory ran out
+ */
+filters *filterCompile(const char *path);
+
+/**
+ * @return TRUE if host matches a host or wildcard rule of flt
+ */
+int filterHost(filters *flt, const char *host);
+
+/**
+ * @return TRUE if address falls in an address range of flt
+ */
+int filterAddress(filters *flt, struct in_addr address);
+
+void filterFree(filters *flt);
+
+/**
+ * start a lookup on the current filter, never blocks
+ * @return the current filter, NULL if none was published. valid until filterReadEnd
+ */
+filters *filterReadBegin();
+
+/**
+ * end the lookup started by filterReadBegin in this thread
+ */
+void filterReadEnd();
+
+/**
+ * make next the current filter, wait until no reader can hold the previous one and free it
+ * @param next - NULL to remove the filter
+ */
+void filterPublish(filters *next);
+
+/**
+ * start the thread that compiles and publishes path again on SIGHUP or when the file changes.
+ * SIGHUP must be blocked in every thread of the process
+ * @param path
+ * @return 0, -1 if the thread could not be started
+ */
+int filterWatch(const char *path);
+
+/**
+ * stop the watcher thread
+ */
+void filterUnwatch();
+
+#endif //PROXY_SERVER_FILTER_H
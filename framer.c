@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "proxyServer.h"
+#include "framer.h"
+
+void framerInit(struct Framer *fr){
+    fr->state = FR_HEADERS;
+    fr->headLen = 0;
+    fr->head[0] = '\0';
+    httpParserInit(&fr->parser, TRUE, FRAMER_HEAD_MAX);
+    fr->status = 0;
+    fr->keepAlive = FALSE;
+    fr->headTaken = 0;
+    fr->contentLength = -1;
+    fr->remaining = 0;
+    fr->lineLen = 0;
+}
+
+int headerHasToken(const char *value, size_t len, const char *token){
+    size_t tokenLen = strlen(token);
+    for (size_t i = 0; i + tokenLen <= len; i++) {
+        if(strncasecmp(value + i, token, tokenLen) == 0){
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * the header block is complete, decide how the body is framed
+ * @return 0 - on success
+ *         -1 - on a malformed status line
+ */
+static int onHeaders(struct Framer *fr){
+    struct HttpParser *p = &fr->parser;
+    int major, minor;
+    char *end;
+    if(p->start[0].len != 8 || sscanf(p->start[0].data, "HTTP/%1d.%1d", &major, &minor) != 2){
+        return -1;
+    }
+    fr->status = (int)strtol(p->start[1].data, &end, 10);
+    if(end != p->start[1].data + 3 || fr->status < 100){
+        return -1;
+    }
+    const struct StrView *connection = httpField(p, "Connection");
+    if(major > 1 || (major == 1 && minor >= 1)){
+        fr->keepAlive = connection == NULL || headerHasToken(connection->data, connection->len, "close") == FALSE;
+    } else{
+        fr->keepAlive = connection != NULL && headerHasToken(connection->data, connection->len, "keep-alive") == TRUE;
+    }
+    if(fr->status == 101){  //the connection switches to another protocol
+        fr->keepAlive = FALSE;
+    }
+    if(fr->status / 100 == 1 || fr->status == 204 || fr->status == 304){
+        fr->state = FR_DONE;
+        return 0;
+    }
+    const struct StrView *te = httpField(p, "Transfer-Encoding");
+    if(te != NULL && headerHasToken(te->data, te->len, "chunked") == TRUE){
+        fr->state = FR_CHUNK_SIZE;
+        return 0;
+    }
+    const struct StrView *cl = httpField(p, "Content-Length");
+    if(cl != NULL){
+        fr->contentLength = strtoll(cl->data, &end, 10);
+        if(end != cl->data + cl->len || cl->len == 0 || fr->contentLength < 0){
+            return -1;
+        }
+        fr->remaining = fr->contentLength;
+        fr->state = fr->remaining == 0 ? FR_DONE : FR_LENGTH;
+        return 0;
+    }
+    fr->keepAlive = FALSE;
+    fr->state = FR_EOF;
+    return 0;
+}
+
+/**
+ * collect a CRLF terminated line into fr->line
+ * @return how many bytes were used, *complete tells if the line ended
+ */
+static size_t takeLine(struct Framer *fr, const char *buf, size_t len, int *complete){
+    const char *nl = memchr(buf, '\n', len);
+    size_t used = nl != NULL ? (size_t)(nl - buf) + 1 : len;
+    size_t copy = nl != NULL ? used - 1 : used;
+    if(fr->lineLen + copy > FRAMER_LINE_MAX){
+        copy = FRAMER_LINE_MAX - fr->lineLen;
+    }
+    memcpy(fr->line + fr->lineLen, buf, copy);
+    fr->lineLen += copy;
+    *complete = nl != NULL ? TRUE : FALSE;
+    if(*complete == TRUE){
+        if(fr->lineLen > 0 && fr->line[fr->lineLen - 1] == '\r'){
+            fr->lineLen--;
+        }
+        fr->line[fr->lineLen] = '\0';
+    }
+    return used;
+}
+
+long framerFeed(struct Framer *fr, const char *buf, size_t len, body_fn onBody, void *arg){
+    size_t off = 0;
+    fr->headTaken = 0;
+    while(off < len && fr->state != FR_DONE && fr->state != FR_ERROR){
+        const char *p = buf + off;
+        size_t left = len - off;
+        int complete;
+        switch (fr->state) {
+            case FR_HEADERS: {
+                size_t copy = left;
+                if(fr->headLen + copy > FRAMER_HEAD_MAX){
+                    copy = FRAMER_HEAD_MAX - fr->headLen;
+                }
+                memcpy(fr->head + fr->headLen, p, copy);
+                size_t before = fr->headLen;
+                fr->headLen += copy;
+                int result = httpParse(&fr->parser, fr->head, fr->headLen);
+                if(result == HP_INCOMPLETE){
+                    off += copy;
+                    fr->headTaken += copy;
+                    break;
+                }
+                if(result != HP_DONE){
+                    fr->state = FR_ERROR;
+                    return -1;
+                }
+                off += fr->parser.headLen - before;     //the bytes after the head belong to the body
+                fr->headTaken += fr->parser.headLen - before;
+                fr->headLen = fr->parser.headLen;
+                fr->head[fr->headLen] = '\0';
+                if(onHeaders(fr) == -1){
+                    fr->state = FR_ERROR;
+                    return -1;
+                }
+                if(fr->status / 100 == 1 && fr->status != 101){  //interim response, the real one follows
+                    size_t taken = fr->headTaken;
+                    framerInit(fr);
+                    fr->headTaken = taken;
+                }
+                break;
+            }
+            case FR_LENGTH:
+            case FR_CHUNK_DATA: {
+                size_t take = (long long)left < fr->remaining ? left : (size_t)fr->remaining;
+                onBody(arg, p, take);
+                fr->remaining -= (long long)take;
+                off += take;
+                if(fr->remaining == 0){
+                    fr->state = fr->state == FR_LENGTH ? FR_DONE : FR_CHUNK_END;
+                }
+                break;
+            }
+            case FR_CHUNK_SIZE: {
+                off += takeLine(fr, p, left, &complete);
+                if(complete == TRUE){
+                    char *end;
+                    fr->remaining = strtoll(fr->line, &end, 16);
+                    fr->lineLen = 0;
+                    if(end == fr->line || fr->remaining < 0){
+                        fr->state = FR_ERROR;
+                        return -1;
+                    }
+                    fr->state = fr->remaining == 0 ? FR_TRAILERS : FR_CHUNK_DATA;
+                }
+                break;
+            }
+            case FR_CHUNK_END:
+            case FR_TRAILERS: {
+                off += takeLine(fr, p, left, &complete);
+                if(complete == TRUE){
+                    int empty = fr->lineLen == 0;
+                    fr->lineLen = 0;
+                    if(fr->state == FR_CHUNK_END){
+                        if(empty == FALSE){
+                            fr->state = FR_ERROR;
+                            return -1;
+                        }
+                        fr->state = FR_CHUNK_SIZE;
+                    } else if(empty == TRUE){
+                        fr->state = FR_DONE;
+                    }
+                }
+                break;
+            }
+            case FR_EOF:
+                onBody(arg, p, left);
+                off = len;
+                break;
+            default:
+                break;
+        }
+    }
+    return (long)off;
+}
+
+int framerPassThrough(struct Framer *fr){
+    return fr->state == FR_LENGTH || fr->state == FR_EOF;
+}
+
+long long framerRemaining(struct Framer *fr){
+    return fr->state == FR_LENGTH ? fr->remaining : -1;
+}
+
+void framerSkip(struct Framer *fr, size_t len){
+    if(fr->state == FR_LENGTH){
+        fr->remaining -= (long long)len;
+        if(fr->remaining <= 0){
+            fr->state = FR_DONE;
+        }
+    }
+}
+
+int framerEof(struct Framer *fr){
+    if(fr->state == FR_EOF){
+        fr->state = FR_DONE;
+    }
+    return fr->state == FR_DONE;
+}
+
+int framerDone(struct Framer *fr){
+    return fr->state == FR_DONE;
+}
+
+int framerHaveHeaders(struct Framer *fr){
+    return fr->state != FR_HEADERS && fr->state != FR_ERROR;
+}
+
+/**
+ * @return TRUE for a field that only concerns the connection it came on
+ */
+static int isHopByHop(struct StrView name){
+    return viewEquals(name, "Connection") == TRUE || viewEquals(name, "Keep-Alive") == TRUE
+           || viewEquals(name, "Proxy-Connection") == TRUE;
+}
+
+size_t framerClientHead(const struct Framer *fr, int keepAlive, char *out){
+    const struct HttpParser *p = &fr->parser;
+    const char *end = fr->head + fr->headLen;
+    const char *line = p->start[0].data;
+    const char *next = memchr(line, '\n', (size_t)(end - line));
+    size_t len = (size_t)(next - line) + 1;
+    memcpy(out, line, len);
+    for (int i = 0; i < p->fieldCount; i++) {
+        line = p->fields[i].name.data;
+        next = memchr(line, '\n', (size_t)(end - line));
+        if(isHopByHop(p->fields[i].name) == FALSE){
+            memcpy(out + len, line, (size_t)(next - line) + 1);
+            len += (size_t)(next - line) + 1;
+        }
+    }
+    const char *connection = keepAlive == TRUE ? CONNECTION_KEEP_ALIVE : CONNECTION_CLOSE;
+    memcpy(out + len, connection, strlen(connection));
+    return len + strlen(connection);
+}
@@ -0,0 +1,118 @@
+#ifndef PROXY_SERVER_FRAMER_H
+#define PROXY_SERVER_FRAMER_H
+
+#include <stddef.h>
+#include "parser.h"
+
+/**
+ * framer.h
+ *
+ * Finds where an origin response ends without waiting for the origin to
+ * close the connection: by Content-Length, by chunked transfer-encoding, or
+ * by EOF when the response has neither. The body is handed out without the
+ * chunk framing so it can be stored in the cache as is.
+ */
+
+// longest response header block accepted
+#define FRAMER_HEAD_MAX 16384
+// longest head framerClientHead writes, with room for the proxy's Connection field
+#define FRAMER_CLIENT_HEAD_MAX (FRAMER_HEAD_MAX + 32)
+// longest chunk size or trailer line kept, longer lines are cut
+#define FRAMER_LINE_MAX 256
+
+enum FramerState{
+    FR_HEADERS,         //collecting the status line and headers
+    FR_LENGTH,          //body framed by Content-Length
+    FR_CHUNK_SIZE,      //reading a chunk size line
+    FR_CHUNK_DATA,      //inside a chunk
+    FR_CHUNK_END,       //CRLF after a chunk
+    FR_TRAILERS,        //trailer lines after the last chunk
+    FR_EOF,             //body ends when the origin closes
+    FR_DONE,
+    FR_ERROR
+};
+
+typedef void (*body_fn)(void *arg, const char *data, size_t len);
+
+struct Framer{
+    enum FramerState state;
+    char head[FRAMER_HEAD_MAX + 1];
+    size_t headLen;
+    struct HttpParser parser;   //of head
+    int status;
+    int keepAlive;      //TRUE if the origin allows another request on the connection
+    size_t headTaken;   //bytes of the last framerFeed that belonged to response heads, interim ones included
+    long long contentLength;    //-1 when the response has none
+    long long remaining;        //of the body or of the current chunk
+    char line[FRAMER_LINE_MAX + 1];
+    size_t lineLen;
+};
+
+/**
+ * prepare fr for a new response
+ */
+void framerInit(struct Framer *fr);
+
+/**
+ * feed bytes read from the origin
+ * @param fr
+ * @param buf
+ * @param len
+ * @param onBody - called with the body bytes, without chunk framing
+ * @param arg - passed to onBody
+ * @return how many bytes of buf belong to the response, -1 if the response is malformed
+ */
+long framerFeed(struct Framer *fr, const char *buf, size_t len, body_fn onBody, void *arg);
+
+/**
+ * @return TRUE if the rest of the body passes through unchanged (Content-Length or EOF framing),
+ *         so it may be moved without framerFeed and accounted with framerSkip
+ */
+int framerPassThrough(struct Framer *fr);
+
+/**
+ * @return bytes of a Content-Length body still expected, -1 if the body ends at EOF
+ */
+long long framerRemaining(struct Framer *fr);
+
+/**
+ * account body bytes that were moved without framerFeed, at most framerRemaining of them
+ */
+void framerSkip(struct Framer *fr, size_t len);
+
+/**
+ * tell the framer the origin closed the connection
+ * @return TRUE if the response is complete
+ */
+int framerEof(struct Framer *fr);
+
+/**
+ * @return TRUE once the whole response was fed
+ */
+int framerDone(struct Framer *fr);
+
+/**
+ * @return TRUE once the status line and headers were fed
+ */
+int framerHaveHeaders(struct Framer *fr);
+
+/**
+ * write the head of fr the way the client gets it: the origin's status line and fields without
+ * Connection, Keep-Alive and Proxy-Connection, which only concern the connection to the origin,
+ * followed by the proxy's own Connection field
+ * @param fr - a framer that has the headers
+ * @param keepAlive - TRUE if the client connection is kept open after this response
+ * @param out - FRAMER_CLIENT_HEAD_MAX bytes
+ * @return bytes written to out
+ */
+size_t framerClientHead(const struct Framer *fr, int keepAlive, char *out);
+
+/**
+ * @param value - header value
+ * @param len - its length
+ * @param token - matched case insensitive
+ * @return TRUE if token appears in the value
+ */
+int headerHasToken(const char *value, size_t len, const char *token);
+
+#endif //PROXY_SERVER_FRAMER_H
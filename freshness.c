@@ -0,0 +1,501 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "proxyServer.h"
+#include "freshness.h"
+
+static long defaultTtl = FRESHNESS_DEFAULT_TTL;
+static long defaultWindow;
+
+// fields that are not stored with a response
+static const char *unstored[] = {"Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding", "TE", "Trailer",
+                                 "Upgrade", "Proxy-Authenticate", "Content-Length", "Age"};
+// fields a 304 answer to a client repeats from the stored head
+static const char *notModifiedFields[] = {"Cache-Control", "Content-Location", "Date", "ETag", "Expires",
+                                          "Last-Modified", "Vary"};
+
+void freshnessInit(long ttl, long staleWindow){
+    defaultTtl = ttl;
+    defaultWindow = staleWindow;
+}
+
+static int isBlank(char c){
+    return c == ' ' || c == '\t';
+}
+
+/**
+ * @return the non-negative integer v holds, -1 if it holds anything else
+ */
+static long seconds(struct StrView v){
+    long n = 0;
+    if(v.len == 0){
+        return -1;
+    }
+    for (size_t i = 0; i < v.len; i++) {
+        if(v.data[i] < '0' || v.data[i] > '9'){
+            return -1;
+        }
+        if(n < 0x7fffffffL){    //larger values mean "forever" alike
+            n = n * 10 + (v.data[i] - '0');
+        }
+    }
+    return n;
+}
+
+static int statusOf(const struct HttpParser *p){
+    const char *s = p->start[1].data;
+    return (s[0] - '0') * 100 + (s[1] - '0') * 10 + (s[2] - '0');
+}
+
+/**
+ * @return TRUE if the comma separated list holds token, case insensitive
+ */
+static int listHas(struct StrView list, struct StrView token){
+    const char *s = list.data;
+    const char *end = list.data + list.len;
+    while(s < end){
+        while(s < end && (isBlank(*s) || *s == ',')){
+            s++;
+        }
+        const char *item = s;
+        while(s < end && *s != ','){
+            s++;
+        }
+        const char *itemEnd = s;
+        while(itemEnd > item && isBlank(itemEnd[-1])){
+            itemEnd--;
+        }
+        if((size_t)(itemEnd - item) == token.len && strncasecmp(item, token.data, token.len) == 0){
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * find a directive in the Cache-Control fields of a head
+ * @param p
+ * @param name
+ * @param arg - set to the argument of the directive without its quotes, may be NULL
+ * @return TRUE if the directive is there
+ */
+static int directive(const struct HttpParser *p, const char *name, struct StrView *arg){
+    size_t nameLen = strlen(name);
+    for (int i = 0; i < p->fieldCount; i++) {
+        if(viewEquals(p->fields[i].name, "Cache-Control") == FALSE){
+            continue;
+        }
+        const char *s = p->fields[i].value.data;
+        const char *end = s + p->fields[i].value.len;
+        while(s < end){
+            while(s < end && (isBlank(*s) || *s == ',')){
+                s++;
+            }
+            const char *token = s;
+            while(s < end && *s != ',' && *s != '=' && isBlank(*s) == FALSE){
+                s++;
+            }
+            size_t tokenLen = (size_t)(s - token);
+            while(s < end && isBlank(*s)){
+                s++;
+            }
+            struct StrView value = {s, 0};
+            if(s < end && *s == '='){
+                s++;
+                while(s < end && isBlank(*s)){
+                    s++;
+                }
+                if(s < end && *s == '"'){   //a quoted argument may hold commas
+                    value.data = ++s;
+                    while(s < end && *s != '"'){
+                        s++;
+                    }
+                    value.len = (size_t)(s - value.data);
+                } else{
+                    value.data = s;
+                    while(s < end && *s != ',' && isBlank(*s) == FALSE){
+                        s++;
+                    }
+                    value.len = (size_t)(s - value.data);
+                }
+            }
+            while(s < end && *s != ','){
+                s++;
+            }
+            if(tokenLen == nameLen && strncasecmp(token, name, nameLen) == 0){
+                if(arg != NULL){
+                    *arg = value;
+                }
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * @return TRUE if a response with status may get a heuristic lifetime
+ */
+static int heuristicStatus(int status){
+    switch (status) {
+        case 200: case 203: case 204: case 300: case 301: case 308:
+        case 404: case 405: case 410: case 414: case 501:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * @return TRUE if the field called name is stored with the response p
+ */
+static int isStored(const struct HttpParser *p, struct StrView name){
+    for (size_t i = 0; i < sizeof(unstored) / sizeof(unstored[0]); i++) {
+        if(viewEquals(name, unstored[i]) == TRUE){
+            return FALSE;
+        }
+    }
+    const struct StrView *connection = httpField(p, "Connection");     //fields it names are hop-by-hop too
+    return connection == NULL || listHas(*connection, name) == FALSE;
+}
+
+/**
+ * corrected initial age of a response, RFC 9111 section 4.2.3
+ */
+static long initialAge(const struct HttpParser *response, time_t requested, time_t received){
+    const struct StrView *dateField = httpField(response, "Date");
+    time_t date = dateField != NULL ? freshnessParseDate(dateField->data, dateField->len) : -1;
+    long apparent = date != -1 && received > date ? (long)(received - date) : 0;
+    const struct StrView *ageField = httpField(response, "Age");
+    long age = ageField != NULL ? seconds(*ageField) : 0;
+    long corrected = (age > 0 ? age : 0) + (received > requested ? (long)(received - requested) : 0);
+    return apparent > corrected ? apparent : corrected;
+}
+
+int freshnessStorable(const struct HttpParser *response, int status){
+    if(status < 200 || status == 206 || status == 304){     //ranges are not stored, a 304 only updates a copy
+        return FALSE;
+    }
+    if(directive(response, "no-store", NULL) == TRUE || directive(response, "private", NULL) == TRUE){
+        return FALSE;
+    }
+    const struct StrView *vary = httpField(response, "Vary");
+    struct StrView any = {"*", 1};
+    if(vary != NULL && listHas(*vary, any) == TRUE){
+        return FALSE;
+    }
+    if(httpField(response, "Expires") != NULL || directive(response, "max-age", NULL) == TRUE
+            || directive(response, "s-maxage", NULL) == TRUE || directive(response, "public", NULL) == TRUE){
+        return TRUE;
+    }
+    return heuristicStatus(status);
+}
+
+static long writeField(FILE *file, const struct HttpField *field){
+    int n = fprintf(file, "%.*s: %.*s\r\n", (int)field->name.len, field->name.data, (int)field->value.len, field->value.data);
+    return n < 0 ? -1 : n;
+}
+
+/**
+ * write a Vary field that names Accept-Encoding
+ * @param vary - the value the response has, NULL if it has none
+ */
+static long writeVary(FILE *file, const struct StrView *vary){
+    struct StrView coding = {"Accept-Encoding", strlen("Accept-Encoding")};
+    int n;
+    if(vary == NULL || vary->len == 0){
+        n = fprintf(file, "Vary: Accept-Encoding\r\n");
+    } else{
+        n = fprintf(file, "Vary: %.*s%s\r\n", (int)vary->len, vary->data, listHas(*vary, coding) == TRUE ? "" : ", Accept-Encoding");
+    }
+    return n < 0 ? -1 : n;
+}
+
+/**
+ * write a field of the stored head, a Vary names Accept-Encoding if varyEncoding is TRUE
+ * @param varied - set to TRUE once a Vary was written
+ */
+static long writeStored(FILE *file, const struct HttpField *field, int varyEncoding, int *varied){
+    if(varyEncoding == TRUE && viewEquals(field->name, "Vary") == TRUE){
+        *varied = TRUE;
+        return writeVary(file, &field->value);
+    }
+    return writeField(file, field);
+}
+
+long freshnessStore(FILE *file, const struct HttpParser *response, const struct HttpParser *stored,
+                    time_t requested, time_t received, int varyEncoding){
+    const struct HttpParser *first = stored != NULL ? stored : response;    //a 304 keeps the status of the copy
+    int fields = 0;
+    int varied = FALSE;
+    long n;
+    long len = fprintf(file, "%.*s %.*s %.*s\r\n", (int)first->start[0].len, first->start[0].data,
+                       (int)first->start[1].len, first->start[1].data, (int)first->start[2].len, first->start[2].data);
+    if(len < 0){
+        return -1;
+    }
+    for (int i = 0; stored != NULL && i < stored->fieldCount; i++) {
+        const struct HttpField *field = &stored->fields[i];
+        int replaced = FALSE;   //by a field of the same name the 304 carries
+        for (int j = 0; j < response->fieldCount && replaced == FALSE; j++) {
+            replaced = response->fields[j].name.len == field->name.len
+                       && strncasecmp(response->fields[j].name.data, field->name.data, field->name.len) == 0
+                       && isStored(response, field->name) == TRUE;
+        }
+        if(isStored(stored, field->name) == FALSE || replaced == TRUE){
+            continue;
+        }
+        if((n = writeStored(file, field, varyEncoding, &varied)) < 0){
+            return -1;
+        }
+        len += n;
+        fields++;
+    }
+    for (int i = 0; i < response->fieldCount; i++) {
+        if(isStored(response, response->fields[i].name) == FALSE){
+            continue;
+        }
+        if((n = writeStored(file, &response->fields[i], varyEncoding, &varied)) < 0){
+            return -1;
+        }
+        len += n;
+        fields++;
+    }
+    if(varyEncoding == TRUE && varied == FALSE){
+        if((n = writeVary(file, NULL)) < 0){
+            return -1;
+        }
+        len += n;
+        fields++;
+    }
+    if(fields >= HTTP_MAX_FIELDS){  //the Age field would not fit into a parsed head
+        return -1;
+    }
+    n = fprintf(file, "Age: %ld\r\n\r\n", initialAge(response, requested, received));
+    if(n < 0 || len + n > FRESHNESS_HEAD_MAX){
+        return -1;
+    }
+    return len + n;
+}
+
+char *freshnessRead(int fd, size_t *len){
+    char *head = (char*) malloc(FRESHNESS_HEAD_MAX);
+    if(head == NULL){
+        return NULL;
+    }
+    ssize_t nread = pread(fd, head, FRESHNESS_HEAD_MAX, 0);
+    struct HttpParser p;
+    httpParserInit(&p, TRUE, FRESHNESS_HEAD_MAX);
+    if(nread <= 0 || httpParse(&p, head, (size_t)nread) != HP_DONE){
+        free(head);
+        return NULL;
+    }
+    char *shrunk = (char*) realloc(head, p.headLen);
+    *len = p.headLen;
+    return shrunk != NULL ? shrunk : head;
+}
+
+int freshnessIsStored(int fd){
+    size_t len;
+    char *head = freshnessRead(fd, &len);
+    if(head == NULL){
+        return FALSE;
+    }
+    struct HttpParser p;
+    httpParserInit(&p, TRUE, FRESHNESS_HEAD_MAX);
+    int stored = httpParse(&p, head, len) == HP_DONE && p.fieldCount > 0
+                 && viewEquals(p.fields[p.fieldCount - 1].name, "Age") == TRUE;
+    free(head);
+    return stored;
+}
+
+int freshnessLoad(const char *head, size_t len, time_t stored, struct Freshness *out, size_t *served){
+    struct HttpParser p;
+    httpParserInit(&p, TRUE, len + 1);
+    if(httpParse(&p, head, len) != HP_DONE || p.fieldCount == 0){
+        return -1;
+    }
+    const struct HttpField *ageField = &p.fields[p.fieldCount - 1];
+    if(viewEquals(ageField->name, "Age") == FALSE || (out->age = seconds(ageField->value)) < 0){
+        return -1;
+    }
+    *served = (size_t)(ageField->name.data - head);
+    out->stored = stored;
+    const struct StrView *field = httpField(&p, "Date");
+    out->date = field != NULL ? freshnessParseDate(field->data, field->len) : -1;
+    if(out->date == -1){
+        out->date = stored;
+    }
+    field = httpField(&p, "Last-Modified");
+    out->lastModified = field != NULL ? freshnessParseDate(field->data, field->len) : -1;
+    out->modified = field != NULL ? (size_t)(field->data - head) : 0;
+    out->modifiedLen = field != NULL ? field->len : 0;
+    field = httpField(&p, "ETag");
+    out->etag = field != NULL ? (size_t)(field->data - head) : 0;
+    out->etagLen = field != NULL ? field->len : 0;
+
+    struct StrView arg;
+    long lifetime = -1;
+    if(directive(&p, "s-maxage", &arg) == TRUE){
+        lifetime = seconds(arg);
+    }
+    if(lifetime < 0 && directive(&p, "max-age", &arg) == TRUE){
+        lifetime = seconds(arg);
+    }
+    if(lifetime < 0 && (field = httpField(&p, "Expires")) != NULL){
+        time_t expires = freshnessParseDate(field->data, field->len);
+        lifetime = expires > out->date ? (long)(expires - out->date) : 0;   //an invalid date means already expired
+    }
+    if(lifetime < 0){
+        if(heuristicStatus(statusOf(&p)) == FALSE && directive(&p, "public", NULL) == FALSE){
+            lifetime = 0;
+        } else if(out->lastModified != -1 && out->lastModified < out->date){
+            lifetime = (long)(out->date - out->lastModified) / 100 * FRESHNESS_HEURISTIC_PERCENT;
+            if(lifetime > FRESHNESS_HEURISTIC_MAX){
+                lifetime = FRESHNESS_HEURISTIC_MAX;
+            }
+        } else{
+            lifetime = defaultTtl;
+        }
+    }
+    out->revalidate = directive(&p, "no-cache", NULL) || directive(&p, "must-revalidate", NULL)
+                      || directive(&p, "proxy-revalidate", NULL) || directive(&p, "s-maxage", NULL);
+    if(directive(&p, "no-cache", NULL) == TRUE){
+        lifetime = 0;
+    }
+    out->lifetime = lifetime;
+    out->staleWindow = 0;
+    if(out->revalidate == FALSE){
+        out->staleWindow = directive(&p, "stale-while-revalidate", &arg) == TRUE ? seconds(arg) : defaultWindow;
+        if(out->staleWindow < 0){
+            out->staleWindow = 0;
+        }
+    }
+    return 0;
+}
+
+long freshnessAge(const struct Freshness *f, time_t now){
+    return f->age + (now > f->stored ? (long)(now - f->stored) : 0);
+}
+
+int freshnessCheck(const struct Freshness *f, time_t now){
+    long age = freshnessAge(f, now);
+    if(age < f->lifetime){
+        return FRESHNESS_FRESH;
+    }
+    if(f->revalidate == FALSE && age < f->lifetime + f->staleWindow){
+        return FRESHNESS_STALE_SERVE;
+    }
+    return FRESHNESS_STALE;
+}
+
+/**
+ * take the next entity tag of an If-None-Match list
+ * @param s - where to start, moved past the tag
+ * @param end
+ * @param tag - set to the opaque tag with its quotes and without a weak prefix
+ * @return TRUE if a tag was taken, FALSE at the end of the list or on a malformed one
+ */
+static int nextTag(const char **s, const char *end, struct StrView *tag){
+    const char *p = *s;
+    while(p < end && (isBlank(*p) || *p == ',')){
+        p++;
+    }
+    if(p < end && *p == '*'){
+        tag->data = p;
+        tag->len = 1;
+        *s = p + 1;
+        return TRUE;
+    }
+    if(end - p >= 2 && p[0] == 'W' && p[1] == '/'){
+        p += 2;
+    }
+    if(p == end || *p != '"'){
+        return FALSE;
+    }
+    const char *close = memchr(p + 1, '"', (size_t)(end - p - 1));
+    if(close == NULL){
+        return FALSE;
+    }
+    tag->data = p;
+    tag->len = (size_t)(close - p) + 1;
+    *s = close + 1;
+    return TRUE;
+}
+
+int freshnessNotModified(const struct Freshness *f, const char *head, const struct HttpParser *request){
+    const struct StrView *match = httpField(request, "If-None-Match");
+    if(match != NULL){  //If-Modified-Since is ignored when it is there
+        struct StrView stored = {head + f->etag, f->etagLen};
+        if(stored.len >= 2 && stored.data[0] == 'W' && stored.data[1] == '/'){     //weak comparison
+            stored.data += 2;
+            stored.len -= 2;
+        }
+        const char *s = match->data;
+        struct StrView tag;
+        while(nextTag(&s, match->data + match->len, &tag) == TRUE){
+            if(tag.len == 1 && tag.data[0] == '*'){
+                return TRUE;
+            }
+            if(f->etagLen > 0 && tag.len == stored.len && memcmp(tag.data, stored.data, tag.len) == 0){
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+    const struct StrView *since = httpField(request, "If-Modified-Since");
+    if(since == NULL){
+        return FALSE;
+    }
+    time_t date = freshnessParseDate(since->data, since->len);
+    time_t modified = f->lastModified != -1 ? f->lastModified : f->date;
+    return date != -1 && modified <= date;
+}
+
+size_t freshnessNotModifiedHead(const char *head, size_t len, long age, char *out, size_t size){
+    struct HttpParser p;
+    httpParserInit(&p, TRUE, len + 1);
+    if(httpParseEnd(&p, head, len) != HP_DONE){
+        return 0;
+    }
+    int n = snprintf(out, size, "%.*s 304 Not Modified\r\n", (int)p.start[0].len, p.start[0].data);
+    for (int i = 0; i < p.fieldCount && n > 0 && (size_t)n < size; i++) {
+        for (size_t j = 0; j < sizeof(notModifiedFields) / sizeof(notModifiedFields[0]); j++) {
+            if(viewEquals(p.fields[i].name, notModifiedFields[j]) == TRUE){
+                n += snprintf(out + n, size - n, "%.*s: %.*s\r\n", (int)p.fields[i].name.len, p.fields[i].name.data,
+                              (int)p.fields[i].value.len, p.fields[i].value.data);
+                break;
+            }
+        }
+    }
+    if(n > 0 && (size_t)n < size){
+        n += snprintf(out + n, size - n, "Age: %ld\r\n", age);
+    }
+    return n > 0 && (size_t)n < size ? (size_t)n : 0;
+}
+
+time_t freshnessParseDate(const char *data, size_t len){
+    static const char *formats[] = {"%a, %d %b %Y %H:%M:%S GMT",    //IMF-fixdate
+                                    "%A, %d-%b-%y %H:%M:%S GMT",    //obsolete RFC 850
+                                    "%a %b %e %H:%M:%S %Y"};        //obsolete asctime
+    char date[64];
+    if(len == 0 || len >= sizeof(date)){
+        return -1;
+    }
+    memcpy(date, data, len);
+    date[len] = '\0';
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        char *end = strptime(date, formats[i], &tm);
+        if(end != NULL && *end == '\0'){
+            return timegm(&tm);
+        }
+    }
+    return -1;
+}
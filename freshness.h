@@ -0,0 +1,145 @@
+#ifndef PROXY_SERVER_FRESHNESS_H
+#define PROXY_SERVER_FRESHNESS_H
+
+#include <stdio.h>
+#include <time.h>
+#include "parser.h"
+
+/**
+ * freshness.h
+ *
+ * HTTP caching rules (RFC 9111) of the shared cache. A cache file starts
+ * with the stored head of its response: the status line and the fields the
+ * origin sent, without hop-by-hop fields, Content-Length and Age, closed by
+ * an Age field that holds the age the response had when it was received.
+ * The body follows the head. The file's modification time is when the
+ * response was received or last validated, so the current age of a copy is
+ * its stored Age plus the seconds the file has been resident since.
+ *
+ * A copy is fresh while its age is below its freshness lifetime, taken from
+ * s-maxage, max-age or Expires, or else guessed: a tenth of the time since
+ * Last-Modified, or the configured default. A stale copy may still be served
+ * during its stale-while-revalidate window while a refresh runs in the
+ * background. Past the window, or when the response demands it, the copy is
+ * revalidated with If-None-Match / If-Modified-Since before it is served,
+ * and a 304 merges its fields into the stored head, so the body is not
+ * transferred again.
+ */
+
+#define FRESHNESS_HEAD_MAX (20 * 1024)         //longest stored head
+#define FRESHNESS_HEURISTIC_PERCENT 10          //of the time since Last-Modified
+#define FRESHNESS_HEURISTIC_MAX (24 * 60 * 60)  //longest lifetime guessed from Last-Modified
+#define FRESHNESS_DEFAULT_TTL 60    //default seconds a response without a lifetime or Last-Modified is fresh
+
+// what freshnessCheck decides for a stored copy
+#define FRESHNESS_FRESH 0
+#define FRESHNESS_STALE_SERVE 1     //serve it, and refresh it in the background
+#define FRESHNESS_STALE 2           //revalidate it before it is served
+
+/**
+ * what the stored head of a copy says about its freshness. offsets point into that head
+ */
+struct Freshness{
+    time_t stored;      //when the response was received or last validated
+    long age;           //its corrected initial age, from the stored Age field
+    long lifetime;      //seconds it is fresh for
+    long staleWindow;   //seconds past its lifetime it may be served while it is refreshed
+    int revalidate;     //TRUE if it may never be served stale (no-cache, must-revalidate, proxy-revalidate)
+    time_t date;        //Date of the response, or when it was received
+    time_t lastModified;    //-1 if the response has no valid Last-Modified
+    size_t etag;        //offset of the ETag value
+    size_t etagLen;     //0 if the response has no ETag
+    size_t modified;    //offset of the Last-Modified value
+    size_t modifiedLen; //0 if the response has no Last-Modified
+};
+
+/**
+ * @param defaultTtl - lifetime of responses without one and without Last-Modified, in seconds
+ * @param staleWindow - stale-while-revalidate window of responses that do not set it, in seconds
+ */
+void freshnessInit(long defaultTtl, long staleWindow);
+
+/**
+ * @param response - parsed head of an origin response to a GET
+ * @param status - its status, or the status of the stored copy a 304 revalidated
+ * @return TRUE if the shared cache may store it
+ */
+int freshnessStorable(const struct HttpParser *response, int status);
+
+/**
+ * write the stored head of an origin response to file
+ * @param file
+ * @param response - parsed head of the origin response
+ * @param stored - parsed stored head of the copy a 304 response revalidated, its fields are kept unless
+ *                 the 304 carries them. NULL for any other response
+ * @param requested - when the request was sent
+ * @param received - when the response head was received
+ * @param varyEncoding - TRUE if compressed variants are made of the copy, its Vary then names Accept-Encoding as theirs do
+ * @return bytes written, -1 if the head could not be written or would be too long
+ */
+long freshnessStore(FILE *file, const struct HttpParser *response, const struct HttpParser *stored,
+                    time_t requested, time_t received, int varyEncoding);
+
+/**
+ * read the stored head at the start of a cache file
+ * @param fd
+ * @param len - set to the bytes of the head, where the body starts
+ * @return the head, to be freed, NULL if the file does not start with a stored head
+ */
+char *freshnessRead(int fd, size_t *len);
+
+/**
+ * @param fd
+ * @return TRUE if the file starts with a head freshnessStore wrote, which always ends with its Age field
+ */
+int freshnessIsStored(int fd);
+
+/**
+ * parse a stored head
+ * @param head
+ * @param len - bytes of the head, its empty line included
+ * @param stored - when the response was received or last validated
+ * @param out
+ * @param served - set to the bytes of the head that are sent with the body, up to its Age field
+ * @return 0, -1 if head is not a stored head
+ */
+int freshnessLoad(const char *head, size_t len, time_t stored, struct Freshness *out, size_t *served);
+
+/**
+ * @return the current age of a copy in seconds
+ */
+long freshnessAge(const struct Freshness *f, time_t now);
+
+/**
+ * @return FRESHNESS_FRESH, FRESHNESS_STALE_SERVE or FRESHNESS_STALE
+ */
+int freshnessCheck(const struct Freshness *f, time_t now);
+
+/**
+ * evaluate the If-None-Match or If-Modified-Since field of a client request against a copy
+ * @param f
+ * @param head - stored head of the copy
+ * @param request - parsed client request head
+ * @return TRUE if the copy the client holds is current and may be answered with 304
+ */
+int freshnessNotModified(const struct Freshness *f, const char *head, const struct HttpParser *request);
+
+/**
+ * build a 304 response head from the stored head of a copy, without Connection and the empty line
+ * @param head - the part of a stored head sent with the body
+ * @param len
+ * @param age - current age of the copy
+ * @param out
+ * @param size - of out
+ * @return bytes written to out, 0 if they did not fit
+ */
+size_t freshnessNotModifiedHead(const char *head, size_t len, long age, char *out, size_t size);
+
+/**
+ * @param data - an HTTP-date in any of its three formats, not NUL terminated
+ * @param len
+ * @return the time, -1 if it is not a valid date
+ */
+time_t freshnessParseDate(const char *data, size_t len);
+
+#endif //PROXY_SERVER_FRESHNESS_H
@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "proxyServer.h"
+#include "inflight.h"
+#include "arena.h"
+
+static struct FetchShard shards[INFLIGHT_SHARDS];
+static struct FetchStats stats;
+static unsigned long tmpSequence;
+
+static unsigned hashKey(const char *key){
+    unsigned h = 2166136261u;   //FNV-1a
+    for (; *key != '\0'; key++) {
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    }
+    return h;
+}
+
+static struct FetchShard *shardOf(unsigned hash){
+    return &shards[hash % INFLIGHT_SHARDS];
+}
+
+static struct Fetch **bucketOf(struct FetchShard *shard, unsigned hash){
+    return &shard->buckets[(hash / INFLIGHT_SHARDS) % INFLIGHT_BUCKETS];
+}
+
+/**
+ * @return "dir/.name.<pid>-<n>.tmp" for key "dir/name", a dot file no request maps to and the cache tree walk skips
+ */
+static char *tmpPathOf(const char *key){
+    const char *slash = strrchr(key, '/');
+    size_t dirLen = slash != NULL ? (size_t)(slash - key) + 1 : 0;
+    unsigned long n = __atomic_add_fetch(&tmpSequence, 1, __ATOMIC_RELAXED);
+    size_t len = strlen(key) + 64;
+    char *path = (char*) malloc(len);
+    if(path == NULL){
+        return NULL;
+    }
+    snprintf(path, len, "%.*s.%s.%d-%lu.tmp", (int)dirLen, key, key + dirLen, (int)getpid(), n);
+    return path;
+}
+
+void fetchInit(){
+    memset(&stats, 0, sizeof(stats));
+    for (int i = 0; i < INFLIGHT_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+    }
+}
+
+/**
+ * find the fetch of key or start one
+ * @param key
+ * @param leader - set to TRUE if the fetch was started
+ * @param follow - FALSE to leave a fetch in flight alone and return NULL
+ */
+static struct Fetch *join(const char *key, int *leader, int follow){
+    unsigned hash = hashKey(key);
+    struct FetchShard *shard = shardOf(hash);
+    pthread_mutex_lock(&shard->lock);
+    struct Fetch *fetch = *bucketOf(shard, hash);
+    while(fetch != NULL && (fetch->hash != hash || strcmp(fetch->key, key) != 0)){
+        fetch = fetch->hashNext;
+    }
+    if(fetch != NULL && follow == FALSE){
+        pthread_mutex_unlock(&shard->lock);
+        *leader = FALSE;
+        return NULL;
+    }
+    if(fetch != NULL){
+        __atomic_add_fetch(&fetch->refs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&fetch->followers, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&shard->lock);
+        __atomic_add_fetch(&stats.followers, 1, __ATOMIC_RELAXED);
+        *leader = FALSE;
+        return fetch;
+    }
+    fetch = (struct Fetch*) calloc(1, sizeof(struct Fetch));
+    if(fetch == NULL || (fetch->key = strdup(key)) == NULL || (fetch->tmpPath = tmpPathOf(key)) == NULL){
+        pthread_mutex_unlock(&shard->lock);
+        if(fetch != NULL){
+            free(fetch->key);
+            free(fetch);
+        }
+        return NULL;
+    }
+    arenaCountHeap(3);     //shared with the followers, it outlives the request that leads it
+    fetch->hash = hash;
+    fetch->fd = -1;
+    pthread_mutex_init(&fetch->lock, NULL);
+    pthread_cond_init(&fetch->changed, NULL);
+    fetch->state = FETCH_RUNNING;
+    fetch->length = -1;
+    fetch->refs = 1;
+    struct Fetch **bucket = bucketOf(shard, hash);
+    fetch->hashNext = *bucket;
+    *bucket = fetch;
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_add_fetch(&stats.fetches, 1, __ATOMIC_RELAXED);
+    *leader = TRUE;
+    return fetch;
+}
+
+struct Fetch *fetchJoin(const char *key, int *leader){
+    return join(key, leader, TRUE);
+}
+
+struct Fetch *fetchLead(const char *key){
+    int leader;
+    return join(key, &leader, FALSE);
+}
+
+void fetchFollow(struct Fetch *fetch){
+    __atomic_add_fetch(&fetch->refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&fetch->followers, 1, __ATOMIC_RELAXED);
+}
+
+int fetchAttachFile(struct Fetch *fetch){
+    int fd = open(fetch->tmpPath, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return -1;
+    }
+    pthread_mutex_lock(&fetch->lock);
+    if(fetch->fd >= 0){     //of an attempt that failed before the head arrived, no follower reads it
+        close(fetch->fd);
+    }
+    fetch->fd = fd;
+    fetch->written = 0;
+    fetch->requested = time(NULL);
+    pthread_mutex_unlock(&fetch->lock);
+    return 0;
+}
+
+void fetchHeaders(struct Fetch *fetch, off_t headLen, long long length){
+    pthread_mutex_lock(&fetch->lock);
+    fetch->haveHeaders = TRUE;
+    fetch->headLen = headLen;
+    fetch->length = length;
+    if(fetch->written < headLen){   //the head was flushed to the file
+        fetch->written = headLen;
+    }
+    pthread_cond_broadcast(&fetch->changed);
+    pthread_mutex_unlock(&fetch->lock);
+}
+
+void fetchProgress(struct Fetch *fetch, FILE *file){
+    if(__atomic_load_n(&fetch->followers, __ATOMIC_RELAXED) == 0){
+        return;
+    }
+    struct stat sb;
+    if(fflush(file) != 0 || fstat(fileno(file), &sb) < 0){     //spliced bytes bypass stdio, the size counts them
+        return;
+    }
+    pthread_mutex_lock(&fetch->lock);
+    if(sb.st_size > fetch->written){
+        fetch->written = sb.st_size;
+        pthread_cond_broadcast(&fetch->changed);
+    }
+    pthread_mutex_unlock(&fetch->lock);
+}
+
+void fetchFinish(struct Fetch *fetch, int complete, off_t size){
+    pthread_mutex_lock(&fetch->lock);
+    if(fetch->state != FETCH_RUNNING){
+        pthread_mutex_unlock(&fetch->lock);
+        return;
+    }
+    fetch->state = complete == TRUE ? FETCH_DONE : FETCH_FAILED;
+    if(complete == TRUE){
+        fetch->written = size;
+    }
+    pthread_cond_broadcast(&fetch->changed);
+    pthread_mutex_unlock(&fetch->lock);
+    if(complete == FALSE){
+        __atomic_add_fetch(&stats.failed, 1, __ATOMIC_RELAXED);
+    }
+    struct FetchShard *shard = shardOf(fetch->hash);
+    pthread_mutex_lock(&shard->lock);
+    struct Fetch **pp = bucketOf(shard, fetch->hash);
+    while(*pp != fetch){
+        pp = &(*pp)->hashNext;
+    }
+    *pp = fetch->hashNext;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+int fetchWait(struct Fetch *fetch, off_t offset, off_t *written){
+    pthread_mutex_lock(&fetch->lock);
+    while(fetch->state == FETCH_RUNNING && (fetch->haveHeaders == FALSE || fetch->written <= offset)){
+        pthread_cond_wait(&fetch->changed, &fetch->lock);
+    }
+    int state = fetch->state;
+    *written = fetch->written;
+    pthread_mutex_unlock(&fetch->lock);
+    return state;
+}
+
+int fetchOpenBody(struct Fetch *fetch){
+    pthread_mutex_lock(&fetch->lock);
+    int fd = fetch->fd >= 0 ? dup(fetch->fd) : -1;
+    pthread_mutex_unlock(&fetch->lock);
+    return fd;
+}
+
+void fetchRelease(struct Fetch *fetch){
+    if(__atomic_sub_fetch(&fetch->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        if(fetch->fd >= 0){
+            close(fetch->fd);
+        }
+        pthread_mutex_destroy(&fetch->lock);
+        pthread_cond_destroy(&fetch->changed);
+        free(fetch->tmpPath);
+        free(fetch->key);
+        free(fetch);
+    }
+}
+
+void fetchGetStats(struct FetchStats *out){
+    out->fetches = __atomic_load_n(&stats.fetches, __ATOMIC_RELAXED);
+    out->followers = __atomic_load_n(&stats.followers, __ATOMIC_RELAXED);
+    out->failed = __atomic_load_n(&stats.failed, __ATOMIC_RELAXED);
+}
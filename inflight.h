@@ -0,0 +1,143 @@
+#ifndef PROXY_SERVER_INFLIGHT_H
+#define PROXY_SERVER_INFLIGHT_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+/**
+ * inflight.h
+ *
+ * Table of the origin fetches in flight, keyed by the cache path, that
+ * collapses concurrent misses of one object into a single origin request.
+ * The first miss becomes the leader: it fetches the object and writes its
+ * body to a temporary file next to the cache path. Misses that arrive
+ * meanwhile join as followers and stream the body from that file as the
+ * leader reports its progress, so no two requests ever write the same file.
+ *
+ * The file starts with the stored head of the response (see freshness.h),
+ * which followers send ahead of the body. A complete file of a response the
+ * cache may store is renamed over the cache path, which publishes it
+ * atomically: a reader opens either the previous file or the whole new one.
+ * The fetch leaves the table once it is done or failed; followers of a
+ * failed fetch end their response early.
+ */
+
+#define INFLIGHT_SHARDS 16
+#define INFLIGHT_BUCKETS 64         //buckets per shard
+
+// states of a fetch
+#define FETCH_RUNNING 0
+#define FETCH_DONE 1
+#define FETCH_FAILED 2
+
+struct Fetch{
+    char *key;
+    unsigned hash;
+    char *tmpPath;      //the leader writes the body here, renamed to key once complete
+    int fd;             //read only descriptor of tmpPath, -1 until the leader created it
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int state;
+    time_t requested;   //when the leader sent the origin request
+    time_t received;    //when the origin response head arrived
+    int status;         //of the origin response
+    int storable;       //TRUE if the cache may store the response
+    int haveHeaders;    //TRUE once the stored head was written to the file
+    off_t headLen;      //bytes of the stored head, the body follows it
+    long long length;   //body length the origin announced, -1 if it did not
+    off_t written;      //bytes of the file followers may read
+    int followers;
+    int refs;           //the leader and every follower hold one
+    struct Fetch *hashNext;
+};
+
+struct FetchShard{
+    pthread_mutex_t lock;
+    struct Fetch *buckets[INFLIGHT_BUCKETS];
+};
+
+struct FetchStats{
+    long fetches;       //leaders
+    long followers;     //requests that joined a fetch in flight
+    long failed;
+};
+
+void fetchInit();
+
+/**
+ * join the fetch of key, starting it if there is none
+ * @param key - cache path
+ * @param leader - set to TRUE if the caller started the fetch and has to fetch the object
+ * @return the fetch, to be given to fetchRelease. NULL if memory ran out
+ */
+struct Fetch *fetchJoin(const char *key, int *leader);
+
+/**
+ * start a fetch of key unless one is in flight, to refresh a stale copy
+ * @param key - cache path
+ * @return the fetch the caller leads, to be given to fetchRelease. NULL if key is fetched already or memory ran out
+ */
+struct Fetch *fetchLead(const char *key);
+
+/**
+ * leader: also follow the fetch, whose origin request is handed to a background job that takes
+ * over the reference of the leader
+ * @param fetch
+ */
+void fetchFollow(struct Fetch *fetch);
+
+/**
+ * leader: open the read only descriptor of the temporary file just created, for the followers.
+ * called once the origin request was sent
+ * @return 0, -1 if it could not be opened
+ */
+int fetchAttachFile(struct Fetch *fetch);
+
+/**
+ * leader: the stored head of the response was written to the file
+ * @param fetch
+ * @param headLen - its bytes
+ * @param length - body length the origin announced, -1 if it did not
+ */
+void fetchHeaders(struct Fetch *fetch, off_t headLen, long long length);
+
+/**
+ * leader: let the followers read what was written to file so far. costs nothing without followers
+ * @param fetch
+ * @param file - the temporary file, flushed
+ */
+void fetchProgress(struct Fetch *fetch, FILE *file);
+
+/**
+ * leader: end the fetch and take it out of the table, a fetch that already ended is left alone
+ * @param fetch
+ * @param complete - TRUE if the whole response reached the file
+ * @param size - bytes of the complete file
+ */
+void fetchFinish(struct Fetch *fetch, int complete, off_t size);
+
+/**
+ * follower: wait until the stored head and more than offset bytes of the file were written, or the fetch ended
+ * @param fetch
+ * @param offset - bytes of the file already taken, -1 to wait for the head only
+ * @param written - set to the bytes of the file that may be read
+ * @return the state of the fetch
+ */
+int fetchWait(struct Fetch *fetch, off_t offset, off_t *written);
+
+/**
+ * follower: once the stored head was written
+ * @return a descriptor of the file to read with explicit offsets and close, -1 on error
+ */
+int fetchOpenBody(struct Fetch *fetch);
+
+/**
+ * drop the reference taken by fetchJoin
+ */
+void fetchRelease(struct Fetch *fetch);
+
+void fetchGetStats(struct FetchStats *stats);
+
+#endif //PROXY_SERVER_INFLIGHT_H
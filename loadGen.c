@@ -0,0 +1,749 @@
+//
+// Closed and open loop load generator for the proxy, loopback only.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+/**
+ * loadGen.c
+ *
+ * Sends GET /o/<size>/<id> requests for the objects of originStub through
+ * the proxy, one connection per thread, and prints what it measured as one
+ * JSON object: throughput, latency percentiles and the CPU time the proxy
+ * and the generator spent per request.
+ *
+ * The load is reproducible from its options alone. A request is a hit of
+ * the hot set with probability --hit-ratio, one of --objects ids drawn from
+ * a generator seeded by --seed and the thread number, and a miss otherwise,
+ * an id no request of the run asked for before. The size of an object is a
+ * function of its id and the seed, drawn from the weighted --sizes classes.
+ * Misses of a run repeat the ids of an earlier run with the same seed, so
+ * every run should start from an empty cache or use its own seed.
+ *
+ * In the closed loop every thread sends its next request when the answer to
+ * the last one arrived. In the open loop the threads together start --rate
+ * requests a second with exponential gaps, and a latency runs from the time
+ * a request was due, so a proxy that falls behind is charged for the queue
+ * it builds rather than hiding it by slowing the generator down.
+ *
+ * --write-filter=<file> --blocklist=<n> only writes a filter file of n rules
+ * no request of the generator matches, a third each of hosts, wildcards and
+ * address ranges, for runs that measure filter lookups of a given size.
+ */
+
+#define USAGE_MSG "Usage: loadGen [--proxy=<ip>:<port>] [--host=<name>] [--concurrency=<n>] [--requests=<n>|--duration=<sec>]" \
+                  " [--mode=closed|open] [--rate=<req/s>] [--sizes=<bytes>[k|m]:<weight>,...] [--objects=<n>]" \
+                  " [--hit-ratio=<0-1>] [--warmup=on|off] [--seed=<n>] [--keep-alive=on|off] [--proxy-pid=<pid>]" \
+                  " [--output=<file>] | --write-filter=<file> --blocklist=<n>\n"
+#define TRUE 1
+#define FALSE 0
+#define GEN_MAX_CLASSES 16      //size classes of --sizes
+#define GEN_HEAD_LIMIT (16 * 1024)  //longest response head read
+#define GEN_BUFFER (64 * 1024)
+#define GEN_MODE_CLOSED 0
+#define GEN_MODE_OPEN 1
+
+struct GenConfig{
+    struct sockaddr_in proxy;
+    const char *host;
+    int concurrency;
+    long long requests;     //measured requests, 0 when the run is timed
+    double duration;        //seconds of a timed run
+    int mode;               //GEN_MODE_CLOSED or GEN_MODE_OPEN
+    double rate;            //requests a second of the open loop, all threads together
+    long long sizes[GEN_MAX_CLASSES];
+    int weights[GEN_MAX_CLASSES];
+    int classes;
+    int totalWeight;
+    const char *sizeSpec;
+    long long objects;      //ids of the hot set
+    double hitRatio;
+    int warmup;             //TRUE to request every hot object once before measuring
+    unsigned long long seed;
+    int keepAlive;
+    int proxyPid;           //0 when the CPU of the proxy is not measured
+    const char *output;     //NULL for stdout
+    const char *filterFile;
+    long long blocklist;
+};
+
+/**
+ * one thread of the generator and what it measured
+ */
+struct Worker{
+    pthread_t thread;
+    int index;
+    unsigned long long rng;
+    int fd;                 //-1 when not connected
+    char *buf;              //bytes read past the last response
+    size_t buffered;
+    long long *latencies;   //nanoseconds
+    long long count;
+    long long capacity;
+    long long errors;       //requests that got no complete response
+    long long status[6];    //responses by status class, 1xx to 5xx
+    long long bytes;        //response bytes received, heads included
+    long long connects;
+};
+
+static struct GenConfig config;
+static long long missSequence;  //misses handed out
+static long long issued;        //measured requests handed out
+static long long startTime;     //of the measured phase, CLOCK_MONOTONIC nanoseconds
+static long long stopTime;      //of a timed run
+static pthread_barrier_t warmedUp;
+
+static long long nowNanos(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * splitmix64, the seeded generator of the ids and gaps
+ */
+static unsigned long long nextRandom(unsigned long long *state){
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * @return uniform in [0, 1)
+ */
+static double uniform(unsigned long long *state){
+    return (double)(nextRandom(state) >> 11) / (double)(1ULL << 53);
+}
+
+/**
+ * @return the size of object id, from the class its hashed id falls in
+ */
+static long long sizeOf(unsigned long long id){
+    unsigned long long state = id ^ config.seed;
+    int pick = (int)(nextRandom(&state) % (unsigned long long)config.totalWeight);
+    for (int i = 0; i < config.classes; i++) {
+        if(pick < config.weights[i]){
+            return config.sizes[i];
+        }
+        pick -= config.weights[i];
+    }
+    return config.sizes[config.classes - 1];
+}
+
+/**
+ * @return the id of the next request of worker, a hot one with probability config.hitRatio
+ */
+static unsigned long long nextId(struct Worker *worker){
+    if(config.objects > 0 && uniform(&worker->rng) < config.hitRatio){
+        return nextRandom(&worker->rng) % (unsigned long long)config.objects;
+    }
+    unsigned long long n = (unsigned long long)__atomic_fetch_add(&missSequence, 1, __ATOMIC_RELAXED);
+    return (config.seed << 32) + (unsigned long long)config.objects + n;
+}
+
+/**
+ * @param spec - "<bytes>[k|m|g]"
+ * @return the size, -1 if spec is not one
+ */
+static long long parseBytes(const char *spec, char **end){
+    long long n = strtoll(spec, end, 10);
+    if(*end == spec || n < 0){
+        return -1;
+    }
+    switch(**end){
+        case 'k': case 'K': n *= 1024; (*end)++; break;
+        case 'm': case 'M': n *= 1024 * 1024; (*end)++; break;
+        case 'g': case 'G': n *= 1024 * 1024 * 1024; (*end)++; break;
+        default: break;
+    }
+    return n;
+}
+
+/**
+ * parse "<bytes>[k|m|g]:<weight>,..." into the size classes of config, a class without a weight weighs 1
+ * @return 0, -1 on a bad spec
+ */
+static int parseSizes(const char *spec){
+    config.classes = 0;
+    config.totalWeight = 0;
+    char *end;
+    while(*spec != '\0'){
+        if(config.classes == GEN_MAX_CLASSES){
+            return -1;
+        }
+        long long size = parseBytes(spec, &end);
+        int weight = 1;
+        if(size < 0){
+            return -1;
+        }
+        if(*end == ':'){
+            spec = end + 1;
+            weight = (int) strtol(spec, &end, 10);
+            if(end == spec || weight <= 0){
+                return -1;
+            }
+        }
+        config.sizes[config.classes] = size;
+        config.weights[config.classes++] = weight;
+        config.totalWeight += weight;
+        if(*end == ','){
+            end++;
+        } else if(*end != '\0'){
+            return -1;
+        }
+        spec = end;
+    }
+    return config.classes > 0 ? 0 : -1;
+}
+
+static int onOff(const char *value, int *out){
+    if(strcmp(value, "on") == 0){
+        *out = TRUE;
+    } else if(strcmp(value, "off") == 0){
+        *out = FALSE;
+    } else{
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * parse the "--name=value" options into config
+ * @return 0 - on success
+ *         -1 - on unknown option or bad value
+ */
+static int parseOptions(int argc, char *argv[]){
+    char *checkIfNumber;
+    memset(&config, 0, sizeof(config));
+    config.proxy.sin_family = AF_INET;
+    config.proxy.sin_port = htons(8080);
+    config.proxy.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    config.host = "bench.test";
+    config.concurrency = 8;
+    config.requests = 10000;
+    config.mode = GEN_MODE_CLOSED;
+    config.sizeSpec = "4k:70,64k:25,1m:5";
+    config.objects = 1000;
+    config.hitRatio = 0.9;
+    config.warmup = TRUE;
+    config.seed = 1;
+    config.keepAlive = TRUE;
+    for (int i = 1; i < argc; i++) {
+        char *opt = argv[i];
+        char *value = strchr(opt, '=');
+        if(strncmp(opt, "--", 2) != 0 || value == NULL){
+            return -1;
+        }
+        value++;
+        if(strncmp(opt, "--proxy=", strlen("--proxy=")) == 0){
+            char host[64];
+            snprintf(host, sizeof(host), "%s", value);
+            char *colon = strchr(host, ':');
+            if(colon != NULL){
+                *colon = '\0';
+                long port = strtol(colon + 1, &checkIfNumber, 10);
+                if(strlen(checkIfNumber) != 0 || port <= 0 || port > 65535){
+                    return -1;
+                }
+                config.proxy.sin_port = htons((unsigned short)port);
+            }
+            if(inet_pton(AF_INET, host, &config.proxy.sin_addr) != 1){
+                return -1;
+            }
+        } else if(strncmp(opt, "--host=", strlen("--host=")) == 0){
+            config.host = value;
+        } else if(strncmp(opt, "--concurrency=", strlen("--concurrency=")) == 0){
+            config.concurrency = (int) strtol(value, &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.concurrency <= 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--requests=", strlen("--requests=")) == 0){
+            config.requests = strtoll(value, &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.requests <= 0){
+                return -1;
+            }
+            config.duration = 0;
+        } else if(strncmp(opt, "--duration=", strlen("--duration=")) == 0){
+            config.duration = strtod(value, &checkIfNumber);
+            if(strlen(checkIfNumber) != 0 || config.duration <= 0){
+                return -1;
+            }
+            config.requests = 0;
+        } else if(strcmp(opt, "--mode=closed") == 0){
+            config.mode = GEN_MODE_CLOSED;
+        } else if(strcmp(opt, "--mode=open") == 0){
+            config.mode = GEN_MODE_OPEN;
+        } else if(strncmp(opt, "--rate=", strlen("--rate=")) == 0){
+            config.rate = strtod(value, &checkIfNumber);
+            if(strlen(checkIfNumber) != 0 || config.rate <= 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--sizes=", strlen("--sizes=")) == 0){
+            config.sizeSpec = value;
+        } else if(strncmp(opt, "--objects=", strlen("--objects=")) == 0){
+            config.objects = strtoll(value, &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.objects < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--hit-ratio=", strlen("--hit-ratio=")) == 0){
+            config.hitRatio = strtod(value, &checkIfNumber);
+            if(strlen(checkIfNumber) != 0 || config.hitRatio < 0 || config.hitRatio > 1){
+                return -1;
+            }
+        } else if(strncmp(opt, "--warmup=", strlen("--warmup=")) == 0){
+            if(onOff(value, &config.warmup) == -1){
+                return -1;
+            }
+        } else if(strncmp(opt, "--seed=", strlen("--seed=")) == 0){
+            config.seed = strtoull(value, &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--keep-alive=", strlen("--keep-alive=")) == 0){
+            if(onOff(value, &config.keepAlive) == -1){
+                return -1;
+            }
+        } else if(strncmp(opt, "--proxy-pid=", strlen("--proxy-pid=")) == 0){
+            config.proxyPid = (int) strtol(value, &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.proxyPid <= 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--output=", strlen("--output=")) == 0){
+            config.output = value;
+        } else if(strncmp(opt, "--write-filter=", strlen("--write-filter=")) == 0){
+            config.filterFile = value;
+        } else if(strncmp(opt, "--blocklist=", strlen("--blocklist=")) == 0){
+            config.blocklist = strtoll(value, &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.blocklist < 0){
+                return -1;
+            }
+        } else{
+            return -1;
+        }
+    }
+    if(parseSizes(config.sizeSpec) == -1 || (config.mode == GEN_MODE_OPEN && config.rate <= 0)){
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * write config.blocklist rules to config.filterFile, none of them matching config.host or a loopback address
+ * @return 0, -1 if the file could not be written
+ */
+static int writeFilter(){
+    FILE *file = fopen(config.filterFile, "w");
+    if(file == NULL){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    unsigned long long state = config.seed;
+    fprintf(file, "# %lld rules written by loadGen, seed %llu\n", config.blocklist, config.seed);
+    for (long long i = 0; i < config.blocklist; i++) {
+        unsigned long long r = nextRandom(&state);
+        switch(i % 3){
+            case 0:
+                fprintf(file, "blocked-%llx.example\n", r);
+                break;
+            case 1:
+                fprintf(file, "*.w%llx.example\n", r);
+                break;
+            default:    //within 10.0.0.0/8 and 172.16.0.0/12, never loopback
+                if(r & 1){
+                    fprintf(file, "10.%u.%u.0/24\n", (unsigned)(r >> 8) & 255, (unsigned)(r >> 16) & 255);
+                } else{
+                    fprintf(file, "172.%u.%u.%u/32\n", 16 + ((unsigned)(r >> 8) & 15), (unsigned)(r >> 16) & 255,
+                            (unsigned)(r >> 24) & 255);
+                }
+                break;
+        }
+    }
+    if(fclose(file) != 0){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int connectProxy(struct Worker *worker){
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if(fd < 0){
+        return -1;
+    }
+    if(connect(fd, (struct sockaddr*) &config.proxy, sizeof(config.proxy)) < 0){
+        close(fd);
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    worker->fd = fd;
+    worker->buffered = 0;
+    worker->connects++;
+    return 0;
+}
+
+static void disconnect(struct Worker *worker){
+    if(worker->fd >= 0){
+        close(worker->fd);
+        worker->fd = -1;
+    }
+    worker->buffered = 0;
+}
+
+/**
+ * @return the value of the field called name in head, NULL if there is none. len is set to its length
+ */
+static const char *fieldOf(const char *head, const char *name, size_t *len){
+    size_t nameLen = strlen(name);
+    for (const char *line = strstr(head, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+        line += 2;
+        if(strncasecmp(line, name, nameLen) == 0 && line[nameLen] == ':'){
+            const char *value = line + nameLen + 1;
+            while(*value == ' ' || *value == '\t'){
+                value++;
+            }
+            const char *end = strstr(value, "\r\n");
+            *len = end != NULL ? (size_t)(end - value) : strlen(value);
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * send one request for object id and read its whole response
+ * @return the status code, -1 if no complete response arrived. the connection is closed when it can't be reused
+ */
+static int exchange(struct Worker *worker, unsigned long long id){
+    if(worker->fd < 0 && connectProxy(worker) < 0){
+        return -1;
+    }
+    char request[512];
+    int n = snprintf(request, sizeof(request), "GET /o/%lld/%llu HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                     sizeOf(id), id, config.host, config.keepAlive == TRUE ? "keep-alive" : "close");
+    for (int sent = 0; sent < n;) {
+        ssize_t w = send(worker->fd, request + sent, (size_t)(n - sent), MSG_NOSIGNAL);
+        if(w < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            disconnect(worker);
+            return -1;
+        }
+        sent += (int)w;
+    }
+    char *end;
+    while(1){
+        worker->buf[worker->buffered] = '\0';
+        if((end = strstr(worker->buf, "\r\n\r\n")) != NULL){
+            break;
+        }
+        if(worker->buffered == GEN_HEAD_LIMIT){
+            disconnect(worker);
+            return -1;
+        }
+        ssize_t r = read(worker->fd, worker->buf + worker->buffered, GEN_HEAD_LIMIT - worker->buffered);
+        if(r <= 0){
+            if(r < 0 && errno == EINTR){
+                continue;
+            }
+            disconnect(worker);     //a kept connection the proxy closed unanswered is an error too, not retried
+            return -1;
+        }
+        worker->buffered += (size_t)r;
+    }
+    end += 4;
+    size_t headLen = (size_t)(end - worker->buf);
+    int status;
+    if(sscanf(worker->buf, "HTTP/%*d.%*d %d", &status) != 1){
+        disconnect(worker);
+        return -1;
+    }
+    char saved = *end;
+    *end = '\0';
+    size_t len;
+    const char *field = fieldOf(worker->buf, "Content-Length", &len);
+    long long length = field != NULL ? strtoll(field, NULL, 10) : -1;
+    field = fieldOf(worker->buf, "Connection", &len);
+    int reuse = config.keepAlive == TRUE && (field == NULL || strncasecmp(field, "close", len) != 0);
+    *end = saved;
+    if(status == 304 || status == 204 || (status >= 100 && status < 200)){
+        length = 0;
+    }
+    worker->bytes += (long long)headLen;
+    size_t extra = worker->buffered - headLen;
+    long long remaining = length;
+    if(length >= 0 && (long long)extra > length){   //the rest belongs to no request, a pipelining proxy is a bug here
+        extra = (size_t)length;
+    }
+    remaining = length >= 0 ? length - (long long)extra : -1;
+    worker->bytes += (long long)extra;
+    worker->buffered = 0;
+    while(remaining != 0){
+        size_t want = remaining > 0 && remaining < GEN_BUFFER ? (size_t)remaining : GEN_BUFFER;
+        ssize_t r = read(worker->fd, worker->buf, want);
+        if(r < 0 && errno == EINTR){
+            continue;
+        }
+        if(r <= 0){
+            disconnect(worker);
+            return length < 0 && r == 0 ? status : -1;   //a body without a length ends with the connection
+        }
+        worker->bytes += r;
+        if(remaining > 0){
+            remaining -= r;
+        }
+    }
+    if(reuse == FALSE){
+        disconnect(worker);
+    }
+    return status;
+}
+
+static void record(struct Worker *worker, long long nanos){
+    if(worker->count == worker->capacity){
+        long long capacity = worker->capacity > 0 ? worker->capacity * 2 : 4096;
+        long long *grown = (long long*) realloc(worker->latencies, (size_t)capacity * sizeof(long long));
+        if(grown == NULL){
+            return;
+        }
+        worker->latencies = grown;
+        worker->capacity = capacity;
+    }
+    worker->latencies[worker->count++] = nanos;
+}
+
+/**
+ * @return TRUE if the measured phase has another request for this thread
+ */
+static int another(long long now){
+    if(config.requests > 0){
+        return __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED) < config.requests;
+    }
+    return now < stopTime;
+}
+
+static void *runWorker(void *arg){
+    struct Worker *worker = (struct Worker*) arg;
+    if(config.warmup == TRUE){
+        for (long long id = worker->index; id < config.objects; id += config.concurrency) {
+            exchange(worker, (unsigned long long)id);
+        }
+    }
+    pthread_barrier_wait(&warmedUp);    //the last thread to arrive sets the start time
+    while(__atomic_load_n(&startTime, __ATOMIC_ACQUIRE) == 0){
+        sched_yield();
+    }
+    double gap = config.mode == GEN_MODE_OPEN ? 1e9 * config.concurrency / config.rate : 0;   //mean, nanoseconds
+    double due = (double)startTime;
+    while(1){
+        long long sent = nowNanos();
+        if(config.mode == GEN_MODE_OPEN){
+            due += -log(1.0 - uniform(&worker->rng)) * gap;
+            if(config.requests == 0 && due >= (double)stopTime){
+                break;
+            }
+            long long wait = (long long)due - sent;
+            if(wait > 0){
+                struct timespec ts = {(time_t)((long long)due / 1000000000LL), (long)((long long)due % 1000000000LL)};
+                while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+            }
+            sent = (long long)due;      //a late request is charged the time it waited for its turn
+        }
+        if(another(nowNanos()) == FALSE){
+            break;
+        }
+        int status = exchange(worker, nextId(worker));
+        if(status < 0){
+            worker->errors++;
+            continue;
+        }
+        worker->status[status / 100 >= 1 && status / 100 <= 5 ? status / 100 : 0]++;
+        record(worker, nowNanos() - sent);
+    }
+    disconnect(worker);
+    return NULL;
+}
+
+/**
+ * @return utime + stime of process pid in seconds, -1 if it can't be read
+ */
+static double processCpu(int pid){
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *file = fopen(path, "r");
+    if(file == NULL){
+        return -1;
+    }
+    char line[1024];
+    char *fields = fgets(line, sizeof(line), file) != NULL ? strrchr(line, ')') : NULL;
+    fclose(file);
+    unsigned long long utime, stime;
+    if(fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                                &utime, &stime) != 2){
+        return -1;
+    }
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static double selfCpu(){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (double)usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+           + (double)usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static int compareLatency(const void *a, const void *b){
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @return the smallest latency at or above quantile of the sorted latencies, in microseconds
+ */
+static double percentile(const long long *sorted, long long count, double quantile){
+    if(count == 0){
+        return 0;
+    }
+    long long rank = (long long)ceil(quantile * (double)count);
+    rank = rank < 1 ? 1 : rank > count ? count : rank;
+    return (double)sorted[rank - 1] / 1000.0;
+}
+
+/**
+ * merge what the workers measured and print it as JSON
+ */
+static int report(struct Worker *workers, double elapsed, double proxyCpu, double generatorCpu){
+    long long count = 0, errors = 0, bytes = 0, connects = 0, status[6] = {0};
+    for (int i = 0; i < config.concurrency; i++) {
+        count += workers[i].count;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        connects += workers[i].connects;
+        for (int j = 0; j < 6; j++) {
+            status[j] += workers[i].status[j];
+        }
+    }
+    long long *all = (long long*) malloc((size_t)(count > 0 ? count : 1) * sizeof(long long));
+    if(all == NULL){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    long long n = 0;
+    double sum = 0;
+    for (int i = 0; i < config.concurrency; i++) {
+        if(workers[i].count > 0){  //a worker whose requests all failed has no latencies
+            memcpy(all + n, workers[i].latencies, (size_t)workers[i].count * sizeof(long long));
+            n += workers[i].count;
+        }
+    }
+    for (long long i = 0; i < n; i++) {
+        sum += (double)all[i];
+    }
+    qsort(all, (size_t)n, sizeof(long long), compareLatency);
+    FILE *out = config.output != NULL ? fopen(config.output, "w") : stdout;
+    if(out == NULL){
+        perror("error: <sys_call>\n");
+        free(all);
+        return -1;
+    }
+    char proxy[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &config.proxy.sin_addr, proxy, sizeof(proxy));
+    fprintf(out, "{\n  \"config\": {\"proxy\": \"%s:%d\", \"host\": \"%s\", \"mode\": \"%s\", \"concurrency\": %d, "
+                 "\"requests\": %lld, \"duration_s\": %g, \"rate\": %g, \"sizes\": \"%s\", \"objects\": %lld, "
+                 "\"hit_ratio\": %g, \"warmup\": %s, \"seed\": %llu, \"keep_alive\": %s},\n",
+            proxy, ntohs(config.proxy.sin_port), config.host, config.mode == GEN_MODE_OPEN ? "open" : "closed",
+            config.concurrency, config.requests, config.duration, config.rate, config.sizeSpec, config.objects,
+            config.hitRatio, config.warmup == TRUE ? "true" : "false", config.seed,
+            config.keepAlive == TRUE ? "true" : "false");
+    fprintf(out, "  \"requests\": %lld,\n  \"errors\": %lld,\n  \"connections\": %lld,\n", n, errors, connects);
+    fprintf(out, "  \"status\": {\"1xx\": %lld, \"2xx\": %lld, \"3xx\": %lld, \"4xx\": %lld, \"5xx\": %lld, "
+                 "\"other\": %lld},\n", status[1], status[2], status[3], status[4], status[5], status[0]);
+    fprintf(out, "  \"elapsed_s\": %.6f,\n  \"throughput_rps\": %.1f,\n  \"bytes\": %lld,\n  \"throughput_mbps\": %.2f,\n",
+            elapsed, elapsed > 0 ? (double)n / elapsed : 0, bytes, elapsed > 0 ? (double)bytes * 8 / 1e6 / elapsed : 0);
+    fprintf(out, "  \"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+                 "\"max\": %.1f},\n", n > 0 ? sum / (double)n / 1000.0 : 0, percentile(all, n, 0.5),
+            percentile(all, n, 0.9), percentile(all, n, 0.99), percentile(all, n, 0.999), percentile(all, n, 1));
+    fprintf(out, "  \"cpu\": {");
+    if(proxyCpu >= 0){
+        fprintf(out, "\"proxy_s\": %.3f, \"proxy_us_per_request\": %.2f, ", proxyCpu,
+                n > 0 ? proxyCpu * 1e6 / (double)n : 0);
+    } else{
+        fprintf(out, "\"proxy_s\": null, \"proxy_us_per_request\": null, ");
+    }
+    fprintf(out, "\"generator_s\": %.3f, \"generator_us_per_request\": %.2f}\n}\n", generatorCpu,
+            n > 0 ? generatorCpu * 1e6 / (double)n : 0);
+    free(all);
+    if(out != stdout && fclose(out) != 0){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    if(parseOptions(argc, argv) == -1){
+        printf(USAGE_MSG);
+        return -1;
+    }
+    if(config.filterFile != NULL){
+        return writeFilter();
+    }
+    signal(SIGPIPE, SIG_IGN);
+    struct Worker *workers = (struct Worker*) calloc((size_t)config.concurrency, sizeof(struct Worker));
+    if(workers == NULL){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    pthread_barrier_init(&warmedUp, NULL, (unsigned)config.concurrency + 1);
+    int started = 0;
+    for (; started < config.concurrency; started++) {
+        struct Worker *worker = &workers[started];
+        worker->index = started;
+        worker->fd = -1;
+        worker->rng = config.seed * 0x100000001B3ULL + (unsigned long long)started;
+        worker->buf = (char*) malloc(GEN_BUFFER + 1);
+        if(worker->buf == NULL || pthread_create(&worker->thread, NULL, runWorker, worker) != 0){
+            perror("error: <sys_call>\n");
+            free(worker->buf);
+            break;
+        }
+    }
+    if(started < config.concurrency){   //threads already waiting would block for good on the barrier
+        exit(-1);
+    }
+    pthread_barrier_wait(&warmedUp);
+    double proxyBefore = config.proxyPid > 0 ? processCpu(config.proxyPid) : -1;
+    double generatorBefore = selfCpu();
+    long long start = nowNanos();
+    stopTime = start + (long long)(config.duration * 1e9);
+    __atomic_store_n(&startTime, start, __ATOMIC_RELEASE);
+    for (int i = 0; i < config.concurrency; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = (double)(nowNanos() - start) / 1e9;
+    double proxyAfter = proxyBefore >= 0 ? processCpu(config.proxyPid) : -1;
+    int result = report(workers, elapsed, proxyAfter >= 0 ? proxyAfter - proxyBefore : -1, selfCpu() - generatorBefore);
+    for (int i = 0; i < config.concurrency; i++) {
+        free(workers[i].buf);
+        free(workers[i].latencies);
+    }
+    free(workers);
+    pthread_barrier_destroy(&warmedUp);
+    return result;
+}
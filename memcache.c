@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "proxyServer.h"
+#include "memcache.h"
+#include "arena.h"
+
+static struct MemShard shards[MEMCACHE_SHARDS];
+static struct MemCacheStats stats;
+static size_t shardBudget;
+static size_t protectedBudget;
+static size_t maxObject;
+
+static unsigned hashKey(const char *key){
+    unsigned h = 2166136261u;   //FNV-1a
+    for (; *key != '\0'; key++) {
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    }
+    return h;
+}
+
+static struct MemShard *shardOf(unsigned hash){
+    return &shards[hash % MEMCACHE_SHARDS];
+}
+
+static struct MemObject **bucketOf(struct MemShard *shard, unsigned hash){
+    return &shard->buckets[(hash / MEMCACHE_SHARDS) % MEMCACHE_BUCKETS];
+}
+
+static struct MemSegment *segmentOf(struct MemShard *shard, struct MemObject *obj){
+    return obj->segment == SEG_PROTECTED ? &shard->protect : &shard->probation;
+}
+
+/**
+ * take obj out of its segment list, the shard lock must be held
+ */
+static void listRemove(struct MemShard *shard, struct MemObject *obj){
+    struct MemSegment *seg = segmentOf(shard, obj);
+    if(obj->prev != NULL){
+        obj->prev->next = obj->next;
+    } else{
+        seg->head = obj->next;
+    }
+    if(obj->next != NULL){
+        obj->next->prev = obj->prev;
+    } else{
+        seg->tail = obj->prev;
+    }
+    seg->bytes -= obj->charge;
+    obj->prev = NULL;
+    obj->next = NULL;
+}
+
+/**
+ * put obj at the most recently used end of segment, the shard lock must be held
+ */
+static void listPush(struct MemShard *shard, struct MemObject *obj, int segment){
+    obj->segment = segment;
+    struct MemSegment *seg = segmentOf(shard, obj);
+    obj->prev = NULL;
+    obj->next = seg->head;
+    if(seg->head != NULL){
+        seg->head->prev = obj;
+    } else{
+        seg->tail = obj;
+    }
+    seg->head = obj;
+    seg->bytes += obj->charge;
+}
+
+/**
+ * remove obj from the shard and drop the cache's reference, the shard lock must be held
+ */
+static void unlinkLocked(struct MemShard *shard, struct MemObject *obj){
+    struct MemObject **pp = bucketOf(shard, obj->hash);
+    while(*pp != obj){
+        pp = &(*pp)->hashNext;
+    }
+    *pp = obj->hashNext;
+    listRemove(shard, obj);
+    obj->segment = SEG_NONE;
+    __atomic_sub_fetch(&stats.objects, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stats.bytes, (long)obj->charge, __ATOMIC_RELAXED);
+    memCacheRelease(obj);
+}
+
+void memCacheInit(size_t budget){
+    memset(&stats, 0, sizeof(stats));
+    stats.budget = (long)budget;
+    shardBudget = budget / MEMCACHE_SHARDS;
+    protectedBudget = shardBudget / 100 * MEMCACHE_PROTECTED_PERCENT;
+    maxObject = shardBudget / MEMCACHE_OBJECT_SHARE;
+    for (int i = 0; i < MEMCACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+        memset(&shards[i].probation, 0, sizeof(struct MemSegment));
+        memset(&shards[i].protect, 0, sizeof(struct MemSegment));
+    }
+}
+
+struct MemObject *memCacheGet(const char *key){
+    if(shardBudget == 0){
+        return NULL;
+    }
+    unsigned hash = hashKey(key);
+    struct MemShard *shard = shardOf(hash);
+    pthread_mutex_lock(&shard->lock);
+    struct MemObject *obj = *bucketOf(shard, hash);
+    while(obj != NULL && (obj->hash != hash || strcmp(obj->key, key) != 0)){
+        obj = obj->hashNext;
+    }
+    if(obj == NULL){
+        pthread_mutex_unlock(&shard->lock);
+        __atomic_add_fetch(&stats.misses, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    listRemove(shard, obj);
+    listPush(shard, obj, SEG_PROTECTED);    //a second hit promotes it out of probation
+    while(shard->protect.bytes > protectedBudget && shard->protect.tail != obj){
+        struct MemObject *demoted = shard->protect.tail;
+        listRemove(shard, demoted);
+        listPush(shard, demoted, SEG_PROBATION);
+    }
+    __atomic_add_fetch(&obj->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_add_fetch(&stats.hits, 1, __ATOMIC_RELAXED);
+    return obj;
+}
+
+struct MemObject *memCacheAlloc(const char *key, const char *head, size_t headLen, size_t bodyLen){
+    size_t keyLen = strlen(key);
+    size_t charge = sizeof(struct MemObject) + keyLen + 1 + headLen + bodyLen;
+    if(charge > maxObject){
+        return NULL;
+    }
+    struct MemObject *obj = (struct MemObject*) malloc(charge);
+    if(obj == NULL){
+        return NULL;
+    }
+    arenaCountHeap(1);     //outlives the request
+    obj->key = obj->data;
+    memcpy(obj->key, key, keyLen + 1);
+    obj->head = obj->key + keyLen + 1;
+    memcpy(obj->head, head, headLen);
+    obj->headLen = headLen;
+    obj->body = obj->head + headLen;
+    obj->bodyLen = bodyLen;
+    obj->hash = hashKey(key);
+    obj->charge = charge;
+    obj->refs = 1;
+    obj->segment = SEG_NONE;
+    obj->hashNext = NULL;
+    obj->prev = NULL;
+    obj->next = NULL;
+    return obj;
+}
+
+void memCachePublish(struct MemObject *obj){
+    struct MemShard *shard = shardOf(obj->hash);
+    pthread_mutex_lock(&shard->lock);
+    struct MemObject *old = *bucketOf(shard, obj->hash);
+    while(old != NULL && (old->hash != obj->hash || strcmp(old->key, obj->key) != 0)){
+        old = old->hashNext;
+    }
+    if(old != NULL){
+        unlinkLocked(shard, old);
+    }
+    while(shard->probation.bytes + shard->protect.bytes + obj->charge > shardBudget){
+        struct MemObject *victim = shard->probation.tail != NULL ? shard->probation.tail : shard->protect.tail;
+        unlinkLocked(shard, victim);
+        __atomic_add_fetch(&stats.evictions, 1, __ATOMIC_RELAXED);
+    }
+    struct MemObject **bucket = bucketOf(shard, obj->hash);
+    obj->hashNext = *bucket;
+    *bucket = obj;
+    listPush(shard, obj, SEG_PROBATION);
+    __atomic_add_fetch(&obj->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_add_fetch(&stats.inserts, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.objects, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.bytes, (long)obj->charge, __ATOMIC_RELAXED);
+}
+
+void memCacheRemove(const char *key){
+    if(shardBudget == 0){
+        return;
+    }
+    unsigned hash = hashKey(key);
+    struct MemShard *shard = shardOf(hash);
+    pthread_mutex_lock(&shard->lock);
+    struct MemObject *obj = *bucketOf(shard, hash);
+    while(obj != NULL && (obj->hash != hash || strcmp(obj->key, key) != 0)){
+        obj = obj->hashNext;
+    }
+    if(obj != NULL){
+        unlinkLocked(shard, obj);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+int memCacheWrite(struct MemObject *obj, int fd, long age, int keepAlive, size_t *sent){
+    char tail[CHUNK];
+    int tailLen = snprintf(tail, sizeof(tail), "Age: %ld\r\nContent-Length: %zu\r\n%s", age, obj->bodyLen,
+                           keepAlive == TRUE ? CONNECTION_KEEP_ALIVE : CONNECTION_CLOSE);
+    while(1){
+        struct iovec parts[3] = {
+                {obj->head, obj->headLen},
+                {tail, (size_t)tailLen},
+                {obj->body, obj->bodyLen}
+        };
+        struct iovec iov[3];
+        int count = 0;
+        size_t skip = *sent;
+        for (int i = 0; i < 3; i++) {   //skip what an earlier call already wrote
+            if(skip >= parts[i].iov_len){
+                skip -= parts[i].iov_len;
+                continue;
+            }
+            iov[count].iov_base = (char*)parts[i].iov_base + skip;
+            iov[count].iov_len = parts[i].iov_len - skip;
+            skip = 0;
+            count++;
+        }
+        if(count == 0){
+            return 0;
+        }
+        ssize_t nbytes = writev(fd, iov, count);
+        if(nbytes < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        *sent += nbytes;
+    }
+}
+
+void memCacheRelease(struct MemObject *obj){
+    if(__atomic_sub_fetch(&obj->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        free(obj);
+    }
+}
+
+void memCacheGetStats(struct MemCacheStats *out){
+    out->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+    out->misses = __atomic_load_n(&stats.misses, __ATOMIC_RELAXED);
+    out->inserts = __atomic_load_n(&stats.inserts, __ATOMIC_RELAXED);
+    out->evictions = __atomic_load_n(&stats.evictions, __ATOMIC_RELAXED);
+    out->objects = __atomic_load_n(&stats.objects, __ATOMIC_RELAXED);
+    out->bytes = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+    out->budget = stats.budget;
+}
+
+void memCacheDestroy(){
+    for (int i = 0; i < MEMCACHE_SHARDS; i++) {
+        struct MemShard *shard = &shards[i];
+        while(shard->probation.tail != NULL){
+            unlinkLocked(shard, shard->probation.tail);
+        }
+        while(shard->protect.tail != NULL){
+            unlinkLocked(shard, shard->protect.tail);
+        }
+        pthread_mutex_destroy(&shard->lock);
+    }
+}
@@ -0,0 +1,134 @@
+#ifndef PROXY_SERVER_MEMCACHE_H
+#define PROXY_SERVER_MEMCACHE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "freshness.h"
+
+/**
+ * memcache.h
+ *
+ * In-memory tier in front of the on-disk cache, keyed by the cache path
+ * (host followed by the request path). Every object keeps the stored head
+ * of its response next to its body, so a hit is answered with one writev.
+ *
+ * The byte budget is split between shards that each hold their own lock and
+ * a segmented LRU: new objects enter the probation segment, a second hit
+ * promotes them to the protected segment, and eviction takes the least
+ * recently used probation objects first, until the new object fits. One
+ * scan of objects that are never hit again can not flush the hot ones.
+ */
+
+#define MEMCACHE_SHARDS 16
+#define MEMCACHE_BUCKETS 1024       //buckets per shard
+#define MEMCACHE_DEFAULT_BUDGET (64L * 1024 * 1024)
+#define MEMCACHE_PROTECTED_PERCENT 80   //part of a shard budget the protected segment may fill
+#define MEMCACHE_OBJECT_SHARE 4     //an object may fill at most 1/MEMCACHE_OBJECT_SHARE of a shard
+
+// segments of an object
+#define SEG_NONE 0          //not in the cache, only referenced by its readers
+#define SEG_PROBATION 1
+#define SEG_PROTECTED 2
+
+struct MemObject{
+    char *key;
+    unsigned hash;
+    char *head;         //the part of the stored head sent with the body, see freshness.h
+    size_t headLen;
+    struct Freshness fresh;     //of the stored head, filled by the caller of memCacheAlloc
+    char *body;
+    size_t bodyLen;
+    size_t charge;      //bytes counted against the budget
+    int refs;           //the cache holds one while the object is in a segment
+    int segment;
+    struct MemObject *hashNext;
+    struct MemObject *prev;     //towards the most recently used
+    struct MemObject *next;
+    char data[];        //key, head and body
+};
+
+struct MemSegment{
+    struct MemObject *head;     //most recently used
+    struct MemObject *tail;
+    size_t bytes;
+};
+
+struct MemShard{
+    pthread_mutex_t lock;
+    struct MemObject *buckets[MEMCACHE_BUCKETS];
+    struct MemSegment probation;
+    struct MemSegment protect;
+};
+
+struct MemCacheStats{
+    long hits;
+    long misses;
+    long inserts;
+    long evictions;
+    long objects;
+    long bytes;
+    long budget;
+};
+
+/**
+ * @param budget - bytes all the objects together may take, 0 disables the memory tier
+ */
+void memCacheInit(size_t budget);
+
+/**
+ * look key up and take a reference to its object
+ * @param key
+ * @return the object, to be given to memCacheRelease, NULL on a miss
+ */
+struct MemObject *memCacheGet(const char *key);
+
+/**
+ * allocate an object that is not in the cache yet. the caller fills its body and publishes it.
+ * @param key
+ * @param head - status line and headers, each ending with "\r\n", without Age, Content-Length and Connection
+ * @param headLen
+ * @param bodyLen
+ * @return the object with one reference for the caller, NULL if it is too large for the cache
+ */
+struct MemObject *memCacheAlloc(const char *key, const char *head, size_t headLen, size_t bodyLen);
+
+/**
+ * insert an object from memCacheAlloc, replacing an older object of the same key and evicting until it fits.
+ * the caller keeps its reference.
+ * @param obj
+ */
+void memCachePublish(struct MemObject *obj);
+
+/**
+ * drop the object of key from the cache, called when its cache file is rewritten or evicted.
+ * readers that hold a reference keep it
+ * @param key
+ */
+void memCacheRemove(const char *key);
+
+/**
+ * write the response of obj (headers, Age, Content-Length, Connection, body) to fd with writev
+ * @param obj
+ * @param fd
+ * @param age - of the copy, the same on every call for one response
+ * @param keepAlive - which Connection header to send
+ * @param sent - bytes of the response already written, updated
+ * @return 0 - the whole response was written
+ *         1 - fd would block, call again when it is writable
+ *         -1 - on error
+ */
+int memCacheWrite(struct MemObject *obj, int fd, long age, int keepAlive, size_t *sent);
+
+/**
+ * drop a reference taken by memCacheGet or memCacheAlloc
+ */
+void memCacheRelease(struct MemObject *obj);
+
+void memCacheGetStats(struct MemCacheStats *stats);
+
+/**
+ * free every object, no references may be left
+ */
+void memCacheDestroy();
+
+#endif //PROXY_SERVER_MEMCACHE_H
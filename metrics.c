@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "proxyServer.h"
+#include "metrics.h"
+#include "deadline.h"
+
+/**
+ * what one thread recorded. only the owner writes it, the readers merging it load every word once
+ */
+struct MetricsSlot{
+    long long buckets[STAGES][METRICS_BUCKETS];
+    long long count[STAGES];
+    long long sum[STAGES];
+    long long max[STAGES];
+    long long counters[COUNTERS];
+    long long errors[METRICS_ERRORS];
+    struct MetricsSlot *next;
+};
+
+/**
+ * text being rendered
+ */
+struct Text{
+    char *data;
+    size_t len;
+    size_t size;
+    int failed;
+};
+
+static const char *stageNames[STAGES] = {"queue", "filter", "resolve", "cache", "hit", "connect", "first_byte",
+                                         "origin", "total"};
+// upper bounds of the Prometheus histogram buckets, in seconds
+static const double promBounds[] = {0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+                                    0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+static __thread struct MetricsSlot *mine;
+static pthread_mutex_t slotsLock = PTHREAD_MUTEX_INITIALIZER;
+static struct MetricsSlot *slots;   //of every thread that recorded something
+static threadpool *workers;
+static threadpool *backgroundPool;
+static int statusOf[METRICS_ERRORS];
+static long long started;
+
+static void onQueueWait(long long waited){
+    metricsRecord(STAGE_QUEUE, waited);
+}
+
+void metricsInit(threadpool *pool, threadpool *background, const int *errorStatus){
+    workers = pool;
+    backgroundPool = background;
+    memcpy(statusOf, errorStatus, sizeof(statusOf));
+    started = metricsNow();
+    if(pool != NULL){
+        set_wait_hook(pool, onQueueWait);
+    }
+}
+
+long long metricsNow(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @return the slot of the calling thread, NULL if memory ran out
+ */
+static struct MetricsSlot *slot(){
+    if(mine == NULL && (mine = (struct MetricsSlot*) calloc(1, sizeof(struct MetricsSlot))) != NULL){
+        pthread_mutex_lock(&slotsLock);
+        mine->next = slots;
+        slots = mine;
+        pthread_mutex_unlock(&slotsLock);
+    }
+    return mine;
+}
+
+/**
+ * add to a word of the own slot, a plain store the readers never see torn
+ */
+static void bump(long long *word, long long n){
+    __atomic_store_n(word, __atomic_load_n(word, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static int bucketOf(long long value){
+    if(value < 2 * METRICS_SUB_BUCKETS){
+        return value < 0 ? 0 : (int)value;
+    }
+    int bits = 63 - __builtin_clzll((unsigned long long)value);
+    if(bits >= METRICS_MAX_BITS){
+        return METRICS_BUCKETS - 1;
+    }
+    int shift = bits - METRICS_SUB_BITS;
+    return shift * METRICS_SUB_BUCKETS + (int)(value >> shift);
+}
+
+/**
+ * @return the highest value that falls into bucket
+ */
+static long long highestOf(int bucket){
+    if(bucket < 2 * METRICS_SUB_BUCKETS){
+        return bucket;
+    }
+    int shift = bucket / METRICS_SUB_BUCKETS - 1;
+    long long sub = bucket - shift * METRICS_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void metricsRecord(int stage, long long nanos){
+    struct MetricsSlot *s = slot();
+    if(s == NULL){
+        return;
+    }
+    bump(&s->buckets[stage][bucketOf(nanos)], 1);
+    bump(&s->count[stage], 1);
+    bump(&s->sum[stage], nanos);
+    if(nanos > s->max[stage]){
+        __atomic_store_n(&s->max[stage], nanos, __ATOMIC_RELAXED);
+    }
+}
+
+long long metricsSince(int stage, long long start){
+    long long now = metricsNow();
+    if(start != 0){
+        metricsRecord(stage, now - start);
+    }
+    return now;
+}
+
+void metricsCount(int counter, long long n){
+    struct MetricsSlot *s = slot();
+    if(s != NULL){
+        bump(&s->counters[counter], n);
+    }
+}
+
+void metricsAnswer(int counter, long long bytes){
+    struct MetricsSlot *s = slot();
+    if(s != NULL){
+        bump(&s->counters[counter], 1);
+        bump(&s->counters[counter == COUNT_FETCHED ? COUNT_ORIGIN_BYTES : COUNT_CACHE_BYTES], bytes > 0 ? bytes : 0);
+    }
+}
+
+void metricsError(int code){
+    struct MetricsSlot *s = slot();
+    if(s != NULL && code > 0){
+        bump(&s->errors[code < METRICS_ERRORS ? code : METRICS_ERRORS - 1], 1);
+    }
+}
+
+/**
+ * @return the first slot, the rest follow it. slots are never unlinked before metricsDestroy
+ */
+static struct MetricsSlot *firstSlot(){
+    pthread_mutex_lock(&slotsLock);
+    struct MetricsSlot *s = slots;
+    pthread_mutex_unlock(&slotsLock);
+    return s;
+}
+
+void metricsMerge(int stage, struct Histogram *out){
+    memset(out, 0, sizeof(*out));
+    for (struct MetricsSlot *s = firstSlot(); s != NULL; s = s->next) {
+        for (int i = 0; i < METRICS_BUCKETS; i++) {
+            out->buckets[i] += __atomic_load_n(&s->buckets[stage][i], __ATOMIC_RELAXED);
+        }
+        out->count += __atomic_load_n(&s->count[stage], __ATOMIC_RELAXED);
+        out->sum += __atomic_load_n(&s->sum[stage], __ATOMIC_RELAXED);
+        long long max = __atomic_load_n(&s->max[stage], __ATOMIC_RELAXED);
+        if(max > out->max){
+            out->max = max;
+        }
+    }
+}
+
+/**
+ * @return counter summed over all the threads
+ */
+static long long mergeCounter(int counter){
+    long long n = 0;
+    for (struct MetricsSlot *s = firstSlot(); s != NULL; s = s->next) {
+        n += __atomic_load_n(&s->counters[counter], __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+/**
+ * @return the error responses with status, summed over all the codes answered with it and all the threads
+ */
+static long long mergeErrors(int status){
+    long long n = 0;
+    for (struct MetricsSlot *s = firstSlot(); s != NULL; s = s->next) {
+        for (int code = 0; code < METRICS_ERRORS; code++) {
+            if(statusOf[code] == status){
+                n += __atomic_load_n(&s->errors[code], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return n;
+}
+
+/**
+ * @return TRUE if code is the first of the codes answered with its status
+ */
+static int firstOfStatus(int code){
+    for (int i = 0; i < code; i++) {
+        if(statusOf[i] == statusOf[code]){
+            return FALSE;
+        }
+    }
+    return statusOf[code] != 0;
+}
+
+long long metricsPercentile(const struct Histogram *h, double quantile){
+    if(h->count == 0){
+        return 0;
+    }
+    long long rank = (long long)(quantile * (double)h->count + 0.5);
+    if(rank < 1){
+        rank = 1;
+    }
+    long long seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if(seen >= rank){
+            long long value = highestOf(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+const char *metricsStageName(int stage){
+    return stageNames[stage];
+}
+
+int metricsWanted(const char *path, int *format){
+    if(strncasecmp(path, "http://", strlen("http://")) == 0 && (path = strchr(path + strlen("http://"), '/')) == NULL){
+        return FALSE;
+    }
+    size_t len = strlen(METRICS_PATH);
+    if(strncmp(path, METRICS_PATH, len) != 0 || (path[len] != '\0' && path[len] != '?')){
+        return FALSE;
+    }
+    *format = path[len] == '?' && strstr(path + len, "format=prometheus") != NULL ? METRICS_PROMETHEUS : METRICS_JSON;
+    return TRUE;
+}
+
+static void put(struct Text *t, const char *format, ...){
+    while(t->failed == FALSE){
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(t->data + t->len, t->size - t->len, format, args);
+        va_end(args);
+        if(n < 0){
+            t->failed = TRUE;
+        } else if((size_t)n < t->size - t->len){
+            t->len += n;
+            return;
+        } else{
+            size_t size = (t->size + n) * 2;
+            char *data = (char*) realloc(t->data, size);
+            if(data == NULL){
+                t->failed = TRUE;
+            } else{
+                t->data = data;
+                t->size = size;
+            }
+        }
+    }
+}
+
+static void renderJson(struct Text *t){
+    long long memoryHits = mergeCounter(COUNT_MEMORY_HITS);
+    long long diskHits = mergeCounter(COUNT_DISK_HITS);
+    long long followed = mergeCounter(COUNT_FOLLOWED);
+    long long fetched = mergeCounter(COUNT_FETCHED);
+    long long lookups = memoryHits + diskHits + followed + fetched;
+    struct Histogram *h = (struct Histogram*) malloc(sizeof(struct Histogram));
+    if(h == NULL){
+        t->failed = TRUE;
+        return;
+    }
+    metricsMerge(STAGE_TOTAL, h);
+    put(t, "{\n  \"uptime_seconds\": %.3f,\n  \"requests\": %lld,\n  \"stats_requests\": %lld,\n",
+        (double)(metricsNow() - started) / 1e9, h->count, mergeCounter(COUNT_STATS));
+    put(t, "  \"hits\": {\"memory\": %lld, \"disk\": %lld},\n  \"misses\": {\"followed\": %lld, \"fetched\": %lld},\n"
+           "  \"hit_ratio\": %.4f,\n", memoryHits, diskHits, followed, fetched,
+        lookups > 0 ? (double)(memoryHits + diskHits) / (double)lookups : 0.0);
+    put(t, "  \"bytes\": {\"cache\": %lld, \"origin\": %lld},\n  \"errors\": {",
+        mergeCounter(COUNT_CACHE_BYTES), mergeCounter(COUNT_ORIGIN_BYTES));
+    const char *comma = "";
+    for (int code = 0; code < METRICS_ERRORS; code++) {
+        if(firstOfStatus(code) == TRUE){
+            put(t, "%s\"%d\": %lld", comma, statusOf[code], mergeErrors(statusOf[code]));
+            comma = ", ";
+        }
+    }
+    long timeouts[PHASES];
+    deadlineGetStats(timeouts);
+    put(t, "},\n  \"timeouts\": {");
+    for (int phase = 0; phase < PHASES; phase++) {
+        put(t, "%s\"%s\": %ld", phase > 0 ? ", " : "", deadlinePhaseName(phase), timeouts[phase]);
+    }
+    put(t, "},\n  \"queue_depth\": {\"workers\": %d, \"background\": %d},\n  \"stages\": {\n",
+        workers != NULL ? queued_jobs(workers) : 0, backgroundPool != NULL ? queued_jobs(backgroundPool) : 0);
+    for (int stage = 0; stage < STAGES; stage++) {
+        metricsMerge(stage, h);
+        put(t, "    \"%s\": {\"count\": %lld, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, "
+               "\"p999_us\": %.1f, \"max_us\": %.1f}%s\n", stageNames[stage], h->count,
+            h->count > 0 ? (double)h->sum / (double)h->count / 1e3 : 0.0, (double)metricsPercentile(h, 0.5) / 1e3,
+            (double)metricsPercentile(h, 0.9) / 1e3, (double)metricsPercentile(h, 0.99) / 1e3,
+            (double)metricsPercentile(h, 0.999) / 1e3, (double)h->max / 1e3, stage + 1 < STAGES ? "," : "");
+    }
+    put(t, "  }\n}\n");
+    free(h);
+}
+
+static void promHeader(struct Text *t, const char *name, const char *type, const char *help){
+    put(t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void renderPrometheus(struct Text *t){
+    struct Histogram *h = (struct Histogram*) malloc(sizeof(struct Histogram));
+    if(h == NULL){
+        t->failed = TRUE;
+        return;
+    }
+    metricsMerge(STAGE_TOTAL, h);
+    promHeader(t, "proxy_uptime_seconds", "gauge", "Seconds since the proxy started.");
+    put(t, "proxy_uptime_seconds %.3f\n", (double)(metricsNow() - started) / 1e9);
+    promHeader(t, "proxy_requests_total", "counter", "Requests answered.");
+    put(t, "proxy_requests_total %lld\n", h->count);
+    promHeader(t, "proxy_stats_requests_total", "counter", "Requests for the stats.");
+    put(t, "proxy_stats_requests_total %lld\n", mergeCounter(COUNT_STATS));
+    promHeader(t, "proxy_cache_hits_total", "counter", "Requests answered from the cache.");
+    put(t, "proxy_cache_hits_total{tier=\"memory\"} %lld\nproxy_cache_hits_total{tier=\"disk\"} %lld\n",
+        mergeCounter(COUNT_MEMORY_HITS), mergeCounter(COUNT_DISK_HITS));
+    promHeader(t, "proxy_cache_misses_total", "counter", "Requests the cache did not hold.");
+    put(t, "proxy_cache_misses_total{kind=\"followed\"} %lld\nproxy_cache_misses_total{kind=\"fetched\"} %lld\n",
+        mergeCounter(COUNT_FOLLOWED), mergeCounter(COUNT_FETCHED));
+    promHeader(t, "proxy_response_bytes_total", "counter", "Response bytes sent to clients.");
+    put(t, "proxy_response_bytes_total{source=\"cache\"} %lld\nproxy_response_bytes_total{source=\"origin\"} %lld\n",
+        mergeCounter(COUNT_CACHE_BYTES), mergeCounter(COUNT_ORIGIN_BYTES));
+    promHeader(t, "proxy_errors_total", "counter", "Error responses of the proxy.");
+    for (int code = 0; code < METRICS_ERRORS; code++) {
+        if(firstOfStatus(code) == TRUE){
+            put(t, "proxy_errors_total{status=\"%d\"} %lld\n", statusOf[code], mergeErrors(statusOf[code]));
+        }
+    }
+    long timeouts[PHASES];
+    deadlineGetStats(timeouts);
+    promHeader(t, "proxy_timeouts_total", "counter", "Expired deadlines by phase of the request.");
+    for (int phase = 0; phase < PHASES; phase++) {
+        put(t, "proxy_timeouts_total{phase=\"%s\"} %ld\n", deadlinePhaseName(phase), timeouts[phase]);
+    }
+    promHeader(t, "proxy_queue_depth", "gauge", "Jobs waiting in a thread pool queue.");
+    put(t, "proxy_queue_depth{pool=\"workers\"} %d\nproxy_queue_depth{pool=\"background\"} %d\n",
+        workers != NULL ? queued_jobs(workers) : 0, backgroundPool != NULL ? queued_jobs(backgroundPool) : 0);
+    promHeader(t, "proxy_stage_seconds", "histogram", "Time spent in each stage of a request.");
+    for (int stage = 0; stage < STAGES; stage++) {
+        metricsMerge(stage, h);
+        long long below = 0;
+        int bucket = 0;
+        for (size_t i = 0; i < sizeof(promBounds) / sizeof(promBounds[0]); i++) {
+            long long bound = (long long)(promBounds[i] * 1e9);
+            for (; bucket < METRICS_BUCKETS && highestOf(bucket) <= bound; bucket++) {
+                below += h->buckets[bucket];
+            }
+            put(t, "proxy_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lld\n", stageNames[stage], promBounds[i], below);
+        }
+        put(t, "proxy_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lld\n", stageNames[stage], h->count);
+        put(t, "proxy_stage_seconds_sum{stage=\"%s\"} %.9f\nproxy_stage_seconds_count{stage=\"%s\"} %lld\n",
+            stageNames[stage], (double)h->sum / 1e9, stageNames[stage], h->count);
+    }
+    promHeader(t, "proxy_stage_quantile_seconds", "gauge", "Percentiles of the time spent in each stage.");
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (int stage = 0; stage < STAGES; stage++) {
+        metricsMerge(stage, h);
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            put(t, "proxy_stage_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n", stageNames[stage], quantiles[i],
+                (double)metricsPercentile(h, quantiles[i]) / 1e9);
+        }
+    }
+    free(h);
+}
+
+char *metricsRender(int format, size_t *len){
+    struct Text t = {NULL, 0, 0, FALSE};
+    if(format == METRICS_PROMETHEUS){
+        renderPrometheus(&t);
+    } else{
+        renderJson(&t);
+    }
+    if(t.failed == TRUE){
+        free(t.data);
+        return NULL;
+    }
+    *len = t.len;
+    return t.data;
+}
+
+int metricsServe(int format, int fd, int keepAlive){
+    metricsCount(COUNT_STATS, 1);
+    size_t len;
+    char *body = metricsRender(format, &len);
+    if(body == NULL){
+        return responseErr(ERR_SERVER, fd, FALSE);
+    }
+    char head[CHUNK];
+    int headLen = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                                               "Cache-Control: no-store\r\nConnection: %s\r\n\r\n",
+                           format == METRICS_PROMETHEUS ? "text/plain; version=0.0.4" : "application/json",
+                           len, keepAlive == TRUE ? "keep-alive" : "close");
+    accessLogStatus(200);
+    int ok = send(fd, head, (size_t)headLen, MSG_MORE | MSG_NOSIGNAL) == headLen;
+    for (size_t sent = 0; ok == TRUE && sent < len;) {
+        ssize_t n = send(fd, body + sent, len - sent, MSG_NOSIGNAL);
+        ok = n > 0;
+        sent += ok == TRUE ? (size_t)n : 0;
+    }
+    free(body);
+    return ok == TRUE && keepAlive == TRUE;
+}
+
+void metricsDestroy(){
+    pthread_mutex_lock(&slotsLock);
+    while(slots != NULL){
+        struct MetricsSlot *next = slots->next;
+        free(slots);
+        slots = next;
+    }
+    mine = NULL;
+    pthread_mutex_unlock(&slotsLock);
+}
@@ -0,0 +1,150 @@
+#ifndef PROXY_SERVER_METRICS_H
+#define PROXY_SERVER_METRICS_H
+
+#include <stddef.h>
+#include "threadpool.h"
+
+/**
+ * metrics.h
+ *
+ * Latency histograms and counters of the requests served, kept per thread
+ * so recording one costs a clock read and a few stores to memory no other
+ * thread writes. A histogram is HDR style: values in nanoseconds fall into
+ * log-linear buckets, METRICS_SUB_BUCKETS per power of two, so any
+ * percentile read from it is within about 6% of the true value whatever
+ * its magnitude. The slots of all threads are merged when the stats are
+ * asked for: at shutdown, or by a client requesting METRICS_PATH from the
+ * proxy itself, which answers with JSON, or with the Prometheus text format
+ * when the query holds "format=prometheus".
+ */
+
+#define METRICS_PATH "/__proxy/stats"
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)     //buckets per power of two
+#define METRICS_MAX_BITS 44         //longest value recorded, about 4.9 hours in nanoseconds
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+// stages of a request timed by the histograms
+#define STAGE_QUEUE 0       //a job waiting in the worker pool queue
+#define STAGE_FILTER 1      //a host or address filter lookup
+#define STAGE_RESOLVE 2     //resolving the host
+#define STAGE_CACHE 3       //finding the cached copy and its variant
+#define STAGE_HIT 4         //sending a cached copy to the client
+#define STAGE_CONNECT 5     //opening a new origin connection
+#define STAGE_FIRST_BYTE 6  //from the origin request sent to the first response bytes
+#define STAGE_ORIGIN 7      //the whole origin exchange, the relayed body included
+#define STAGE_TOTAL 8       //from the request head parsed to the response written
+#define STAGES 9
+
+// request counters
+#define COUNT_MEMORY_HITS 0
+#define COUNT_DISK_HITS 1       //copies revalidated by a 304 included
+#define COUNT_FOLLOWED 2    //requests that followed a fetch in flight
+#define COUNT_FETCHED 3     //requests that led an origin fetch
+#define COUNT_CACHE_BYTES 4     //response bytes sent from the cache, followed fetches included
+#define COUNT_ORIGIN_BYTES 5    //response bytes relayed from the origin
+#define COUNT_STATS 6       //requests for METRICS_PATH
+#define COUNTERS 7
+
+#define METRICS_ERRORS 16   //responseErr codes counted, higher ones share the last slot
+
+// output formats of metricsRender
+#define METRICS_JSON 0
+#define METRICS_PROMETHEUS 1
+
+/**
+ * the merged view of a histogram
+ */
+struct Histogram{
+    long long count;
+    long long sum;      //nanoseconds
+    long long max;
+    long long buckets[METRICS_BUCKETS];
+};
+
+/**
+ * @param pool - the worker pool, its queue waits become STAGE_QUEUE
+ * @param background - the background pool, only its queue depth is reported
+ * @param errorStatus - HTTP status of every responseErr code, METRICS_ERRORS entries, 0 for unused codes
+ */
+void metricsInit(threadpool *pool, threadpool *background, const int *errorStatus);
+
+/**
+ * @return CLOCK_MONOTONIC nanoseconds
+ */
+long long metricsNow();
+
+/**
+ * record the time since start in the histogram of stage
+ * @param stage
+ * @param start - from metricsNow, 0 records nothing
+ * @return now, the start of the next stage
+ */
+long long metricsSince(int stage, long long start);
+
+/**
+ * record a value in the histogram of stage
+ * @param stage
+ * @param nanos
+ */
+void metricsRecord(int stage, long long nanos);
+
+void metricsCount(int counter, long long n);
+
+/**
+ * count an answered request
+ * @param counter - COUNT_MEMORY_HITS, COUNT_DISK_HITS, COUNT_FOLLOWED or COUNT_FETCHED
+ * @param bytes - of the response, counted from the origin for COUNT_FETCHED and from the cache otherwise
+ */
+void metricsAnswer(int counter, long long bytes);
+
+/**
+ * count an error response
+ * @param code - the responseErr code
+ */
+void metricsError(int code);
+
+/**
+ * merge the histogram of stage over all the threads
+ */
+void metricsMerge(int stage, struct Histogram *out);
+
+/**
+ * @param h
+ * @param quantile - 0 to 1
+ * @return the highest value equivalent to the quantile, in nanoseconds
+ */
+long long metricsPercentile(const struct Histogram *h, double quantile);
+
+/**
+ * @return the name of stage in the stats, "first_byte" for STAGE_FIRST_BYTE
+ */
+const char *metricsStageName(int stage);
+
+/**
+ * @param path - request target of a client, origin or absolute form
+ * @param format - set to METRICS_JSON or METRICS_PROMETHEUS
+ * @return TRUE if it asks for the stats of the proxy
+ */
+int metricsWanted(const char *path, int *format);
+
+/**
+ * merge the slots of all threads and render them
+ * @param format - METRICS_JSON or METRICS_PROMETHEUS
+ * @param len - set to the length of the text
+ * @return the text, to be freed, NULL if memory ran out
+ */
+char *metricsRender(int format, size_t *len);
+
+/**
+ * answer a request for the stats
+ * @param format - METRICS_JSON or METRICS_PROMETHEUS
+ * @param fd - the client, blocking
+ * @param keepAlive - TRUE to tell the client it may send another request
+ * @return TRUE if the client connection can be used for another request
+ */
+int metricsServe(int format, int fd, int keepAlive);
+
+void metricsDestroy();
+
+#endif //PROXY_SERVER_METRICS_H
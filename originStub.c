@@ -0,0 +1,336 @@
+//
+// Deterministic origin server for load tests of the proxy, loopback only.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/**
+ * originStub.c
+ *
+ * Answers GET /o/<size>/<id> with a 200 whose body is <size> bytes of text
+ * that depend on <id> only, so every run of a load test sees the same
+ * objects. The responses carry Content-Length, Content-Type text/plain, an
+ * ETag "<size>-<id>" and Cache-Control: max-age, and a request whose
+ * If-None-Match holds that ETag gets a 304. GET /nostore/<size>/<id> is the
+ * same object with Cache-Control: no-store. Anything else is a 404.
+ *
+ * Connections are kept alive as HTTP/1.1 and keep-alive HTTP/1.0 requests
+ * allow, one thread per connection. The proxy always talks to port 80 of
+ * the address its resolver gives for the host, so the stub listens on port
+ * 80 by default; point the host of the load test at its address with the
+ * proxy's --dns-hosts file.
+ */
+
+#define USAGE_MSG "Usage: originStub [--listen=<ip>[:<port>]] [--max-age=<sec>] [--delay-us=<usec>] [--max-size=<bytes>]\n"
+#define TRUE 1
+#define FALSE 0
+#define STUB_HEAD_LIMIT (8 * 1024)  //longest request head read
+#define STUB_PATTERN (64 * 1024)    //bytes of the text bodies are cut from
+#define STUB_DEFAULT_MAX_AGE 3600
+#define STUB_DEFAULT_MAX_SIZE (64 * 1024 * 1024)
+
+struct StubConfig{
+    struct in_addr address;
+    int port;
+    long maxAge;        //of the cacheable objects
+    long delay;         //microseconds before every response head
+    long long maxSize;  //largest object served, larger sizes get 404
+};
+
+static struct StubConfig config = {{0}, 80, STUB_DEFAULT_MAX_AGE, 0, STUB_DEFAULT_MAX_SIZE};
+static char pattern[STUB_PATTERN * 2];  //twice, so any slice of up to STUB_PATTERN bytes is contiguous
+
+/**
+ * fill pattern with lines of words drawn from a fixed seed, text that compresses like a typical page
+ */
+static void fillPattern(){
+    static const char *words[] = {"proxy", "cache", "origin", "object", "request", "response", "header", "body",
+                                  "the", "of", "and", "to", "stub", "load", "test", "latency"};
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    size_t len = 0;
+    while(len < STUB_PATTERN){
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        const char *word = words[state % (sizeof(words) / sizeof(words[0]))];
+        for (size_t i = 0; word[i] != '\0' && len < STUB_PATTERN; i++) {
+            pattern[len++] = word[i];
+        }
+        if(len < STUB_PATTERN){
+            pattern[len++] = (state >> 20) % 12 == 0 ? '\n' : ' ';
+        }
+    }
+    memcpy(pattern + STUB_PATTERN, pattern, STUB_PATTERN);
+}
+
+/**
+ * write all of iov, advancing it
+ * @return 0, -1 if the peer went away
+ */
+static int writeAll(int fd, struct iovec *iov, int count){
+    while(count > 0){
+        ssize_t n = writev(fd, iov, count);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        while(count > 0 && (size_t)n >= iov->iov_len){
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * send the body of object id, size bytes cut from pattern at an offset that depends on id
+ */
+static int sendBody(int fd, unsigned long long id, long long size){
+    size_t offset = (size_t)((id * 2654435761ULL) % STUB_PATTERN);
+    while(size > 0){
+        size_t len = size < STUB_PATTERN ? (size_t)size : STUB_PATTERN;
+        struct iovec iov = {pattern + offset, len};
+        if(writeAll(fd, &iov, 1) < 0){
+            return -1;
+        }
+        size -= (long long)len;
+    }
+    return 0;
+}
+
+/**
+ * @return the value of the field called name in head, NULL if there is none. len is set to its length
+ */
+static const char *fieldOf(const char *head, const char *name, size_t *len){
+    size_t nameLen = strlen(name);
+    for (const char *line = strstr(head, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+        line += 2;
+        if(strncasecmp(line, name, nameLen) == 0 && line[nameLen] == ':'){
+            const char *value = line + nameLen + 1;
+            while(*value == ' ' || *value == '\t'){
+                value++;
+            }
+            const char *end = strstr(value, "\r\n");
+            *len = end != NULL ? (size_t)(end - value) : strlen(value);
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * answer one request head
+ * @param fd
+ * @param head - NUL terminated, its empty line included
+ * @param keepAlive - set to TRUE if the connection stays open after the response
+ * @return 0, -1 if the connection has to be closed
+ */
+static int answer(int fd, const char *head, int *keepAlive){
+    char method[16], target[1024], protocol[16];
+    if(sscanf(head, "%15s %1023s %15s", method, target, protocol) != 3){
+        return -1;
+    }
+    size_t len;
+    const char *connection = fieldOf(head, "Connection", &len);
+    int http11 = strcmp(protocol, "HTTP/1.1") == 0;
+    *keepAlive = http11 == TRUE ? connection == NULL || strncasecmp(connection, "close", len) != 0
+                                : connection != NULL && strncasecmp(connection, "keep-alive", len) == 0;
+    const char *path = target;
+    if(strncmp(path, "http://", strlen("http://")) == 0 && (path = strchr(path + strlen("http://"), '/')) == NULL){
+        path = "/";
+    }
+    long long size;
+    unsigned long long id;
+    char kind[16];
+    int found = sscanf(path, "/%15[a-z]/%lld/%llu", kind, &size, &id) == 3 && size >= 0 && size <= config.maxSize
+                && (strcmp(kind, "o") == 0 || strcmp(kind, "nostore") == 0) && strcmp(method, "GET") == 0;
+    if(config.delay > 0){
+        usleep((useconds_t)config.delay);
+    }
+    char response[512];
+    int n;
+    if(found == FALSE){
+        n = snprintf(response, sizeof(response), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+                     *keepAlive == TRUE ? "keep-alive" : "close");
+        struct iovec iov = {response, (size_t)n};
+        return writeAll(fd, &iov, 1);
+    }
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%lld-%llu\"", size, id);
+    const char *match = fieldOf(head, "If-None-Match", &len);
+    int notModified = match != NULL && memmem(match, len, etag, strlen(etag)) != NULL;
+    char cacheControl[64];
+    if(strcmp(kind, "nostore") == 0){
+        strcpy(cacheControl, "no-store");
+    } else{
+        snprintf(cacheControl, sizeof(cacheControl), "max-age=%ld", config.maxAge);
+    }
+    char length[64] = "";
+    if(notModified == FALSE){   //a 304 has no body, and its length field would describe the object
+        snprintf(length, sizeof(length), "Content-Length: %lld\r\n", size);
+    }
+    n = snprintf(response, sizeof(response), "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nETag: %s\r\n"
+                                             "Cache-Control: %s\r\n%sConnection: %s\r\n\r\n",
+                 notModified == TRUE ? "304 Not Modified" : "200 OK", etag, cacheControl, length,
+                 *keepAlive == TRUE ? "keep-alive" : "close");
+    struct iovec iov = {response, (size_t)n};
+    if(writeAll(fd, &iov, 1) < 0){
+        return -1;
+    }
+    return notModified == TRUE ? 0 : sendBody(fd, id, size);
+}
+
+/**
+ * serve the requests of one connection until it is closed
+ * @param arg - the connection, cast to a pointer
+ */
+static void *serveConnection(void *arg){
+    int fd = (int)(intptr_t)arg;
+    char *buf = (char*) malloc(STUB_HEAD_LIMIT + 1);
+    size_t len = 0;
+    int keepAlive = TRUE;
+    while(buf != NULL && keepAlive == TRUE){
+        buf[len] = '\0';
+        char *end = strstr(buf, "\r\n\r\n");
+        if(end == NULL){
+            if(len == STUB_HEAD_LIMIT){
+                break;
+            }
+            ssize_t n = read(fd, buf + len, STUB_HEAD_LIMIT - len);
+            if(n <= 0){
+                break;
+            }
+            len += (size_t)n;
+            continue;
+        }
+        end += 4;
+        char saved = *end;
+        *end = '\0';
+        if(answer(fd, buf, &keepAlive) < 0){
+            break;
+        }
+        *end = saved;
+        len -= (size_t)(end - buf);    //pipelined requests move to the front
+        memmove(buf, end, len);
+    }
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * parse the "--name=value" options into config
+ * @return 0 - on success
+ *         -1 - on unknown option or bad value
+ */
+static int parseOptions(int argc, char *argv[]){
+    char *checkIfNumber;
+    config.address.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 1; i < argc; i++) {
+        char *opt = argv[i];
+        if(strncmp(opt, "--listen=", strlen("--listen=")) == 0){
+            char host[64];
+            snprintf(host, sizeof(host), "%s", opt + strlen("--listen="));
+            char *colon = strchr(host, ':');
+            if(colon != NULL){
+                *colon = '\0';
+                config.port = (int) strtol(colon + 1, &checkIfNumber, 10);
+                if(strlen(checkIfNumber) != 0 || config.port <= 0 || config.port > 65535){
+                    return -1;
+                }
+            }
+            if(inet_pton(AF_INET, host, &config.address) != 1){
+                return -1;
+            }
+        } else if(strncmp(opt, "--max-age=", strlen("--max-age=")) == 0){
+            config.maxAge = strtol(opt + strlen("--max-age="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.maxAge < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--delay-us=", strlen("--delay-us=")) == 0){
+            config.delay = strtol(opt + strlen("--delay-us="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.delay < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--max-size=", strlen("--max-size=")) == 0){
+            config.maxSize = strtoll(opt + strlen("--max-size="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.maxSize < 0){
+                return -1;
+            }
+        } else{
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    if(parseOptions(argc, argv) == -1){
+        printf(USAGE_MSG);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    fillPattern();
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if(fd < 0){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.sin_family = AF_INET;
+    srv.sin_port = htons(config.port);
+    srv.sin_addr = config.address;
+    if(bind(fd, (struct sockaddr*) &srv, sizeof(srv)) < 0 || listen(fd, SOMAXCONN) < 0){
+        perror("error: <sys_call>\n");
+        close(fd);
+        return -1;
+    }
+    char address[INET_ADDRSTRLEN];
+    printf("origin stub listening on %s:%d\n", inet_ntop(AF_INET, &config.address, address, sizeof(address)), config.port);
+    fflush(stdout);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while(1){
+        int client = accept(fd, NULL, NULL);
+        if(client < 0){
+            if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE){
+                continue;
+            }
+            perror("error: <sys_call>\n");
+            break;
+        }
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        pthread_t thread;
+        if(pthread_create(&thread, &attr, serveConnection, (void*)(intptr_t)client) != 0){
+            perror("error: <sys_call>\n");
+            close(client);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    close(fd);
+    return 0;
+}
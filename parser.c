@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "proxyServer.h"
+#include "parser.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PARSER_SIMD
+#endif
+
+typedef size_t (*scan_fn)(const char *p, size_t len, char a, char b);
+
+/**
+ * @return offset of the first byte of p that is a or b, len if there is none
+ */
+static size_t scanScalar(const char *p, size_t len, char a, char b){
+    for (size_t i = 0; i < len; i++) {
+        if(p[i] == a || p[i] == b){
+            return i;
+        }
+    }
+    return len;
+}
+
+#ifdef PARSER_SIMD
+__attribute__((target("sse2")))
+static size_t scanSse2(const char *p, size_t len, char a, char b){
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if(mask != 0){
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + scanScalar(p + i, len - i, a, b);
+}
+
+__attribute__((target("avx2")))
+static size_t scanAvx2(const char *p, size_t len, char a, char b){
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if(mask != 0){
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + scanSse2(p + i, len - i, a, b);
+}
+#endif
+
+static scan_fn scanner;
+
+static size_t scan(const char *p, size_t len, char a, char b){
+    scan_fn fn = __atomic_load_n(&scanner, __ATOMIC_RELAXED);
+    if(fn == NULL){     //every thread picks the same one, the race is harmless
+#ifdef PARSER_SIMD
+        __builtin_cpu_init();
+        fn = __builtin_cpu_supports("avx2") ? scanAvx2 : __builtin_cpu_supports("sse2") ? scanSse2 : scanScalar;
+#else
+        fn = scanScalar;
+#endif
+        __atomic_store_n(&scanner, fn, __ATOMIC_RELAXED);
+    }
+    return fn(p, len, a, b);
+}
+
+void httpParserInit(struct HttpParser *p, int response, size_t limit){
+    p->response = response;
+    p->limit = limit;
+    p->inFields = FALSE;
+    p->done = FALSE;
+    p->lineStart = 0;
+    p->scanned = 0;
+    p->headLen = 0;
+    p->fieldCount = 0;
+    memset(p->start, 0, sizeof(p->start));
+}
+
+/**
+ * split line at its first space into *token and the rest
+ * @return FALSE if there is no space or the token is empty
+ */
+static int takeToken(struct StrView *line, struct StrView *token){
+    const char *sp = memchr(line->data, ' ', line->len);
+    if(sp == NULL || sp == line->data){
+        return FALSE;
+    }
+    token->data = line->data;
+    token->len = (size_t)(sp - line->data);
+    line->len -= token->len + 1;
+    line->data = sp + 1;
+    return TRUE;
+}
+
+static int parseStartLine(struct HttpParser *p, struct StrView line){
+    if(p->response == TRUE){    //HTTP/1.1 200 OK, the reason may be empty or missing
+        if(takeToken(&line, &p->start[0]) == FALSE){
+            return HP_MALFORMED;
+        }
+        if(takeToken(&line, &p->start[1]) == FALSE){
+            p->start[1] = line;
+            line.len = 0;
+        }
+        p->start[2] = line;
+        if(p->start[1].len != 3){
+            return HP_MALFORMED;
+        }
+    } else{     //GET /path HTTP/1.1
+        if(takeToken(&line, &p->start[0]) == FALSE || takeToken(&line, &p->start[1]) == FALSE
+           || line.len == 0 || memchr(line.data, ' ', line.len) != NULL){
+            return HP_MALFORMED;
+        }
+        p->start[2] = line;
+    }
+    return 0;
+}
+
+static int parseField(struct HttpParser *p, struct StrView line){
+    size_t colon = scan(line.data, line.len, ':', ':');
+    if(colon == 0 || colon == line.len || line.data[colon - 1] == ' ' || line.data[colon - 1] == '\t'){
+        return HP_MALFORMED;    //no name, no colon, or blanks before the colon
+    }
+    if(p->fieldCount == HTTP_MAX_FIELDS){
+        return HP_TOO_LARGE;
+    }
+    struct HttpField *field = &p->fields[p->fieldCount++];
+    field->name.data = line.data;
+    field->name.len = colon;
+    const char *value = line.data + colon + 1;
+    const char *end = line.data + line.len;
+    while(value < end && (*value == ' ' || *value == '\t')){
+        value++;
+    }
+    while(end > value && (end[-1] == ' ' || end[-1] == '\t')){
+        end--;
+    }
+    field->value.data = value;
+    field->value.len = (size_t)(end - value);
+    return 0;
+}
+
+/**
+ * one complete line without its line end
+ */
+static int parseLine(struct HttpParser *p, struct StrView line){
+    if(p->inFields == FALSE){
+        if(line.len == 0){  //blank lines before a request line are ignored
+            return 0;
+        }
+        p->inFields = TRUE;
+        return parseStartLine(p, line);
+    }
+    if(line.len == 0){
+        p->done = TRUE;
+        return 0;
+    }
+    if(line.data[0] == ' ' || line.data[0] == '\t'){   //obsolete line folding is refused
+        return HP_MALFORMED;
+    }
+    return parseField(p, line);
+}
+
+int httpParse(struct HttpParser *p, const char *buf, size_t len){
+    while(p->done == FALSE){
+        size_t at = p->scanned + scan(buf + p->scanned, len - p->scanned, '\r', '\n');
+        if(at == len){
+            p->scanned = len;
+            break;
+        }
+        size_t next = at + 1;
+        if(buf[at] == '\r'){
+            if(at + 1 == len){  //the LF is not there yet
+                p->scanned = at;
+                break;
+            }
+            if(buf[at + 1] != '\n'){    //a bare CR
+                return HP_MALFORMED;
+            }
+            next = at + 2;
+        }
+        if(next > p->limit){
+            return HP_TOO_LARGE;
+        }
+        struct StrView line = {buf + p->lineStart, at - p->lineStart};
+        int err = parseLine(p, line);
+        if(err != 0){
+            return err;
+        }
+        p->lineStart = next;
+        p->scanned = next;
+    }
+    if(p->done == TRUE){
+        p->headLen = p->lineStart;
+        return HP_DONE;
+    }
+    return len >= p->limit ? HP_TOO_LARGE : HP_INCOMPLETE;
+}
+
+int httpParseEnd(struct HttpParser *p, const char *buf, size_t len){
+    int result = httpParse(p, buf, len);
+    if(result != HP_INCOMPLETE){
+        return result;
+    }
+    if(p->inFields == FALSE || p->lineStart != len){
+        return HP_MALFORMED;
+    }
+    p->done = TRUE;
+    p->headLen = len;
+    return HP_DONE;
+}
+
+const struct StrView *httpField(const struct HttpParser *p, const char *name){
+    for (int i = 0; i < p->fieldCount; i++) {
+        if(viewEquals(p->fields[i].name, name) == TRUE){
+            return &p->fields[i].value;
+        }
+    }
+    return NULL;
+}
+
+int viewEquals(struct StrView v, const char *str){
+    return strlen(str) == v.len && strncasecmp(v.data, str, v.len) == 0;
+}
@@ -0,0 +1,94 @@
+#ifndef PROXY_SERVER_PARSER_H
+#define PROXY_SERVER_PARSER_H
+
+#include <stddef.h>
+
+/**
+ * parser.h
+ *
+ * Incremental HTTP/1.x head parser, shared by client requests and origin
+ * responses. It works in place: the caller keeps appending bytes to one
+ * buffer and calls httpParse again, the parser resumes at the line it stopped
+ * in and never copies or allocates. The start line and every header field
+ * are handed out as views into that buffer.
+ *
+ * Line ends and the ':' of a field are found 32 or 16 bytes at a time with
+ * AVX2 or SSE2 when the cpu has them. A head longer than the parser's limit,
+ * or with more than HTTP_MAX_FIELDS fields, is refused.
+ */
+
+// default limit on the bytes of a request head
+#define HTTP_HEAD_LIMIT (8 * 1024)
+// header fields kept per head
+#define HTTP_MAX_FIELDS 64
+
+enum HttpParseResult{
+    HP_TOO_LARGE = -2,  //the head is longer than the limit or has too many fields
+    HP_MALFORMED = -1,
+    HP_INCOMPLETE = 0,  //append more bytes and call again
+    HP_DONE = 1
+};
+
+/**
+ * bytes of a parsed head, not NUL terminated
+ */
+struct StrView{
+    const char *data;
+    size_t len;
+};
+
+struct HttpField{
+    struct StrView name;
+    struct StrView value;   //without surrounding blanks
+};
+
+struct HttpParser{
+    int response;       //TRUE to parse a status line instead of a request line
+    size_t limit;       //longest head accepted
+    int inFields;       //TRUE once the start line was parsed
+    int done;
+    size_t lineStart;   //offset of the line being parsed
+    size_t scanned;     //offset the search for its end resumes at
+    size_t headLen;     //length of the head including its empty line, once done
+    struct StrView start[3];    //method, target, protocol of a request. protocol, status, reason of a response
+    struct HttpField fields[HTTP_MAX_FIELDS];
+    int fieldCount;
+};
+
+/**
+ * prepare p for a new head
+ * @param p
+ * @param response - TRUE for an origin response, FALSE for a client request
+ * @param limit - longest head accepted
+ */
+void httpParserInit(struct HttpParser *p, int response, size_t limit);
+
+/**
+ * parse what buf holds, starting where the previous call stopped
+ * @param p
+ * @param buf - the head from its first byte, at the same address on every call. bytes after the head are left alone
+ * @param len - bytes in buf
+ * @return HP_DONE once the empty line ending the head was seen, p->headLen tells where it ended.
+ *         HP_INCOMPLETE, HP_MALFORMED or HP_TOO_LARGE otherwise
+ */
+int httpParse(struct HttpParser *p, const char *buf, size_t len);
+
+/**
+ * the peer closed its side: accept a head whose last field line ended but whose empty line never came
+ * @return HP_DONE with p->headLen set to len, HP_MALFORMED if the head is cut inside a line
+ */
+int httpParseEnd(struct HttpParser *p, const char *buf, size_t len);
+
+/**
+ * @param p - a parsed head
+ * @param name - field name, matched case insensitive
+ * @return the value of the first field called name, NULL if there is none
+ */
+const struct StrView *httpField(const struct HttpParser *p, const char *name);
+
+/**
+ * @return TRUE if v holds exactly str, case insensitive
+ */
+int viewEquals(struct StrView v, const char *str);
+
+#endif //PROXY_SERVER_PARSER_H
@@ -0,0 +1,784 @@
+//
+// Microbenchmarks of the hot functions of the proxy, linked against Proxy_Core.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <arpa/inet.h>
+
+#include "proxyServer.h"
+
+/**
+ * proxyBench.c
+ *
+ * Times the functions every request goes through, each in isolation and on
+ * canned inputs: parsing a request head (scanRequestHead and parseRequest),
+ * building the cache key (buildFullPath), get_mime_type, host and address
+ * lookups in a filter of --rules rules (searchHostInFilter, searchIpInFilter)
+ * and compiling that filter, and handing jobs to the worker pool (dispatch
+ * to the job starting in do_work, alone and in bursts).
+ *
+ * The request heads come from bench/requests.txt. The filter is generated
+ * from --seed unless --filter names a file, 100000 rules by default, a third
+ * each of hosts, wildcards and address ranges, and a tenth of the lookups
+ * match one of them.
+ *
+ * A benchmark runs --warmup untimed batches, then --reps repetitions of
+ * --batches timed batches of --batch operations. Every batch gives one
+ * sample, its nanoseconds per operation; the handoff gives one sample per
+ * job, the time it spent between dispatch and its start. The repetitions
+ * go round all the benchmarks in turn, on a thread pinned to one cpu, so a
+ * slow spell of the machine spreads over all of them instead of making one
+ * look slower. The JSON printed holds the percentiles of the samples and
+ * the median of every repetition.
+ *
+ * With --baseline, the medians of the repetitions are compared with those
+ * of the same benchmark in an earlier output by a Mann-Whitney U test. A
+ * benchmark regressed if it is slower with p < 0.01 and by more than
+ * --threshold percent, and the exit status is then 1. Every repetition also
+ * times "calibrate", a fixed arithmetic loop, and the medians compared are
+ * relative to its median of the same repetition, so a machine running at
+ * another clock than when the baseline was taken does not show up as a
+ * change of every benchmark.
+ */
+
+#define BENCH_USAGE_MSG "Usage: proxyBench [--reps=<n>] [--batches=<n>] [--batch=<n>] [--warmup=<n>] [--rules=<n>] [--filter=<file>]" \
+                  " [--corpus=<file>] [--threads=<n>] [--seed=<n>] [--only=<name>] [--output=<file>]" \
+                  " [--baseline=<file>] [--threshold=<percent>]\n"
+#define BENCH_MAX_REPS 100
+#define BENCH_MAX_BATCH 4096
+#define BENCH_MAX_RESULTS 16
+#define BENCH_MAX_CORPUS 256
+#define BENCH_LOOKUPS 4096          //hosts and addresses the filter lookups cycle through
+#define BENCH_SIGNIFICANCE 0.01     //p value below which a difference from the baseline is not chance
+
+/**
+ * the samples of one benchmark and how it compares with the baseline
+ */
+typedef void (*batch_fn)(long first, int count);
+
+struct Result{
+    const char *name;
+    const char *unit;
+    batch_fn prepare;   //readies a batch untimed, NULL if it needs nothing
+    batch_fn run;       //does operations first to first + count - 1, NULL for the handoff
+    int batch;          //operations of a batch
+    int batches;        //timed batches of a repetition
+    int warmup;         //untimed batches before the first repetition
+    long op;            //next operation
+    double *samples;
+    long count;
+    long capacity;
+    double runs[BENCH_MAX_REPS];    //median sample of every repetition
+    int reps;
+    int compared;       //TRUE if the baseline has the benchmark
+    double baseMedian;  //of the baseline, scaled to the calibration of this run
+    double change;      //percent, of the median of the runs relative to the calibration
+    double pValue;
+    const char *verdict;
+};
+
+struct BenchConfig{
+    int reps;
+    int batches;
+    int batch;
+    int warmup;
+    long rules;
+    const char *filterFile;
+    const char *corpusFile;
+    int threads;
+    unsigned long long seed;
+    const char *only;
+    const char *output;
+    const char *baseline;
+    double threshold;
+};
+
+static struct BenchConfig options = {15, 200, 64, 50, 100000, NULL, BENCH_DATA_DIR "/requests.txt", 4, 1,
+                                     NULL, NULL, NULL, 5};
+static struct Result results[BENCH_MAX_RESULTS];
+static int resultCount;
+static volatile long sink;      //results of the timed calls end here, so none is optimized away
+
+static char *corpus[BENCH_MAX_CORPUS];
+static size_t corpusLen[BENCH_MAX_CORPUS];
+static int corpusCount;
+static char *corpusPaths[BENCH_MAX_CORPUS];     //request targets of the corpus
+static struct Headers headers[BENCH_MAX_BATCH];
+static struct Arena *arena;
+static struct ArenaMark arenaStart;
+static char *hosts[BENCH_LOOKUPS];
+static struct in_addr addresses[BENCH_LOOKUPS];
+static char *filterPath;
+static filters *compiled;
+static threadpool *pool;
+static double *waits;           //handoff waits told by the pool hook
+static long waitCount;
+static int done;                //jobs of the pool finished
+
+static long long nowNanos(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * splitmix64, the seeded generator of the filter and the lookups
+ */
+static unsigned long long nextRandom(unsigned long long *state){
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static int compareDouble(const void *a, const void *b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @param sorted
+ * @param count - at least 1
+ * @param quantile - 0 to 1
+ * @return the smallest sample at or above quantile
+ */
+static double percentile(const double *sorted, long count, double quantile){
+    long rank = (long)ceil(quantile * (double)count);
+    rank = rank < 1 ? 1 : rank > count ? count : rank;
+    return sorted[rank - 1];
+}
+
+static double median(const double *values, long count){
+    double *sorted = (double*) malloc((size_t)count * sizeof(double));
+    if(sorted == NULL || count == 0){
+        free(sorted);
+        return 0;
+    }
+    memcpy(sorted, values, (size_t)count * sizeof(double));
+    qsort(sorted, (size_t)count, sizeof(double), compareDouble);
+    double m = percentile(sorted, count, 0.5);
+    free(sorted);
+    return m;
+}
+
+/**
+ * add a benchmark, unless --only leaves it out
+ */
+static void addBench(const char *name, const char *unit, batch_fn prepare, batch_fn run, int batch, int batches,
+                     int warmup){
+    if((resultCount > 0 && options.only != NULL && strstr(name, options.only) == NULL) || resultCount == BENCH_MAX_RESULTS){
+        return;
+    }
+    struct Result *r = &results[resultCount++];
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    r->unit = unit;
+    r->prepare = prepare;
+    r->run = run;
+    r->batch = batch;
+    r->batches = batches;
+    r->warmup = warmup;
+    r->verdict = "none";
+}
+
+static void addSample(struct Result *r, double value){
+    if(r->count == r->capacity){
+        long capacity = r->capacity > 0 ? r->capacity * 2 : 1024;
+        double *grown = (double*) realloc(r->samples, (size_t)capacity * sizeof(double));
+        if(grown == NULL){
+            return;
+        }
+        r->samples = grown;
+        r->capacity = capacity;
+    }
+    r->samples[r->count++] = value;
+}
+
+/**
+ * close a repetition whose samples start at first
+ */
+static void endRep(struct Result *r, long first){
+    r->runs[r->reps++] = median(r->samples + first, r->count - first);
+}
+
+/**
+ * time one repetition of r, its warmup before the first
+ */
+static void measure(struct Result *r){
+    for (int i = r->reps == 0 ? 0 : r->warmup; i < r->warmup; i++, r->op += r->batch) {
+        if(r->prepare != NULL){
+            r->prepare(r->op, r->batch);
+        }
+        r->run(r->op, r->batch);
+    }
+    long first = r->count;
+    for (int i = 0; i < r->batches; i++, r->op += r->batch) {
+        if(r->prepare != NULL){
+            r->prepare(r->op, r->batch);
+        }
+        long long start = nowNanos();
+        r->run(r->op, r->batch);
+        addSample(r, (double)(nowNanos() - start) / r->batch);
+    }
+    endRep(r, first);
+}
+
+/**
+ * load the request heads of path, blocks separated by empty lines, '#' lines skipped
+ * @return 0, -1 if the file can't be read or holds no request
+ */
+static int loadCorpus(const char *path){
+    FILE *file = fopen(path, "r");
+    if(file == NULL){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    char line[CHUNK * 4];
+    char head[HTTP_HEAD_LIMIT];
+    size_t len = 0;
+    int more = TRUE;
+    while(more == TRUE){
+        more = fgets(line, sizeof(line), file) != NULL;
+        if(more == TRUE && line[0] == '#'){
+            continue;
+        }
+        size_t lineLen = more == TRUE ? strcspn(line, "\r\n") : 0;
+        if(lineLen > 0 && len + lineLen + strlen("\r\n\r\n") < sizeof(head)){
+            memcpy(head + len, line, lineLen);
+            len += lineLen;
+            memcpy(head + len, "\r\n", strlen("\r\n"));
+            len += strlen("\r\n");
+            continue;
+        }
+        if(len > 0 && corpusCount < BENCH_MAX_CORPUS){     //an empty line or the end ends the head
+            memcpy(head + len, "\r\n", strlen("\r\n") + 1);
+            len += strlen("\r\n");
+            corpusLen[corpusCount] = len;
+            corpus[corpusCount++] = strdup(head);
+        }
+        len = 0;
+    }
+    fclose(file);
+    return corpusCount > 0 ? 0 : -1;
+}
+
+/**
+ * copy heads of the corpus into the batch headers and reset their parsers
+ */
+static void prepareHeads(long first, int count){
+    for (int i = 0; i < count; i++) {
+        int k = (int)((first + i) % corpusCount);
+        memcpy(headers[i].request, corpus[k], corpusLen[k] + 1);
+        httpParserInit(&headers[i].parser, FALSE, config.headerLimit);
+    }
+}
+
+static void runCalibrate(long first, int count){
+    unsigned long long state = (unsigned long long)first;
+    for (int i = 0; i < count * 64; i++) {
+        state = nextRandom(&state);
+    }
+    sink += (long)state;
+}
+
+static void runParse(long first, int count){
+    long ok = 0;
+    for (int i = 0; i < count; i++) {
+        int k = (int)((first + i) % corpusCount);
+        ok += scanRequestHead(&headers[i], corpusLen[k], FALSE) == HP_DONE && parseRequest(&headers[i]) == 0;
+    }
+    sink += ok;
+}
+
+static void prepareParsed(long first, int count){
+    prepareHeads(first, count);
+    runParse(first, count);
+    arenaRewind(arena, arenaStart);
+}
+
+static void runFullPath(long first, int count){
+    (void)first;
+    for (int i = 0; i < count; i++) {
+        char *path = buildFullPath(&headers[i]);
+        sink += path != NULL ? (long)path[0] : 0;
+    }
+}
+
+static void runMime(long first, int count){
+    for (int i = 0; i < count; i++) {
+        char *type = get_mime_type(corpusPaths[(first + i) % corpusCount]);
+        sink += type != NULL ? (long)type[0] : 0;
+    }
+}
+
+static void runFilterHost(long first, int count){
+    long found = 0;
+    for (int i = 0; i < count; i++) {
+        found += searchHostInFilter(hosts[(first + i) % BENCH_LOOKUPS]);
+    }
+    sink += found;
+}
+
+static void runFilterAddress(long first, int count){
+    long found = 0;
+    for (int i = 0; i < count; i++) {
+        found += searchIpInFilter(addresses[(first + i) % BENCH_LOOKUPS]);
+    }
+    sink += found;
+}
+
+static void prepareCompile(long first, int count){
+    (void)first;
+    (void)count;
+    if(compiled != NULL){
+        filterFree(compiled);
+        compiled = NULL;
+    }
+}
+
+static void runCompile(long first, int count){
+    (void)first;
+    for (int i = 0; i < count; i++) {
+        prepareCompile(0, 0);
+        compiled = filterCompile(filterPath);
+    }
+}
+
+/**
+ * write the generated filter to a temporary file and fill the lookups, a tenth of them matching a rule
+ * @return the path of the file, to be unlinked and freed, NULL if it could not be written
+ */
+static char *generateFilter(){
+    char *path = strdup("/tmp/proxyBench-filter-XXXXXX");
+    int fd = path != NULL ? mkstemp(path) : -1;
+    FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if(file == NULL){
+        perror("error: <sys_call>\n");
+        if(fd >= 0){
+            close(fd);
+            unlink(path);
+        }
+        free(path);
+        return NULL;
+    }
+    unsigned long long state = options.seed;
+    char name[128];
+    int hostHits = 0, addressHits = 0;
+    for (long i = 0; i < options.rules; i++) {
+        unsigned long long r = nextRandom(&state);
+        int lookedUp = (i / 3) % 7 == 0;   //a spread of the rules is matched by the lookups
+        switch(i % 3){
+            case 0:
+                snprintf(name, sizeof(name), "blocked-%llx.example", r);
+                fprintf(file, "%s\n", name);
+                break;
+            case 1:     //the lookup is a subdomain of the wildcard
+                snprintf(name, sizeof(name), "cdn%llu.w%llx.example", r % 100, r);
+                fprintf(file, "*.%s\n", strchr(name, '.') + 1);
+                break;
+            default:
+                fprintf(file, "10.%u.%u.0/24\n", (unsigned)(r >> 8) & 255, (unsigned)(r >> 16) & 255);
+                if(lookedUp && addressHits < BENCH_LOOKUPS / 10){
+                    addresses[10 * addressHits++].s_addr = htonl((10u << 24) | ((unsigned)((r >> 8) & 255) << 16)
+                                                                 | ((unsigned)((r >> 16) & 255) << 8) | ((unsigned)r & 255));
+                }
+                continue;
+        }
+        if(lookedUp && hostHits < BENCH_LOOKUPS / 10){
+            hosts[10 * hostHits++] = strdup(name);
+        }
+    }
+    if(fclose(file) != 0){
+        perror("error: <sys_call>\n");
+        unlink(path);
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+/**
+ * fill the lookups generateFilter left empty with hosts and addresses no rule matches
+ */
+static void fillLookups(){
+    unsigned long long state = options.seed ^ 0x5DEECE66DULL;
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        unsigned long long r = nextRandom(&state);
+        if(hosts[i] == NULL){
+            char name[128];
+            if(r % 4 == 0 && corpusCount > 0){     //a host of the corpus, found in no rule set
+                struct Headers *h = &headers[0];
+                prepareHeads((long)(r >> 8), 1);
+                runParse((long)(r >> 8), 1);
+                snprintf(name, sizeof(name), "%s", h->host != NULL ? h->host : "localhost");
+            } else{
+                snprintf(name, sizeof(name), "www.site-%llx.example.net", r >> 16);
+            }
+            hosts[i] = strdup(name);
+        }
+        if(addresses[i].s_addr == 0){
+            addresses[i].s_addr = htonl((unsigned)(r >> 24) | (172u << 24));   //within 172/8, no range there
+        }
+    }
+}
+
+static int jobDone(void *arg){
+    (void)arg;
+    __atomic_add_fetch(&done, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void onWait(long long waited){
+    long i = __atomic_fetch_add(&waitCount, 1, __ATOMIC_RELAXED);
+    waits[i] = (double)waited;
+}
+
+/**
+ * dispatch count jobs at once and wait until all of them ran
+ */
+static void runBurst(long first, int count){
+    (void)first;
+    __atomic_store_n(&done, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < count; i++) {
+        dispatch(pool, jobDone, NULL);
+    }
+    while(__atomic_load_n(&done, __ATOMIC_ACQUIRE) < count){
+        sched_yield();
+    }
+}
+
+/**
+ * time one repetition of the wait of a job from dispatch to its start in do_work, with the workers idle.
+ * r->batches jobs are timed, after r->warmup untimed ones before the first repetition
+ */
+static void measureHandoff(struct Result *r){
+    int warmup = r->reps == 0 ? r->warmup : 0;
+    set_wait_hook(pool, onWait);
+    waitCount = 0;
+    for (int i = 0; i < warmup + r->batches; i++) {
+        __atomic_store_n(&done, 0, __ATOMIC_RELAXED);
+        dispatch(pool, jobDone, NULL);
+        while(__atomic_load_n(&done, __ATOMIC_ACQUIRE) == 0){
+            sched_yield();
+        }
+        usleep(20);     //let the worker go back to sleep, the handoff includes its wakeup
+    }
+    set_wait_hook(pool, NULL);
+    long first = r->count;
+    for (long i = warmup; i < waitCount; i++) {
+        addSample(r, waits[i]);
+    }
+    endRep(r, first);
+}
+
+/**
+ * read the medians of the repetitions of name from a baseline output
+ * @return how many were read
+ */
+static int baselineRuns(const char *text, const char *name, double *runs){
+    char key[128];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+    const char *entry = strstr(text, key);
+    const char *list = entry != NULL ? strstr(entry, "\"runs\": [") : NULL;
+    const char *next = entry != NULL ? strstr(entry + strlen(key), "\"name\": ") : NULL;
+    if(list == NULL || (next != NULL && list > next)){
+        return 0;
+    }
+    int n = 0;
+    char *end;
+    for (const char *p = list + strlen("\"runs\": ["); n < BENCH_MAX_REPS && *p != ']'; p = end) {
+        double v = strtod(p, &end);
+        if(end == p){
+            break;
+        }
+        runs[n++] = v;
+        while(*end == ',' || *end == ' '){
+            end++;
+        }
+    }
+    return n;
+}
+
+/**
+ * compare r with the same benchmark of the baseline, a two sided Mann-Whitney U test on the repetition medians
+ * relative to those of the calibration
+ */
+static void compare(struct Result *r, const char *text){
+    double base[BENCH_MAX_REPS], baseScale[BENCH_MAX_REPS], runs[BENCH_MAX_REPS];
+    int m = baselineRuns(text, r->name, base);
+    int n = r->reps;
+    if(m == 0 || n == 0 || baselineRuns(text, results[0].name, baseScale) != m || r == &results[0]){
+        return;
+    }
+    for (int i = 0; i < m; i++) {
+        base[i] = baseScale[i] > 0 ? base[i] / baseScale[i] : base[i];
+    }
+    for (int i = 0; i < n; i++) {
+        runs[i] = results[0].runs[i] > 0 ? r->runs[i] / results[0].runs[i] : r->runs[i];
+    }
+    double rankSum = 0;     //of the current runs, ties get their average rank
+    for (int i = 0; i < n; i++) {
+        double below = 0, equal = 0;
+        for (int j = 0; j < n; j++) {
+            below += runs[j] < runs[i];
+            equal += runs[j] == runs[i];
+        }
+        for (int j = 0; j < m; j++) {
+            below += base[j] < runs[i];
+            equal += base[j] == runs[i];
+        }
+        rankSum += below + (equal + 1) / 2;
+    }
+    double u = rankSum - (double)n * (n + 1) / 2;
+    double sigma = sqrt((double)n * m * (n + m + 1) / 12.0);
+    double z = sigma > 0 ? (u - (double)n * m / 2) / sigma : 0;
+    r->compared = TRUE;
+    r->pValue = erfc(fabs(z) / sqrt(2.0));
+    r->baseMedian = median(base, m);
+    r->change = r->baseMedian > 0 ? (median(runs, n) / r->baseMedian - 1) * 100 : 0;
+    r->baseMedian *= median(results[0].runs, n);
+    if(r->pValue < BENCH_SIGNIFICANCE && r->change > options.threshold){
+        r->verdict = "regression";
+    } else if(r->pValue < BENCH_SIGNIFICANCE && r->change < -options.threshold){
+        r->verdict = "improvement";
+    } else{
+        r->verdict = "unchanged";
+    }
+}
+
+/**
+ * @return the contents of path, to be freed, NULL if it can't be read
+ */
+static char *readFile(const char *path){
+    FILE *file = fopen(path, "r");
+    if(file == NULL){
+        perror("error: <sys_call>\n");
+        return NULL;
+    }
+    size_t capacity = 64 * 1024, len = 0, n;
+    char *text = (char*) malloc(capacity + 1);
+    while(text != NULL && (n = fread(text + len, 1, capacity - len, file)) > 0){
+        len += n;
+        if(len == capacity){
+            char *grown = (char*) realloc(text, capacity * 2 + 1);
+            if(grown == NULL){
+                free(text);
+                text = NULL;
+                break;
+            }
+            text = grown;
+            capacity *= 2;
+        }
+    }
+    fclose(file);
+    if(text != NULL){
+        text[len] = '\0';
+    }
+    return text;
+}
+
+/**
+ * print the results as JSON
+ * @return the number of regressions, -1 if the output could not be written
+ */
+static int report(){
+    FILE *out = options.output != NULL ? fopen(options.output, "w") : stdout;
+    if(out == NULL){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    int regressions = 0;
+    fprintf(out, "{\n  \"config\": {\"reps\": %d, \"batches\": %d, \"batch\": %d, \"warmup\": %d, \"rules\": %ld, "
+                 "\"threads\": %d, \"seed\": %llu, \"corpus\": %d},\n  \"benchmarks\": [\n", options.reps,
+            options.batches, options.batch, options.warmup, options.rules, options.threads, options.seed, corpusCount);
+    for (int i = 0; i < resultCount; i++) {
+        struct Result *r = &results[i];
+        if(r->count == 0){
+            continue;
+        }
+        double sum = 0;
+        for (long j = 0; j < r->count; j++) {
+            sum += r->samples[j];
+        }
+        qsort(r->samples, (size_t)r->count, sizeof(double), compareDouble);
+        fprintf(out, "    {\"name\": \"%s\", \"unit\": \"%s\", \"samples\": %ld, \"mean\": %.2f, \"min\": %.2f, "
+                     "\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f,\n      \"runs\": [",
+                r->name, r->unit, r->count, sum / (double)r->count, r->samples[0], percentile(r->samples, r->count, 0.5),
+                percentile(r->samples, r->count, 0.9), percentile(r->samples, r->count, 0.99),
+                percentile(r->samples, r->count, 0.999), r->samples[r->count - 1]);
+        for (int j = 0; j < r->reps; j++) {
+            fprintf(out, "%s%.2f", j > 0 ? ", " : "", r->runs[j]);
+        }
+        fprintf(out, "]");
+        if(r->compared == TRUE){
+            fprintf(out, ",\n      \"baseline\": {\"median\": %.2f, \"change_percent\": %.2f, \"p_value\": %.4g, "
+                         "\"verdict\": \"%s\"}", r->baseMedian, r->change, r->pValue, r->verdict);
+            regressions += strcmp(r->verdict, "regression") == 0;
+        }
+        fprintf(out, "}%s\n", i + 1 < resultCount ? "," : "");
+        fprintf(stderr, "%-18s p50 %10.2f %s  p99 %10.2f%s%s\n", r->name, percentile(r->samples, r->count, 0.5), r->unit,
+                percentile(r->samples, r->count, 0.99), r->compared == TRUE ? "  " : "",
+                r->compared == TRUE ? r->verdict : "");
+    }
+    fprintf(out, "  ],\n  \"regressions\": %d\n}\n", regressions);
+    if(out != stdout && fclose(out) != 0){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    return regressions;
+}
+
+/**
+ * parse the "--name=value" options
+ * @return 0 - on success
+ *         -1 - on unknown option or bad value
+ */
+static int parseOptions(int argc, char *argv[]){
+    char *checkIfNumber;
+    for (int i = 1; i < argc; i++) {
+        char *opt = argv[i];
+        char *value = strchr(opt, '=');
+        if(strncmp(opt, "--", 2) != 0 || value == NULL){
+            return -1;
+        }
+        value++;
+        long n = strtol(value, &checkIfNumber, 10);
+        int number = strlen(checkIfNumber) == 0 && checkIfNumber != value;
+        if(strncmp(opt, "--reps=", strlen("--reps=")) == 0 && number && n > 0 && n <= BENCH_MAX_REPS){
+            options.reps = (int)n;
+        } else if(strncmp(opt, "--batches=", strlen("--batches=")) == 0 && number && n > 0){
+            options.batches = (int)n;
+        } else if(strncmp(opt, "--batch=", strlen("--batch=")) == 0 && number && n > 0 && n <= BENCH_MAX_BATCH){
+            options.batch = (int)n;
+        } else if(strncmp(opt, "--warmup=", strlen("--warmup=")) == 0 && number && n >= 0){
+            options.warmup = (int)n;
+        } else if(strncmp(opt, "--rules=", strlen("--rules=")) == 0 && number && n > 0){
+            options.rules = n;
+        } else if(strncmp(opt, "--threads=", strlen("--threads=")) == 0 && number && n > 0 && n <= MAXT_IN_POOL){
+            options.threads = (int)n;
+        } else if(strncmp(opt, "--seed=", strlen("--seed=")) == 0 && number){
+            options.seed = strtoull(value, NULL, 10);
+        } else if(strncmp(opt, "--threshold=", strlen("--threshold=")) == 0){
+            options.threshold = strtod(value, &checkIfNumber);
+            if(strlen(checkIfNumber) != 0 || options.threshold < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--filter=", strlen("--filter=")) == 0){
+            options.filterFile = value;
+        } else if(strncmp(opt, "--corpus=", strlen("--corpus=")) == 0){
+            options.corpusFile = value;
+        } else if(strncmp(opt, "--only=", strlen("--only=")) == 0){
+            options.only = value;
+        } else if(strncmp(opt, "--output=", strlen("--output=")) == 0){
+            options.output = value;
+        } else if(strncmp(opt, "--baseline=", strlen("--baseline=")) == 0){
+            options.baseline = value;
+        } else{
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    if(parseOptions(argc, argv) == -1){
+        printf(BENCH_USAGE_MSG);
+        return -1;
+    }
+    char *baseline = options.baseline != NULL ? readFile(options.baseline) : NULL;
+    if((options.baseline != NULL && baseline == NULL) || loadCorpus(options.corpusFile) == -1){
+        free(baseline);
+        return -1;
+    }
+    arena = arenaTake();
+    for (int i = 0; i < options.batch && arena != NULL; i++) {
+        headers[i].client_fd = -1;
+        headers[i].arena = arena;
+        headers[i].request = (char*) malloc(config.headerLimit + 1);
+        if(headers[i].request == NULL){
+            arena = NULL;
+        }
+    }
+    if(arena == NULL){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    arenaStart = arenaMark(arena);
+    for (int k = 0; k < corpusCount; k++) {     //the targets get_mime_type is called with
+        prepareHeads(k, 1);
+        runParse(k, 1);
+        corpusPaths[k] = strdup(headers[0].path != NULL ? headers[0].path : "/");
+    }
+    filterPath = options.filterFile != NULL ? strdup(options.filterFile) : generateFilter();
+    if(filterPath == NULL || (compiled = filterCompile(filterPath)) == NULL){
+        printf("error: the filter could not be %s\n", filterPath == NULL ? "written" : "compiled");
+        return -1;
+    }
+    fillLookups();
+    pool = create_threadpool(options.threads);
+    if(pool == NULL){
+        return -1;
+    }
+
+    pin_to_group_cpu(0);
+    filterPublish(compiled);    //looked up by searchHostInFilter, filter_compile makes copies of its own
+    compiled = NULL;
+    addBench("calibrate", "ns/op", NULL, runCalibrate, options.batch, options.batches, options.warmup);    //first, always
+    addBench("parse_request", "ns/op", prepareHeads, runParse, options.batch, options.batches, options.warmup);
+    addBench("full_path", "ns/op", prepareParsed, runFullPath, options.batch, options.batches, options.warmup);
+    addBench("mime_type", "ns/op", NULL, runMime, options.batch, options.batches, options.warmup);
+    addBench("filter_host", "ns/op", NULL, runFilterHost, options.batch, options.batches, options.warmup);
+    addBench("filter_address", "ns/op", NULL, runFilterAddress, options.batch, options.batches, options.warmup);
+    addBench("filter_compile", "ns/op", prepareCompile, runCompile, 1, 3, 1);
+    addBench("dispatch_handoff", "ns", NULL, NULL, 1, options.batches * 4, options.warmup);
+    addBench("dispatch_burst", "ns/op", NULL, runBurst, options.batch, options.batches, options.warmup);
+    waits = (double*) malloc((size_t)(options.batches * 4 + options.warmup) * sizeof(double));
+    if(waits == NULL){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    for (int rep = 0; rep < options.reps; rep++) {
+        for (int i = 0; i < resultCount; i++) {
+            if(results[i].run != NULL){
+                measure(&results[i]);
+            } else{
+                measureHandoff(&results[i]);
+            }
+        }
+    }
+    prepareCompile(0, 0);
+    filterPublish(NULL);
+    destroy_threadpool(pool);
+    free(waits);
+
+    for (int i = 0; baseline != NULL && i < resultCount; i++) {
+        compare(&results[i], baseline);
+    }
+    int regressions = report();
+    if(options.filterFile == NULL){
+        unlink(filterPath);
+    }
+    free(filterPath);
+    free(baseline);
+    for (int i = 0; i < options.batch; i++) {
+        free(headers[i].request);
+    }
+    arenaGive(arena);
+    for (int i = 0; i < resultCount; i++) {
+        free(results[i].samples);
+    }
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        free(hosts[i]);
+    }
+    for (int k = 0; k < corpusCount; k++) {
+        free(corpus[k]);
+        free(corpusPaths[k]);
+    }
+    return regressions == 0 ? 0 : 1;
+}
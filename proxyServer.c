@@ -5,68 +5,61 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <sys/stat.h>
-#include "threadpool.h"
-
-#define USAGE_MSG "Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n"
-#define CHUNK 1024
-#define TRUE 1
-#define FALSE 0
-#define REQ_TEMPLATE "GET %s %s\r\nHost: %s\r\nConnection: close\r\n\r\n"
-
-struct Headers{
-    int *client_fd;
-    char *request;
-    char *method;
-    char *path;
-    char *protocol;
-    char *host;
-};
-
-typedef struct List{
-    char *data;
-    struct List *next;
-}list;
-
-typedef struct Filters{
-    list *urlHead;
-    list *urlTail;
-    list *ipHead;
-    list *ipTail;
-}filters;
-
-char *get_mime_type(char *name);
-int handleRequests(void *sd);
-int listenLoop(threadpool *tp, int maxRequests, int port);
-void responseErr(int code, int fd);
-void freeHeaders(struct Headers *h);
-int checkIfExist(char *filePath);
-int loadFilterFile(char* filePath);
-int searchInFilter(struct in_addr hostIP, char* hostDomain);
-void freeFilters();
-void createFile(char *fullPath, FILE **newFile);
-long readResponseMsg(int server_fd, int client_fd, char *fullPath);
-long findFileSize(char *fullPath);
-long giveFromLocal(char *fullPath, int client_fd);
-void writeFileContent(char *fullPath, int client_fd);
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <signal.h>
+#include "proxyServer.h"
+#include "eventloop.h"
+#include "resolver.h"
+#include "upstream.h"
+#include "framer.h"
+#include "memcache.h"
+#include "fdcache.h"
+#include "relay.h"
+#include "parser.h"
+#include "arena.h"
+#include "cacheindex.h"
+#include "inflight.h"
+#include "variants.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "deadline.h"
+#include "admission.h"
 
 const char BAD_REQUEST[] = "HTTP/1.0 400 Bad Request\r\n"
                            "Content-Type: text/html\r\n"
-                           "Content-Length: 113\r\n"
-                           "Connection: close\r\n"
+                           "Content-Length: 111\r\n"
+                           "Connection: %s\r\n"
                            "\r\n"
                            "<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>\r\n"
                            "<BODY><H4>400 Bad request</H4>\r\n"
                            "Bad Request.\r\n"
                            "</BODY></HTML>";
 
+const char TOO_LARGE[] = "HTTP/1.0 431 Request Header Fields Too Large\r\n"
+                         "Content-Type: text/html\r\n"
+                         "Content-Length: 164\r\n"
+                         "Connection: %s\r\n"
+                         "\r\n"
+                         "<HTML><HEAD><TITLE>431 Request Header Fields Too Large</TITLE></HEAD>\r\n"
+                         "<BODY><H4>431 Request Header Fields Too Large</H4>\r\n"
+                         "Request header too large.\r\n"
+                         "</BODY></HTML>";
+
 const char ACCESS_DENIED[] = "HTTP/1.0 403 Forbidden\r\n"
                              "Content-Type: text/html\r\n"
-                             "Content-Length: 111\r\n"
-                             "Connection: close\r\n"
+                             "Content-Length: 109\r\n"
+                             "Connection: %s\r\n"
                              "\r\n"
                              "<HTML><HEAD><TITLE>403 Forbidden</TITLE></HEAD>\r\n"
                              "<BODY><H4>403 Forbidden</H4>\r\n"
@@ -75,8 +68,8 @@ const char ACCESS_DENIED[] = "HTTP/1.0 403 Forbidden\r\n"
 
 const char NOT_FOUND[] = "HTTP/1.0 404 Not Found\r\n"
                          "Content-Type: text/html\r\n"
-                         "Content-Length: 112\r\n"
-                         "Connection: close\r\n"
+                         "Content-Length: 110\r\n"
+                         "Connection: %s\r\n"
                          "\r\n"
                          "<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\r\n"
                          "<BODY><H4>404 Not Found</H4>\r\n"
@@ -85,8 +78,8 @@ const char NOT_FOUND[] = "HTTP/1.0 404 Not Found\r\n"
 
 const char SERVER_ERROR[] = "HTTP/1.0 500 Internal Server Error\r\n"
                             "Content-Type: text/html\r\n"
-                            "Content-Length: 144\r\n"
-                            "Connection: close\r\n"
+                            "Content-Length: 142\r\n"
+                            "Connection: %s\r\n"
                             "\r\n"
                             "<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\r\n"
                             "<BODY><H4>500 Internal Server Error</H4>\r\n"
@@ -95,18 +88,148 @@ const char SERVER_ERROR[] = "HTTP/1.0 500 Internal Server Error\r\n"
 
 const char NOT_SUPPORTED[] = "HTTP/1.0 501 Not supported\r\n"
                              "Content-Type: text/html\r\n"
-                             "Content-Length: 129\r\n"
-                             "Connection: close\r\n"
+                             "Content-Length: 127\r\n"
+                             "Connection: %s\r\n"
                              "\r\n"
                              "<HTML><HEAD><TITLE>501 Not supported</TITLE></HEAD>\r\n"
                              "<BODY><H4>501 Not supported</H4>\r\n"
                              "Method is not supported.\r\n"
                              "</BODY></HTML>";
 
-filters *f;
+const char REQUEST_TIMEOUT[] = "HTTP/1.0 408 Request Timeout\r\n"
+                               "Content-Type: text/html\r\n"
+                               "Content-Length: 148\r\n"
+                               "Connection: %s\r\n"
+                               "\r\n"
+                               "<HTML><HEAD><TITLE>408 Request Timeout</TITLE></HEAD>\r\n"
+                               "<BODY><H4>408 Request Timeout</H4>\r\n"
+                               "Client took too long to send its request.\r\n"
+                               "</BODY></HTML>";
+
+const char GATEWAY_TIMEOUT[] = "HTTP/1.0 504 Gateway Timeout\r\n"
+                               "Content-Type: text/html\r\n"
+                               "Content-Length: 148\r\n"
+                               "Connection: %s\r\n"
+                               "\r\n"
+                               "<HTML><HEAD><TITLE>504 Gateway Timeout</TITLE></HEAD>\r\n"
+                               "<BODY><H4>504 Gateway Timeout</H4>\r\n"
+                               "The origin server did not answer in time.\r\n"
+                               "</BODY></HTML>";
+
+const char OVERLOADED[] = "HTTP/1.0 503 Service Unavailable\r\n"
+                          "Content-Type: text/html\r\n"
+                          "Content-Length: 156\r\n"
+                          "Retry-After: %d\r\n"
+                          "Connection: %s\r\n"
+                          "\r\n"
+                          "<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>\r\n"
+                          "<BODY><H4>503 Service Unavailable</H4>\r\n"
+                          "The proxy is overloaded, try again later.\r\n"
+                          "</BODY></HTML>";
+
+const char TOO_MANY[] = "HTTP/1.0 429 Too Many Requests\r\n"
+                        "Content-Type: text/html\r\n"
+                        "Content-Length: 146\r\n"
+                        "Retry-After: %d\r\n"
+                        "Connection: %s\r\n"
+                        "\r\n"
+                        "<HTML><HEAD><TITLE>429 Too Many Requests</TITLE></HEAD>\r\n"
+                        "<BODY><H4>429 Too Many Requests</H4>\r\n"
+                        "Too many requests from this client.\r\n"
+                        "</BODY></HTML>";
+
+struct Config config = {
+    .mode = MODE_THREADS,
+    .groups = 0,
+    .dnsHosts = "/etc/hosts",
+    .dnsServer = NULL,
+    .upstreamIdle = UPSTREAM_IDLE_TIMEOUT,
+    .upstreamMaxPerHost = UPSTREAM_MAX_PER_HOST,
+    .clientIdle = CLIENT_IDLE_TIMEOUT,
+    .clientMaxRequests = CLIENT_MAX_REQUESTS,
+    .memCache = MEMCACHE_DEFAULT_BUDGET,
+    .fdCache = FDCACHE_DEFAULT_CAPACITY,
+    .relayBuffer = RELAY_DEFAULT_BUFFER,
+    .relaySplice = TRUE,
+    .headerLimit = HTTP_HEAD_LIMIT,
+    .cacheDir = CACHEINDEX_DEFAULT_ROOT,
+    .cacheIndex = CACHEINDEX_DEFAULT_SNAPSHOT,
+    .diskCache = CACHEINDEX_DEFAULT_QUOTA,
+    .diskObjects = 0,
+    .diskPolicy = CACHE_POLICY_GDSF,
+    .defaultTtl = FRESHNESS_DEFAULT_TTL,
+    .staleWindow = 0,
+    .compress = TRUE,
+    .accessLog = "-",
+    .accessLogSize = ACCESSLOG_DEFAULT_SIZE,
+    .dnsTimeout = DEADLINE_DNS,
+    .connectTimeout = DEADLINE_CONNECT,
+    .firstByteTimeout = DEADLINE_FIRST_BYTE,
+    .relayIdle = DEADLINE_RELAY,
+    .requestTimeout = DEADLINE_TOTAL,
+    .listenBacklog = ADMISSION_DEFAULT_BACKLOG,
+    .queueLimit = ADMISSION_DEFAULT_QUEUE,
+    .retryAfter = ADMISSION_DEFAULT_RETRY,
+    .clientRate = 0,
+    .clientBurst = 0,
+    .clientConns = 0
+};
+
+struct Acceptor{
+    threadpool *tp;
+    int group;
+    int fd;
+    pthread_t thread;
+};
+
+/**
+ * how stale copies were handled, and how many client conditional requests were answered from the cache
+ */
+struct ValidationStats{
+    long revalidated;   //stale copies revalidated with the origin before they were served
+    long notModified;   //revalidations and refreshes the origin answered with 304
+    long refreshed;     //stale copies served while they were refreshed in the background
+    long answered;      //client conditional requests answered with 304
+};
+
+/**
+ * how range requests were answered
+ */
+struct RangeStats{
+    long partial;       //206 responses
+    long multipart;     //206 responses with several ranges
+    long unsatisfiable; //416 responses
+    long filled;        //range requests that started a fetch of the whole object
+};
+
+/**
+ * an origin request of a fetch given to the background pool
+ */
+struct Refresh{
+    struct Fetch *fetch;    //led by the job
+    char *request;
+    struct in_addr address;
+};
+
+// HTTP status of every responseErr code
+static const int errorStatus[METRICS_ERRORS] = {0, 400, 403, 404, 500, 501, 431, 408, 504, 503, 429};
 
+static struct ValidationStats validation;
+static struct RangeStats rangeStats;
+static threadpool *backgroundPool;      //runs the origin requests no client waits on directly
+static unsigned long boundarySequence;
+static struct Acceptor *acceptors;
+static int acceptorsNum;
+static int acceptedCount;
+static int maxAccepted;
+
+void *acceptLoop(void *arg);
+
+int parseOptions(int argc, char *argv[]);
+
+#ifndef PROXY_SERVER_LIBRARY     //defined when the pieces of the proxy are built as a library for the benchmarks
 int main(int argc, char *argv[]) {
-    if(argc != 5){
+    if(argc < 5){
         printf(USAGE_MSG);
         return -1;
     }
@@ -126,32 +249,494 @@ int main(int argc, char *argv[]) {
         printf(USAGE_MSG);
         return -1;
     }
-    f = (filters*) malloc(sizeof(filters));
-    if(f == NULL){
-        perror("error: <sys_call>\n");
+    if(parseOptions(argc, argv) == -1){
+        printf(USAGE_MSG);
         return -1;
     }
-    f->ipHead = NULL;
-    f->ipTail = NULL;
-    f->urlHead = NULL;
-    f->urlTail = NULL;
+    char snapshot[PATH_MAX];
+    if(config.cacheIndex != NULL && strcmp(config.cacheIndex, CACHEINDEX_DEFAULT_SNAPSHOT) == 0){   //kept with the cache it indexes
+        snprintf(snapshot, sizeof(snapshot), "%s/%s", config.cacheDir, CACHEINDEX_DEFAULT_SNAPSHOT);
+        config.cacheIndex = snapshot;
+    }
+    sigset_t hup;   //taken by the filter watcher only, every thread inherits the mask
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
     if(loadFilterFile(argv[4]) == -1){
+        return -1;
+    }
+    if(filterWatch(argv[4]) == -1){
+        freeFilters();
+        return -1;
+    }
+    if(config.groups == 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.groups = cpus > 0 ? (int)cpus : 1;
+    }
+    signal(SIGPIPE, SIG_IGN);   //a client may close its keep-alive connection while we answer on it
+    threadpool *tp = create_threadpool_groups(poolSize, config.groups < poolSize ? config.groups : poolSize);
+    backgroundPool = create_threadpool(BACKGROUND_POOL_SIZE);
+    if(tp == NULL || backgroundPool == NULL){
+        if(tp != NULL){
+            destroy_threadpool(tp);
+        }
+        freeFilters();
+        return -1;
+    }
+    metricsInit(tp, backgroundPool, errorStatus);   //before the first dispatch, the pool is timed from it
+    if(accessLogInit(config.accessLog, config.accessLogSize) == -1){
+        destroy_threadpool(tp);
+        destroy_threadpool(backgroundPool);
         freeFilters();
         return -1;
     }
-    threadpool *tp = create_threadpool(poolSize);
-    if(tp == NULL){
+    upstreamInit(config.upstreamIdle, config.upstreamMaxPerHost);
+    memCacheInit(config.memCache);
+    fdCacheInit(config.fdCache);
+    fetchInit();
+    freshnessInit(config.defaultTtl, config.staleWindow);
+    relayInit(config.relayBuffer, config.relaySplice);
+    variantInit(backgroundPool, config.compress);
+    if(cacheIndexInit(config.cacheDir, config.cacheIndex) == -1
+            || cacheIndexStartEvictor(config.diskCache, config.diskObjects, config.diskPolicy) == -1){
+        destroy_threadpool(tp);
+        destroy_threadpool(backgroundPool);
+        memCacheDestroy();
+        fdCacheDestroy();
+        relayDestroy();
+        cacheIndexStopEvictor();
+        cacheIndexDestroy();
+        accessLogDestroy();
         freeFilters();
         return -1;
     }
-    listenLoop(tp, maxRequests, serverPort);
+    struct CacheIndexStats ist;
+    cacheIndexGetStats(&ist);
+    printf("Cache index: %ld objects in %lld bytes, loaded from %s in %.1f ms\n", ist.loaded, ist.bytes,
+           ist.fromSnapshot == TRUE ? "the snapshot" : "the cache tree", ist.loadMs);
+    if(resolverInit(tp, config.dnsHosts, config.dnsServer) == -1){
+        printf(USAGE_MSG);
+        destroy_threadpool(tp);
+        destroy_threadpool(backgroundPool);
+        memCacheDestroy();
+        fdCacheDestroy();
+        relayDestroy();
+        cacheIndexStopEvictor();
+        cacheIndexDestroy();
+        accessLogDestroy();
+        freeFilters();
+        return -1;
+    }
+    int deadlines[PHASES] = {config.clientIdle, config.dnsTimeout, config.connectTimeout, config.firstByteTimeout,
+                             config.relayIdle, config.requestTimeout};
+    if(deadlineInit(deadlines) == -1
+            || admissionInit(config.queueLimit, config.clientRate, config.clientBurst, config.clientConns) == -1){
+        destroy_threadpool(tp);
+        destroy_threadpool(backgroundPool);
+        memCacheDestroy();
+        fdCacheDestroy();
+        relayDestroy();
+        cacheIndexStopEvictor();
+        cacheIndexDestroy();
+        accessLogDestroy();
+        resolverDestroy();
+        deadlineDestroy();
+        freeFilters();
+        return -1;
+    }
+    if(config.mode == MODE_EPOLL){
+        runEventLoops(tp, maxRequests, serverPort, config.groups);
+    } else{
+        listenLoop(tp, maxRequests, serverPort);
+    }
 
     destroy_threadpool(tp);
+    destroy_threadpool(backgroundPool);     //after the pool whose jobs give it work
+    printUpstreamStats();
+    printMemCacheStats();
+    printArenaStats();
+    printFetchStats();
+    printFreshnessStats();
+    printRangeStats();
+    printVariantStats();
+    printLatencyStats();
+    deadlineDestroy();      //after the pools, no thread arms a deadline any more
+    printDeadlineStats();
+    printAdmissionStats();
+    admissionDestroy();
+    accessLogDestroy();     //after the pools, nothing logs any more
+    printAccessLogStats();
+    cacheIndexStopEvictor();
+    printCacheIndexStats();
+    if(config.cacheIndex != NULL){
+        cacheIndexSave(config.cacheIndex);
+    }
+    upstreamDestroy();
+    memCacheDestroy();
+    fdCacheDestroy();
+    relayDestroy();
+    cacheIndexDestroy();
+    resolverDestroy();
     freeFilters();
+    metricsDestroy();
+    return 0;
+}
+#endif
+
+/**
+ * print the reuse counters of the origin connection pool
+ */
+void printUpstreamStats(){
+    struct UpstreamStats st;
+    upstreamGetStats(&st);
+    printf("Origin connections: %ld opened, %ld reused, %ld released to the pool, %ld expired idle, "
+           "%ld over the per host limit, %ld stale, %ld retried\n",
+           st.opened, st.reused, st.released, st.expired, st.overLimit, st.stale, st.retried);
+}
+
+/**
+ * print the counters of the in-memory object cache and of the open file table
+ */
+void printMemCacheStats(){
+    struct MemCacheStats st;
+    memCacheGetStats(&st);
+    printf("Memory cache: %ld hits, %ld misses, %ld inserted, %ld evicted, %ld objects in %ld of %ld bytes\n",
+           st.hits, st.misses, st.inserts, st.evictions, st.objects, st.bytes, st.budget);
+    struct FdCacheStats fst;
+    fdCacheGetStats(&fst);
+    printf("Open file table: %ld hits, %ld opens, %ld evicted, %ld open\n", fst.hits, fst.opens, fst.evictions, fst.open);
+}
+
+/**
+ * print how much request memory came from arenas, and how often it needed the heap
+ */
+void printArenaStats(){
+    struct ArenaStats st;
+    arenaGetStats(&st);
+    double requests = st.requests > 0 ? (double)st.requests : 1.0;
+    printf("Arenas: %lu created, %lu reused, %lu requests, %.2f allocations and %.2f heap allocations per request\n",
+           st.created, st.reused, st.requests, (double)st.allocs / requests, (double)st.heapAllocs / requests);
+}
+
+/**
+ * print how many misses were collapsed into an origin fetch already in flight
+ */
+void printFetchStats(){
+    struct FetchStats st;
+    fetchGetStats(&st);
+    printf("Collapsed forwarding: %ld origin fetches, %ld requests joined a fetch in flight, %ld fetches failed\n",
+           st.fetches, st.followers, st.failed);
+}
+
+/**
+ * print how stale copies were revalidated or refreshed, and the client conditional requests answered with 304
+ */
+void printFreshnessStats(){
+    printf("Revalidation: %ld stale copies revalidated, %ld refreshed in the background, %ld confirmed by 304, "
+           "%ld conditional requests answered with 304\n",
+           __atomic_load_n(&validation.revalidated, __ATOMIC_RELAXED), __atomic_load_n(&validation.refreshed, __ATOMIC_RELAXED),
+           __atomic_load_n(&validation.notModified, __ATOMIC_RELAXED), __atomic_load_n(&validation.answered, __ATOMIC_RELAXED));
+}
+
+/**
+ * print how range requests were answered
+ */
+void printRangeStats(){
+    printf("Ranges: %ld partial responses, %ld with several ranges, %ld not satisfiable, %ld misses filled in the background\n",
+           rangeStats.partial, rangeStats.multipart, rangeStats.unsatisfiable, rangeStats.filled);
+}
+
+/**
+ * print how many responses were sent from compressed variants, and the variants made
+ */
+void printVariantStats(){
+    struct VariantStats st;
+    variantGetStats(&st);
+    printf("Compression (%s): %ld br, %ld zstd and %ld gzip responses, %ld variants made saving %lld bytes, "
+           "%ld incompressible, %ld not started\n", variantCodings(), st.served[CODING_BR], st.served[CODING_ZSTD],
+           st.served[CODING_GZIP], st.created, st.saved, st.incompressible, st.dropped);
+}
+
+/**
+ * print the median and the 99th percentile of every request stage
+ */
+void printLatencyStats(){
+    struct Histogram *h = (struct Histogram*) malloc(sizeof(struct Histogram));
+    if(h == NULL){
+        return;
+    }
+    printf("Latency p50/p99 (us):");
+    for (int stage = 0; stage < STAGES; stage++) {
+        metricsMerge(stage, h);
+        printf("%s %s %.1f/%.1f", stage == 0 ? "" : ",", metricsStageName(stage),
+               (double)metricsPercentile(h, 0.5) / 1e3, (double)metricsPercentile(h, 0.99) / 1e3);
+    }
+    printf("\n");
+    free(h);
+}
+
+/**
+ * print how many lines the access log wrote, and how many records it dropped or lost
+ */
+void printAccessLogStats(){
+    if(config.accessLog == NULL){
+        return;
+    }
+    struct AccessLogStats st;
+    accessLogGetStats(&st);
+    printf("Access log: %ld records written, %ld dropped, %ld rotations, %ld lost to write errors\n",
+           st.written, st.dropped, st.rotations, st.failed);
+}
+
+/**
+ * print how many deadlines expired in every phase of a request
+ */
+void printDeadlineStats(){
+    long timeouts[PHASES];
+    deadlineGetStats(timeouts);
+    printf("Timeouts: header %ld, dns %ld, connect %ld, first byte %ld, relay %ld, total %ld\n",
+           timeouts[PHASE_HEADER], timeouts[PHASE_DNS], timeouts[PHASE_CONNECT], timeouts[PHASE_FIRST_BYTE],
+           timeouts[PHASE_RELAY], timeouts[PHASE_TOTAL]);
+}
+
+/**
+ * print the connections and requests admission control turned away
+ */
+void printAdmissionStats(){
+    struct AdmissionStats st;
+    admissionGetStats(&st);
+    printf("Admission: %ld connections shed at the queue limit, %ld over the per client cap, %ld requests over the rate limit, "
+           "%ld clients tracked, %ld untracked\n", st.shed, st.overConns, st.overRate, st.clients, st.untracked);
+}
+
+/**
+ * print the lookups of the cache index, what it holds against the disk quotas and what was evicted
+ */
+void printCacheIndexStats(){
+    struct CacheIndexStats st;
+    cacheIndexGetStats(&st);
+    printf("Cache index: %ld lookups, %ld hits, %ld stored, %ld removed, %ld objects in %lld bytes\n",
+           st.lookups, st.hits, st.stores, st.removals, st.objects, st.bytes);
+    printf("Disk cache: %ld of %ld objects, %lld of %lld bytes (%.1f%%), %ld evicted in %ld runs (%lld bytes, %.2f per second)\n",
+           st.objects, st.maxObjects, st.bytes, st.maxBytes, st.maxBytes > 0 ? (double)st.bytes * 100.0 / (double)st.maxBytes : 0.0,
+           st.evictions, st.evictionRuns, st.evictedBytes, st.evictionRate);
+}
+
+/**
+ * parse the optional "--name=value" arguments that follow the positional ones into config
+ * @param argc
+ * @param argv
+ * @return 0 - on success
+ *         -1 - on unknown option or bad value
+ */
+int parseOptions(int argc, char *argv[]){
+    char *checkIfNumber;
+    for (int i = 5; i < argc; i++) {
+        char *opt = argv[i];
+        if(strcmp(opt, "--mode=threads") == 0){
+            config.mode = MODE_THREADS;
+        } else if(strcmp(opt, "--mode=epoll") == 0){
+            config.mode = MODE_EPOLL;
+        } else if(strncmp(opt, "--groups=", strlen("--groups=")) == 0){
+            config.groups = (int) strtol(opt + strlen("--groups="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.groups <= 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--dns-hosts=", strlen("--dns-hosts=")) == 0){
+            config.dnsHosts = opt + strlen("--dns-hosts=");
+            if(strcmp(config.dnsHosts, "none") == 0){
+                config.dnsHosts = NULL;
+            }
+        } else if(strncmp(opt, "--dns-server=", strlen("--dns-server=")) == 0){
+            config.dnsServer = opt + strlen("--dns-server=");
+        } else if(strncmp(opt, "--upstream-idle=", strlen("--upstream-idle=")) == 0){
+            config.upstreamIdle = (int) strtol(opt + strlen("--upstream-idle="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.upstreamIdle < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--upstream-max-per-host=", strlen("--upstream-max-per-host=")) == 0){
+            config.upstreamMaxPerHost = (int) strtol(opt + strlen("--upstream-max-per-host="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.upstreamMaxPerHost < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--client-idle=", strlen("--client-idle=")) == 0){
+            config.clientIdle = (int) strtol(opt + strlen("--client-idle="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.clientIdle <= 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--client-max-requests=", strlen("--client-max-requests=")) == 0){
+            config.clientMaxRequests = (int) strtol(opt + strlen("--client-max-requests="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.clientMaxRequests <= 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--mem-cache=", strlen("--mem-cache=")) == 0){
+            if(parseSize(opt + strlen("--mem-cache="), &config.memCache) == -1){
+                return -1;
+            }
+        } else if(strncmp(opt, "--fd-cache=", strlen("--fd-cache=")) == 0){
+            config.fdCache = (int) strtol(opt + strlen("--fd-cache="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.fdCache < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--relay-buffer=", strlen("--relay-buffer=")) == 0){
+            if(parseSize(opt + strlen("--relay-buffer="), &config.relayBuffer) == -1 || config.relayBuffer == 0
+                    || config.relayBuffer > RELAY_MAX_BUFFER){
+                return -1;
+            }
+        } else if(strncmp(opt, "--header-limit=", strlen("--header-limit=")) == 0){
+            if(parseSize(opt + strlen("--header-limit="), &config.headerLimit) == -1 || config.headerLimit < CHUNK
+                    || config.headerLimit > HEADER_MAX_LIMIT){
+                return -1;
+            }
+        } else if(strncmp(opt, "--cache-dir=", strlen("--cache-dir=")) == 0){
+            config.cacheDir = opt + strlen("--cache-dir=");
+            size_t len = strlen(config.cacheDir);
+            while(len > 1 && config.cacheDir[len - 1] == '/'){
+                config.cacheDir[--len] = '\0';
+            }
+            if(len == 0 || strlen(config.cacheDir) + strlen(CACHEINDEX_DEFAULT_SNAPSHOT) + 2 > PATH_MAX){
+                return -1;
+            }
+        } else if(strncmp(opt, "--cache-index=", strlen("--cache-index=")) == 0){
+            config.cacheIndex = opt + strlen("--cache-index=");
+            if(strcmp(config.cacheIndex, "none") == 0){
+                config.cacheIndex = NULL;
+            } else if(strlen(config.cacheIndex) == 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--disk-cache=", strlen("--disk-cache=")) == 0){
+            if(parseSize(opt + strlen("--disk-cache="), &config.diskCache) == -1){
+                return -1;
+            }
+        } else if(strncmp(opt, "--disk-objects=", strlen("--disk-objects=")) == 0){
+            config.diskObjects = strtol(opt + strlen("--disk-objects="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.diskObjects < 0){
+                return -1;
+            }
+        } else if(strcmp(opt, "--disk-policy=lru") == 0){
+            config.diskPolicy = CACHE_POLICY_LRU;
+        } else if(strcmp(opt, "--disk-policy=gdsf") == 0){
+            config.diskPolicy = CACHE_POLICY_GDSF;
+        } else if(strncmp(opt, "--default-ttl=", strlen("--default-ttl=")) == 0){
+            config.defaultTtl = strtol(opt + strlen("--default-ttl="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.defaultTtl < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--stale-while-revalidate=", strlen("--stale-while-revalidate=")) == 0){
+            config.staleWindow = strtol(opt + strlen("--stale-while-revalidate="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.staleWindow < 0){
+                return -1;
+            }
+        } else if(strcmp(opt, "--compress=on") == 0){
+            config.compress = TRUE;
+        } else if(strcmp(opt, "--compress=off") == 0){
+            config.compress = FALSE;
+        } else if(strcmp(opt, "--relay=splice") == 0){
+            config.relaySplice = TRUE;
+        } else if(strcmp(opt, "--relay=copy") == 0){
+            config.relaySplice = FALSE;
+        } else if(strncmp(opt, "--access-log=", strlen("--access-log=")) == 0){
+            config.accessLog = opt + strlen("--access-log=");
+            if(strcmp(config.accessLog, "none") == 0){
+                config.accessLog = NULL;
+            } else if(strlen(config.accessLog) == 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--access-log-size=", strlen("--access-log-size=")) == 0){
+            if(parseSize(opt + strlen("--access-log-size="), &config.accessLogSize) == -1){
+                return -1;
+            }
+        } else if(strncmp(opt, "--dns-timeout=", strlen("--dns-timeout=")) == 0){
+            config.dnsTimeout = (int) strtol(opt + strlen("--dns-timeout="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.dnsTimeout < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--connect-timeout=", strlen("--connect-timeout=")) == 0){
+            config.connectTimeout = (int) strtol(opt + strlen("--connect-timeout="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.connectTimeout < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--first-byte-timeout=", strlen("--first-byte-timeout=")) == 0){
+            config.firstByteTimeout = (int) strtol(opt + strlen("--first-byte-timeout="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.firstByteTimeout < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--relay-idle=", strlen("--relay-idle=")) == 0){
+            config.relayIdle = (int) strtol(opt + strlen("--relay-idle="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.relayIdle < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--request-timeout=", strlen("--request-timeout=")) == 0){
+            config.requestTimeout = (int) strtol(opt + strlen("--request-timeout="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.requestTimeout < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--listen-backlog=", strlen("--listen-backlog=")) == 0){
+            config.listenBacklog = (int) strtol(opt + strlen("--listen-backlog="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.listenBacklog <= 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--queue-limit=", strlen("--queue-limit=")) == 0){
+            config.queueLimit = (int) strtol(opt + strlen("--queue-limit="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.queueLimit < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--retry-after=", strlen("--retry-after=")) == 0){
+            config.retryAfter = (int) strtol(opt + strlen("--retry-after="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.retryAfter < 0){
+                return -1;
+            }
+        } else if(strncmp(opt, "--client-rate=", strlen("--client-rate=")) == 0){
+            config.clientRate = (int) strtol(opt + strlen("--client-rate="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.clientRate < 0 || config.clientRate > 1000000){
+                return -1;
+            }
+        } else if(strncmp(opt, "--client-burst=", strlen("--client-burst=")) == 0){
+            config.clientBurst = (int) strtol(opt + strlen("--client-burst="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.clientBurst < 0 || config.clientBurst > 1000000){
+                return -1;
+            }
+        } else if(strncmp(opt, "--client-conns=", strlen("--client-conns=")) == 0){
+            config.clientConns = (int) strtol(opt + strlen("--client-conns="), &checkIfNumber, 10);
+            if(strlen(checkIfNumber) != 0 || config.clientConns < 0){
+                return -1;
+            }
+        } else{
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * parse a byte count with an optional k, m or g suffix
+ * @param value
+ * @param bytes - set to the count
+ * @return 0 - on success
+ *         -1 - on a bad value
+ */
+int parseSize(const char *value, size_t *bytes){
+    char *suffix;
+    long long n = strtoll(value, &suffix, 10);
+    if(suffix == value || n < 0){
+        return -1;
+    }
+    if(strcasecmp(suffix, "k") == 0){
+        n *= 1024;
+    } else if(strcasecmp(suffix, "m") == 0){
+        n *= 1024 * 1024;
+    } else if(strcasecmp(suffix, "g") == 0){
+        n *= 1024 * 1024 * 1024;
+    } else if(strlen(suffix) != 0){
+        return -1;
+    }
+    *bytes = (size_t)n;
     return 0;
 }
+
 /**
- * Loop that waiting to connections, runs on the main thread.
+ * Loop that waiting to connections. every group gets its own SO_REUSEPORT listening socket
+ * and acceptor pinned to the group cpu, group 0 runs on the main thread.
  * @param tp threadpool pointer
  * @param maxRequests
  * @param port
@@ -159,6 +744,100 @@ int main(int argc, char *argv[]) {
  *         -1 - on error before the listen loop started
  */
 int listenLoop(threadpool *tp, int maxRequests, int port){
+    int groups = config.groups;
+    acceptors = (struct Acceptor*) malloc(sizeof(struct Acceptor) * groups);
+    if(acceptors == NULL){
+        perror("error: <sys_call>\n");
+        return -1;
+    }
+    acceptedCount = 0;
+    maxAccepted = maxRequests;
+    acceptorsNum = 0;
+    for (int i = 0; i < groups; i++) {
+        acceptors[i].tp = tp;
+        acceptors[i].group = i;
+        acceptors[i].fd = openListenSocket(port, groups > 1);
+        if(acceptors[i].fd < 0){
+            break;
+        }
+        acceptorsNum++;
+    }
+    if(acceptorsNum < groups){
+        for (int i = 0; i < acceptorsNum; i++) {
+            close(acceptors[i].fd);
+        }
+        free(acceptors);
+        return -1;
+    }
+    int started = 1;
+    for (; started < groups; started++) {
+        if(pthread_create(&acceptors[started].thread, NULL, acceptLoop, (void*)&acceptors[started]) != 0){
+            perror("error: <sys_call>\n");
+            break;
+        }
+    }
+    acceptLoop(&acceptors[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(acceptors[i].thread, NULL);
+    }
+    for (int i = 0; i < groups; i++) {
+        close(acceptors[i].fd);
+    }
+    free(acceptors);
+    acceptors = NULL;
+    return 0;
+}
+
+/**
+ * accept connections on the group socket and dispatch them to the group queue,
+ * until maxRequests connections were accepted by all the groups together.
+ * @param arg - the group's struct Acceptor
+ * @return NULL
+ */
+void *acceptLoop(void *arg){
+    struct Acceptor *a = (struct Acceptor*)arg;
+    if(acceptorsNum > 1){
+        pin_to_group_cpu(a->group);
+    }
+    while(__atomic_load_n(&acceptedCount, __ATOMIC_SEQ_CST) < maxAccepted){
+        struct sockaddr_in peer;
+        socklen_t peerLen = sizeof(peer);
+        int newFd = accept(a->fd, (struct sockaddr*) &peer, &peerLen);
+        if(newFd < 0){
+            continue;
+        }
+        int n = __atomic_add_fetch(&acceptedCount, 1, __ATOMIC_SEQ_CST);
+        if(n > maxAccepted){
+            close(newFd);
+            break;
+        }
+        if(n == maxAccepted){
+            for (int i = 0; i < acceptorsNum; i++) {   //wake the acceptors blocked in accept
+                if(i != a->group){
+                    shutdown(acceptors[i].fd, SHUT_RD);
+                }
+            }
+        }
+        if(admissionShed(a->tp) == TRUE){   //answered now rather than after the jobs queued before it
+            refuseConnection(newFd, ERR_OVERLOADED);
+            continue;
+        }
+        if(admissionEnter(newFd, peer.sin_addr) == FALSE){
+            refuseConnection(newFd, ERR_TOO_MANY);
+            continue;
+        }
+        dispatch_to_group(a->tp, a->group, &handleRequests, (void*)(intptr_t)newFd);
+    }
+    return NULL;
+}
+
+/**
+ * create a TCP socket bound to port on all interfaces and start listening on it
+ * @param port
+ * @param reusePort - TRUE to let several sockets listen on port, the kernel spreads connections between them
+ * @return the listening socket descriptor, -1 on error
+ */
+int openListenSocket(int port, int reusePort){
     struct sockaddr_in srv;
 
     int fd;
@@ -168,6 +847,13 @@ int listenLoop(threadpool *tp, int maxRequests, int port){
         return -1;
     }
 
+    int on = 1;
+    if(reusePort == TRUE && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0){
+        perror("error: <sys_call>\n");
+        close(fd);
+        return -1;
+    }
+
     srv.sin_family = AF_INET;
 
     srv.sin_port = htons(port);
@@ -175,24 +861,15 @@ int listenLoop(threadpool *tp, int maxRequests, int port){
     srv.sin_addr.s_addr = htonl(INADDR_ANY);
     if(bind(fd, (struct sockaddr*) &srv, sizeof(srv)) < 0){
         perror("error: <sys_call>\n");
+        close(fd);
         return -1;
     }
-    if(listen(fd, 5) < 0){
+    if(listen(fd, config.listenBacklog) < 0){
         perror("error: <sys_call>\n");
+        close(fd);
         return -1;
     }
-    for (int i = 0; i < maxRequests; i++) {
-        int *newFd = (int*) malloc(sizeof(int));
-        if(newFd == NULL){
-            continue;
-        }
-        if((*newFd = accept(fd, NULL, NULL)) < 0){
-            continue;
-        }
-        dispatch(tp, &handleRequests, (void*)newFd);
-    }
-    close(fd);
-    return 0;
+    return fd;
 }
 
 /**
@@ -220,104 +897,359 @@ char *get_mime_type(char *name){
 }
 
 /**
- *
- * @param sd - the socket descriptor of the client
+ * serve the requests of one client connection until it is closed, goes idle, asks to close
+ * or reaches config.clientMaxRequests. pipelined requests are served from the read buffer in order.
+ * @param sd - the socket descriptor of the client, cast to a pointer
  * @return -1 - on error
  *          0 - on success
  */
 int handleRequests(void *sd){
-    struct Headers *h = (struct Headers*) malloc(sizeof(struct Headers));
-    if(h == NULL){
-        responseErr(4, *(int*)sd);
+    int fd = (int)(intptr_t)sd;
+    struct Arena *arena = arenaTake();
+    struct Headers *h = arena != NULL ? (struct Headers*) arenaCalloc(arena, sizeof(struct Headers)) : NULL;
+    char *request = h != NULL ? (char*) arenaAlloc(arena, sizeof(char) * (config.headerLimit + 1)) : NULL;
+    if(request == NULL){
+        responseErr(ERR_SERVER, fd, FALSE);
+        admissionLeave(fd);
+        close(fd);
+        if(arena != NULL){
+            arenaGive(arena);
+        }
         return -1;
     }
-    h->client_fd = (int*)sd;
-    h->request = NULL;
+    h->client_fd = fd;
+    h->arena = arena;
+    h->request = request;
+    h->keepAlive = FALSE;
+    struct ArenaMark connectionScope = arenaMark(arena);   //everything after it lives for one request
 
     ssize_t nbytes;
-    ssize_t totalBytes = 0;
-    char buffer[CHUNK];
-    h->request = (char*) malloc(sizeof(char) * (CHUNK + 1));
-    if(h->request == NULL){
-        responseErr(4, *h->client_fd);
-        freeHeaders(h);
-        return -1;
-    }
-    while ((nbytes = read(*h->client_fd, buffer, CHUNK)) > 0){ //read all headers
-        buffer[nbytes] = '\0';
-        memcpy(h->request + sizeof(char) * totalBytes, buffer, nbytes + 1);
-        totalBytes += nbytes;
-        if(strstr(buffer, "\r\n\r\n") != NULL){
+    size_t totalBytes = 0;
+    deadlineClient(fd);     //an idle or slow client does not hold the worker forever
+    httpParserInit(&h->parser, FALSE, config.headerLimit);
+    int keepAlive = TRUE;
+    for (int served = 0; keepAlive == TRUE && served < config.clientMaxRequests; served++) {
+        int result;
+        nbytes = 1;
+        deadlineStart(PHASE_HEADER);
+        while((result = scanRequestHead(h, totalBytes, FALSE)) == HP_INCOMPLETE && nbytes > 0){ //read all headers
+            nbytes = read(fd, h->request + totalBytes, config.headerLimit - totalBytes);
+            if(nbytes > 0){
+                totalBytes += nbytes;
+            }
+        }
+        if(deadlineStop() == PHASE_HEADER && result == HP_INCOMPLETE){  //the head took longer than config.clientIdle
+            if(totalBytes > 0){     //a client that went quiet between requests is just closed
+                accessLogBegin(&h->entry, h->client_fd);
+                responseErr(ERR_REQUEST_TIMEOUT, fd, FALSE);
+                accessLogKeepStatus(&h->entry);
+                accessLogWrite(&h->entry, NULL, NULL, NULL);
+            }
             break;
         }
-        h->request = realloc(h->request, sizeof(char) * (totalBytes + CHUNK + 1));
-        if(h->request == NULL){
-            responseErr(4, *h->client_fd);
-            freeHeaders(h);
-            return -1;
+        if(result == HP_INCOMPLETE){    //EOF before a whole request head
+            if(served > 0 || totalBytes == 0){
+                break;
+            }
+            result = scanRequestHead(h, totalBytes, TRUE);  //parse what the client sent before it stopped
         }
-
+        if(result != HP_DONE || admissionRequest(fd) == FALSE){
+            accessLogBegin(&h->entry, h->client_fd);
+            responseErr(result != HP_DONE ? (result == HP_TOO_LARGE ? ERR_TOO_LARGE : ERR_BAD_REQUEST) : ERR_TOO_MANY, fd, FALSE);
+            accessLogKeepStatus(&h->entry);
+            accessLogWrite(&h->entry, NULL, NULL, NULL);
+            break;
+        }
+        keepAlive = serveRequest(h, served + 1 < config.clientMaxRequests);
+        consumeRequest(h, &totalBytes);
+        arenaRewind(arena, connectionScope);
     }
+    deadlineFinish();
+    deadlineClient(-1);     //freeHeaders closes it
+    admissionLeave(fd);
+    freeHeaders(h);
+    return 0;
+}
 
-
-    h->method = (char*) malloc(sizeof(char) * (totalBytes + 1));
-    h->path = (char*) malloc(sizeof(char) * (totalBytes + 1));
-    h->protocol = (char*) malloc(sizeof(char) * (totalBytes + 1));
-    h->host = (char*) malloc(sizeof(char) * (totalBytes + 1));
-
-    if(h->method == NULL || h->path == NULL || h->protocol == NULL || h->host == NULL){
-        responseErr(4, *h->client_fd);
-        freeHeaders(h);
-        return -1;
+static int serveObject(struct Headers *h);
+
+/**
+ * serve one request of a client connection, from the local file system or from the origin,
+ * or the stats of the proxy if it asks for METRICS_PATH, and log it
+ * @param h - headers whose parser found a whole request head at the start of h->request
+ * @param mayKeep - FALSE if this is the last request allowed on the connection
+ * @return TRUE if the client connection can be used for another request
+ */
+int serveRequest(struct Headers *h, int mayKeep){
+    accessLogBegin(&h->entry, h->client_fd);
+    deadlineStart(PHASE_TOTAL);
+    int keepAlive;
+    int format;
+    int err = parseRequest(h);
+    if(mayKeep == FALSE){
+        h->keepAlive = FALSE;
     }
+    if(err != 0){
+        keepAlive = responseErr(err, h->client_fd, FALSE);
+    } else if(metricsWanted(h->path, &format) == TRUE){
+        keepAlive = metricsServe(format, h->client_fd, h->keepAlive);
+        accessLogAnswer(&h->entry, ACCESS_STATS, 0, 0);
+    } else{
+        keepAlive = serveObject(h);
+        metricsSince(STAGE_TOTAL, h->entry.start);
+    }
+    accessLogKeepStatus(&h->entry);     //of an error response
+    accessLogWrite(&h->entry, h->method, h->host, h->path);
+    if(deadlineExpired() != PHASE_NONE){    //its sockets may be shut down
+        keepAlive = FALSE;
+    }
+    deadlineFinish();
+    return keepAlive;
+}
 
-    if(sscanf(h->request, "%s %s %s", h->method, h->path, h->protocol) != 3){
-        responseErr(1, *h->client_fd);
-        freeHeaders(h);
-        return -1;
+/**
+ * serve the object a parsed request asks for, from the caches or from the origin
+ * @param h
+ * @return TRUE if the client connection can be used for another request
+ */
+static int serveObject(struct Headers *h){
+    if(searchHostInFilter(h->host) == TRUE){
+        return responseErr(ERR_FORBIDDEN, h->client_fd, h->keepAlive);
+    }
+    struct in_addr address;
+    long long start = metricsNow();
+    deadlineStart(PHASE_DNS);
+    int resolved = resolverResolve(h->host, &address);
+    h->entry.resolve = metricsSince(STAGE_RESOLVE, start) - start;
+    if(deadlineStop() != PHASE_NONE){   //the lookup is not cut short, its answer came too late
+        return responseErr(ERR_GATEWAY_TIMEOUT, h->client_fd, FALSE);
+    }
+    if (resolved != RESOLVE_FOUND){    //check if the URL/IP is valid
+        return responseErr(ERR_NOT_FOUND, h->client_fd, h->keepAlive);
+    }
+    if(searchIpInFilter(address) == TRUE){
+        return responseErr(ERR_FORBIDDEN, h->client_fd, h->keepAlive);
     }
 
-    if(strcasecmp(h->protocol, "HTTP/1.0") != 0 && strcasecmp(h->protocol, "HTTP/1.1") != 0){
-        responseErr(1, *h->client_fd);
-        freeHeaders(h);
-        return -1;
+    char *fullPath = buildFullPath(h);
+    if (fullPath == NULL){
+        return responseErr(ERR_SERVER, h->client_fd, FALSE);
+    }
+    char *constructedRequest = buildOriginRequest(h, NULL, NULL);
+    if(constructedRequest == NULL){
+        return responseErr(ERR_SERVER, h->client_fd, FALSE);
+    }
+    int keepAlive = h->keepAlive;
+    struct MemObject *obj = NULL;
+    struct CachedFile *file = NULL;
+    start = metricsNow();
+    int verdict = findInCache(fullPath, &obj, &file);
+    if(verdict == FRESHNESS_STALE_SERVE){   //served as it is while a refresh runs in the background
+        char *request = obj != NULL ? buildOriginRequest(h, obj->head, &obj->fresh) : buildOriginRequest(h, file->head, &file->fresh);
+        if(request != NULL){
+            refreshStale(fullPath, request, address);
+        }
+    }
+    if(obj != NULL || (file != NULL && verdict != FRESHNESS_STALE)){
+        variantPick(fullPath, &h->parser, &obj, &file);
+    }
+    start = metricsSince(STAGE_CACHE, start);
+    if(obj != NULL){    //from memory
+        size_t sent = 0;
+        if(giveFromMemory(obj, &h->parser, h->client_fd, keepAlive, &sent) != 0){
+            keepAlive = FALSE;
+        }
+        memCacheRelease(obj);
+        metricsSince(STAGE_HIT, start);
+        metricsAnswer(COUNT_MEMORY_HITS, (long long)sent);
+        accessLogAnswer(&h->entry, ACCESS_MEMORY, 0, (long long)sent);
     }
+    else if(file != NULL && verdict != FRESHNESS_STALE){ //from local
+        long sent = giveFromLocal(file, &h->parser, h->client_fd, &keepAlive);
+        metricsSince(STAGE_HIT, start);
+        metricsAnswer(COUNT_DISK_HITS, sent);
+        accessLogAnswer(&h->entry, ACCESS_DISK, 0, sent);
+        fdCacheRelease(file);
 
-    char *firstPtr = strstr(h->request, "Host: ");
-    if(firstPtr == NULL){
-        responseErr(1, *h->client_fd);
-        freeHeaders(h);
-        return -1;
     }
-    firstPtr += strlen("Host: ");
-    char *secondPtr = strchr(firstPtr, '\r');
-    if(secondPtr == NULL || (secondPtr - firstPtr) == 0){
-        responseErr(1, *h->client_fd);
-        freeHeaders(h);
-        return -1;
+    else{   //from server, revalidating the stale file if there is one
+        int leader = FALSE;
+        struct Fetch *fetch = fetchJoin(fullPath, &leader);
+        if(fetch == NULL){
+            if(file != NULL){
+                fdCacheRelease(file);
+            }
+            return responseErr(ERR_SERVER, h->client_fd, FALSE);
+        }
+        if(leader == TRUE && file != NULL && (constructedRequest = buildOriginRequest(h, file->head, &file->fresh)) == NULL){
+            fetchFinish(fetch, FALSE, 0);
+            fetchRelease(fetch);
+            fdCacheRelease(file);
+            return responseErr(ERR_SERVER, h->client_fd, FALSE);
+        }
+        if(leader == TRUE && httpField(&h->parser, "Range") != NULL
+                && fillForRange(fetch, constructedRequest, address) == 0){
+            leader = FALSE;     //the whole object is fetched in the background, the ranges follow it
+        }
+        if(leader == FALSE){    //another request fetches it already, follow its body
+            if(file != NULL){
+                fdCacheRelease(file);
+            }
+            long sent = followFetch(fetch, &h->parser, h->client_fd, &keepAlive);
+            fetchRelease(fetch);
+            if(sent < 0){
+                return responseErr(ERR_SERVER, h->client_fd, FALSE);
+            }
+            metricsAnswer(COUNT_FOLLOWED, sent);
+            accessLogAnswer(&h->entry, ACCESS_FOLLOWED, 0, sent);
+            return keepAlive;
+        }
+        int keepClient = keepAlive;
+        start = metricsNow();
+        long responseBytes = fetchFromOrigin(address, constructedRequest, h->client_fd, fetch, file, &keepClient, h->arena);
+        h->entry.origin = metricsNow() - start;
+        int notModified = file != NULL && fetch->status == 304;
+        fetchRelease(fetch);
+        if (responseBytes == -1){
+            if(file != NULL){
+                fdCacheRelease(file);
+            }
+            return responseErr(deadlineExpired() != PHASE_NONE ? ERR_GATEWAY_TIMEOUT : ERR_SERVER, h->client_fd, FALSE);
+        }
+        if(notModified == TRUE){    //the origin confirmed the copy, nothing was sent to the client yet
+            struct CachedFile *current = openFromCache(fullPath);   //with the merged head, unless it could not be stored
+            if(current != NULL){
+                fdCacheRelease(file);
+                file = current;
+            }
+            long sent = giveFromLocal(file, &h->parser, h->client_fd, &keepAlive);
+            metricsAnswer(COUNT_DISK_HITS, sent);
+            accessLogAnswer(&h->entry, ACCESS_REVALIDATED, 0, sent);
+            fdCacheRelease(file);
+            return keepAlive;
+        }
+        if(file != NULL){
+            fdCacheRelease(file);
+        }
+        keepAlive = keepAlive && keepClient;
+        metricsAnswer(COUNT_FETCHED, responseBytes);
+        accessLogAnswer(&h->entry, ACCESS_ORIGIN, 0, responseBytes);
     }
+    return keepAlive;
+}
 
-    snprintf(h->host, secondPtr - firstPtr + 1, "%s", firstPtr);
-    if(strcasecmp(h->method, "GET") != 0){
-        responseErr(5, *h->client_fd);
-        freeHeaders(h);
-        return -1;
+/**
+ * continue parsing the request head at the start of h->request
+ * @param h
+ * @param len - bytes read from the client, pipelined requests included
+ * @param eof - TRUE if the client will not send more, a head missing only its empty line is accepted
+ * @return the httpParse result, h->parser.headLen is the length of the head once HP_DONE
+ */
+int scanRequestHead(struct Headers *h, size_t len, int eof){
+    if(eof == TRUE){
+        return httpParseEnd(&h->parser, h->request, len);
     }
-    struct hostent *hp;
-    struct in_addr address;
-    hp = gethostbyname(h->host);
-    if (hp == NULL){    //check if the URL/IP is valid
-        responseErr(3, *h->client_fd);
-        freeHeaders(h);
-        return -1;
+    return httpParse(&h->parser, h->request, len);
+}
+
+/**
+ * drop a served request and move the pipelined bytes that followed it to the start of h->request
+ * @param h
+ * @param len - bytes in h->request, updated
+ */
+void consumeRequest(struct Headers *h, size_t *len){
+    size_t headLen = h->parser.headLen;
+    h->method = NULL;
+    h->path = NULL;
+    h->protocol = NULL;
+    h->host = NULL;
+    h->keepAlive = FALSE;
+    memmove(h->request, h->request + headLen, *len - headLen);
+    *len -= headLen;
+    h->request[*len] = '\0';
+    httpParserInit(&h->parser, FALSE, config.headerLimit);
+}
+
+/**
+ * terminate a view of the parsed head in place
+ * @return the view as a string
+ */
+static char *terminate(struct StrView v){
+    char *str = (char*)v.data;
+    str[v.len] = '\0';
+    return str;
+}
+
+/**
+ * take the request line and the Host field of the parsed request head into the other fields of h,
+ * and decide if the client connection is kept open after it. they are terminated in place,
+ * over the byte that follows each of them, so the views of the other fields stay intact
+ * @param h - headers whose parser found a whole request head
+ * @return 0 - on success
+ *         the responseErr code to answer with otherwise
+ */
+int parseRequest(struct Headers *h){
+    struct HttpParser *p = &h->parser;
+    h->keepAlive = FALSE;
+    h->method = h->path = h->protocol = h->host = NULL;     //of the previous request, logged as unknown
+    if(viewEquals(p->start[2], "HTTP/1.0") == FALSE && viewEquals(p->start[2], "HTTP/1.1") == FALSE){
+        return ERR_BAD_REQUEST;
     }
-    address.s_addr = ((struct in_addr*)(hp->h_addr))->s_addr;
-    if(searchInFilter(*((struct in_addr *) (hp->h_addr)), h->host) == TRUE){
-        responseErr(2, *h->client_fd);
-        freeHeaders(h);
-        return -1;
+    const struct StrView *host = httpField(p, "Host");
+    if(host == NULL || host->len == 0){
+        return ERR_BAD_REQUEST;
+    }
+    int isGet = viewEquals(p->start[0], "GET");
+    int http11 = viewEquals(p->start[2], "HTTP/1.1");
+    const struct StrView *connection = httpField(p, "Connection");
+    if(http11 == TRUE){
+        h->keepAlive = connection == NULL || headerHasToken(connection->data, connection->len, "close") == FALSE;
+    } else{
+        h->keepAlive = connection != NULL && headerHasToken(connection->data, connection->len, "keep-alive") == TRUE;
+    }
+    h->method = terminate(p->start[0]);     //each view ends at a space or a line end, nothing else is lost
+    h->path = terminate(p->start[1]);
+    h->protocol = terminate(p->start[2]);
+    h->host = terminate(*host);
+    if(isGet == FALSE){
+        return ERR_NOT_SUPPORTED;
     }
+    return 0;
+}
 
+/**
+ * copy a host or a path to a cache path, with the dot that starts a name escaped as "%2E". names that start
+ * with a dot are left to the files the proxy keeps next to its objects (variants, temporary files of fetches),
+ * so no request can name them, and ".." can not leave the cache directory
+ * @param out - NULL to only count
+ * @param in
+ * @return bytes of the copy
+ */
+static size_t copyEscaped(char *out, const char *in){
+    size_t len = 0;
+    for (const char *p = in; *p != '\0'; p++) {
+        if(*p == '.' && (p == in || p[-1] == '/')){
+            if(out != NULL){
+                memcpy(out + len, "%2E", 3);
+            }
+            len += 3;
+            continue;
+        }
+        if(out != NULL){
+            out[len] = *p;
+        }
+        len++;
+    }
+    return len;
+}
+
+/**
+ * build the local file system path of the requested object: the cache directory, the host and the path,
+ * with "index.html" appended to directories
+ * @param h
+ * @return path allocated from h->arena, NULL on allocation failure
+ */
+char *buildFullPath(struct Headers *h){
     char *pathToSearch = h->path;
     if(strstr(pathToSearch, "http://") == pathToSearch){    //remove the "http://" and the host name to search/create local file.
         pathToSearch = pathToSearch + strlen("http://");
@@ -325,221 +1257,182 @@ int handleRequests(void *sd){
     if(strstr(pathToSearch, h->host) == pathToSearch){
         pathToSearch = pathToSearch + strlen(h->host);
     }
-    char *fullPath = (char*)malloc(sizeof(char) * (strlen(h->host) + strlen(pathToSearch) + strlen("index.html") + 1));
+    size_t rootLen = strlen(config.cacheDir);
+    char *fullPath = (char*)arenaAlloc(h->arena, sizeof(char) * (rootLen + 1 + copyEscaped(NULL, h->host)
+                                                                 + copyEscaped(NULL, pathToSearch) + strlen("index.html") + 1));
     if (fullPath == NULL){
-        responseErr(4, *h->client_fd);
-        freeHeaders(h);
-        return -1;
+        return NULL;
     }
-    if(pathToSearch[strlen(pathToSearch) - 1] == '/'){
-        sprintf(fullPath, "%s%s%s", h->host, pathToSearch, "index.html");
-    }else {
-        sprintf(fullPath, "%s%s", h->host, pathToSearch);
+    size_t len = (size_t)sprintf(fullPath, "%s/", config.cacheDir);
+    len += copyEscaped(fullPath + len, h->host);
+    len += copyEscaped(fullPath + len, pathToSearch);
+    fullPath[len] = '\0';
+    if(strlen(pathToSearch) == 0 || pathToSearch[strlen(pathToSearch) - 1] == '/'){
+        strcat(fullPath + len, "index.html");
     }
-    char *constructedRequest = (char*)malloc(sizeof(char)*(strlen(h->path) + strlen(h->protocol) + strlen(h->host) + strlen(REQ_TEMPLATE) + 1));
-    if(constructedRequest == NULL){
-        free(fullPath);
-        responseErr(4, *h->client_fd);
-        freeHeaders(h);
-        return -1;
-    }
-    sprintf(constructedRequest, REQ_TEMPLATE, h->path, h->protocol, h->host);
-    printf("HTTP request =\n%s\nLEN = %d\n", constructedRequest, (int)strlen(constructedRequest));
-    if(checkIfExist(fullPath) == TRUE){ //from local
-        printf("File is given from local filesystem\n");
-        printf("\n Total response bytes: %d\n", (int)giveFromLocal(fullPath, *h->client_fd));
+    return fullPath;
+}
 
+/**
+ * build the request that is sent to the origin server
+ * @param h
+ * @param head - stored head of the copy the request revalidates, NULL for an unconditional request
+ * @param fresh - of head, its ETag and Last-Modified become If-None-Match and If-Modified-Since
+ * @return request allocated from h->arena, NULL on allocation failure
+ */
+char *buildOriginRequest(struct Headers *h, const char *head, const struct Freshness *fresh){
+    size_t validators = head != NULL ? strlen("If-None-Match: \r\nIf-Modified-Since: \r\n") + fresh->etagLen + fresh->modifiedLen : 0;
+    char *constructedRequest = (char*)arenaAlloc(h->arena, sizeof(char)*(strlen(h->path) + strlen(h->protocol) + strlen(h->host) + strlen(REQ_TEMPLATE) + validators + 1));
+    if(constructedRequest == NULL){
+        return NULL;
     }
-    else{   //from server
-        struct sockaddr_in peeraddr;
-        int server_fd;
-
-        if ((server_fd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-            free(fullPath);
-            free(constructedRequest);
-            responseErr(4, *h->client_fd);
-            freeHeaders(h);
-            return -1;
-        }
-        peeraddr.sin_family = AF_INET;
-        peeraddr.sin_port = htons(80);
-        peeraddr.sin_addr.s_addr = address.s_addr;
-
-        if(connect(server_fd, (struct sockaddr*) &peeraddr, sizeof(peeraddr)) < 0) {
-            free(fullPath);
-            free(constructedRequest);
-            responseErr(4, *h->client_fd);
-            freeHeaders(h);
-            return -1;
-        }
-        size_t written = 0;
-
-        while (written < strlen(constructedRequest)) {  //send the request to the server
-            if ((nbytes = write(server_fd, constructedRequest + written, strlen(constructedRequest) - written)) < 0) {
-                free(fullPath);
-                free(constructedRequest);
-                responseErr(4, *h->client_fd);
-                freeHeaders(h);
-                return -1;
-            }
-            written += nbytes;
+    int len = sprintf(constructedRequest, REQ_TEMPLATE, h->path, h->protocol, h->host);
+    if(head != NULL){
+        len -= (int)strlen("\r\n");    //the validators go before the empty line
+        if(fresh->etagLen > 0){
+            len += sprintf(constructedRequest + len, "If-None-Match: %.*s\r\n", (int)fresh->etagLen, head + fresh->etag);
         }
-        long responseBytes = readResponseMsg(server_fd, *h->client_fd, fullPath);
-        if (responseBytes == -1){
-            free(fullPath);
-            free(constructedRequest);
-            responseErr(4, *h->client_fd);
-            freeHeaders(h);
-            return -1;
+        if(fresh->modifiedLen > 0){
+            len += sprintf(constructedRequest + len, "If-Modified-Since: %.*s\r\n", (int)fresh->modifiedLen, head + fresh->modified);
         }
-        printf("File is given from origin server\n");
-        printf("\n Total response bytes: %d\n", (int)responseBytes);
+        strcpy(constructedRequest + len, "\r\n");
     }
-    free(constructedRequest);
-
-    free(fullPath);
-    freeHeaders(h);
-
-    return 0;
+    return constructedRequest;
 }
 
-void responseErr(int code, int fd){
+/**
+ * write the canned error response for code to fd, closing fd is left to its owner
+ * @param code - one of the ERR_* codes
+ * @param fd
+ * @param keepAlive - TRUE if the client may send another request. only 403 and 404 honour it,
+ *                    after the other codes the rest of the client stream can not be trusted
+ * @return TRUE if the response announced the connection stays open
+ */
+int responseErr(int code, int fd, int keepAlive){
+    const char *canned;
     switch (code) {
-        case 1:
-            write(fd, BAD_REQUEST, strlen(BAD_REQUEST));
+        case ERR_BAD_REQUEST:
+            canned = BAD_REQUEST;
+            keepAlive = FALSE;
             break;
-        case 2:
-            write(fd, ACCESS_DENIED, strlen(ACCESS_DENIED));
+        case ERR_FORBIDDEN:
+            canned = ACCESS_DENIED;
             break;
-        case 3:
-            write(fd, NOT_FOUND, strlen(NOT_FOUND));
+        case ERR_NOT_FOUND:
+            canned = NOT_FOUND;
             break;
-        case 4:
-            write(fd, SERVER_ERROR, strlen(SERVER_ERROR));
+        case ERR_SERVER:
+            canned = SERVER_ERROR;
+            keepAlive = FALSE;
             break;
-        case 5:
-            write(fd, NOT_SUPPORTED, strlen(NOT_SUPPORTED));
+        case ERR_NOT_SUPPORTED:
+            canned = NOT_SUPPORTED;
+            keepAlive = FALSE;
             break;
-        default:
+        case ERR_TOO_LARGE:
+            canned = TOO_LARGE;
+            keepAlive = FALSE;
+            break;
+        case ERR_REQUEST_TIMEOUT:
+            canned = REQUEST_TIMEOUT;
+            keepAlive = FALSE;
+            break;
+        case ERR_GATEWAY_TIMEOUT:
+            canned = GATEWAY_TIMEOUT;
+            keepAlive = FALSE;
             break;
+        case ERR_OVERLOADED:
+            canned = OVERLOADED;
+            keepAlive = FALSE;
+            break;
+        case ERR_TOO_MANY:
+            canned = TOO_MANY;
+            keepAlive = FALSE;
+            break;
+        default:
+            return FALSE;
+    }
+    metricsError(code);
+    accessLogStatus(errorStatus[code]);
+    char msg[CHUNK];
+    const char *connection = keepAlive == TRUE ? "keep-alive" : "close";
+    int len = code == ERR_OVERLOADED || code == ERR_TOO_MANY ? snprintf(msg, sizeof(msg), canned, config.retryAfter, connection)
+                                                             : snprintf(msg, sizeof(msg), canned, connection);
+    if(write(fd, msg, len) < 0){
+        return FALSE;
+    }
+    return keepAlive;
+}
+
+/**
+ * answer a connection that is not served, without waiting for its request, and close it
+ * @param fd - just accepted
+ * @param code - ERR_OVERLOADED or ERR_TOO_MANY
+ */
+void refuseConnection(int fd, int code){
+    char discard[CHUNK];
+    responseErr(code, fd, FALSE);
+    accessLogTakeStatus();  //no request was read, nothing is logged
+    while(recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0){    //unread bytes would turn the close into a reset
     }
+    shutdown(fd, SHUT_WR);
     close(fd);
 }
 
+/**
+ * close the client and give back the arena h lives in
+ * @param h
+ */
 void freeHeaders(struct Headers *h){
-    if(h->client_fd != NULL){
-        close(*h->client_fd);
-        free(h->client_fd);
-        h->client_fd = NULL;
-    }
-    if(h->request != NULL){
-        free(h->request);
-        h->request = NULL;
+    if(h->client_fd >= 0){
+        close(h->client_fd);
+        h->client_fd = -1;
     }
-    if(h->protocol != NULL){
-        free(h->protocol);
-        h->protocol = NULL;
-    }
-    if(h->method != NULL){
-        free(h->method);
-        h->method = NULL;
-    }
-    if(h->path != NULL){
-        free(h->path);
-        h->path = NULL;
-    }
-    if(h->host != NULL){
-        free(h->host);
-        h->host = NULL;
-    }
-    free(h);
-
+    arenaGive(h->arena);
 }
 
+/**
+ * compile the filter file and publish it, host rules into a hash set and a reversed-label trie, address ranges into a Patricia trie
+ * @param filePath
+ * @return 1, -1 if the file is missing or could not be compiled
+ */
 int loadFilterFile(char* filePath){
     if (checkIfExist(filePath) == FALSE){
         printf(USAGE_MSG);
         return -1;
     }
-    f->ipHead = NULL;
-    f->ipTail = NULL;
-    f->urlHead = NULL;
-    f->urlTail = NULL;
-
-    FILE *fp = fopen(filePath, "r");
-    if(fp == NULL){
-        perror("error: <sys_call>\n");
+    filters *flt = filterCompile(filePath);
+    if(flt == NULL){
         return -1;
     }
-    char *line = NULL;
-    size_t len = 0;
-    while (getline(&line, &len, fp) != -1){
-        list *temp = (list*) malloc(sizeof(list));
-        if (temp == NULL){
-            fclose(fp);
-            perror("error: <sys_call>\n");
-            return -1;
-        }
-        temp->next = NULL;
-        temp->data = (char*) malloc(sizeof(char) * (strlen(line) + 1));
-        if (temp->data == NULL){
-            fclose(fp);
-            perror("error: <sys_call>\n");
-            return -1;
-        }
-        if(strchr(line, '\r') != NULL){
-            *strchr(line, '\r') = '\0';
-        }
-        if(strchr(line, '\n') != NULL){
-            *strchr(line, '\n') = '\0';
-        }
-        sprintf(temp->data, "%s", line);
-        if(*line >= '0' && *line <= '9'){
-            if (f->ipHead == NULL){
-                f->ipHead = temp;
-                f->ipTail = temp;
-            } else{
-                f->ipTail->next = temp;
-                f->ipTail = temp;
-            }
-        } else{
-            if (f->urlHead == NULL){
-                f->urlHead = temp;
-                f->urlTail = temp;
-            } else{
-                f->urlTail->next = temp;
-                f->urlTail = temp;
-            }
-        }
-    }
-    fclose(fp);
-    free(line);
+    printf("Filter: %ld hosts, %ld wildcard domains, %ld address ranges\n", flt->hostRules, flt->wildcardRules, flt->rangeRules);
+    filterPublish(flt);
     return 1;
 }
 
-int searchInFilter(struct in_addr hostIP, char* hostDomain){
-    list *curr = f->urlHead;
-    while(curr != NULL){
-        if(strcasecmp(hostDomain, curr->data) == 0){
-            return TRUE;
-        }
-        curr = curr->next;
-    }
-    curr = f->ipHead;
-    while(curr != NULL){
-        int c1, c2, c3, c4, bitsNum, scanned;
-        struct in_addr ip;
-        scanned = sscanf(curr->data, "%d.%d.%d.%d/%d", &c1, &c2, &c3, &c4, &bitsNum);
-        ip.s_addr = htonl(c4 + 256*c3 + 256*256*c2 + 256*256*256*c1);
-        if(scanned == 4){
-            bitsNum = 32;
-        }
-        if(((ip.s_addr ^ hostIP.s_addr) & htonl(0xFFFFFFFFu << (32 - bitsNum))) == 0){ //compare bitsNum bits
-            return TRUE;
-        }
-        curr = curr->next;
-    }
-    return FALSE;
+/**
+ * checked before the host is resolved, so a blocked host never costs a lookup
+ * @return TRUE if hostDomain matches a host or wildcard rule
+ */
+int searchHostInFilter(char* hostDomain){
+    long long start = metricsNow();
+    filters *flt = filterReadBegin();
+    int found = flt != NULL && filterHost(flt, hostDomain);
+    filterReadEnd();
+    metricsSince(STAGE_FILTER, start);
+    return found;
+}
+
+/**
+ * @return TRUE if the resolved address falls in an address range rule
+ */
+int searchIpInFilter(struct in_addr hostIP){
+    long long start = metricsNow();
+    filters *flt = filterReadBegin();
+    int found = flt != NULL && filterAddress(flt, hostIP);
+    filterReadEnd();
+    metricsSince(STAGE_FILTER, start);
+    return found;
 }
 
 int checkIfExist(char *filePath) {
@@ -552,103 +1445,460 @@ int checkIfExist(char *filePath) {
 }
 
 void freeFilters(){
-    list *curr = f->urlHead;
-    while (curr != NULL){
-        if (curr->data != NULL){
-            free(curr->data);
+    filterUnwatch();
+    filterPublish(NULL);
+}
+
+/**
+ * send the whole request to the origin
+ * @param server_fd
+ * @param request
+ * @return 0 - on success
+ *         -1 - on error
+ */
+int writeRequest(int server_fd, char *request){
+    size_t written = 0;
+    size_t len = strlen(request);
+    while (written < len) {
+        ssize_t nbytes = send(server_fd, request + written, len - written, MSG_NOSIGNAL);
+        if (nbytes < 0) {
+            return -1;
         }
-        list *temp = curr->next;
-        free(curr);
-        curr = temp;
+        written += nbytes;
+    }
+    return 0;
+}
+
+struct BodySink{
+    FILE *file;
+    struct Fetch *fetch;
+    struct Framer *fr;
+    struct CachedFile *stale;
+    int failed;
+};
+
+static void writeBody(void *arg, const char *data, size_t len){
+    struct BodySink *sink = (struct BodySink*)arg;
+    if(sink->failed == FALSE && sink->fetch->haveHeaders == FALSE
+            && storeResponseHead(sink->file, sink->fetch, sink->fr, sink->stale) < 0){
+        sink->failed = TRUE;
     }
-    curr = f->ipHead;
-    while (curr != NULL){
-        if (curr->data != NULL){
-            free(curr->data);
+    if(sink->failed == FALSE && fwrite(data, 1, len, sink->file) != len){
+        sink->failed = TRUE;
+    }
+}
+
+/**
+ * write what the framer took of buf to the client, the origin's head rewritten by framerClientHead
+ * @param client_fd
+ * @param fr - fed with buf
+ * @param keepAlive - TRUE to tell the client it may send another request
+ * @param clientHead - FRAMER_CLIENT_HEAD_MAX bytes the head is rewritten into
+ * @param buf
+ * @param used - bytes of buf that belong to the response
+ * @return -1 if the client can not be written to
+ */
+static int writeToClient(int client_fd, struct Framer *fr, int keepAlive, char *clientHead, const char *buf, size_t used){
+    if(fr->headTaken > 0 && framerHaveHeaders(fr) == TRUE){     //the head ended in buf
+        size_t len = framerClientHead(fr, keepAlive, clientHead);
+        if(write(client_fd, clientHead, len) < 0){
+            return -1;
         }
-        list *temp = curr->next;
-        free(curr);
-        curr = temp;
     }
-    free(f);
-    f = NULL;
+    if(used > fr->headTaken && write(client_fd, buf + fr->headTaken, used - fr->headTaken) < 0){
+        return -1;
+    }
+    return 0;
 }
 
 /**
- * read the response from the server and write to the client and file
+ * read one response from the server and write it to the client without the origin's hop-by-hop fields, and its stored head and body to the file.
+ * the end of the response is found by its framing, so the connection can be used again.
  * @param server_fd
- * @param client_fd
- * @param fullPath
- * @return How many bytes written
+ * @param client_fd - -1 for a background refresh
+ * @param fetch - led by the caller, its temporary file receives the response and is published once complete
+ * @param stale - the copy the request revalidates, NULL for an unconditional request. a 304 is not written to the client
+ * @param reusable - set to TRUE if another request may be sent on server_fd
+ * @param keepClient - TRUE if the client may send another request, the Connection field the client gets tells it.
+ *                     set to TRUE if the whole response reached the client and its framing lets the client send another request
+ * @param arena - of the request, holds the framer, the read buffer and the head written to the client
+ * @return How many bytes written, -1 if the file could not be created
  */
-long readResponseMsg(int server_fd, int client_fd, char *fullPath) {
-    FILE *newFile;
-    createFile(fullPath, &newFile);
-    if(newFile == NULL){
+long readResponseMsg(int server_fd, int client_fd, struct Fetch *fetch, struct CachedFile *stale, int *reusable,
+                     int *keepClient, struct Arena *arena) {
+    int keepAlive = *keepClient;
+    *reusable = FALSE;
+    *keepClient = FALSE;
+    struct BodySink sink;
+    createFile(fetch, &sink.file);
+    if(sink.file == NULL){
         return -1;
     }
-    char *msg = malloc(sizeof(char) * (CHUNK + 1));
-    if (msg == NULL){
+    sink.failed = FALSE;
+    sink.fetch = fetch;
+    sink.stale = stale;
+    struct Framer *fr = (struct Framer*) arenaAlloc(arena, sizeof(struct Framer));
+    char *buf = (char*) arenaAlloc(arena, config.relayBuffer);
+    char *clientHead = (char*) arenaAlloc(arena, FRAMER_CLIENT_HEAD_MAX);
+    if (fr == NULL || buf == NULL || clientHead == NULL){
+        closeCacheFile(sink.file, fetch, NULL);
         return -1;
     }
-    unsigned char buf [CHUNK];
-    memset(msg, '\0', CHUNK + 1);
+    framerInit(fr);
+    sink.fr = fr;
     ssize_t nbytes;
+    long used = 0;
     size_t totalBytes = 0;
-    char *endOfHeaders;
-    int isFdLive = TRUE;
+    int isFdLive = client_fd >= 0;
+    struct RelayPipe *pipes = NULL;
+    int triedSplice = FALSE;
+    size_t spliced = 0;
+    long long waiting = metricsNow();   //the request was just written
 
-    while ((endOfHeaders = strstr((char*)msg, "\r\n\r\n")) == NULL){ //read response headers and write them to the client
-        nbytes = read(server_fd, buf, CHUNK);
-        if(nbytes < 0) {
-            free(msg);
-            fclose(newFile);
-            remove(fullPath);
-            return (long)totalBytes;
+    while (framerDone(fr) == FALSE){
+        if(triedSplice == FALSE && framerPassThrough(fr) == TRUE){  //the rest of the body can bypass user space
+            triedSplice = TRUE;
+            if(fetch->haveHeaders == FALSE && storeResponseHead(sink.file, fetch, fr, stale) < 0){
+                sink.failed = TRUE;
+            }
+            if(fflush(sink.file) == 0){
+                pipes = relayPipeTake();
+            }
+        }
+        if(pipes != NULL && (isFdLive == TRUE || sink.failed == FALSE)){
+            long long remaining = framerRemaining(fr);
+            size_t len = remaining >= 0 && (size_t)remaining < pipes->size ? (size_t)remaining : pipes->size;
+            int fileLive = sink.failed == FALSE;
+            nbytes = relaySpliceIn(pipes, server_fd, len, isFdLive, &fileLive);
+            if(nbytes > 0){
+                framerSkip(fr, (size_t)nbytes);
+                relaySpliceOut(pipes, client_fd, fileno(sink.file), &isFdLive, &fileLive);
+                sink.failed = fileLive == FALSE;
+                fetchProgress(fetch, sink.file);
+                deadlineProgress();
+                spliced += nbytes;
+                totalBytes += nbytes;
+                used = nbytes;
+                continue;
+            }
+            if(nbytes < 0 && (errno == EINVAL || errno == ENOSYS) && spliced == 0){   //not for these descriptors, copy instead
+                relayPipeGive(pipes);
+                pipes = NULL;
+                continue;
+            }
+            if(nbytes == 0){
+                framerEof(fr);
+            }
+            break;
+        }
+        nbytes = read(server_fd, buf, config.relayBuffer);
+        if(nbytes == 0){
+            framerEof(fr);
+            break;
+        }
+        if(nbytes < 0){
+            break;
+        }
+        if(waiting != 0){
+            metricsSince(STAGE_FIRST_BYTE, waiting);
+            waiting = 0;
+            deadlineStart(PHASE_RELAY);
+        } else{
+            deadlineProgress();
+        }
+        used = framerFeed(fr, buf, nbytes, &writeBody, &sink);
+        if(used < 0){
+            break;
+        }
+        if(sink.failed == FALSE && fetch->haveHeaders == FALSE && framerHaveHeaders(fr) == TRUE
+                && storeResponseHead(sink.file, fetch, fr, stale) < 0){   //a head without body bytes yet
+            sink.failed = TRUE;
+        }
+        fetchProgress(fetch, sink.file);
+        if(stale != NULL && fr->status == 304){     //the client is answered from the revalidated copy
+            isFdLive = FALSE;
         }
         if(isFdLive == TRUE){
-            if(write(client_fd, buf, nbytes) < 0){
+            if(writeToClient(client_fd, fr, keepAlive && fr->keepAlive, clientHead, buf, (size_t)used) < 0){
                 isFdLive = FALSE;
             }
         }
-
-        memcpy(msg + totalBytes, buf, nbytes);
-        totalBytes += nbytes;
-        msg[totalBytes] = '\0';
-        if((msg = realloc(msg, sizeof(char) * (totalBytes + CHUNK + 1))) == NULL){
-            fclose(newFile);
-            remove(fullPath);
-            return (long)totalBytes;
+        totalBytes += used;
+        if(used < nbytes){  //the origin sent more than the response
+            break;
         }
     }
-    *endOfHeaders = '\0';
+    if(pipes != NULL){
+        relayPipeGive(pipes);
+    }
+    closeCacheFile(sink.file, fetch, framerDone(fr) == TRUE && sink.failed == FALSE ? fr : NULL);
+    if(framerDone(fr) == TRUE && used == nbytes){
+        *reusable = fr->keepAlive;
+    }
+    if(framerDone(fr) == TRUE && isFdLive == TRUE){
+        *keepClient = keepAlive && fr->keepAlive;   //FALSE for a response framed by EOF, the client needs the close to see its end
+    }
+    if(client_fd >= 0 && (stale == NULL || fr->status != 304)){
+        accessLogStatus(fr->status);
+    }
+    return (long)totalBytes;
+}
 
-    int startOfContent = (int)(strlen(msg) + 4 + nbytes - totalBytes);
-    fwrite(buf + startOfContent, 1, nbytes - startOfContent, newFile); //write to file the content after the headers from the last chunk
-    while ((nbytes = read(server_fd, buf, CHUNK)) > 0){ //write the rest of the content to the client and the file
-        if(fwrite(buf, 1, nbytes, newFile) != (size_t)nbytes){
-            fclose(newFile);
-            remove(fullPath);
-            return (long)totalBytes;
+/**
+ * send a request to the origin on a pooled connection, or a new one if the pooled one was dropped, and relay its response
+ * @param address - of the origin
+ * @param request
+ * @param client_fd - -1 for a background refresh
+ * @param fetch - led by the caller, it ends here
+ * @param stale - the copy the request revalidates, NULL for an unconditional request
+ * @param keepClient - TRUE if the client may send another request, set to TRUE if the client connection may be used for another request
+ * @param arena
+ * @return how many bytes of the response were relayed, -1 if the origin could not be reached or its deadline
+ *         expired before it answered
+ */
+long fetchFromOrigin(struct in_addr address, char *request, int client_fd, struct Fetch *fetch, struct CachedFile *stale,
+                     int *keepClient, struct Arena *arena){
+    long long start = metricsNow();
+    int reused = TRUE;
+    int server_fd = upstreamTake(address, 80);
+    if(server_fd < 0){
+        reused = FALSE;
+        deadlineStart(PHASE_CONNECT);
+        server_fd = upstreamConnect(address, 80);
+        metricsSince(STAGE_CONNECT, start);
+    } else{
+        deadlineServer(server_fd);
+    }
+    long responseBytes = -1;
+    int reusable = FALSE;
+    int keepAlive = *keepClient;
+    *keepClient = FALSE;
+    while(server_fd >= 0 && deadlineExpired() == PHASE_NONE){
+        deadlineStart(PHASE_FIRST_BYTE);    //readResponseMsg moves on to PHASE_RELAY
+        if(writeRequest(server_fd, request) == 0){
+            *keepClient = keepAlive;
+            responseBytes = readResponseMsg(server_fd, client_fd, fetch, stale, &reusable, keepClient, arena);
         }
-        totalBytes += nbytes;
-        if (isFdLive == TRUE){
-            if(write(client_fd, buf, nbytes) < 0){
-                isFdLive = FALSE;
-            }
+        if(responseBytes > 0 || reused == FALSE || deadlineExpired() != PHASE_NONE){
+            break;
         }
+        deadlineServer(-1);
+        close(server_fd);   //the origin dropped the pooled connection before answering, try a new one
+        upstreamCountRetry();
+        reused = FALSE;
+        responseBytes = -1;
+        long long connecting = metricsNow();
+        deadlineStart(PHASE_CONNECT);
+        server_fd = upstreamConnect(address, 80);
+        metricsSince(STAGE_CONNECT, connecting);
     }
-    fclose(newFile);
-    free(msg);
-    return (long)totalBytes;
+    int expired = deadlineStop();
+    fetchFinish(fetch, FALSE, 0);   //followers of a fetch that did not complete its file end here
+    metricsSince(STAGE_ORIGIN, start);
+    if(server_fd < 0){
+        return -1;
+    }
+    deadlineServer(-1);
+    upstreamRelease(server_fd, address, 80, reusable && expired == PHASE_NONE);
+    return responseBytes <= 0 && expired != PHASE_NONE ? -1 : responseBytes;
 }
 
 /**
- * create file and sub folders
+ * find the cached copy of fullPath and decide whether it may be served
  * @param fullPath
+ * @param obj - set to the copy in memory if it may be served as it is, NULL otherwise
+ * @param file - set to the cache file if obj is NULL and the file holds a copy, NULL otherwise
+ * @return FRESHNESS_FRESH or FRESHNESS_STALE_SERVE for a copy that may be served, FRESHNESS_STALE for a file
+ *         that has to be revalidated first, CACHE_MISS if there is no copy to serve or to revalidate
+ */
+int findInCache(char *fullPath, struct MemObject **obj, struct CachedFile **file){
+    time_t now = time(NULL);
+    *file = NULL;
+    *obj = memCacheGet(fullPath);
+    if(*obj != NULL){
+        int verdict = freshnessCheck(&(*obj)->fresh, now);
+        if(verdict != FRESHNESS_STALE){
+            return verdict;
+        }
+        memCacheRelease(*obj);  //the file is revalidated instead
+        *obj = NULL;
+    }
+    *file = openFromCache(fullPath);
+    if(*file == NULL){
+        return CACHE_MISS;
+    }
+    int verdict = freshnessCheck(&(*file)->fresh, now);
+    if(verdict == FRESHNESS_STALE && (*file)->fresh.etagLen == 0 && (*file)->fresh.modifiedLen == 0){
+        fdCacheRelease(*file);      //nothing to validate it with
+        *file = NULL;
+        return CACHE_MISS;
+    }
+    if(verdict == FRESHNESS_STALE){
+        __atomic_add_fetch(&validation.revalidated, 1, __ATOMIC_RELAXED);
+    }
+    return verdict;
+}
+
+/**
+ * run the origin request of a fetch no client leads, on the background pool. a stale copy of
+ * the object is revalidated by it
+ */
+static int backgroundJob(void *arg){
+    struct Refresh *r = (struct Refresh*)arg;
+    struct CachedFile *stale = openFromCache(r->fetch->key);
+    struct Arena *arena = arenaTake();
+    int keepClient = FALSE;
+    if(arena != NULL){
+        fetchFromOrigin(r->address, r->request, -1, r->fetch, stale, &keepClient, arena);
+        deadlineFinish();
+        arenaGive(arena);
+    }
+    fetchFinish(r->fetch, FALSE, 0);
+    fetchRelease(r->fetch);
+    if(stale != NULL){
+        fdCacheRelease(stale);
+    }
+    free(r->request);
+    free(r);
+    return 0;
+}
+
+/**
+ * give the origin request of a fetch to the background pool, which takes over the reference of the caller
+ * @param fetch - led by the caller
+ * @param request - copied
+ * @param address - of the origin
+ * @return 0, -1 if memory ran out and the caller still leads the fetch
+ */
+static int fetchInBackground(struct Fetch *fetch, const char *request, struct in_addr address){
+    struct Refresh *r = (struct Refresh*) malloc(sizeof(struct Refresh));
+    if(r == NULL || (r->request = strdup(request)) == NULL){
+        free(r);
+        return -1;
+    }
+    arenaCountHeap(2);     //outlives the request
+    r->fetch = fetch;
+    r->address = address;
+    dispatch(backgroundPool, backgroundJob, r);
+    return 0;
+}
+
+/**
+ * refresh a stale copy that is served meanwhile, unless a fetch of it is in flight already
+ * @param key - cache path of the copy
+ * @param request - conditional request for the origin, copied
+ * @param address - of the origin
+ */
+void refreshStale(const char *key, const char *request, struct in_addr address){
+    struct Fetch *fetch = fetchLead(key);
+    if(fetch == NULL){
+        return;
+    }
+    if(fetchInBackground(fetch, request, address) < 0){
+        fetchFinish(fetch, FALSE, 0);
+        fetchRelease(fetch);
+        return;
+    }
+    __atomic_add_fetch(&validation.refreshed, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * a range request leads the fetch of an object: fetch the whole object in the background to fill the
+ * cache, and let the request follow the fetch so its ranges are sent as soon as they arrive
+ * @param fetch - led by the caller, followed by it on success
+ * @param request - for the origin, copied
+ * @param address - of the origin
+ * @return 0, -1 if the caller still leads the fetch
+ */
+int fillForRange(struct Fetch *fetch, const char *request, struct in_addr address){
+    fetchFollow(fetch);
+    if(fetchInBackground(fetch, request, address) < 0){
+        fetchRelease(fetch);    //the reference fetchFollow took, the caller keeps its own
+        return -1;
+    }
+    __atomic_add_fetch(&rangeStats.filled, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * copy the body of a stale copy after the stored head of its revalidation
+ * @return 0, -1 on error
+ */
+static int copyStaleBody(struct CachedFile *stale, int fd){
+    off_t off = stale->body;
+    while(off < stale->size){
+        ssize_t nbytes = copy_file_range(stale->fd, &off, fd, NULL, (size_t)(stale->size - off), 0);
+        if(nbytes < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)){
+            break;
+        }
+        if(nbytes <= 0){
+            return -1;
+        }
+    }
+    char buf[CHUNK];
+    while(off < stale->size){   //copy_file_range is not supported between these files
+        ssize_t nread = pread(stale->fd, buf, sizeof(buf), off);
+        if(nread <= 0 || write(fd, buf, (size_t)nread) != nread){
+            return -1;
+        }
+        off += nread;
+    }
+    return 0;
+}
+
+/**
+ * write the stored head of the origin response to the temporary file of its fetch and announce it to the followers.
+ * a 304 that revalidated a stale copy writes the merged head and the body of the copy
+ * @param file
+ * @param fetch
+ * @param fr - framer that parsed the response head
+ * @param stale - the copy the request revalidated, NULL for an unconditional request
+ * @return 0, -1 if the head could not be stored
+ */
+int storeResponseHead(FILE *file, struct Fetch *fetch, struct Framer *fr, struct CachedFile *stale){
+    if(fetch->haveHeaders == TRUE || framerHaveHeaders(fr) == FALSE){
+        return 0;
+    }
+    fetch->received = time(NULL);
+    fetch->status = fr->status;
+    int refresh = stale != NULL && fr->status == 304;
+    struct HttpParser stored;
+    if(refresh == TRUE){
+        httpParserInit(&stored, TRUE, (size_t)stale->body + 1);
+        if(httpParse(&stored, stale->head, (size_t)stale->body) != HP_DONE){
+            return -1;
+        }
+    }
+    long long length = refresh == TRUE ? (long long)(stale->size - stale->body) : fr->contentLength;
+    int varies = variantVaries(fetch->key, refresh == TRUE ? &stored : &fr->parser, length);
+    long len = freshnessStore(file, &fr->parser, refresh == TRUE ? &stored : NULL, fetch->requested, fetch->received, varies);
+    if(len < 0){
+        return -1;
+    }
+    fetch->storable = freshnessStorable(refresh == TRUE ? &stored : &fr->parser,
+                                        refresh == TRUE ? atoi(stored.start[1].data) : fr->status);
+    if(refresh == TRUE){
+        if(fflush(file) != 0 || copyStaleBody(stale, fileno(file)) < 0){
+            return -1;
+        }
+        __atomic_add_fetch(&validation.notModified, 1, __ATOMIC_RELAXED);
+    }
+    if(fflush(file) != 0){
+        return -1;
+    }
+    fetchHeaders(fetch, (off_t)len, length);
+    fetchProgress(fetch, file);
+    return 0;
+}
+
+/**
+ * create the temporary file of a fetch and the sub folders of its cache path. the cache path
+ * itself is left alone until the file is complete
+ * @param fetch
  * @param newFile
  */
-void createFile(char *fullPath, FILE **newFile) {
+void createFile(struct Fetch *fetch, FILE **newFile) {
+    char *fullPath = fetch->tmpPath;
     char *p = NULL;
     for (p = fullPath; *p && strstr(p, "/") != NULL; p++) {
         if (*p == '/') {
@@ -661,58 +1911,480 @@ void createFile(char *fullPath, FILE **newFile) {
     if (*newFile == NULL) {
         return;
     }
+    arenaCountHeap(2);     //the stream and its buffer
+    if (fetchAttachFile(fetch) == -1) {
+        fclose(*newFile);
+        remove(fullPath);
+        *newFile = NULL;
+    }
 }
 
-long findFileSize(char *fullPath) {
-    FILE* fp = fopen(fullPath, "r");
-    fseek(fp, 0L, SEEK_END);
-    long int res = ftell(fp);
-    fclose(fp);
-    return (long)res;
+/**
+ * close the temporary file of a fetch. a complete file of a storable response is renamed over the cache path,
+ * recorded in the cache index and handed to the followers. the followers of any other complete file read it
+ * until they release the fetch, an incomplete one is removed
+ * @param file
+ * @param fetch
+ * @param fr - framer of the response, its head is digested into the index. NULL if the file is incomplete
+ * @return TRUE if the file was published
+ */
+int closeCacheFile(FILE *file, struct Fetch *fetch, struct Framer *fr) {
+    struct stat sb;
+    int complete = fr != NULL && fetch->haveHeaders == TRUE && fflush(file) == 0
+                   && fstat(fileno(file), &sb) == 0;  //spliced bytes bypass stdio
+    if (complete == TRUE && fetch->storable == TRUE) {
+        struct timespec times[2] = {{0, UTIME_OMIT}, {fetch->received, 0}};    //the age of the copy counts from here
+        futimens(fileno(file), times);
+    }
+    if (fclose(file) != 0) {
+        complete = FALSE;
+    }
+    if (complete == TRUE && fetch->storable == FALSE) {
+        remove(fetch->tmpPath);     //the followers hold it open
+        fetchFinish(fetch, TRUE, sb.st_size);
+        return FALSE;
+    }
+    if (complete == TRUE && rename(fetch->tmpPath, fetch->key) < 0) {
+        perror("error: <sys_call>\n");
+        complete = FALSE;
+    }
+    if (complete == FALSE) {
+        remove(fetch->tmpPath);
+        return FALSE;
+    }
+    cacheIndexStore(fetch->key, sb.st_size, cacheIndexDigest(fr->head, fr->headLen));
+    fdCacheForget(fetch->key);      //descriptors and copies of the file it replaced
+    memCacheRemove(fetch->key);
+    variantsForget(fetch->key);
+    fetchFinish(fetch, TRUE, sb.st_size);
+    return TRUE;
 }
 
 /**
- * write file content to the client from local file system
+ * open the cache file of fullPath if the cache index holds it, a miss costs no syscall.
+ * a file that disappeared from the disk, or does not start with a stored head, is dropped from the index
  * @param fullPath
+ * @return the open file, to be given to fdCacheRelease. NULL on a miss
+ */
+struct CachedFile *openFromCache(char *fullPath) {
+    if (cacheIndexLookup(fullPath, NULL) == FALSE) {
+        return NULL;
+    }
+    struct CachedFile *file = fdCacheOpen(fullPath);
+    if (file == NULL) {
+        cacheIndexRemove(fullPath);
+    }
+    return file;
+}
+
+/**
+ * answer a range request from the temporary file of a fetch, once the length of the object is known
+ * @param fetch
+ * @param state - of the fetch
+ * @param written - bytes of the file written so far
+ * @param fd - of the file
+ * @param head - stored head the file starts with
+ * @param request - parsed request head of the client
  * @param client_fd
+ * @param keepAlive
+ * @param sent - set to the bytes written to the client
+ * @return TRUE if the request was answered, FALSE if it gets the whole object
  */
-void writeFileContent(char *fullPath, int client_fd) {
-    char buf[CHUNK];
-    FILE *fp;
-    size_t nread;
-    fp = fopen(fullPath, "r");
-    if (fp == NULL) {
-        return;
+static int followRanges(struct Fetch *fetch, int state, off_t written, int fd, const char *head,
+                        const struct HttpParser *request, int client_fd, int *keepAlive, long *sent){
+    off_t headLen = fetch->headLen;
+    long long length = fetch->length;
+    while (length < 0 && state == FETCH_RUNNING) {  //the ranges of a chunked body are known at its end
+        state = fetchWait(fetch, written, &written);
+    }
+    if (state == FETCH_DONE) {
+        length = (long long)(written - headLen);
+    }
+    struct Freshness fresh;
+    size_t served;
+    struct ByteRange ranges[RANGE_MAX];
+    int count;
+    if (length < 0 || freshnessLoad(head, (size_t)headLen, fetch->received, &fresh, &served) < 0
+            || rangeParse(request, &fresh, head, (off_t)length, ranges, &count) == RANGE_NONE) {
+        return FALSE;
+    }
+    struct RangeSource src = {NULL, fd, headLen, fetch};
+    *sent = giveRanges(head, served, freshnessAge(&fresh, time(NULL)), (off_t)length, ranges, count, &src,
+                       client_fd, keepAlive);
+    return TRUE;
+}
+
+/**
+ * answer a request whose object another request is fetching from the origin. the stored head and the body
+ * are streamed from the temporary file of the fetch as its leader writes it, or the ranges the request asks for
+ * @param fetch - joined as a follower
+ * @param request - parsed request head of the client
+ * @param client_fd
+ * @param keepAlive - TRUE to tell the client it may send another request, set to FALSE if the connection has to close
+ * @return how many bytes written to the client, -1 if the fetch failed before anything was written
+ */
+long followFetch(struct Fetch *fetch, const struct HttpParser *request, int client_fd, int *keepAlive) {
+    off_t written;
+    int state = fetchWait(fetch, -1, &written);
+    int fd = state == FETCH_FAILED ? -1 : fetchOpenBody(fetch);
+    if (fd < 0) {
+        return -1;
+    }
+    off_t headLen = fetch->headLen;
+    long long length = state == FETCH_DONE ? (long long)(written - headLen) : fetch->length;
+    size_t served = (size_t)headLen - strlen("\r\n");     //up to the empty line
+    char msg[FRESHNESS_HEAD_MAX + CHUNK];
+    if (headLen > FRESHNESS_HEAD_MAX || pread(fd, msg, (size_t)headLen, 0) != (ssize_t)headLen) {
+        close(fd);
+        return -1;
+    }
+    long sent;
+    if (httpField(request, "Range") != NULL && followRanges(fetch, state, written, fd, msg, request, client_fd, keepAlive, &sent) == TRUE) {
+        close(fd);
+        return sent;
+    }
+    accessLogStatus(accessLogHeadStatus(msg, served));
+    size_t len = served;
+    if (length >= 0) {
+        len += sprintf(msg + len, "Content-Length: %lld\r\n", length);
+    } else {
+        *keepAlive = FALSE;     //the body ends when the connection does
+    }
+    len += sprintf(msg + len, "%s", *keepAlive == TRUE ? CONNECTION_KEEP_ALIVE : CONNECTION_CLOSE);
+    if (send(client_fd, msg, len, MSG_MORE | MSG_NOSIGNAL) < 0) {
+        close(fd);
+        *keepAlive = FALSE;
+        return 0;
     }
-    while ((nread = fread(buf, 1, sizeof buf, fp)) > 0) {
-        if(write(client_fd, buf, nread) < 0){
-            fclose(fp);
-            return;
+    off_t off = headLen;
+    while (1) {
+        while (off < written) {
+            if (sendfile(client_fd, fd, &off, (size_t)(written - off)) <= 0) {
+                state = FETCH_FAILED;
+                break;
+            }
         }
+        if (state != FETCH_RUNNING) {
+            break;
+        }
+        state = fetchWait(fetch, off, &written);
+    }
+    if (state == FETCH_FAILED || (length >= 0 && (long long)(off - headLen) != length)) {
+        *keepAlive = FALSE;     //the response is cut short
     }
-    fclose(fp);
+    close(fd);
+    return (long)len + (long)(off - headLen);
 }
 
 /**
- * write headers and file content(from local file system) to the client
- * @param fullPath
+ * read the whole body of the file into buf
+ * @param file
+ * @param buf - file->size - file->body bytes
+ * @return 0 - on success
+ *         -1 - if the file could not be read
+ */
+int readFileContent(struct CachedFile *file, char *buf) {
+    off_t off = file->body;
+    while (off < file->size) {
+        ssize_t nread = pread(file->fd, buf + (off - file->body), (size_t)(file->size - off), off);
+        if (nread <= 0) {
+            return -1;
+        }
+        off += nread;
+    }
+    return 0;
+}
+
+/**
+ * write the body of the file to the client from a mapping of the file, for files sendfile can not send
+ * @param file
  * @param client_fd
- * @return how meany bytes writen to the client
+ * @param off - offset in the file the body continues at
+ * @return how many bytes of the body were written
  */
-long giveFromLocal(char *fullPath, int client_fd) {
-    char msg[CHUNK];
-    char *type = get_mime_type(fullPath);
-    long len = findFileSize(fullPath);
-    if (type != NULL){
-        sprintf(msg, "HTTP/1.0 200 OK\r\nContent-Length: %ld\r\nContent-Type: %s\r\nConnection: close\r\n\r\n", len, type);
-    } else{
-        sprintf(msg, "HTTP/1.0 200 OK\r\nContent-Length: %ld\r\nConnection: close\r\n\r\n", len);
+long mapFileContent(struct CachedFile *file, int client_fd, off_t off) {
+    char *map = mmap(NULL, (size_t)file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+    if (map == MAP_FAILED) {
+        return (long)(off - file->body);
     }
+    while (off < file->size) {
+        ssize_t nbytes = send(client_fd, map + off, (size_t)(file->size - off), MSG_NOSIGNAL);
+        if (nbytes <= 0) {
+            break;
+        }
+        off += nbytes;
+    }
+    munmap(map, (size_t)file->size);
+    return (long)(off - file->body);
+}
 
-    if(write(client_fd, msg, strlen(msg)) < 0){
+/**
+ * write the body of the file to the client from local file system, without copying it through user space
+ * @param file
+ * @param client_fd
+ * @return how many bytes of the body were written
+ */
+long sendFileContent(struct CachedFile *file, int client_fd) {
+    off_t off = file->body;
+    while (off < file->size) {
+        ssize_t nbytes = sendfile(client_fd, file->fd, &off, (size_t)(file->size - off));
+        if (nbytes < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            return mapFileContent(file, client_fd, off);
+        }
+        if (nbytes <= 0) {
+            break;
+        }
+    }
+    return (long)(off - file->body);
+}
+
+/**
+ * send bytes first to last of the body of a copy, waiting for them if its fetch is still writing them
+ * @return 0, -1 on error or if the fetch ended before it wrote them
+ */
+static int sendSlice(const struct RangeSource *src, int client_fd, off_t first, off_t last) {
+    if (src->mem != NULL) {
+        size_t off = (size_t)first;
+        while (off <= (size_t)last) {
+            ssize_t nbytes = send(client_fd, src->mem + off, (size_t)last + 1 - off, MSG_MORE | MSG_NOSIGNAL);
+            if (nbytes <= 0) {
+                return -1;
+            }
+            off += nbytes;
+        }
         return 0;
     }
-    writeFileContent(fullPath, client_fd);
+    off_t off = src->body + first;
+    off_t end = src->body + last + 1;
+    while (off < end) {
+        off_t written = end;
+        if (src->fetch != NULL) {
+            fetchWait(src->fetch, off, &written);
+            if (written <= off) {   //the fetch ended before it wrote them
+                return -1;
+            }
+        }
+        size_t len = (size_t)((written < end ? written : end) - off);
+        ssize_t nbytes = sendfile(client_fd, src->fd, &off, len);
+        if (nbytes < 0 && (errno == EINVAL || errno == ENOSYS)) {  //copy through user space instead
+            char buf[CHUNK * 8];
+            ssize_t nread = pread(src->fd, buf, len < sizeof(buf) ? len : sizeof(buf), off);
+            if (nread <= 0 || send(client_fd, buf, (size_t)nread, MSG_MORE | MSG_NOSIGNAL) != nread) {
+                return -1;
+            }
+            off += nread;
+            continue;
+        }
+        if (nbytes <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * write the head of one part of a multipart/byteranges body
+ * @return its bytes, the bytes it needs if out is too small
+ */
+static int partHead(char *out, size_t size, const char *boundary, struct StrView type, const struct ByteRange *range, off_t length) {
+    if (type.len == 0) {
+        return snprintf(out, size, "\r\n--%s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n", boundary,
+                        (long long)range->first, (long long)range->last, (long long)length);
+    }
+    return snprintf(out, size, "\r\n--%s\r\nContent-Type: %.*s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n", boundary,
+                    (int)type.len, type.data, (long long)range->first, (long long)range->last, (long long)length);
+}
 
-    return len + strlen(msg);
+/**
+ * answer a range request with 206, one range as the body and several as a multipart/byteranges body, or with 416
+ * @param head - the part of the stored head sent with the body
+ * @param served
+ * @param age - of the copy
+ * @param length - of the body
+ * @param ranges - from rangeParse
+ * @param count - 0 to answer 416
+ * @param src - where the body is read from
+ * @param client_fd
+ * @param keepAlive - TRUE to tell the client it may send another request, set to FALSE if the response is cut short
+ * @return how many bytes writen to the client, -1 if nothing was written
+ */
+long giveRanges(const char *head, size_t served, long age, off_t length, const struct ByteRange *ranges, int count,
+                const struct RangeSource *src, int client_fd, int *keepAlive) {
+    char msg[FRESHNESS_HEAD_MAX + CHUNK];
+    const char *connection = *keepAlive == TRUE ? CONNECTION_KEEP_ALIVE : CONNECTION_CLOSE;
+    if (count == 0) {
+        const char *space = memchr(head, ' ', served);
+        int len = sprintf(msg, "%.*s 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\nContent-Length: 0\r\n%s",
+                          space != NULL ? (int)(space - head) : 0, head, (long long)length, connection);
+        __atomic_add_fetch(&rangeStats.unsatisfiable, 1, __ATOMIC_RELAXED);
+        accessLogStatus(416);
+        return send(client_fd, msg, (size_t)len, MSG_NOSIGNAL) == len ? len : -1;
+    }
+    size_t len = rangeHead(head, served, count > 1, msg, FRESHNESS_HEAD_MAX);
+    if (len == 0) {
+        return -1;
+    }
+    char boundary[32];
+    struct StrView type = rangeContentType(head, served);
+    long long bodyLen = 0;
+    if (count == 1) {
+        bodyLen = (long long)(ranges[0].last - ranges[0].first + 1);
+        len += sprintf(msg + len, "Content-Range: bytes %lld-%lld/%lld\r\n", (long long)ranges[0].first,
+                       (long long)ranges[0].last, (long long)length);
+    } else {
+        snprintf(boundary, sizeof(boundary), "%020lu", __atomic_add_fetch(&boundarySequence, 1, __ATOMIC_RELAXED));
+        for (int i = 0; i < count; i++) {
+            bodyLen += partHead(NULL, 0, boundary, type, &ranges[i], length) + (long long)(ranges[i].last - ranges[i].first + 1);
+        }
+        bodyLen += (long long)(strlen("\r\n----\r\n") + strlen(boundary));
+        len += sprintf(msg + len, "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+        __atomic_add_fetch(&rangeStats.multipart, 1, __ATOMIC_RELAXED);
+    }
+    len += sprintf(msg + len, "Age: %ld\r\nContent-Length: %lld\r\n%s", age, bodyLen, connection);
+    __atomic_add_fetch(&rangeStats.partial, 1, __ATOMIC_RELAXED);
+    accessLogStatus(206);
+    if (send(client_fd, msg, len, MSG_MORE | MSG_NOSIGNAL) != (ssize_t)len) {
+        *keepAlive = FALSE;
+        return -1;
+    }
+    long sent = (long)len;
+    for (int i = 0; i < count; i++) {
+        if (count > 1) {
+            int n = partHead(msg, sizeof(msg), boundary, type, &ranges[i], length);
+            if (send(client_fd, msg, (size_t)n, MSG_MORE | MSG_NOSIGNAL) != n) {
+                *keepAlive = FALSE;
+                return sent;
+            }
+            sent += n;
+        }
+        if (sendSlice(src, client_fd, ranges[i].first, ranges[i].last) < 0) {
+            *keepAlive = FALSE;     //the response is cut short
+            return sent;
+        }
+        sent += (long)(ranges[i].last - ranges[i].first + 1);
+    }
+    if (count > 1) {
+        int n = sprintf(msg, "\r\n--%s--\r\n", boundary);
+        if (send(client_fd, msg, (size_t)n, MSG_NOSIGNAL) != n) {
+            *keepAlive = FALSE;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+/**
+ * answer a conditional request of a client with 304, the copy it holds is current
+ * @param head - the part of the stored head sent with the body
+ * @param len
+ * @param age - of the copy
+ * @param client_fd
+ * @param keepAlive
+ * @return how many bytes writen to the client, -1 on error
+ */
+long giveNotModified(const char *head, size_t len, long age, int client_fd, int keepAlive) {
+    char msg[FRESHNESS_HEAD_MAX + CHUNK];
+    size_t msgLen = freshnessNotModifiedHead(head, len, age, msg, sizeof(msg) - CHUNK);
+    if (msgLen == 0) {
+        return -1;
+    }
+    msgLen += sprintf(msg + msgLen, "%s", keepAlive == TRUE ? CONNECTION_KEEP_ALIVE : CONNECTION_CLOSE);
+    if (send(client_fd, msg, msgLen, MSG_NOSIGNAL) != (ssize_t)msgLen) {
+        return -1;
+    }
+    __atomic_add_fetch(&validation.answered, 1, __ATOMIC_RELAXED);
+    accessLogStatus(304);
+    return (long)msgLen;
+}
+
+/**
+ * write a copy from the memory cache to the client, or 304 if the client holds it already
+ * @param obj
+ * @param request - parsed request head of the client
+ * @param client_fd
+ * @param keepAlive
+ * @param sent - set to the bytes written
+ * @return 0 - on success, -1 on error
+ */
+int giveFromMemory(struct MemObject *obj, const struct HttpParser *request, int client_fd, int keepAlive, size_t *sent) {
+    long age = freshnessAge(&obj->fresh, time(NULL));
+    *sent = 0;
+    if (freshnessNotModified(&obj->fresh, obj->head, request) == TRUE) {
+        long len = giveNotModified(obj->head, obj->headLen, age, client_fd, keepAlive);
+        if (len >= 0) {
+            *sent = (size_t)len;
+        }
+        return len >= 0 ? 0 : -1;
+    }
+    struct ByteRange ranges[RANGE_MAX];
+    int count;
+    if (rangeParse(request, &obj->fresh, obj->head, (off_t)obj->bodyLen, ranges, &count) != RANGE_NONE) {
+        struct RangeSource src = {obj->body, -1, 0, NULL};
+        int keep = keepAlive;
+        long len = giveRanges(obj->head, obj->headLen, age, (off_t)obj->bodyLen, ranges, count, &src, client_fd, &keep);
+        *sent = len > 0 ? (size_t)len : 0;
+        return len >= 0 && keep == keepAlive ? 0 : -1;
+    }
+    accessLogStatus(accessLogHeadStatus(obj->head, obj->headLen));
+    return memCacheWrite(obj, client_fd, age, keepAlive, sent);
+}
+
+/**
+ * write the stored head and the body of a cache file to the client, or 304 if the client holds it already.
+ * a file small enough for the memory cache is loaded into it, so the next hits skip the disk.
+ * @param file - the open cache file
+ * @param request - parsed request head of the client
+ * @param client_fd
+ * @param keepAlive - TRUE to tell the client it may send another request, set to FALSE if the response was cut short
+ * @return how many bytes written to the client
+ */
+long giveFromLocal(struct CachedFile *file, const struct HttpParser *request, int client_fd, int *keepAlive) {
+    long age = freshnessAge(&file->fresh, time(NULL));
+    if (freshnessNotModified(&file->fresh, file->head, request) == TRUE) {
+        long len = giveNotModified(file->head, file->served, age, client_fd, *keepAlive);
+        if (len < 0) {
+            *keepAlive = FALSE;
+        }
+        return len > 0 ? len : 0;
+    }
+    long len = (long)(file->size - file->body);
+    struct ByteRange ranges[RANGE_MAX];
+    int count;
+    if (rangeParse(request, &file->fresh, file->head, (off_t)len, ranges, &count) != RANGE_NONE) {  //not loaded into memory
+        struct RangeSource src = {NULL, file->fd, file->body, NULL};
+        long sent = giveRanges(file->head, file->served, age, (off_t)len, ranges, count, &src, client_fd, keepAlive);
+        if (sent < 0) {
+            *keepAlive = FALSE;
+        }
+        return sent > 0 ? sent : 0;
+    }
+    accessLogStatus(accessLogHeadStatus(file->head, file->served));
+    struct MemObject *obj = memCacheAlloc(file->path, file->head, file->served, (size_t)len);
+    if(obj != NULL){
+        obj->fresh = file->fresh;
+        if(readFileContent(file, obj->body) == 0){
+            size_t sent = 0;
+            memCachePublish(obj);
+            if(memCacheWrite(obj, client_fd, age, *keepAlive, &sent) != 0){
+                *keepAlive = FALSE;
+            }
+            memCacheRelease(obj);
+            return (long)sent;
+        }
+        memCacheRelease(obj);
+    }
+    char msg[CHUNK];
+    int msgLen = sprintf(msg, "Age: %ld\r\nContent-Length: %ld\r\n%s", age, len,
+                         *keepAlive == TRUE ? CONNECTION_KEEP_ALIVE : CONNECTION_CLOSE);
+
+    if(send(client_fd, file->head, file->served, MSG_MORE | MSG_NOSIGNAL) != (ssize_t)file->served
+            || send(client_fd, msg, (size_t)msgLen, MSG_MORE | MSG_NOSIGNAL) != msgLen){    //held back until the body fills the segment
+        *keepAlive = FALSE;
+        return 0;
+    }
+    long body = sendFileContent(file, client_fd);
+    if (body != len) {
+        *keepAlive = FALSE;
+    }
+    return (long)file->served + msgLen + body;
 }
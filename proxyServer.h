@@ -0,0 +1,185 @@
+#ifndef PROXY_SERVER_PROXYSERVER_H
+#define PROXY_SERVER_PROXYSERVER_H
+
+#include <stdio.h>
+#include <netinet/in.h>
+#include "threadpool.h"
+#include "fdcache.h"
+#include "filter.h"
+#include "parser.h"
+#include "arena.h"
+#include "framer.h"
+#include "inflight.h"
+#include "memcache.h"
+#include "freshness.h"
+#include "range.h"
+#include "accesslog.h"
+
+/**
+ * proxyServer.h
+ *
+ * Declarations shared between the blocking (one worker per connection)
+ * serving mode in proxyServer.c and the other serving modes.
+ */
+
+#define USAGE_MSG "Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter> [--mode=threads|epoll] [--groups=<n>] [--dns-hosts=<file|none>] [--dns-server=<ip[:port]|system|none>]" \
+                  " [--upstream-idle=<sec>] [--upstream-max-per-host=<n>] [--client-idle=<sec>] [--client-max-requests=<n>]" \
+                  " [--mem-cache=<bytes>[k|m|g]] [--fd-cache=<n>] [--relay=splice|copy] [--relay-buffer=<bytes>[k|m]]" \
+                  " [--header-limit=<bytes>[k]] [--cache-dir=<dir>] [--cache-index=<file|none>]" \
+                  " [--disk-cache=<bytes>[k|m|g]] [--disk-objects=<n>] [--disk-policy=lru|gdsf]" \
+                  " [--default-ttl=<sec>] [--stale-while-revalidate=<sec>] [--compress=on|off]" \
+                  " [--access-log=<file|-|none>] [--access-log-size=<bytes>[k|m|g]]" \
+                  " [--dns-timeout=<sec>] [--connect-timeout=<sec>] [--first-byte-timeout=<sec>] [--relay-idle=<sec>] [--request-timeout=<sec>]" \
+                  " [--listen-backlog=<n>] [--queue-limit=<n>] [--retry-after=<sec>] [--client-rate=<req/s>] [--client-burst=<n>]" \
+                  " [--client-conns=<n>]\n"
+#define CHUNK 1024
+#define BACKGROUND_POOL_SIZE 4      //threads of the origin requests no client waits on directly
+#define RELAY_MAX_BUFFER (1024 * 1024)  //largest --relay-buffer
+#define HEADER_MAX_LIMIT (1024 * 1024)  //largest --header-limit
+#define TRUE 1
+#define FALSE 0
+#define REQ_TEMPLATE "GET %s %s\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n"
+#define CONNECTION_KEEP_ALIVE "Connection: keep-alive\r\n\r\n"
+#define CONNECTION_CLOSE "Connection: close\r\n\r\n"
+#define CLIENT_IDLE_TIMEOUT 15      //default seconds a client connection may take to send a request head
+#define CLIENT_MAX_REQUESTS 100     //default requests served on one client connection
+
+// codes accepted by responseErr
+#define ERR_BAD_REQUEST 1
+#define ERR_FORBIDDEN 2
+#define ERR_NOT_FOUND 3
+#define ERR_SERVER 4
+#define ERR_NOT_SUPPORTED 5
+#define ERR_TOO_LARGE 6
+#define ERR_REQUEST_TIMEOUT 7
+#define ERR_GATEWAY_TIMEOUT 8
+#define ERR_OVERLOADED 9      //answered with Retry-After
+#define ERR_TOO_MANY 10
+
+// findInCache found no copy
+#define CACHE_MISS (-1)
+
+// serving modes
+#define MODE_THREADS 0
+#define MODE_EPOLL 1
+
+struct Headers{
+    int client_fd;      //closed by freeHeaders, -1 if the caller closes it
+    struct Arena *arena;    //h lives in it, request scoped strings are allocated from it
+    char *request;      //config.headerLimit + 1 bytes read from the client, pipelined requests included
+    char *method;       //the parsed fields point into request, terminated in place
+    char *path;
+    char *protocol;
+    char *host;
+    int keepAlive;      //TRUE if the client connection is kept open after this request
+    struct HttpParser parser;   //of the request head at the start of request
+    struct AccessEntry entry;   //of the request being served, logged once it is answered
+};
+
+/**
+ * Runtime options, filled from the optional "--name=value" arguments
+ * that follow the four positional ones.
+ */
+struct Config{
+    int mode;       //MODE_THREADS or MODE_EPOLL
+    int groups;     //acceptor/worker groups (event loops in epoll mode), defaults to the online cpus
+    char *dnsHosts;     //hosts file of the resolver, NULL for none
+    char *dnsServer;    //DNS server of the resolver, NULL for the one in /etc/resolv.conf
+    int upstreamIdle;   //seconds an idle origin connection is kept
+    int upstreamMaxPerHost;     //idle connections kept per origin, 0 disables reuse
+    int clientIdle;     //seconds a client connection may wait before sending a whole request head
+    int clientMaxRequests;      //requests served on one client connection, 1 disables keep-alive
+    size_t memCache;    //byte budget of the in-memory object cache, 0 disables it
+    int fdCache;        //open cache file descriptors kept, 0 opens the file for every hit
+    size_t relayBuffer;     //bytes moved per read or splice when relaying an origin response
+    int relaySplice;    //TRUE to splice pass-through bodies instead of copying them
+    size_t headerLimit;     //longest request head accepted from a client
+    char *cacheDir;     //directory the cache files are kept in, no trailing slash
+    char *cacheIndex;   //snapshot the cache index is saved to and loaded from, NULL to walk the cache tree on every start
+    size_t diskCache;   //byte quota of the on-disk cache, 0 for none
+    long diskObjects;   //object quota of the on-disk cache, 0 for none
+    int diskPolicy;     //CACHE_POLICY_LRU or CACHE_POLICY_GDSF
+    long defaultTtl;    //seconds a response without a lifetime or Last-Modified is fresh
+    long staleWindow;   //seconds a stale copy is served while it is refreshed, unless its response says otherwise
+    int compress;       //TRUE to make and serve compressed variants of cached objects
+    char *accessLog;    //file the access log is written to, "-" for stdout, NULL for none
+    size_t accessLogSize;   //bytes the access log grows to before it is rotated, 0 never rotates
+    int dnsTimeout;     //seconds a host may take to resolve, 0 for no limit
+    int connectTimeout;     //seconds an origin may take to accept a connection, 0 for no limit
+    int firstByteTimeout;   //seconds an origin may take to start its response, 0 for no limit
+    int relayIdle;      //seconds a response may go without progress, 0 for no limit
+    int requestTimeout;     //seconds a request may take from its head to the end of its response, 0 for no limit
+    int listenBacklog;  //connections the kernel queues before they are accepted
+    int queueLimit;     //jobs queued in the worker pool before new connections are answered 503, 0 never sheds
+    int retryAfter;     //seconds a client answered 503 or 429 is told to wait
+    int clientRate;     //requests per second of one client address, 0 for no limit
+    int clientBurst;    //requests one client address may make at once, 0 for one second of clientRate
+    int clientConns;    //connections one client address may hold open, 0 for no limit
+};
+
+extern struct Config config;
+
+/**
+ * where the body of a copy whose ranges are sent is read from
+ */
+struct RangeSource{
+    const char *mem;    //the body in memory, NULL to read it from fd
+    int fd;
+    off_t body;         //offset of the body in fd
+    struct Fetch *fetch;    //still writing fd, NULL once the file is complete
+};
+
+char *get_mime_type(char *name);
+int handleRequests(void *sd);
+int serveRequest(struct Headers *h, int mayKeep);
+int scanRequestHead(struct Headers *h, size_t len, int eof);
+void consumeRequest(struct Headers *h, size_t *len);
+int listenLoop(threadpool *tp, int maxRequests, int port);
+int openListenSocket(int port, int reusePort);
+int responseErr(int code, int fd, int keepAlive);
+void refuseConnection(int fd, int code);
+void freeHeaders(struct Headers *h);
+int parseRequest(struct Headers *h);
+int parseSize(const char *value, size_t *bytes);
+char *buildFullPath(struct Headers *h);
+char *buildOriginRequest(struct Headers *h, const char *head, const struct Freshness *fresh);
+int checkIfExist(char *filePath);
+int loadFilterFile(char* filePath);
+int searchHostInFilter(char* hostDomain);
+int searchIpInFilter(struct in_addr hostIP);
+void freeFilters();
+void createFile(struct Fetch *fetch, FILE **newFile);
+int storeResponseHead(FILE *file, struct Fetch *fetch, struct Framer *fr, struct CachedFile *stale);
+int closeCacheFile(FILE *file, struct Fetch *fetch, struct Framer *fr);
+long followFetch(struct Fetch *fetch, const struct HttpParser *request, int client_fd, int *keepAlive);
+struct CachedFile *openFromCache(char *fullPath);
+int findInCache(char *fullPath, struct MemObject **obj, struct CachedFile **file);
+void refreshStale(const char *key, const char *request, struct in_addr address);
+int fillForRange(struct Fetch *fetch, const char *request, struct in_addr address);
+int writeRequest(int server_fd, char *request);
+long fetchFromOrigin(struct in_addr address, char *request, int client_fd, struct Fetch *fetch, struct CachedFile *stale,
+                     int *keepClient, struct Arena *arena);
+long readResponseMsg(int server_fd, int client_fd, struct Fetch *fetch, struct CachedFile *stale, int *reusable,
+                     int *keepClient, struct Arena *arena);
+void printUpstreamStats();
+void printMemCacheStats();
+void printArenaStats();
+void printCacheIndexStats();
+void printFetchStats();
+void printFreshnessStats();
+void printRangeStats();
+void printVariantStats();
+void printLatencyStats();
+void printAccessLogStats();
+void printDeadlineStats();
+void printAdmissionStats();
+int readFileContent(struct CachedFile *file, char *buf);
+long mapFileContent(struct CachedFile *file, int client_fd, off_t off);
+long sendFileContent(struct CachedFile *file, int client_fd);
+long giveRanges(const char *head, size_t served, long age, off_t length, const struct ByteRange *ranges, int count,
+                const struct RangeSource *src, int client_fd, int *keepAlive);
+long giveNotModified(const char *head, size_t len, long age, int client_fd, int keepAlive);
+int giveFromMemory(struct MemObject *obj, const struct HttpParser *request, int client_fd, int keepAlive, size_t *sent);
+long giveFromLocal(struct CachedFile *file, const struct HttpParser *request, int client_fd, int *keepAlive);
+
+#endif //PROXY_SERVER_PROXYSERVER_H
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "proxyServer.h"
+#include "range.h"
+
+static int isBlank(char c){
+    return c == ' ' || c == '\t';
+}
+
+/**
+ * parse the digits at *s, moved past them
+ * @return the number, -1 if there are none or it overflows
+ */
+static off_t number(const char **s, const char *end){
+    const char *p = *s;
+    off_t n = 0;
+    while(p < end && *p >= '0' && *p <= '9'){
+        if(n > (off_t)0x7fffffffffffLL){
+            return -1;
+        }
+        n = n * 10 + (*p - '0');
+        p++;
+    }
+    if(p == *s){
+        return -1;
+    }
+    *s = p;
+    return n;
+}
+
+/**
+ * @return TRUE if the If-Range field of request is absent or matches the stored copy strongly
+ */
+static int ifRangeHolds(const struct HttpParser *request, const struct Freshness *f, const char *head){
+    const struct StrView *ifRange = httpField(request, "If-Range");
+    if(ifRange == NULL){
+        return TRUE;
+    }
+    if(ifRange->len > 0 && (ifRange->data[0] == '"' || ifRange->data[0] == 'W')){  //an entity tag, never a weak one
+        return f->etagLen > 0 && ifRange->data[0] == '"' && ifRange->len == f->etagLen
+               && memcmp(ifRange->data, head + f->etag, f->etagLen) == 0;
+    }
+    time_t date = freshnessParseDate(ifRange->data, ifRange->len);
+    return date != -1 && f->lastModified != -1 && date == f->lastModified;
+}
+
+/**
+ * @return TRUE if the stored head has status 200, the only status whose ranges are served
+ */
+static int isWhole(const char *head){
+    const char *space = memchr(head, ' ', strlen("HTTP/1.1 "));     //a stored head starts with a whole status line
+    return space != NULL && strncmp(space + 1, "200 ", 4) == 0;
+}
+
+int rangeParse(const struct HttpParser *request, const struct Freshness *f, const char *head, off_t length,
+               struct ByteRange *out, int *count){
+    const struct StrView *range = httpField(request, "Range");
+    *count = 0;
+    if(range == NULL || isWhole(head) == FALSE || ifRangeHolds(request, f, head) == FALSE){
+        return RANGE_NONE;
+    }
+    const char *s = range->data;
+    const char *end = range->data + range->len;
+    if(range->len < 6 || strncasecmp(s, "bytes=", 6) != 0){    //other units are ignored
+        return RANGE_NONE;
+    }
+    s += 6;
+    int asked = 0;
+    while(s < end){
+        while(s < end && (isBlank(*s) || *s == ',')){
+            s++;
+        }
+        if(s == end){
+            break;
+        }
+        off_t first = -1;
+        off_t last = -1;
+        if(*s != '-'){
+            if((first = number(&s, end)) < 0){
+                return RANGE_NONE;
+            }
+        }
+        if(s == end || *s != '-'){
+            return RANGE_NONE;
+        }
+        s++;
+        if(s < end && *s >= '0' && *s <= '9' && (last = number(&s, end)) < 0){
+            return RANGE_NONE;
+        }
+        while(s < end && isBlank(*s)){
+            s++;
+        }
+        if(s < end && *s != ','){
+            return RANGE_NONE;
+        }
+        if(first == -1 && last == -1){
+            return RANGE_NONE;
+        }
+        if(first != -1 && last != -1 && last < first){
+            return RANGE_NONE;
+        }
+        if(++asked > RANGE_MAX){
+            *count = 0;
+            return RANGE_NONE;
+        }
+        if(first == -1){    //a suffix: the last bytes of the body
+            if(last == 0 || length == 0){
+                continue;
+            }
+            first = last < length ? length - last : 0;
+            last = length - 1;
+        } else if(first >= length){
+            continue;
+        } else if(last == -1 || last >= length){
+            last = length - 1;
+        }
+        out[*count].first = first;
+        out[*count].last = last;
+        (*count)++;
+    }
+    if(asked == 0){
+        return RANGE_NONE;
+    }
+    return *count > 0 ? RANGE_SATISFIABLE : RANGE_UNSATISFIABLE;
+}
+
+size_t rangeHead(const char *head, size_t len, int multipart, char *out, size_t size){
+    struct HttpParser p;
+    httpParserInit(&p, TRUE, len + 1);
+    if(httpParseEnd(&p, head, len) != HP_DONE){
+        return 0;
+    }
+    int n = snprintf(out, size, "%.*s 206 Partial Content\r\n", (int)p.start[0].len, p.start[0].data);
+    for (int i = 0; i < p.fieldCount && n > 0 && (size_t)n < size; i++) {
+        if(multipart == TRUE && viewEquals(p.fields[i].name, "Content-Type") == TRUE){
+            continue;
+        }
+        n += snprintf(out + n, size - n, "%.*s: %.*s\r\n", (int)p.fields[i].name.len, p.fields[i].name.data,
+                      (int)p.fields[i].value.len, p.fields[i].value.data);
+    }
+    return n > 0 && (size_t)n < size ? (size_t)n : 0;
+}
+
+struct StrView rangeContentType(const char *head, size_t len){
+    struct StrView none = {"", 0};
+    struct HttpParser p;
+    httpParserInit(&p, TRUE, len + 1);
+    if(httpParseEnd(&p, head, len) != HP_DONE){
+        return none;
+    }
+    const struct StrView *type = httpField(&p, "Content-Type");
+    return type != NULL ? *type : none;
+}
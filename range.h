@@ -0,0 +1,65 @@
+#ifndef PROXY_SERVER_RANGE_H
+#define PROXY_SERVER_RANGE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "parser.h"
+#include "freshness.h"
+
+/**
+ * range.h
+ *
+ * Byte range requests (RFC 9110 section 14). A request whose Range field
+ * names byte ranges of a stored 200 response is answered with 206 Partial
+ * Content: one range as the body itself with a Content-Range field, several
+ * as a multipart/byteranges body whose parts carry their own Content-Type
+ * and Content-Range. An If-Range field that does not match the stored copy
+ * strongly, or a Range field the proxy does not understand, turns the
+ * request back into a request for the whole object. Ranges none of which
+ * overlap the object are answered with 416.
+ */
+
+#define RANGE_MAX 16    //ranges served in one response, a request with more gets the whole object
+
+// what rangeParse decides for a request
+#define RANGE_NONE 0            //send the whole object
+#define RANGE_SATISFIABLE 1     //send the ranges
+#define RANGE_UNSATISFIABLE 2   //send 416
+
+struct ByteRange{
+    off_t first;
+    off_t last;     //inclusive
+};
+
+/**
+ * evaluate the Range and If-Range fields of a client request against a stored copy
+ * @param request - parsed client request head
+ * @param f - of the stored copy
+ * @param head - stored head of the copy
+ * @param length - of its body
+ * @param out - RANGE_MAX entries, set to the satisfiable ranges in the order they were asked for
+ * @param count - set to the entries of out
+ * @return RANGE_NONE, RANGE_SATISFIABLE or RANGE_UNSATISFIABLE
+ */
+int rangeParse(const struct HttpParser *request, const struct Freshness *f, const char *head, off_t length,
+               struct ByteRange *out, int *count);
+
+/**
+ * build a 206 response head from the stored head of a copy, without Age, Content-Length, Connection and the empty line
+ * @param head - the part of a stored head sent with the body
+ * @param len
+ * @param multipart - TRUE to leave Content-Type out, the parts carry it
+ * @param out
+ * @param size - of out
+ * @return bytes written to out, 0 if they did not fit
+ */
+size_t rangeHead(const char *head, size_t len, int multipart, char *out, size_t size);
+
+/**
+ * @param head - the part of a stored head sent with the body
+ * @param len
+ * @return the Content-Type value of head, an empty view if it has none
+ */
+struct StrView rangeContentType(const char *head, size_t len);
+
+#endif //PROXY_SERVER_RANGE_H
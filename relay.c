@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "proxyServer.h"
+#include "relay.h"
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static struct RelayPipe *idlePipes;
+static int idleCount;
+static size_t pipeSize = RELAY_DEFAULT_BUFFER;
+static int spliceEnabled = TRUE;
+
+static void closePipe(struct RelayPipe *p){
+    close(p->toClient[0]);
+    close(p->toClient[1]);
+    close(p->toFile[0]);
+    close(p->toFile[1]);
+    free(p);
+}
+
+void relayInit(size_t bufferSize, int useSplice){
+    pipeSize = bufferSize;
+    spliceEnabled = useSplice;
+    idlePipes = NULL;
+    idleCount = 0;
+}
+
+struct RelayPipe *relayPipeTake(){
+    if(spliceEnabled == FALSE){
+        return NULL;
+    }
+    pthread_mutex_lock(&poolLock);
+    struct RelayPipe *p = idlePipes;
+    if(p != NULL){
+        idlePipes = p->next;
+        idleCount--;
+    }
+    pthread_mutex_unlock(&poolLock);
+    if(p != NULL){
+        return p;
+    }
+    p = (struct RelayPipe*) calloc(1, sizeof(struct RelayPipe));
+    if(p == NULL){
+        return NULL;
+    }
+    if(pipe2(p->toClient, O_CLOEXEC) < 0){
+        free(p);
+        return NULL;
+    }
+    if(pipe2(p->toFile, O_CLOEXEC) < 0){
+        close(p->toClient[0]);
+        close(p->toClient[1]);
+        free(p);
+        return NULL;
+    }
+    fcntl(p->toClient[1], F_SETPIPE_SZ, (int)pipeSize);    //may be refused above pipe-max-size, the default stays
+    fcntl(p->toFile[1], F_SETPIPE_SZ, (int)pipeSize);
+    int a = fcntl(p->toClient[1], F_GETPIPE_SZ);
+    int b = fcntl(p->toFile[1], F_GETPIPE_SZ);
+    if(a <= 0 || b <= 0){
+        closePipe(p);
+        return NULL;
+    }
+    p->size = (size_t)(a < b ? a : b);
+    if(p->size > pipeSize){
+        p->size = pipeSize;
+    }
+    return p;
+}
+
+void relayPipeGive(struct RelayPipe *p){
+    if(p->clientPending > 0 || p->filePending > 0){     //stale bytes would reach the next relay
+        closePipe(p);
+        return;
+    }
+    pthread_mutex_lock(&poolLock);
+    if(idleCount < RELAY_IDLE_PIPES){
+        p->next = idlePipes;
+        idlePipes = p;
+        idleCount++;
+        p = NULL;
+    }
+    pthread_mutex_unlock(&poolLock);
+    if(p != NULL){
+        closePipe(p);
+    }
+}
+
+ssize_t relaySpliceIn(struct RelayPipe *p, int server_fd, size_t len, int clientLive, int *fileLive){
+    int toFileOnly = clientLive == FALSE;
+    int *first = toFileOnly ? p->toFile : p->toClient;
+    ssize_t n = splice(server_fd, NULL, first[1], NULL, len, SPLICE_F_MOVE);
+    if(n <= 0){
+        return n;
+    }
+    if(toFileOnly){
+        p->filePending += n;
+        return n;
+    }
+    p->clientPending += n;
+    if(*fileLive == TRUE){
+        ssize_t copied = tee(p->toClient[0], p->toFile[1], (size_t)n, SPLICE_F_NONBLOCK);
+        if(copied > 0){
+            p->filePending += copied;
+        }
+        if(copied != n){    //the file would miss bytes, give up on it
+            *fileLive = FALSE;
+        }
+    }
+    return n;
+}
+
+int relaySpliceOut(struct RelayPipe *p, int client_fd, int file_fd, int *clientLive, int *fileLive){
+    while(*fileLive == TRUE && p->filePending > 0){
+        ssize_t n = splice(p->toFile[0], NULL, file_fd, NULL, p->filePending, SPLICE_F_MOVE);
+        if(n <= 0){
+            *fileLive = FALSE;
+            break;
+        }
+        p->filePending -= n;
+    }
+    while(*clientLive == TRUE && p->clientPending > 0){
+        ssize_t n = splice(p->toClient[0], NULL, client_fd, NULL, p->clientPending, SPLICE_F_MOVE);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return 1;
+        }
+        if(n <= 0){
+            *clientLive = FALSE;
+            break;
+        }
+        p->clientPending -= n;
+    }
+    return 0;
+}
+
+void relayDestroy(){
+    pthread_mutex_lock(&poolLock);
+    while(idlePipes != NULL){
+        struct RelayPipe *p = idlePipes;
+        idlePipes = p->next;
+        closePipe(p);
+    }
+    idleCount = 0;
+    pthread_mutex_unlock(&poolLock);
+}
@@ -0,0 +1,77 @@
+#ifndef PROXY_SERVER_RELAY_H
+#define PROXY_SERVER_RELAY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * relay.h
+ *
+ * Zero-copy relay of origin response bodies on a cache miss. Once the body
+ * passes through unchanged (Content-Length or EOF framing), the bytes are
+ * spliced from the origin socket into a pipe, tee'd into a second pipe, and
+ * spliced from the pipes to the client and to the cache file, so they never
+ * enter user space. Chunked bodies, and descriptors splice does not support,
+ * keep using the buffered relay.
+ *
+ * Pipe pairs are reused through a small shared pool; a pair that still
+ * holds bytes when its relay ends is closed instead.
+ */
+
+#define RELAY_DEFAULT_BUFFER (16 * 1024)
+#define RELAY_IDLE_PIPES 64     //pipe pairs kept for reuse
+
+struct RelayPipe{
+    int toClient[2];
+    int toFile[2];
+    size_t size;            //capacity of each pipe
+    size_t clientPending;   //bytes in toClient not written to the client yet
+    size_t filePending;     //bytes in toFile not written to the cache file yet
+    struct RelayPipe *next;
+};
+
+/**
+ * @param bufferSize - bytes moved per read or splice, also the size asked for the pipes
+ * @param useSplice - FALSE to always use the buffered relay
+ */
+void relayInit(size_t bufferSize, int useSplice);
+
+/**
+ * @return a pair of empty pipes, NULL if splice is disabled or the pipes could not be created
+ */
+struct RelayPipe *relayPipeTake();
+
+/**
+ * give a pair back when its relay ended
+ */
+void relayPipeGive(struct RelayPipe *p);
+
+/**
+ * move up to len bytes from the origin socket into the pipes, both pipes must be empty
+ * @param p
+ * @param server_fd
+ * @param len - at most p->size
+ * @param clientLive - FALSE to fill only the cache file pipe
+ * @param fileLive - FALSE to fill only the client pipe. set to FALSE if the copy for the file failed
+ * @return bytes taken from the socket, 0 on EOF, -1 on error (errno tells, EAGAIN when the origin would block)
+ */
+ssize_t relaySpliceIn(struct RelayPipe *p, int server_fd, size_t len, int clientLive, int *fileLive);
+
+/**
+ * write what the pipes hold to the cache file and the client
+ * @param p
+ * @param client_fd
+ * @param file_fd
+ * @param clientLive - set to FALSE if writing to the client failed
+ * @param fileLive - set to FALSE if writing to the cache file failed
+ * @return 0 - the pipes are empty, or only hold bytes of a failed side
+ *         1 - the client would block, call again when it is writable
+ */
+int relaySpliceOut(struct RelayPipe *p, int client_fd, int file_fd, int *clientLive, int *fileLive);
+
+/**
+ * close the pooled pipes
+ */
+void relayDestroy();
+
+#endif //PROXY_SERVER_RELAY_H
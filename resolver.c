@@ -0,0 +1,585 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "proxyServer.h"
+#include "resolver.h"
+#include "arena.h"
+
+// outcome of a backend query, RESOLVE_FOUND and RESOLVE_NOT_FOUND are cached
+#define QUERY_ERROR -1
+
+#define DNS_HEADER_LEN 12
+#define DNS_PACKET_LEN 1500
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_RCODE_NXDOMAIN 3
+
+#define NAME_MAX_LEN 253     //longest host name
+
+struct ResolveJob{
+    unsigned hash;
+    char name[NAME_MAX_LEN + 1];
+};
+
+static struct ResolveShard shards[RESOLVER_SHARDS];
+static threadpool *pool;
+static char *hostsFile;
+static int useSystem;
+static struct sockaddr_in serverAddr;
+static int haveServer;
+static unsigned queryId;
+
+static unsigned hashName(const char *name){
+    unsigned h = 2166136261u;   //FNV-1a
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+static struct ResolveShard *shardOf(unsigned hash){
+    return &shards[hash % RESOLVER_SHARDS];
+}
+
+static struct ResolveEntry **bucketOf(unsigned hash){
+    return &shardOf(hash)->buckets[(hash / RESOLVER_SHARDS) % RESOLVER_BUCKETS];
+}
+
+/**
+ * find name in its shard, the shard lock must be held. expired entries on the way are dropped.
+ */
+static struct ResolveEntry *findLocked(const char *name, unsigned hash, time_t now){
+    struct ResolveEntry **pp = bucketOf(hash);
+    while(*pp != NULL){
+        struct ResolveEntry *e = *pp;
+        if(e->state != ENTRY_PENDING && e->expires <= now){
+            *pp = e->next;
+            shardOf(hash)->entries--;
+            free(e->name);
+            free(e);
+            continue;
+        }
+        if(e->hash == hash && strcmp(e->name, name) == 0){
+            return e;
+        }
+        pp = &e->next;
+    }
+    return NULL;
+}
+
+static void unlinkLocked(struct ResolveEntry *e){
+    struct ResolveEntry **pp = bucketOf(e->hash);
+    while(*pp != NULL && *pp != e){
+        pp = &(*pp)->next;
+    }
+    if(*pp == e){
+        *pp = e->next;
+        shardOf(e->hash)->entries--;
+    }
+}
+
+static void sweepLocked(struct ResolveShard *shard, time_t now){
+    for (int i = 0; i < RESOLVER_BUCKETS; i++) {
+        struct ResolveEntry **pp = &shard->buckets[i];
+        while(*pp != NULL){
+            struct ResolveEntry *e = *pp;
+            if(e->state != ENTRY_PENDING && e->expires <= now){
+                *pp = e->next;
+                shard->entries--;
+                free(e->name);
+                free(e);
+            } else{
+                pp = &e->next;
+            }
+        }
+    }
+}
+
+/**
+ * look for address of name in the hosts file
+ * @return RESOLVE_FOUND or RESOLVE_NOT_FOUND
+ */
+static int queryHosts(const char *name, struct in_addr *address){
+    FILE *fp = fopen(hostsFile, "r");
+    if(fp == NULL){
+        return RESOLVE_NOT_FOUND;
+    }
+    char *line = NULL;
+    size_t len = 0;
+    int result = RESOLVE_NOT_FOUND;
+    while (result == RESOLVE_NOT_FOUND && getline(&line, &len, fp) != -1){
+        char *comment = strchr(line, '#');
+        if(comment != NULL){
+            *comment = '\0';
+        }
+        char *save = NULL;
+        char *ip = strtok_r(line, " \t\r\n", &save);
+        struct in_addr parsed;
+        if(ip == NULL || inet_pton(AF_INET, ip, &parsed) != 1){
+            continue;
+        }
+        char *alias;
+        while((alias = strtok_r(NULL, " \t\r\n", &save)) != NULL){
+            if(strcasecmp(alias, name) == 0){
+                *address = parsed;
+                result = RESOLVE_FOUND;
+                break;
+            }
+        }
+    }
+    free(line);
+    fclose(fp);
+    return result;
+}
+
+static int querySystem(const char *name, struct in_addr *address, int *ttl){
+    struct hostent hostbuf, *hp = NULL;
+    char tmp[8192];
+    int herr;
+    *ttl = RESOLVER_DEFAULT_TTL;
+    if(gethostbyname_r(name, &hostbuf, tmp, sizeof(tmp), &hp, &herr) != 0 || hp == NULL){
+        if(herr == HOST_NOT_FOUND || herr == NO_DATA){
+            *ttl = RESOLVER_NEGATIVE_TTL;
+            return RESOLVE_NOT_FOUND;
+        }
+        return QUERY_ERROR;
+    }
+    address->s_addr = ((struct in_addr*)(hp->h_addr))->s_addr;
+    return RESOLVE_FOUND;
+}
+
+/**
+ * skip a possibly compressed name of a DNS message
+ * @return offset after the name, -1 if it runs past the message
+ */
+static int skipName(const unsigned char *pkt, int len, int off){
+    while(off < len){
+        unsigned char c = pkt[off];
+        if(c == 0){
+            return off + 1;
+        }
+        if((c & 0xC0) == 0xC0){
+            return off + 2 <= len ? off + 2 : -1;
+        }
+        off += c + 1;
+    }
+    return -1;
+}
+
+static unsigned get16(const unsigned char *p){
+    return ((unsigned)p[0] << 8) | p[1];
+}
+
+static unsigned get32(const unsigned char *p){
+    return ((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8) | p[3];
+}
+
+/**
+ * build an A query for name
+ * @return the query length, -1 if name is not a valid DNS name
+ */
+static int buildQuery(const char *name, unsigned id, unsigned char *pkt){
+    memset(pkt, 0, DNS_HEADER_LEN);
+    pkt[0] = (unsigned char)(id >> 8);
+    pkt[1] = (unsigned char)id;
+    pkt[2] = 0x01;  //recursion desired
+    pkt[5] = 1;     //one question
+    int off = DNS_HEADER_LEN;
+    const char *label = name;
+    while(*label){
+        const char *dot = strchr(label, '.');
+        size_t labelLen = dot != NULL ? (size_t)(dot - label) : strlen(label);
+        if(labelLen == 0 || labelLen > 63 || off + labelLen + 6 > 300){
+            return -1;
+        }
+        pkt[off++] = (unsigned char)labelLen;
+        memcpy(pkt + off, label, labelLen);
+        off += (int)labelLen;
+        label += labelLen;
+        if(*label == '.'){
+            label++;
+        }
+    }
+    pkt[off++] = 0;
+    pkt[off++] = 0;
+    pkt[off++] = DNS_TYPE_A;
+    pkt[off++] = 0;
+    pkt[off++] = 1;     //class IN
+    return off;
+}
+
+/**
+ * parse the answer to an A query
+ * @return RESOLVE_FOUND, RESOLVE_NOT_FOUND (NXDOMAIN or no A record) or QUERY_ERROR
+ */
+static int parseAnswer(const unsigned char *pkt, int len, struct in_addr *address, int *ttl){
+    unsigned rcode = pkt[3] & 0x0F;
+    unsigned qd = get16(pkt + 4), an = get16(pkt + 6), ns = get16(pkt + 8);
+    if(rcode != 0 && rcode != DNS_RCODE_NXDOMAIN){
+        return QUERY_ERROR;
+    }
+    int off = DNS_HEADER_LEN;
+    for (unsigned i = 0; i < qd; i++) {
+        if((off = skipName(pkt, len, off)) < 0 || off + 4 > len){
+            return QUERY_ERROR;
+        }
+        off += 4;
+    }
+    unsigned minTtl = 0xFFFFFFFFu;
+    int found = FALSE;
+    for (unsigned i = 0; i < an + ns; i++) {
+        if((off = skipName(pkt, len, off)) < 0 || off + 10 > len){
+            return QUERY_ERROR;
+        }
+        unsigned type = get16(pkt + off);
+        unsigned recordTtl = get32(pkt + off + 4);
+        unsigned rdlen = get16(pkt + off + 8);
+        off += 10;
+        if(off + (int)rdlen > len){
+            return QUERY_ERROR;
+        }
+        if(i < an && rcode == 0){
+            if(recordTtl < minTtl){     //the TTL of a CNAME chain is its shortest link
+                minTtl = recordTtl;
+            }
+            if(type == DNS_TYPE_A && rdlen == 4 && found == FALSE){
+                memcpy(&address->s_addr, pkt + off, 4);
+                found = TRUE;
+            }
+        } else if(i >= an && type == DNS_TYPE_SOA && rdlen >= 4 && found == FALSE){
+            unsigned minimum = get32(pkt + off + rdlen - 4);   //negative TTL per RFC 2308
+            minTtl = recordTtl < minimum ? recordTtl : minimum;
+        }
+        off += (int)rdlen;
+    }
+    if(found == TRUE){
+        *ttl = (int)minTtl;
+        return RESOLVE_FOUND;
+    }
+    *ttl = minTtl != 0xFFFFFFFFu ? (int)minTtl : RESOLVER_NEGATIVE_TTL;
+    return RESOLVE_NOT_FOUND;
+}
+
+static int queryServer(const char *name, struct in_addr *address, int *ttl){
+    unsigned char pkt[DNS_PACKET_LEN];
+    unsigned id = __atomic_add_fetch(&queryId, 1, __ATOMIC_RELAXED) & 0xFFFF;
+    int qlen = buildQuery(name, id, pkt);
+    if(qlen < 0){
+        *ttl = RESOLVER_NEGATIVE_TTL;
+        return RESOLVE_NOT_FOUND;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(fd < 0){
+        return QUERY_ERROR;
+    }
+    if(connect(fd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0){
+        close(fd);
+        return QUERY_ERROR;
+    }
+    int result = QUERY_ERROR;
+    for (int attempt = 0; attempt < RESOLVER_ATTEMPTS && result == QUERY_ERROR; attempt++) {
+        if(send(fd, pkt, qlen, 0) != qlen){
+            continue;
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        while(poll(&pfd, 1, RESOLVER_TIMEOUT_MS) > 0){
+            unsigned char answer[DNS_PACKET_LEN];
+            ssize_t n = recv(fd, answer, sizeof(answer), 0);
+            if(n < DNS_HEADER_LEN){
+                break;
+            }
+            if(get16(answer) != id || (answer[2] & 0x80) == 0){
+                continue;   //not the answer to this query
+            }
+            result = parseAnswer(answer, (int)n, address, ttl);
+            break;
+        }
+    }
+    close(fd);
+    return result;
+}
+
+/**
+ * run the backends for name
+ * @return RESOLVE_FOUND, RESOLVE_NOT_FOUND or QUERY_ERROR
+ */
+static int query(const char *name, struct in_addr *address, int *ttl){
+    if(hostsFile != NULL && queryHosts(name, address) == RESOLVE_FOUND){
+        *ttl = RESOLVER_DEFAULT_TTL;
+        return RESOLVE_FOUND;
+    }
+    if(useSystem == TRUE){
+        return querySystem(name, address, ttl);
+    }
+    if(haveServer == TRUE){
+        return queryServer(name, address, ttl);
+    }
+    *ttl = RESOLVER_NEGATIVE_TTL;
+    return RESOLVE_NOT_FOUND;
+}
+
+/**
+ * store the result of the query for name and notify everybody waiting for it
+ */
+static int publish(const char *name, unsigned hash, int result, struct in_addr address, int ttl){
+    struct ResolveShard *shard = shardOf(hash);
+    struct ResolveWaiter *waiters = NULL;
+    pthread_mutex_lock(&shard->lock);
+    struct ResolveEntry *e = findLocked(name, hash, time(NULL));
+    if(e != NULL){
+        waiters = e->waiters;
+        e->waiters = NULL;
+        if(result == QUERY_ERROR || ttl <= 0){  //answer to the current waiters only
+            unlinkLocked(e);
+            free(e->name);
+            free(e);
+        } else{
+            e->state = result == RESOLVE_FOUND ? ENTRY_FOUND : ENTRY_NEGATIVE;
+            e->address = address;
+            e->expires = time(NULL) + ttl;
+        }
+    }
+    pthread_cond_broadcast(&shard->done);
+    pthread_mutex_unlock(&shard->lock);
+    if(result == QUERY_ERROR){
+        result = RESOLVE_NOT_FOUND;
+    }
+    while(waiters != NULL){
+        struct ResolveWaiter *next = waiters->next;
+        waiters->cb(waiters->arg, result, address);
+        free(waiters);
+        waiters = next;
+    }
+    return result;
+}
+
+static int resolveJob(void *arg){
+    struct ResolveJob *job = (struct ResolveJob*)arg;
+    struct in_addr address = {0};
+    int ttl = 0;
+    int result = query(job->name, &address, &ttl);
+    publish(job->name, job->hash, result, address, ttl);
+    free(job);
+    return 0;
+}
+
+/**
+ * write a lower case copy of host to name
+ * @return 0, -1 if it is too long to be a host name
+ */
+static int normalize(const char *host, char name[NAME_MAX_LEN + 1]){
+    size_t len = strlen(host);
+    if(len == 0 || len > NAME_MAX_LEN){
+        return -1;
+    }
+    for (size_t i = 0; i <= len; i++) {
+        name[i] = (char)tolower((unsigned char)host[i]);
+    }
+    if(name[len - 1] == '.'){
+        name[len - 1] = '\0';
+    }
+    return 0;
+}
+
+/**
+ * the cache side of a lookup
+ * @param name - normalized name
+ * @param owner - set to TRUE when a pending entry was created, its creator must run the query
+ */
+static int lookupCache(const char *name, unsigned hash, struct in_addr *address, resolve_callback cb, void *arg, int *owner){
+    struct ResolveShard *shard = shardOf(hash);
+    time_t now = time(NULL);
+    *owner = FALSE;
+    struct ResolveWaiter *w = NULL;
+    if(cb != NULL){
+        w = (struct ResolveWaiter*)malloc(sizeof(struct ResolveWaiter));
+        if(w == NULL){
+            return RESOLVE_NOT_FOUND;
+        }
+        arenaCountHeap(1);
+        w->cb = cb;
+        w->arg = arg;
+    }
+    pthread_mutex_lock(&shard->lock);
+    struct ResolveEntry *e = findLocked(name, hash, now);
+    if(e != NULL && e->state != ENTRY_PENDING){
+        int result = e->state == ENTRY_FOUND ? RESOLVE_FOUND : RESOLVE_NOT_FOUND;
+        *address = e->address;
+        pthread_mutex_unlock(&shard->lock);
+        free(w);
+        return result;
+    }
+    if(e == NULL){
+        e = (struct ResolveEntry*)calloc(1, sizeof(struct ResolveEntry));
+        char *copy = strdup(name);
+        if(e == NULL || copy == NULL){
+            pthread_mutex_unlock(&shard->lock);
+            free(e);
+            free(copy);
+            free(w);
+            return RESOLVE_NOT_FOUND;
+        }
+        arenaCountHeap(2);     //cached past the request
+        if(shard->entries >= RESOLVER_SHARD_ENTRIES){
+            sweepLocked(shard, now);
+        }
+        e->name = copy;
+        e->hash = hash;
+        e->state = ENTRY_PENDING;
+        struct ResolveEntry **bucket = bucketOf(hash);
+        e->next = *bucket;
+        *bucket = e;
+        shard->entries++;
+        *owner = TRUE;
+    }
+    if(w != NULL){
+        w->next = e->waiters;
+        e->waiters = w;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return RESOLVE_PENDING;
+}
+
+int resolverLookup(const char *host, struct in_addr *address, resolve_callback cb, void *arg){
+    if(inet_pton(AF_INET, host, address) == 1){
+        return RESOLVE_FOUND;
+    }
+    char name[NAME_MAX_LEN + 1];
+    if(normalize(host, name) == -1){
+        return RESOLVE_NOT_FOUND;
+    }
+    unsigned hash = hashName(name);
+    int owner;
+    int result = lookupCache(name, hash, address, cb, arg, &owner);
+    if(result != RESOLVE_PENDING || owner == FALSE){
+        return result;
+    }
+    struct ResolveJob *job = (struct ResolveJob*)malloc(sizeof(struct ResolveJob));
+    if(job == NULL){
+        struct in_addr none = {0};
+        publish(name, hash, QUERY_ERROR, none, 0);
+        return RESOLVE_PENDING;     //the callback already ran
+    }
+    arenaCountHeap(1);
+    strcpy(job->name, name);
+    job->hash = hash;
+    dispatch(pool, &resolveJob, (void*)job);
+    return RESOLVE_PENDING;
+}
+
+int resolverResolve(const char *host, struct in_addr *address){
+    if(inet_pton(AF_INET, host, address) == 1){
+        return RESOLVE_FOUND;
+    }
+    char name[NAME_MAX_LEN + 1];
+    if(normalize(host, name) == -1){
+        return RESOLVE_NOT_FOUND;
+    }
+    unsigned hash = hashName(name);
+    int owner;
+    int result = lookupCache(name, hash, address, NULL, NULL, &owner);
+    if(result == RESOLVE_PENDING && owner == TRUE){
+        int ttl = 0;
+        result = query(name, address, &ttl);
+        result = publish(name, hash, result, *address, ttl);
+    } else if(result == RESOLVE_PENDING){   //somebody else runs the query
+        struct ResolveShard *shard = shardOf(hash);
+        struct ResolveEntry *e;
+        pthread_mutex_lock(&shard->lock);
+        while((e = findLocked(name, hash, time(NULL))) != NULL && e->state == ENTRY_PENDING){
+            pthread_cond_wait(&shard->done, &shard->lock);
+        }
+        result = e != NULL && e->state == ENTRY_FOUND ? RESOLVE_FOUND : RESOLVE_NOT_FOUND;
+        if(e != NULL){
+            *address = e->address;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return result;
+}
+
+/**
+ * read the first IPv4 nameserver of /etc/resolv.conf into serverAddr
+ * @return TRUE if one was found
+ */
+static int loadResolvConf(){
+    FILE *fp = fopen("/etc/resolv.conf", "r");
+    if(fp == NULL){
+        return FALSE;
+    }
+    char *line = NULL;
+    size_t len = 0;
+    int found = FALSE;
+    while(found == FALSE && getline(&line, &len, fp) != -1){
+        char ip[64];
+        if(sscanf(line, "nameserver %63s", ip) == 1 && inet_pton(AF_INET, ip, &serverAddr.sin_addr) == 1){
+            serverAddr.sin_family = AF_INET;
+            serverAddr.sin_port = htons(53);
+            found = TRUE;
+        }
+    }
+    free(line);
+    fclose(fp);
+    return found;
+}
+
+int resolverInit(threadpool *tp, const char *hostsPath, const char *server){
+    pool = tp;
+    useSystem = FALSE;
+    haveServer = FALSE;
+    queryId = (unsigned)getpid() ^ (unsigned)time(NULL);
+    hostsFile = NULL;
+    if(hostsPath != NULL && (hostsFile = strdup(hostsPath)) == NULL){
+        return -1;
+    }
+    for (int i = 0; i < RESOLVER_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        pthread_cond_init(&shards[i].done, NULL);
+        shards[i].entries = 0;
+        memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+    }
+    if(server == NULL){
+        haveServer = loadResolvConf();
+        useSystem = haveServer == FALSE ? TRUE : FALSE;
+    } else if(strcmp(server, "system") == 0){
+        useSystem = TRUE;
+    } else if(strcmp(server, "none") != 0){
+        char ip[64];
+        int port = 53;
+        if(sscanf(server, "%63[^:]:%d", ip, &port) < 1 || inet_pton(AF_INET, ip, &serverAddr.sin_addr) != 1 ||
+           port <= 0 || port > 65535){
+            return -1;
+        }
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(port);
+        haveServer = TRUE;
+    }
+    return 0;
+}
+
+void resolverDestroy(){
+    for (int i = 0; i < RESOLVER_SHARDS; i++) {
+        for (int b = 0; b < RESOLVER_BUCKETS; b++) {
+            struct ResolveEntry *e = shards[i].buckets[b];
+            while(e != NULL){
+                struct ResolveEntry *next = e->next;
+                free(e->name);
+                free(e);
+                e = next;
+            }
+            shards[i].buckets[b] = NULL;
+        }
+        pthread_mutex_destroy(&shards[i].lock);
+        pthread_cond_destroy(&shards[i].done);
+    }
+    free(hostsFile);
+    hostsFile = NULL;
+}
@@ -0,0 +1,106 @@
+#ifndef PROXY_SERVER_RESOLVER_H
+#define PROXY_SERVER_RESOLVER_H
+
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "threadpool.h"
+
+/**
+ * resolver.h
+ *
+ * Thread-safe host name resolution with a sharded in-memory cache.
+ * Answers are kept for their record TTL, names that do not exist (NXDOMAIN
+ * or no A record) are cached negatively, and concurrent lookups of the same
+ * name share a single query.
+ *
+ * Backends, tried in order:
+ *   1. a hosts file (/etc/hosts unless --dns-hosts says otherwise)
+ *   2. a DNS server over UDP (the first nameserver of /etc/resolv.conf unless --dns-server says otherwise),
+ *      or the libc resolver when the server is "system"
+ */
+
+#define RESOLVER_SHARDS 64
+#define RESOLVER_BUCKETS 256          //buckets per shard
+#define RESOLVER_SHARD_ENTRIES 4096   //a shard sweeps its expired entries above this size
+#define RESOLVER_DEFAULT_TTL 60       //seconds, for answers that carry no TTL (hosts file, libc)
+#define RESOLVER_NEGATIVE_TTL 30      //seconds, for negative answers without an SOA record
+#define RESOLVER_TIMEOUT_MS 2000      //per UDP attempt
+#define RESOLVER_ATTEMPTS 2
+
+// results of resolverLookup / resolverResolve
+#define RESOLVE_FOUND 0
+#define RESOLVE_NOT_FOUND 1
+#define RESOLVE_PENDING 2
+
+// states of a cache entry
+#define ENTRY_PENDING 0
+#define ENTRY_FOUND 1
+#define ENTRY_NEGATIVE 2
+
+/**
+ * called from a pool thread when a pending lookup finished
+ * @param arg - the argument given to resolverLookup
+ * @param result - RESOLVE_FOUND or RESOLVE_NOT_FOUND
+ * @param address - the address when found
+ */
+typedef void (*resolve_callback)(void *arg, int result, struct in_addr address);
+
+struct ResolveWaiter{
+    resolve_callback cb;
+    void *arg;
+    struct ResolveWaiter *next;
+};
+
+struct ResolveEntry{
+    char *name;         //lower case
+    unsigned hash;
+    int state;
+    struct in_addr address;
+    time_t expires;
+    struct ResolveWaiter *waiters;
+    struct ResolveEntry *next;
+};
+
+struct ResolveShard{
+    pthread_mutex_t lock;
+    pthread_cond_t done;    //broadcast when a pending entry of the shard finished
+    int entries;
+    struct ResolveEntry *buckets[RESOLVER_BUCKETS];
+};
+
+/**
+ * set up the cache and the backends
+ * @param tp - pool that runs the queries of resolverLookup
+ * @param hostsPath - hosts file, NULL for none
+ * @param server - "ip[:port]" of a DNS server, "system" for the libc resolver,
+ *                 NULL to take the first nameserver of /etc/resolv.conf
+ * @return 0 - on success
+ *         -1 - on error
+ */
+int resolverInit(threadpool *tp, const char *hostsPath, const char *server);
+
+/**
+ * non-blocking lookup
+ * @param host
+ * @param address - filled when RESOLVE_FOUND is returned
+ * @param cb - called with arg once a RESOLVE_PENDING lookup finished
+ * @param arg
+ * @return RESOLVE_FOUND, RESOLVE_NOT_FOUND or RESOLVE_PENDING
+ */
+int resolverLookup(const char *host, struct in_addr *address, resolve_callback cb, void *arg);
+
+/**
+ * blocking lookup, runs the query on the calling thread or waits for the one already running
+ * @param host
+ * @param address - filled when found
+ * @return RESOLVE_FOUND or RESOLVE_NOT_FOUND
+ */
+int resolverResolve(const char *host, struct in_addr *address);
+
+/**
+ * free the cache
+ */
+void resolverDestroy();
+
+#endif //PROXY_SERVER_RESOLVER_H
@@ -1,47 +1,216 @@
 //
 // Created by Ido Cohen on 20/12/2021.
 //
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "threadpool.h"
 
+static void futexWait(int *addr, int val){
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futexWake(int *addr, int count){
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/**
+ * wake one worker, preferably of group. when group has no sleeper a worker of another
+ * group is woken so it can steal the job.
+ * @param tp
+ * @param group
+ */
+static void wakeWorker(threadpool *tp, int group){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);    //publishing the job must not pass the sleepers check
+    for (int i = 0; i < tp->num_groups; i++) {
+        work_queue *q = &tp->queues[(group + i) % tp->num_groups];
+        if(__atomic_load_n(&q->sleepers, __ATOMIC_SEQ_CST) > 0){
+            __atomic_add_fetch(&q->epoch, 1, __ATOMIC_SEQ_CST);
+            futexWake(&q->epoch, 1);
+            return;
+        }
+    }
+}
+
+static long long monotonicNanos(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * run a job taken from a ring, after telling the wait hook how long it was queued
+ */
+static void runJob(threadpool *tp, work_t *job){
+    if(job->queued != 0 && tp->on_wait != NULL){
+        tp->on_wait(monotonicNanos() - job->queued);
+    }
+    job->routine(job->arg);
+}
+
+/**
+ * take the next job out of a group ring
+ * @param q
+ * @param job - filled with the job
+ * @return 1 - if a job was taken
+ *         0 - if the ring is empty
+ */
+static int tryTake(work_queue *q, work_t *job){
+    size_t pos = __atomic_load_n(&q->qhead, __ATOMIC_RELAXED);
+    while(1){
+        work_t *cell = &q->ring[pos & (QUEUE_CAPACITY - 1)];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)seq - (long)(pos + 1);
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&q->qhead, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                job->routine = cell->routine;
+                job->arg = cell->arg;
+                job->queued = cell->queued;
+                __atomic_store_n(&cell->seq, pos + QUEUE_CAPACITY, __ATOMIC_RELEASE);
+                __atomic_sub_fetch(&q->qsize, 1, __ATOMIC_RELAXED);
+                return 1;
+            }
+        } else if(diff < 0){
+            return 0;
+        } else{
+            pos = __atomic_load_n(&q->qhead, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * put a job into a group ring
+ * @return 1 - on success
+ *         0 - if the ring is full
+ */
+static int tryPut(work_queue *q, dispatch_fn routine, void *arg, long long queued){
+    size_t pos = __atomic_load_n(&q->qtail, __ATOMIC_RELAXED);
+    while(1){
+        work_t *cell = &q->ring[pos & (QUEUE_CAPACITY - 1)];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)seq - (long)pos;
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&q->qtail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                cell->routine = routine;
+                cell->arg = arg;
+                cell->queued = queued;
+                __atomic_add_fetch(&q->qsize, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        } else if(diff < 0){
+            return 0;
+        } else{
+            pos = __atomic_load_n(&q->qtail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * take a job from the own group, or steal one from the busiest other group
+ * @return 1 - if a job was taken
+ *         0 - if all rings are empty
+ */
+static int takeOrSteal(threadpool *tp, int group, work_t *job){
+    if(tryTake(&tp->queues[group], job) == 1){
+        return 1;
+    }
+    while(1){
+        int victim = -1;
+        int most = 0;
+        for (int i = 1; i < tp->num_groups; i++) {
+            int g = (group + i) % tp->num_groups;
+            int size = __atomic_load_n(&tp->queues[g].qsize, __ATOMIC_RELAXED);
+            if(size > most){
+                most = size;
+                victim = g;
+            }
+        }
+        if(victim == -1){
+            return 0;
+        }
+        if(tryTake(&tp->queues[victim], job) == 1){
+            return 1;
+        }
+    }
+}
+
+int pin_to_group_cpu(int group){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus <= 0){
+        return -1;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(group % cpus, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
 threadpool *create_threadpool(int num_threads_in_pool) {
+    return create_threadpool_groups(num_threads_in_pool, 1);
+}
 
-    threadpool *tp = (threadpool*)malloc(sizeof(threadpool));
+threadpool *create_threadpool_groups(int num_threads_in_pool, int num_groups) {
+    if(num_threads_in_pool <= 0 || num_threads_in_pool > MAXT_IN_POOL || num_groups <= 0 || num_groups > num_threads_in_pool){
+        return NULL;
+    }
+
+    threadpool *tp = (threadpool*)calloc(1, sizeof(threadpool));
     if(tp == NULL){
         perror("error: <sys_call>\n");
         return NULL;
     }
     tp->num_threads = num_threads_in_pool;
-    tp->qsize = 0;
+    tp->num_groups = num_groups;
+    tp->next_group = 0;
 
     tp->threads = (pthread_t*) malloc(sizeof(pthread_t) * num_threads_in_pool);
-    if(tp->threads == NULL){
-        free(tp);
-        perror("error: <sys_call>\n");
-        return NULL;
-    }
-    tp->qhead = NULL;
-    tp->qtail = NULL;
-    if(pthread_mutex_init(&tp->qlock, NULL) != 0){
+    tp->workers = (worker*) malloc(sizeof(worker) * num_threads_in_pool);
+    if(tp->threads == NULL || tp->workers == NULL ||
+       posix_memalign((void**)&tp->queues, CACHE_LINE, sizeof(work_queue) * num_groups) != 0){
         free(tp->threads);
+        free(tp->workers);
         free(tp);
         perror("error: <sys_call>\n");
         return NULL;
     }
-    if(pthread_cond_init(&tp->q_not_empty, NULL) != 0 || pthread_cond_init(&tp->q_empty, NULL) != 0){
-        free(tp->threads);
-        free(tp);
-        perror("error: <sys_call>\n");
-        return NULL;
+    for (int g = 0; g < num_groups; g++) {
+        work_queue *q = &tp->queues[g];
+        q->qsize = 0;
+        q->qhead = 0;
+        q->qtail = 0;
+        q->epoch = 0;
+        q->sleepers = 0;
+        if(posix_memalign((void**)&q->ring, CACHE_LINE, sizeof(work_t) * QUEUE_CAPACITY) != 0){
+            for (int i = 0; i < g; i++) {
+                free(tp->queues[i].ring);
+            }
+            free(tp->queues);
+            free(tp->threads);
+            free(tp->workers);
+            free(tp);
+            perror("error: <sys_call>\n");
+            return NULL;
+        }
+        for (size_t i = 0; i < QUEUE_CAPACITY; i++) {
+            q->ring[i].seq = i;
+        }
     }
     tp->shutdown = 0;
     tp->dont_accept = 0;
     for (int i = 0; i < num_threads_in_pool; i++) {
-        if(pthread_create(&tp->threads[i], NULL, do_work, (void*)tp) != 0){
-            free(tp->threads);
-            free(tp);
+        tp->workers[i].pool = tp;
+        tp->workers[i].group = i % num_groups;
+        if(pthread_create(&tp->threads[i], NULL, do_work, (void*)&tp->workers[i]) != 0){
+            tp->num_threads = i;
+            destroy_threadpool(tp);
             perror("error: <sys_call>\n");
             return NULL;
         }
@@ -51,69 +220,81 @@ threadpool *create_threadpool(int num_threads_in_pool) {
 }
 
 void dispatch(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg) {
-    if(from_me->dont_accept == 1){
-        return;
+    int group = 0;
+    if(from_me->num_groups > 1){
+        group = (int)((unsigned)__atomic_fetch_add(&from_me->next_group, 1, __ATOMIC_RELAXED) % from_me->num_groups);
     }
-    work_t *w = (work_t*)malloc(sizeof(work_t));
-    if(w == NULL){
+    dispatch_to_group(from_me, group, dispatch_to_here, arg);
+}
+
+void dispatch_to_group(threadpool *from_me, int group, dispatch_fn dispatch_to_here, void *arg) {
+    if(__atomic_load_n(&from_me->dont_accept, __ATOMIC_ACQUIRE) == 1){
         return;
     }
-    w->arg = arg;
-    w->routine = dispatch_to_here;
-    w->next = NULL;
-    pthread_mutex_lock(&from_me->qlock);
-    if(from_me->qsize == 0){
-        from_me->qhead = w;
-        from_me->qtail = w;
-    } else {
-        from_me->qtail->next = w;
-        from_me->qtail = w;
+    group %= from_me->num_groups;
+    long long queued = from_me->on_wait != NULL ? monotonicNanos() : 0;
+    while(tryPut(&from_me->queues[group], dispatch_to_here, arg, queued) == 0){
+        sched_yield();
+    }
+    wakeWorker(from_me, group);
+}
+
+void set_wait_hook(threadpool *pool, void (*hook)(long long waited)) {
+    pool->on_wait = hook;
+}
+
+int queued_jobs(threadpool *pool) {
+    int queued = 0;
+    for (int g = 0; g < pool->num_groups; g++) {
+        queued += __atomic_load_n(&pool->queues[g].qsize, __ATOMIC_RELAXED);
     }
-    from_me->qsize++;
-    pthread_mutex_unlock(&from_me->qlock);
-    pthread_cond_broadcast(&from_me->q_not_empty);
+    return queued;
 }
 
 void destroy_threadpool(threadpool *destroyme) {
-    pthread_mutex_lock(&destroyme->qlock);
-    destroyme->dont_accept = 1;
-    if(destroyme->qsize > 0){
-        pthread_cond_wait(&destroyme->q_empty, &destroyme->qlock);
-    }
-    destroyme->shutdown = 1;
-    pthread_mutex_unlock(&destroyme->qlock);
-    pthread_cond_broadcast(&destroyme->q_not_empty);
+    __atomic_store_n(&destroyme->dont_accept, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&destroyme->shutdown, 1, __ATOMIC_SEQ_CST);
+    for (int g = 0; g < destroyme->num_groups; g++) {
+        __atomic_add_fetch(&destroyme->queues[g].epoch, 1, __ATOMIC_SEQ_CST);
+        futexWake(&destroyme->queues[g].epoch, INT_MAX);
+    }
     for (int i = 0; i < destroyme->num_threads; i++) {
         pthread_join(destroyme->threads[i], NULL);
     }
-    pthread_mutex_destroy(&destroyme->qlock);
-    pthread_cond_destroy(&destroyme->q_not_empty);
-    pthread_cond_destroy(&destroyme->q_empty);
+    for (int g = 0; g < destroyme->num_groups; g++) {
+        free(destroyme->queues[g].ring);
+    }
+    free(destroyme->queues);
+    free(destroyme->workers);
     free(destroyme->threads);
     free(destroyme);
 }
 
 void *do_work(void *p) {
-    threadpool *tp = (threadpool*)p;
+    worker *self = (worker*)p;
+    threadpool *tp = self->pool;
+    work_queue *q = &tp->queues[self->group];
+    work_t w;
+    if(tp->num_groups > 1){
+        pin_to_group_cpu(self->group);
+    }
     while(1){
-        if(tp->shutdown == 1){
-            return NULL;
+        if(takeOrSteal(tp, self->group, &w) == 1){
+            runJob(tp, &w);
+            continue;
         }
-        pthread_mutex_lock(&tp->qlock);
-        if(tp->qsize != 0){
-            work_t *w = tp->qhead;
-            tp->qhead = tp->qhead->next;
-            tp->qsize--;
-            pthread_mutex_unlock(&tp->qlock);
-            w->routine(w->arg);
-            free(w);
-            if(tp->dont_accept == 1 && tp->qsize == 0){
-                pthread_cond_signal(&tp->q_empty);
-            }
-        } else{
-            pthread_cond_wait(&tp->q_not_empty, &tp->qlock);
-            pthread_mutex_unlock(&tp->qlock);
+        int epoch = __atomic_load_n(&q->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+        if(takeOrSteal(tp, self->group, &w) == 1){   //a job may have arrived before we were counted as a sleeper
+            __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+            runJob(tp, &w);
+            continue;
+        }
+        if(__atomic_load_n(&tp->shutdown, __ATOMIC_SEQ_CST) == 1){
+            __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+            return NULL;
         }
+        futexWait(&q->epoch, epoch);
+        __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
     }
 }
-
@@ -1,6 +1,10 @@
 //
 // Created by Ido Cohen on 20/12/2021.
 //
+#ifndef PROXY_SERVER_THREADPOOL_H
+#define PROXY_SERVER_THREADPOOL_H
+
+#include <stddef.h>
 #include <pthread.h>
 
 /**
@@ -14,30 +18,64 @@
 #define MAXT_IN_POOL 200
 
 
+// number of jobs a group queue can hold, must be a power of two
+#define QUEUE_CAPACITY 4096
+
+#define CACHE_LINE 64
+
+
 /**
- * the pool holds a queue of this structure
+ * the queues hold a ring of this structure. a cell is free for the producer
+ * whose ticket equals seq, and holds a job for the consumer whose ticket + 1
+ * equals seq. every cell takes its own cache line.
  */
 typedef struct work_st{
+    size_t seq;  //ticket of the next producer/consumer allowed to use the cell
     int (*routine) (void*);  //the threads process function
     void * arg;  //argument to the function
-    struct work_st* next;
+    long long queued;  //CLOCK_MONOTONIC nanoseconds of the dispatch, 0 if the pool has no wait hook
+    char pad[CACHE_LINE - sizeof(size_t) - sizeof(void*) * 2 - sizeof(long long)];
 } work_t;
 
 
+/**
+ * The queue of one group. the producer and consumer positions and the wakeup
+ * word live on separate cache lines so dispatching does not bounce the lines
+ * the workers spin on.
+ */
+typedef struct work_queue_st {
+    work_t* ring;		//QUEUE_CAPACITY inline jobs
+    size_t qhead __attribute__((aligned(CACHE_LINE)));		//next ticket to dequeue
+    size_t qtail __attribute__((aligned(CACHE_LINE)));		//next ticket to enqueue
+    int qsize __attribute__((aligned(CACHE_LINE)));	        //number in the queue
+    int epoch __attribute__((aligned(CACHE_LINE)));	//futex word, bumped before every wakeup
+    int sleepers;		//group threads waiting, or about to wait, on epoch
+} work_queue;
+
+
+/**
+ * every pool thread belongs to one group, takes jobs from its group queue
+ * first and steals from the other groups when its own queue is empty.
+ */
+typedef struct worker_st {
+    struct _threadpool_st *pool;
+    int group;
+} worker;
+
+
 /**
  * The actual pool
  */
 typedef struct _threadpool_st {
     int num_threads;	//number of active threads
-    int qsize;	        //number in the queue
+    int num_groups;	//number of group queues
     pthread_t *threads;	//pointer to threads
-    work_t* qhead;		//queue head pointer
-    work_t* qtail;		//queue tail pointer
-    pthread_mutex_t qlock;		//lock on the queue list
-    pthread_cond_t q_not_empty;	//non-empty and empty condition variables
-    pthread_cond_t q_empty;
+    worker *workers;	//argument of every thread
+    work_queue *queues;	//one queue per group
+    int next_group;	//round robin position of dispatch
     int shutdown;            //1 if the pool is in destruction process
     int dont_accept;       //1 if destroy function has begun
+    void (*on_wait)(long long);  //told the nanoseconds every job waited in its queue, NULL for none
 } threadpool;
 
 
@@ -51,38 +89,47 @@ typedef int (*dispatch_fn)(void *);
 
 /**
  * create_threadpool creates a fixed-sized thread
- * pool.  If the function succeeds, it returns a (non-NULL)
+ * pool with a single group.  If the function succeeds, it returns a (non-NULL)
  * "threadpool", else it returns NULL.
+ */
+threadpool* create_threadpool(int num_threads_in_pool);
+
+/**
+ * create_threadpool_groups creates a fixed-sized thread pool split into
+ * num_groups groups, thread i belongs to group i % num_groups.
  * this function should:
  * 1. input sanity check
  * 2. initialize the threadpool structure
- * 3. initialized mutex and conditional variables
- * 4. create the threads, the thread init function is do_work and its argument is the initialized threadpool.
+ * 3. allocate the group rings and mark every cell free
+ * 4. create the threads, the thread init function is do_work and its argument is the thread's worker.
+ * when there is more than one group, threads are pinned to the cpu of their group.
  */
-threadpool* create_threadpool(int num_threads_in_pool);
+threadpool* create_threadpool_groups(int num_threads_in_pool, int num_groups);
 
 
 /**
- * dispatch enter a "job" of type work_t into the queue.
+ * dispatch enter a "job" of type work_t into the queue of the next group, round robin.
  * when an available thread takes a job from the queue, it will
  * call the function "dispatch_to_here" with argument "arg".
- * this function should:
- * 1. create and init work_t element
- * 2. lock the mutex
- * 3. add the work_t element to the queue
- * 4. unlock mutex
- *
  */
 void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
+/**
+ * dispatch_to_group enter a "job" into the queue of group.
+ * this function should:
+ * 1. claim a ticket and copy the job into its cell, no allocation or lock
+ * 2. if the ring is full, yield until a worker frees a cell
+ * 3. wake a single sleeping worker of group, or of another group that will steal the job
+ */
+void dispatch_to_group(threadpool* from_me, int group, dispatch_fn dispatch_to_here, void *arg);
+
 /**
  * The work function of the thread
  * this function should:
- * 1. lock mutex
- * 2. if the queue is empty, wait
- * 3. take the first element from the queue (work_t)
- * 4. unlock mutex
- * 5. call the thread routine
+ * 1. take the next job from the group ring, or steal one from another group
+ * 2. if all rings are empty, announce itself as a sleeper and wait on the group epoch futex
+ * 3. call the thread routine
+ * 4. once shutdown is set, exit when the rings are drained
  *
  */
 void* do_work(void* p);
@@ -90,11 +137,26 @@ void* do_work(void* p);
 
 /**
  * destroy_threadpool kills the threadpool, causing
- * all threads in it to commit suicide, and then
+ * all threads in it to commit suicide after the queued jobs ran, and then
  * frees all the memory associated with the threadpool.
  */
 void destroy_threadpool(threadpool* destroyme);
 
+/**
+ * set_wait_hook makes the pool time its jobs: before a thread runs a job it calls
+ * hook with the nanoseconds the job waited in its queue. set it before the first dispatch.
+ */
+void set_wait_hook(threadpool* pool, void (*hook)(long long waited));
 
+/**
+ * queued_jobs counts the jobs waiting in all the group queues of the pool
+ */
+int queued_jobs(threadpool* pool);
 
+/**
+ * pin the calling thread to the cpu serving group (group modulo the online cpus).
+ * @return 0 on success, -1 on failure
+ */
+int pin_to_group_cpu(int group);
 
+#endif //PROXY_SERVER_THREADPOOL_H
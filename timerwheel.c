@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include <time.h>
+
+#include "proxyServer.h"
+#include "timerwheel.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_SPAN (1UL << (TIMER_BITS * TIMER_LEVELS))    //ticks the wheel covers
+
+/**
+ * @return milliseconds of a clock that only needs to be as fine as a tick
+ */
+static long long clockMs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @return the tick the clock is in
+ */
+static unsigned long currentTick(const struct TimerWheel *w){
+    long long ms = clockMs() - w->origin;
+    return ms > 0 ? (unsigned long)(ms / TIMER_TICK_MS) : 0;
+}
+
+static void emptyList(struct Timer *head){
+    head->prev = head;
+    head->next = head;
+}
+
+static void detach(struct Timer *t){
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+void timerWheelInit(struct TimerWheel *w){
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            emptyList(&w->slots[level][slot]);
+        }
+    }
+    w->origin = clockMs();
+    w->now = 0;
+    w->armed = 0;
+}
+
+void timerInit(struct Timer *t, void (*fire)(struct Timer *t), void *arg){
+    t->prev = NULL;
+    t->next = NULL;
+    t->expires = 0;
+    t->fire = fire;
+    t->arg = arg;
+}
+
+/**
+ * link t into the slot of its expiry, relative to the next tick to run
+ */
+static void place(struct TimerWheel *w, struct Timer *t){
+    unsigned long delta = t->expires - w->now;
+    struct Timer *head;
+    if((long)delta < 0){   //late already, runs with the next tick
+        head = &w->slots[0][w->now & TIMER_MASK];
+    } else{
+        if(delta >= TIMER_SPAN){
+            t->expires = w->now + TIMER_SPAN - 1;
+            delta = TIMER_SPAN - 1;
+        }
+        int level = 0;
+        while(delta >= (1UL << (TIMER_BITS * (level + 1)))){
+            level++;
+        }
+        head = &w->slots[level][(t->expires >> (TIMER_BITS * level)) & TIMER_MASK];
+    }
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+void timerArm(struct TimerWheel *w, struct Timer *t, long ms){
+    if(t->next != NULL){
+        detach(t);
+    } else{
+        w->armed++;
+    }
+    if(ms < 1){     //never the tick being run, it is not visited again before the wheel turns
+        ms = 1;
+    }
+    t->expires = currentTick(w) + (unsigned long)((ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+    place(w, t);
+}
+
+void timerCancel(struct TimerWheel *w, struct Timer *t){
+    if(t->next != NULL){
+        detach(t);
+        w->armed--;
+    }
+}
+
+int timerArmed(const struct Timer *t){
+    return t->next != NULL;
+}
+
+/**
+ * move the timers of a slot of an upper level down to the levels below
+ * @return the slot
+ */
+static int cascade(struct TimerWheel *w, int level, int slot){
+    struct Timer *head = &w->slots[level][slot];
+    struct Timer moved;
+    if(head->next == head){
+        return slot;
+    }
+    moved.next = head->next;    //take the whole list, place may put timers back into this level
+    moved.prev = head->prev;
+    moved.next->prev = &moved;
+    moved.prev->next = &moved;
+    emptyList(head);
+    while(moved.next != &moved){
+        struct Timer *t = moved.next;
+        detach(t);
+        place(w, t);
+    }
+    return slot;
+}
+
+void timerWheelAdvance(struct TimerWheel *w){
+    unsigned long target = currentTick(w);
+    if(w->armed == 0){
+        w->now = target + 1;
+        return;
+    }
+    while((long)(target - w->now) >= 0){
+        int slot = (int)(w->now & TIMER_MASK);
+        if(slot == 0){
+            for (int level = 1; level < TIMER_LEVELS
+                    && cascade(w, level, (int)((w->now >> (TIMER_BITS * level)) & TIMER_MASK)) == 0; level++) {
+            }
+        }
+        struct Timer *head = &w->slots[0][slot];
+        struct Timer due;
+        if(head->next != head){     //fired from a list of their own, a callback may arm or cancel any timer
+            due.next = head->next;
+            due.prev = head->prev;
+            due.next->prev = &due;
+            due.prev->next = &due;
+            emptyList(head);
+            while(due.next != &due){
+                struct Timer *t = due.next;
+                detach(t);
+                w->armed--;
+                t->fire(t);
+            }
+        }
+        w->now++;
+    }
+}
+
+int timerWheelWait(const struct TimerWheel *w){
+    if(w->armed == 0){
+        return -1;
+    }
+    unsigned long tick = w->now;
+    for (int i = 0; i < TIMER_SLOTS; i++, tick++) {
+        const struct Timer *head = &w->slots[0][tick & TIMER_MASK];
+        if(head->next != head || (tick & TIMER_MASK) == 0){     //due, or an upper level cascades
+            break;
+        }
+    }
+    long long ms = (long long)tick * TIMER_TICK_MS - (clockMs() - w->origin);
+    return ms > 0 ? (int)ms : 0;
+}
@@ -0,0 +1,81 @@
+#ifndef PROXY_SERVER_TIMERWHEEL_H
+#define PROXY_SERVER_TIMERWHEEL_H
+
+/**
+ * timerwheel.h
+ *
+ * A hierarchical timing wheel: TIMER_LEVELS wheels of TIMER_SLOTS slots,
+ * a slot of level n spanning TIMER_SLOTS^n ticks of TIMER_TICK_MS. A timer
+ * is linked into the slot its expiry falls in, so arming and cancelling it
+ * are O(1) list operations whatever the number of timers. When the first
+ * level wraps, the next slot of the level above is cascaded down, its timers
+ * relinked into the finer slots. Timers are intrusive, the owner embeds them
+ * and the wheel allocates nothing.
+ *
+ * A wheel is not locked, it belongs to one thread or is guarded by its user.
+ */
+
+#define TIMER_TICK_MS 10
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4      //timers up to 64^4 ticks ahead, about 46 hours, longer ones are cut to it
+
+struct Timer{
+    struct Timer *prev;
+    struct Timer *next;     //NULL while not armed
+    unsigned long expires;  //tick
+    void (*fire)(struct Timer *t);  //called from timerWheelAdvance, the timer is no longer armed
+    void *arg;
+};
+
+struct TimerWheel{
+    unsigned long now;      //the next tick to run
+    long long origin;       //milliseconds of tick 0
+    long armed;
+    struct Timer slots[TIMER_LEVELS][TIMER_SLOTS];  //list heads
+};
+
+/**
+ * @param w
+ */
+void timerWheelInit(struct TimerWheel *w);
+
+/**
+ * @param t
+ * @param fire - called when the timer expires
+ * @param arg - kept in t->arg for fire
+ */
+void timerInit(struct Timer *t, void (*fire)(struct Timer *t), void *arg);
+
+/**
+ * arm t to expire ms from now, it is moved if it was armed already
+ * @param w
+ * @param t
+ * @param ms - rounded up to whole ticks, at least one
+ */
+void timerArm(struct TimerWheel *w, struct Timer *t, long ms);
+
+/**
+ * @param w
+ * @param t - nothing happens if it is not armed
+ */
+void timerCancel(struct TimerWheel *w, struct Timer *t);
+
+/**
+ * @return TRUE if t is armed
+ */
+int timerArmed(const struct Timer *t);
+
+/**
+ * fire the timers whose expiry passed
+ * @param w
+ */
+void timerWheelAdvance(struct TimerWheel *w);
+
+/**
+ * @param w
+ * @return milliseconds until the wheel has to be advanced, -1 if no timer is armed
+ */
+int timerWheelWait(const struct TimerWheel *w);
+
+#endif //PROXY_SERVER_TIMERWHEEL_H
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "proxyServer.h"
+#include "upstream.h"
+#include "arena.h"
+#include "deadline.h"
+
+static struct UpstreamShard shards[UPSTREAM_SHARDS];
+static struct UpstreamStats stats;
+static int idleTimeout = UPSTREAM_IDLE_TIMEOUT;
+static int maxPerHost = UPSTREAM_MAX_PER_HOST;
+
+static unsigned hashOrigin(struct in_addr address, int port){
+    unsigned h = (unsigned)address.s_addr * 2654435761u;
+    return h ^ ((unsigned)port * 40503u);
+}
+
+/**
+ * find the host entry of address:port, the shard lock must be held
+ * @param create - TRUE to add a missing entry
+ */
+static struct UpstreamHost *findHost(struct UpstreamShard *shard, unsigned hash, struct in_addr address, int port, int create){
+    struct UpstreamHost **bucket = &shard->buckets[(hash / UPSTREAM_SHARDS) % UPSTREAM_BUCKETS];
+    for (struct UpstreamHost *host = *bucket; host != NULL; host = host->next) {
+        if(host->address.s_addr == address.s_addr && host->port == port){
+            return host;
+        }
+    }
+    if(create == FALSE){
+        return NULL;
+    }
+    struct UpstreamHost *host = (struct UpstreamHost*)calloc(1, sizeof(struct UpstreamHost));
+    if(host == NULL){
+        return NULL;
+    }
+    host->address = address;
+    host->port = port;
+    host->next = *bucket;
+    *bucket = host;
+    return host;
+}
+
+/**
+ * close the connections of host that were idle for too long, the shard lock must be held
+ */
+static void expireIdle(struct UpstreamHost *host, time_t now){
+    struct UpstreamConn **pp = &host->conns;
+    while(*pp != NULL){
+        struct UpstreamConn *c = *pp;
+        if(now - c->idleSince >= idleTimeout){
+            *pp = c->next;
+            close(c->fd);
+            free(c);
+            host->idle--;
+            __atomic_add_fetch(&stats.expired, 1, __ATOMIC_RELAXED);
+        } else{
+            pp = &c->next;
+        }
+    }
+}
+
+/**
+ * an idle connection is usable if the origin neither closed it nor sent anything on it
+ */
+static int stillOpen(int fd){
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void upstreamInit(int timeout, int perHost){
+    idleTimeout = timeout;
+    maxPerHost = perHost;
+    memset(&stats, 0, sizeof(stats));
+    for (int i = 0; i < UPSTREAM_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+    }
+}
+
+int upstreamTake(struct in_addr address, int port){
+    unsigned hash = hashOrigin(address, port);
+    struct UpstreamShard *shard = &shards[hash % UPSTREAM_SHARDS];
+    time_t now = time(NULL);
+    while(1){
+        pthread_mutex_lock(&shard->lock);
+        struct UpstreamHost *host = findHost(shard, hash, address, port, FALSE);
+        if(host == NULL){
+            pthread_mutex_unlock(&shard->lock);
+            return -1;
+        }
+        expireIdle(host, now);
+        struct UpstreamConn *c = host->conns;
+        if(c == NULL){
+            pthread_mutex_unlock(&shard->lock);
+            return -1;
+        }
+        host->conns = c->next;
+        host->idle--;
+        pthread_mutex_unlock(&shard->lock);
+        int fd = c->fd;
+        free(c);
+        if(stillOpen(fd)){
+            __atomic_add_fetch(&stats.reused, 1, __ATOMIC_RELAXED);
+            return fd;
+        }
+        close(fd);
+        __atomic_add_fetch(&stats.stale, 1, __ATOMIC_RELAXED);
+    }
+}
+
+int upstreamConnect(struct in_addr address, int port){
+    struct sockaddr_in peeraddr;
+    int fd;
+    if ((fd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    deadlineServer(fd);     //an expired connect deadline shuts it down, which ends the connect
+    peeraddr.sin_family = AF_INET;
+    peeraddr.sin_port = htons(port);
+    peeraddr.sin_addr.s_addr = address.s_addr;
+    if(connect(fd, (struct sockaddr*) &peeraddr, sizeof(peeraddr)) < 0) {
+        deadlineServer(-1);
+        close(fd);
+        return -1;
+    }
+    upstreamCountOpened();
+    return fd;
+}
+
+void upstreamRelease(int fd, struct in_addr address, int port, int reusable){
+    if(reusable == FALSE || maxPerHost == 0){
+        close(fd);
+        return;
+    }
+    unsigned hash = hashOrigin(address, port);
+    struct UpstreamShard *shard = &shards[hash % UPSTREAM_SHARDS];
+    struct UpstreamConn *c = (struct UpstreamConn*)malloc(sizeof(struct UpstreamConn));
+    if(c == NULL){
+        close(fd);
+        return;
+    }
+    arenaCountHeap(1);     //the idle connection outlives the request
+    c->fd = fd;
+    c->idleSince = time(NULL);
+    pthread_mutex_lock(&shard->lock);
+    struct UpstreamHost *host = findHost(shard, hash, address, port, TRUE);
+    if(host != NULL){
+        expireIdle(host, c->idleSince);
+    }
+    if(host == NULL || host->idle >= maxPerHost){
+        pthread_mutex_unlock(&shard->lock);
+        close(fd);
+        free(c);
+        __atomic_add_fetch(&stats.overLimit, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    c->next = host->conns;
+    host->conns = c;
+    host->idle++;
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_add_fetch(&stats.released, 1, __ATOMIC_RELAXED);
+}
+
+void upstreamCountOpened(){
+    __atomic_add_fetch(&stats.opened, 1, __ATOMIC_RELAXED);
+}
+
+void upstreamCountRetry(){
+    __atomic_add_fetch(&stats.retried, 1, __ATOMIC_RELAXED);
+}
+
+void upstreamGetStats(struct UpstreamStats *out){
+    out->opened = __atomic_load_n(&stats.opened, __ATOMIC_RELAXED);
+    out->reused = __atomic_load_n(&stats.reused, __ATOMIC_RELAXED);
+    out->released = __atomic_load_n(&stats.released, __ATOMIC_RELAXED);
+    out->expired = __atomic_load_n(&stats.expired, __ATOMIC_RELAXED);
+    out->overLimit = __atomic_load_n(&stats.overLimit, __ATOMIC_RELAXED);
+    out->stale = __atomic_load_n(&stats.stale, __ATOMIC_RELAXED);
+    out->retried = __atomic_load_n(&stats.retried, __ATOMIC_RELAXED);
+}
+
+void upstreamDestroy(){
+    for (int i = 0; i < UPSTREAM_SHARDS; i++) {
+        for (int b = 0; b < UPSTREAM_BUCKETS; b++) {
+            struct UpstreamHost *host = shards[i].buckets[b];
+            while(host != NULL){
+                struct UpstreamHost *nextHost = host->next;
+                struct UpstreamConn *c = host->conns;
+                while(c != NULL){
+                    struct UpstreamConn *next = c->next;
+                    close(c->fd);
+                    free(c);
+                    c = next;
+                }
+                free(host);
+                host = nextHost;
+            }
+            shards[i].buckets[b] = NULL;
+        }
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+}
@@ -0,0 +1,97 @@
+#ifndef PROXY_SERVER_UPSTREAM_H
+#define PROXY_SERVER_UPSTREAM_H
+
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+/**
+ * upstream.h
+ *
+ * Pool of idle keep-alive connections to origin servers, keyed by ip:port.
+ * A connection is given back after a response that left it reusable and is
+ * handed out again to the next request for the same origin.
+ */
+
+#define UPSTREAM_SHARDS 16
+#define UPSTREAM_BUCKETS 64     //buckets per shard
+#define UPSTREAM_IDLE_TIMEOUT 30    //default seconds an idle connection is kept
+#define UPSTREAM_MAX_PER_HOST 8     //default idle connections kept per origin
+
+struct UpstreamConn{
+    int fd;
+    time_t idleSince;
+    struct UpstreamConn *next;
+};
+
+struct UpstreamHost{
+    struct in_addr address;
+    int port;
+    int idle;   //length of conns
+    struct UpstreamConn *conns;     //most recently released first
+    struct UpstreamHost *next;
+};
+
+struct UpstreamShard{
+    pthread_mutex_t lock;
+    struct UpstreamHost *buckets[UPSTREAM_BUCKETS];
+};
+
+/**
+ * counters of the pool, for tuning the idle timeout and per host limit
+ */
+struct UpstreamStats{
+    long opened;        //new connections
+    long reused;        //requests sent on a pooled connection
+    long released;      //connections given back to the pool
+    long expired;       //idle connections closed by the idle timeout
+    long overLimit;     //connections closed because the origin already had enough idle ones
+    long stale;         //pooled connections the origin had closed meanwhile
+    long retried;       //requests resent on a new connection after a pooled one failed
+};
+
+/**
+ * @param idleTimeout - seconds an idle connection is kept
+ * @param maxPerHost - idle connections kept per origin
+ */
+void upstreamInit(int idleTimeout, int maxPerHost);
+
+/**
+ * take an idle connection to address:port out of the pool
+ * @return the connected socket, -1 if there is none
+ */
+int upstreamTake(struct in_addr address, int port);
+
+/**
+ * connect a new blocking socket to address:port, declared with deadlineServer so the connect deadline can end it
+ * @return the connected socket, -1 on error
+ */
+int upstreamConnect(struct in_addr address, int port);
+
+/**
+ * give a connection back after its response was read completely
+ * @param fd
+ * @param address
+ * @param port
+ * @param reusable - FALSE closes fd
+ */
+void upstreamRelease(int fd, struct in_addr address, int port, int reusable);
+
+/**
+ * count a new connection opened by the caller itself (non-blocking connect)
+ */
+void upstreamCountOpened();
+
+/**
+ * count a request that was resent after a pooled connection failed
+ */
+void upstreamCountRetry();
+
+void upstreamGetStats(struct UpstreamStats *stats);
+
+/**
+ * close every pooled connection
+ */
+void upstreamDestroy();
+
+#endif //PROXY_SERVER_UPSTREAM_H
@@ -0,0 +1,603 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "proxyServer.h"
+#include "variants.h"
+#include "cacheindex.h"
+
+#define GZIP_LEVEL 6
+#define BROTLI_QUALITY 9
+#define ZSTD_LEVEL 9
+
+static const char *codingNames[CODINGS] = {"br", "zstd", "gzip"};
+// Content-Types besides text/* and the +xml and +json types that are compressed
+static const char *compressibleTypes[] = {"application/javascript", "application/json", "application/xml",
+                                          "application/ecmascript", "application/x-javascript", "image/svg+xml"};
+
+static threadpool *pool;
+static int enabled;
+static struct VariantStats stats;
+static pthread_mutex_t pendingLock = PTHREAD_MUTEX_INITIALIZER;
+static char *pending[VARIANT_PENDING_MAX];  //keys of the objects being compressed
+static unsigned long tmpSequence;
+
+static int isBlank(char c){
+    return c == ' ' || c == '\t';
+}
+
+/**
+ * @return TRUE if the encoder of coding was found at build time
+ */
+static int builtIn(int coding){
+    switch (coding) {
+#ifdef HAVE_BROTLI
+        case CODING_BR:
+            return TRUE;
+#endif
+#ifdef HAVE_ZSTD
+        case CODING_ZSTD:
+            return TRUE;
+#endif
+#ifdef HAVE_ZLIB
+        case CODING_GZIP:
+            return TRUE;
+#endif
+        default:
+            return FALSE;
+    }
+}
+
+void variantInit(threadpool *p, int on){
+    memset(&stats, 0, sizeof(stats));
+    pool = p;
+    enabled = on;
+}
+
+const char *variantCodings(){
+    static char names[32];
+    names[0] = '\0';
+    for (int i = 0; i < CODINGS; i++) {
+        if(builtIn(i) == TRUE){
+            if(names[0] != '\0'){
+                strcat(names, " ");
+            }
+            strcat(names, codingNames[i]);
+        }
+    }
+    return names[0] != '\0' ? names : "none";
+}
+
+/**
+ * write "dir/.name.<coding>" for key "dir/name", a dot file no request maps to
+ * @return 0, -1 if it does not fit in size
+ */
+static int variantPath(const char *key, int coding, char *out, size_t size){
+    const char *slash = strrchr(key, '/');
+    size_t dirLen = slash != NULL ? (size_t)(slash - key) + 1 : 0;
+    int n = snprintf(out, size, "%.*s.%s.%s", (int)dirLen, key, key + dirLen, codingNames[coding]);
+    return n >= 0 && (size_t)n < size ? 0 : -1;
+}
+
+/**
+ * compress len bytes of in with coding
+ * @param out - set to the compressed bytes, to be freed
+ * @return their length, 0 on error
+ */
+static size_t encode(int coding, const char *in, size_t len, char **out){
+    *out = NULL;
+#ifdef HAVE_ZLIB
+    if(coding == CODING_GZIP){
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if(deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK){   //+16 writes a gzip wrapper
+            return 0;
+        }
+        size_t bound = deflateBound(&zs, (uLong)len);
+        if((*out = (char*) malloc(bound)) == NULL){
+            deflateEnd(&zs);
+            return 0;
+        }
+        zs.next_in = (Bytef*)in;
+        zs.avail_in = (uInt)len;
+        zs.next_out = (Bytef*)*out;
+        zs.avail_out = (uInt)bound;
+        size_t n = deflate(&zs, Z_FINISH) == Z_STREAM_END ? (size_t)zs.total_out : 0;
+        deflateEnd(&zs);
+        return n;
+    }
+#endif
+#ifdef HAVE_BROTLI
+    if(coding == CODING_BR){
+        size_t n = BrotliEncoderMaxCompressedSize(len);
+        if(n == 0 || (*out = (char*) malloc(n)) == NULL){
+            return 0;
+        }
+        if(BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len, (const uint8_t*)in,
+                                 &n, (uint8_t*)*out) == BROTLI_FALSE){
+            return 0;
+        }
+        return n;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if(coding == CODING_ZSTD){
+        size_t bound = ZSTD_compressBound(len);
+        if((*out = (char*) malloc(bound)) == NULL){
+            return 0;
+        }
+        size_t n = ZSTD_compress(*out, bound, in, len, ZSTD_LEVEL);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    (void)in;
+    (void)len;
+    return 0;
+}
+
+/**
+ * @return the weight the Accept-Encoding field of request gives coding, 0 to 1000. 0 if it is not acceptable
+ */
+static int weightOf(const struct StrView *accept, int coding){
+    const char *s = accept->data;
+    const char *end = accept->data + accept->len;
+    int any = 0;
+    while(s < end){
+        while(s < end && (isBlank(*s) || *s == ',')){
+            s++;
+        }
+        const char *name = s;
+        while(s < end && *s != ',' && *s != ';' && isBlank(*s) == FALSE){
+            s++;
+        }
+        size_t nameLen = (size_t)(s - name);
+        int weight = 1000;
+        while(s < end && *s != ','){    //parameters, only q counts
+            if(*s == ';'){
+                s++;
+                while(s < end && isBlank(*s)){
+                    s++;
+                }
+                if(end - s >= 2 && (s[0] == 'q' || s[0] == 'Q') && s[1] == '='){
+                    s += 2;
+                    weight = 0;
+                    int digits = 0;
+                    if(s < end && *s == '1'){
+                        weight = 1000;
+                    }
+                    for (s++; s < end && (*s == '.' || (*s >= '0' && *s <= '9')); s++) {
+                        if(*s != '.' && digits < 3 && weight < 1000){
+                            weight += (*s - '0') * (digits == 0 ? 100 : digits == 1 ? 10 : 1);
+                            digits++;
+                        }
+                    }
+                    continue;
+                }
+            }
+            s++;
+        }
+        if(nameLen == 1 && name[0] == '*'){
+            any = weight;
+        } else if((nameLen == strlen(codingNames[coding]) && strncasecmp(name, codingNames[coding], nameLen) == 0)
+                  || (coding == CODING_GZIP && nameLen == 6 && strncasecmp(name, "x-gzip", 6) == 0)){
+            return weight;
+        }
+    }
+    return any;
+}
+
+/**
+ * @return TRUE if the comma separated list holds token, ignoring the arguments of its elements
+ */
+static int listHas(const struct StrView *list, const char *token){
+    const char *s = list->data;
+    const char *end = list->data + list->len;
+    size_t len = strlen(token);
+    while(s < end){
+        while(s < end && (isBlank(*s) || *s == ',')){
+            s++;
+        }
+        const char *name = s;
+        while(s < end && *s != ',' && *s != '=' && isBlank(*s) == FALSE){
+            s++;
+        }
+        if((size_t)(s - name) == len && strncasecmp(name, token, len) == 0){
+            return TRUE;
+        }
+        while(s < end && *s != ','){
+            if(*s == '"'){  //a quoted argument may hold commas
+                const char *close = memchr(s + 1, '"', (size_t)(end - s - 1));
+                s = close != NULL ? close : end - 1;
+            }
+            s++;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * @param p - parsed head of the response
+ * @param bodyLen - -1 if it is not known
+ * @return TRUE if a variant may be made of the response
+ */
+static int compressibleResponse(const char *key, const struct HttpParser *p, long long bodyLen){
+    if(bodyLen >= 0 && (bodyLen < VARIANT_MIN_SIZE || bodyLen > VARIANT_MAX_SIZE)){
+        return FALSE;
+    }
+    if(viewEquals(p->start[1], "200") == FALSE){
+        return FALSE;
+    }
+    const struct StrView *field = httpField(p, "Content-Encoding");
+    if(field != NULL && viewEquals(*field, "identity") == FALSE){
+        return FALSE;
+    }
+    if((field = httpField(p, "Cache-Control")) != NULL && listHas(field, "no-transform") == TRUE){
+        return FALSE;
+    }
+    struct StrView type = {NULL, 0};
+    if((field = httpField(p, "Content-Type")) != NULL){
+        type = *field;
+    } else{
+        type.data = get_mime_type((char*)key);
+        type.len = type.data != NULL ? strlen(type.data) : 0;
+    }
+    const char *semicolon = type.len > 0 ? memchr(type.data, ';', type.len) : NULL;
+    if(semicolon != NULL){
+        type.len = (size_t)(semicolon - type.data);
+    }
+    while(type.len > 0 && isBlank(type.data[type.len - 1])){
+        type.len--;
+    }
+    if(type.len >= 5 && strncasecmp(type.data, "text/", 5) == 0){
+        return TRUE;
+    }
+    if(type.len >= 4 && (strncasecmp(type.data + type.len - 4, "+xml", 4) == 0
+                         || (type.len >= 5 && strncasecmp(type.data + type.len - 5, "+json", 5) == 0))){
+        return TRUE;
+    }
+    for (size_t i = 0; i < sizeof(compressibleTypes) / sizeof(compressibleTypes[0]); i++) {
+        if(viewEquals(type, compressibleTypes[i]) == TRUE){
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * @return TRUE if the stored copy is a response a variant may be made of
+ */
+static int compressible(const char *key, const char *head, size_t len, off_t bodyLen){
+    struct HttpParser p;
+    httpParserInit(&p, TRUE, len + 1);
+    if(httpParseEnd(&p, head, len) != HP_DONE){
+        return FALSE;
+    }
+    return bodyLen >= 0 && compressibleResponse(key, &p, (long long)bodyLen);
+}
+
+/**
+ * write the stored head of a variant: the identity copy's with its own ETag, Content-Encoding and Vary
+ * @param file
+ * @param head - whole stored head of the identity copy
+ * @param len
+ * @param coding
+ * @return bytes written, -1 on error
+ */
+static long writeHead(FILE *file, const char *head, size_t len, int coding){
+    struct HttpParser p;
+    httpParserInit(&p, TRUE, len + 1);
+    if(httpParse(&p, head, len) != HP_DONE || p.fieldCount + 2 > HTTP_MAX_FIELDS){
+        return -1;
+    }
+    const char *name = codingNames[coding];
+    const struct HttpField *age = &p.fields[p.fieldCount - 1];  //a stored head ends with it
+    const struct StrView *vary = httpField(&p, "Vary");
+    long n = fprintf(file, "%.*s %.*s %.*s\r\n", (int)p.start[0].len, p.start[0].data, (int)p.start[1].len, p.start[1].data,
+                     (int)p.start[2].len, p.start[2].data);
+    for (int i = 0; i < p.fieldCount - 1 && n > 0; i++) {
+        const struct HttpField *field = &p.fields[i];
+        int written;
+        if(viewEquals(field->name, "Vary") == TRUE){
+            continue;
+        }
+        if(viewEquals(field->name, "ETag") == TRUE && field->value.len >= 2 && field->value.data[field->value.len - 1] == '"'){
+            written = fprintf(file, "ETag: %.*s-%s\"\r\n", (int)field->value.len - 1, field->value.data, name);
+        } else{
+            written = fprintf(file, "%.*s: %.*s\r\n", (int)field->name.len, field->name.data,
+                              (int)field->value.len, field->value.data);
+        }
+        n = written < 0 ? -1 : n + written;
+    }
+    if(n < 0){
+        return -1;
+    }
+    int written;
+    if(vary == NULL){
+        written = fprintf(file, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n", name);
+    } else{
+        written = fprintf(file, "Content-Encoding: %s\r\nVary: %.*s%s\r\n", name, (int)vary->len, vary->data,
+                          listHas(vary, "Accept-Encoding") == TRUE ? "" : ", Accept-Encoding");
+    }
+    int ageLen = fprintf(file, "Age: %.*s\r\n\r\n", (int)age->value.len, age->value.data);
+    if(written < 0 || ageLen < 0 || n + written + ageLen > FRESHNESS_HEAD_MAX){
+        return -1;
+    }
+    return n + written + ageLen;
+}
+
+/**
+ * @return "<path>.<pid>-<n>.tmp", a dot file the cache tree walk removes if it is left behind
+ */
+static char *tmpPathOf(const char *path){
+    unsigned long n = __atomic_add_fetch(&tmpSequence, 1, __ATOMIC_RELAXED);
+    size_t len = strlen(path) + 64;
+    char *tmp = (char*) malloc(len);
+    if(tmp == NULL){
+        return NULL;
+    }
+    snprintf(tmp, len, "%s.%d-%lu.tmp", path, (int)getpid(), n);
+    return tmp;
+}
+
+/**
+ * @return TRUE if path holds a variant or an incompressible marker made from the identity copy stored at stored
+ */
+static int madeFrom(const char *path, time_t stored, off_t *size){
+    struct stat sb;
+    if(stat(path, &sb) < 0 || sb.st_mtime != stored){
+        return FALSE;
+    }
+    *size = sb.st_size;
+    return TRUE;
+}
+
+/**
+ * write the variant of an identity copy in coding, or the empty marker if it does not save enough
+ * @param file - the identity copy
+ * @param body - its body
+ * @param len
+ * @param coding
+ * @param path - of the variant
+ * @return bytes of the file written, -1 on error
+ */
+static long writeVariant(struct CachedFile *file, const char *body, size_t len, int coding, const char *path){
+    char *data;
+    size_t n = encode(coding, body, len, &data);
+    if(n == 0){
+        free(data);
+        return -1;
+    }
+    char *tmp = tmpPathOf(path);
+    FILE *out = tmp != NULL ? fopen(tmp, "w") : NULL;
+    if(out == NULL){
+        free(data);
+        free(tmp);
+        return -1;
+    }
+    long size = 0;
+    if(n * 100 <= len * (100 - VARIANT_MIN_SAVING)){
+        long headLen = writeHead(out, file->head, (size_t)file->body, coding);
+        size = headLen < 0 || fwrite(data, 1, n, out) != n ? -1 : headLen + (long)n;
+    }
+    free(data);
+    struct timespec times[2] = {{0, UTIME_OMIT}, {file->fresh.stored, 0}};     //ties the variant to the identity copy
+    struct stat current, identity;
+    if(size < 0 || fflush(out) != 0 || futimens(fileno(out), times) < 0 || fclose(out) != 0){
+        if(size >= 0){
+            perror("error: <sys_call>\n");
+        }
+        remove(tmp);
+        free(tmp);
+        return -1;
+    }
+    if(stat(file->path, &current) < 0 || fstat(file->fd, &identity) < 0
+       || current.st_ino != identity.st_ino || current.st_dev != identity.st_dev){
+        remove(tmp);    //the identity copy was replaced or removed meanwhile
+        free(tmp);
+        return -1;
+    }
+    if(rename(tmp, path) < 0){
+        perror("error: <sys_call>\n");
+        remove(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    fdCacheForget(path);    //a variant of an older identity copy
+    memCacheRemove(path);
+    return size;
+}
+
+/**
+ * make the missing variants of a cached object, on the background pool
+ * @param arg - its cache path, in the pending set
+ */
+static int compressJob(void *arg){
+    char *key = (char*)arg;
+    struct CachedFile *file = fdCacheOpen(key);
+    off_t len = file != NULL ? file->size - file->body : 0;
+    char *body = NULL;
+    if(file != NULL && compressible(key, file->head, file->served, len) == TRUE
+       && (body = (char*) malloc((size_t)len)) != NULL && pread(file->fd, body, (size_t)len, file->body) == len){
+        for (int coding = 0; coding < CODINGS; coding++) {
+            char path[PATH_MAX];
+            off_t size;
+            if(builtIn(coding) == FALSE || variantPath(key, coding, path, sizeof(path)) != 0
+               || madeFrom(path, file->fresh.stored, &size) == TRUE){
+                continue;
+            }
+            long written = writeVariant(file, body, (size_t)len, coding, path);
+            if(written == 0){
+                __atomic_add_fetch(&stats.incompressible, 1, __ATOMIC_RELAXED);
+            } else if(written > 0){
+                cacheIndexGrow(key, (off_t)written);    //variants are charged to the identity copy
+                __atomic_add_fetch(&stats.created, 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&stats.saved, (long long)(file->size - written), __ATOMIC_RELAXED);
+            }
+        }
+    }
+    free(body);
+    if(file != NULL){
+        fdCacheRelease(file);
+    }
+    pthread_mutex_lock(&pendingLock);
+    for (int i = 0; i < VARIANT_PENDING_MAX; i++) {
+        if(pending[i] == key){
+            pending[i] = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pendingLock);
+    free(key);
+    return 0;
+}
+
+/**
+ * start making the variants of key unless it is waiting already
+ */
+static void schedule(const char *key){
+    int slot = -1;
+    pthread_mutex_lock(&pendingLock);
+    for (int i = 0; i < VARIANT_PENDING_MAX; i++) {
+        if(pending[i] != NULL && strcmp(pending[i], key) == 0){
+            pthread_mutex_unlock(&pendingLock);
+            return;
+        }
+        if(pending[i] == NULL && slot < 0){
+            slot = i;
+        }
+    }
+    char *copy = slot >= 0 ? strdup(key) : NULL;
+    if(copy != NULL){
+        pending[slot] = copy;
+    }
+    pthread_mutex_unlock(&pendingLock);
+    if(copy == NULL){
+        __atomic_add_fetch(&stats.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    dispatch(pool, compressJob, copy);
+}
+
+/**
+ * @return the variant of key in coding made from the identity copy stored at stored, in memory or on disk.
+ *         FALSE if there is none, TRUE with both NULL if the coding does not shrink the object
+ */
+static int findVariant(const char *path, time_t stored, struct MemObject **obj, struct CachedFile **file){
+    *obj = memCacheGet(path);
+    if(*obj != NULL && (*obj)->fresh.stored == stored){
+        return TRUE;
+    }
+    if(*obj != NULL){
+        memCacheRelease(*obj);
+        *obj = NULL;
+    }
+    *file = fdCacheOpen(path);
+    if(*file != NULL && (*file)->fresh.stored == stored){
+        return TRUE;
+    }
+    if(*file != NULL){
+        fdCacheRelease(*file);
+        *file = NULL;
+    }
+    off_t size;
+    return madeFrom(path, stored, &size) == TRUE && size == 0;
+}
+
+void variantPick(const char *key, const struct HttpParser *request, struct MemObject **obj, struct CachedFile **file){
+    const struct StrView *accept = enabled == TRUE ? httpField(request, "Accept-Encoding") : NULL;
+    if(accept == NULL){
+        return;
+    }
+    int weights[CODINGS];
+    int acceptable = FALSE;
+    for (int coding = 0; coding < CODINGS; coding++) {
+        weights[coding] = builtIn(coding) == TRUE ? weightOf(accept, coding) : 0;
+        acceptable |= weights[coding] > 0;
+    }
+    const char *head = *obj != NULL ? (*obj)->head : (*file)->head;
+    size_t served = *obj != NULL ? (*obj)->headLen : (*file)->served;
+    off_t len = *obj != NULL ? (off_t)(*obj)->bodyLen : (*file)->size - (*file)->body;
+    time_t stored = *obj != NULL ? (*obj)->fresh.stored : (*file)->fresh.stored;
+    if(acceptable == FALSE || compressible(key, head, served, len) == FALSE){
+        return;
+    }
+    int missing = FALSE;
+    while(TRUE){
+        int best = -1;
+        for (int coding = 0; coding < CODINGS; coding++) {     //ties go to the coding preferred
+            if(weights[coding] > 0 && (best < 0 || weights[coding] > weights[best])){
+                best = coding;
+            }
+        }
+        if(best < 0){
+            break;
+        }
+        weights[best] = 0;
+        char path[PATH_MAX];
+        struct MemObject *variantObj = NULL;
+        struct CachedFile *variantFile = NULL;
+        int found = variantPath(key, best, path, sizeof(path)) == 0
+                    && findVariant(path, stored, &variantObj, &variantFile) == TRUE;
+        if(found == FALSE){
+            missing = TRUE;
+        } else if(variantObj != NULL || variantFile != NULL){
+            if(*obj != NULL){
+                memCacheRelease(*obj);
+            }
+            if(*file != NULL){
+                fdCacheRelease(*file);
+            }
+            *obj = variantObj;
+            *file = variantFile;
+            __atomic_add_fetch(&stats.served[best], 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    if(missing == TRUE && pool != NULL){
+        schedule(key);
+    }
+}
+
+int variantVaries(const char *key, const struct HttpParser *response, long long length){
+    return enabled == TRUE && compressibleResponse(key, response, length);
+}
+
+void variantsForget(const char *key){
+    for (int coding = 0; coding < CODINGS; coding++) {
+        char path[PATH_MAX];
+        if(variantPath(key, coding, path, sizeof(path)) != 0){
+            continue;
+        }
+        unlink(path);
+        fdCacheForget(path);
+        memCacheRemove(path);
+    }
+}
+
+void variantGetStats(struct VariantStats *out){
+    for (int coding = 0; coding < CODINGS; coding++) {
+        out->served[coding] = __atomic_load_n(&stats.served[coding], __ATOMIC_RELAXED);
+    }
+    out->created = __atomic_load_n(&stats.created, __ATOMIC_RELAXED);
+    out->incompressible = __atomic_load_n(&stats.incompressible, __ATOMIC_RELAXED);
+    out->dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+    out->saved = __atomic_load_n(&stats.saved, __ATOMIC_RELAXED);
+}
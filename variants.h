@@ -0,0 +1,82 @@
+#ifndef PROXY_SERVER_VARIANTS_H
+#define PROXY_SERVER_VARIANTS_H
+
+#include "threadpool.h"
+#include "parser.h"
+#include "memcache.h"
+#include "fdcache.h"
+
+/**
+ * variants.h
+ *
+ * Compressed variants of cached objects. A compressible object (a 200
+ * response with a text-like Content-Type, no Content-Encoding and no
+ * no-transform directive) gets a variant per content coding built in:
+ * gzip with zlib, and br and zstd when their encoders were found at build
+ * time. A variant is a cache file of its own next to the identity copy,
+ * "dir/.name.<coding>", whose stored head is the identity's with
+ * Content-Encoding, Vary: Accept-Encoding and an ETag of its own, so it is
+ * served, ranged and revalidated against clients like any other copy.
+ *
+ * Variants are made once, by a job on the background pool that a hit on
+ * the identity copy starts, never on the request path. A variant is
+ * valid while its modification time matches the identity copy's, and is
+ * removed with it. A coding that does not shrink an object leaves an empty
+ * file behind, so the object is not compressed again.
+ */
+
+#define VARIANT_MIN_SIZE 256            //smaller bodies are not compressed
+#define VARIANT_MAX_SIZE (16 * 1024 * 1024)     //larger bodies are not compressed
+#define VARIANT_MIN_SAVING 10           //percent a variant has to save to be kept
+#define VARIANT_PENDING_MAX 64          //objects waiting to be compressed, more are left alone
+
+// content codings, in the order the proxy prefers them
+#define CODING_BR 0
+#define CODING_ZSTD 1
+#define CODING_GZIP 2
+#define CODINGS 3
+
+struct VariantStats{
+    long served[CODINGS];   //responses sent from a variant, per coding
+    long created;       //variants written
+    long incompressible;    //codings that did not save enough
+    long dropped;       //compressions not started because too many were waiting
+    long long saved;    //bytes the variants are smaller than their identity copies
+};
+
+/**
+ * @param pool - runs the compressions
+ * @param enabled - FALSE to never make or serve variants
+ */
+void variantInit(threadpool *pool, int enabled);
+
+/**
+ * replace a servable identity copy with the variant the client prefers, or start making the variants
+ * @param key - cache path of the identity copy
+ * @param request - parsed client request head, its Accept-Encoding is negotiated
+ * @param obj - the identity copy in memory, NULL if it is given in file. replaced with the variant in memory
+ * @param file - the identity copy on disk, NULL if it is given in obj. replaced with the variant on disk
+ */
+void variantPick(const char *key, const struct HttpParser *request, struct MemObject **obj, struct CachedFile **file);
+
+/**
+ * @param key - cache path of the identity copy
+ * @param response - parsed head the identity copy is stored with
+ * @param length - of its body, -1 if it is not known yet
+ * @return TRUE if variants are made of the copy, so its responses vary by Accept-Encoding like theirs
+ */
+int variantVaries(const char *key, const struct HttpParser *response, long long length);
+
+/**
+ * remove the variants of key, called when its identity copy is replaced or removed
+ */
+void variantsForget(const char *key);
+
+/**
+ * @return the names of the content codings built in, separated by spaces
+ */
+const char *variantCodings();
+
+void variantGetStats(struct VariantStats *out);
+
+#endif //PROXY_SERVER_VARIANTS_H